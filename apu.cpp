@@ -0,0 +1,942 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "apu.h"
+
+// NTSC CPU clock
+static const double CPU_CLOCK = 1789773.0;
+
+// Samples per CPU cycle, with a 32-bit fraction
+static const uint64_t SAMPLE_STEP = (uint64_t)(APU::SAMPLE_RATE / CPU_CLOCK * 4294967296.0 + 0.5);
+
+static const uint8_t length_table[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t duty_table[4][8] = {
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uint8_t triangle_table[32] = {
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// In CPU cycles
+static const uint16_t noise_periods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t dmc_periods[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Frame counter steps, in CPU cycles from the start of the sequence; the
+// last one starts the next sequence
+static const uint16_t frame_steps[2][6] = {
+    { 7457, 14913, 22371, 29828, 29829, 29830 },
+    { 7457, 14913, 22371, 29829, 37281, 37282 }
+};
+
+// Mixer levels and band-limited step kernels
+struct APUTables {
+    float pulse[31];
+    float tnd[203];
+    float blep[32][16];
+    uint16_t lfsr_jump[2][16][15];
+    APUTables(void) {
+        pulse[0] = 0.0f;
+        for (int i = 1; i < 31; i++) {
+            pulse[i] = 95.52 / (8128.0 / i + 100.0);
+        }
+        tnd[0] = 0.0f;
+        for (int i = 1; i < 203; i++) {
+            tnd[i] = 163.67 / (24329.0 / i + 100.0);
+        }
+        // Blackman-windowed sinc impulse, cut off below Nyquist, for each
+        // fraction of a sample; a step is the running sum of one
+        const int taps = 16;
+        const double cutoff = 0.9;
+        for (int p = 0; p < 32; p++) {
+            double sum = 0.0;
+            double kernel[taps];
+            for (int k = 0; k < taps; k++) {
+                double x = k - taps / 2 - p / 32.0;
+                double s = (x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x));
+                double w = 0.42 + 0.5 * cos(M_PI * x / (taps / 2)) + 0.08 * cos(2 * M_PI * x / (taps / 2));
+                kernel[k] = s * w;
+                sum += kernel[k];
+            }
+            for (int k = 0; k < taps; k++) {
+                blep[p][k] = kernel[k] / sum;
+            }
+        }
+        // Noise shift register advanced by 2^i clocks, as GF(2) matrices
+        // given by the image of each bit
+        for (int mode = 0; mode < 2; mode++) {
+            for (int j = 0; j < 15; j++) {
+                uint16_t v = 1 << j;
+                uint16_t feedback = (v ^ (v >> (mode ? 6 : 1))) & 1;
+                lfsr_jump[mode][0][j] = (v >> 1) | (feedback << 14);
+            }
+            for (int i = 1; i < 16; i++) {
+                for (int j = 0; j < 15; j++) {
+                    lfsr_jump[mode][i][j] = jump(lfsr_jump[mode][i - 1],
+                        lfsr_jump[mode][i - 1][j]);
+                }
+            }
+        }
+    }
+    static uint16_t jump(const uint16_t *matrix, uint16_t v) {
+        uint16_t r = 0;
+        for (int j = 0; j < 15; j++) {
+            if (v & (1 << j)) {
+                r ^= matrix[j];
+            }
+        }
+        return r;
+    }
+};
+
+static const APUTables &tables(void) {
+    static const APUTables t;
+    return t;
+}
+
+APU::APU(void) {
+    cycles = 0;
+    context = NULL;
+    irq = NULL;
+    dmc_read = NULL;
+    irq_out = false;
+    synthesis = true;
+    reset();
+}
+
+void APU::reset(void) {
+    memset(pulse, 0, sizeof(pulse));
+    memset(&triangle, 0, sizeof(triangle));
+    memset(&noise, 0, sizeof(noise));
+    memset(&dmc, 0, sizeof(dmc));
+    pulse[1].second = true;
+    pulse[0].next = cycles;
+    pulse[1].next = cycles;
+    triangle.next = cycles;
+    noise.lfsr = 1;
+    noise.period = noise_periods[0];
+    noise.next = cycles;
+    dmc.period = dmc_periods[0];
+    dmc.bits = 8;
+    dmc.silence = true;
+    dmc.sample_address = 0xC000;
+    dmc.sample_length = 1;
+    dmc.next = cycles;
+
+    five_step = false;
+    irq_inhibit = false;
+    frame_irq = false;
+    dmc_irq = false;
+    frame_start = cycles;
+    frame_step = 0;
+    update_irq();
+
+    restart_output();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CHANNELS
+////////////////////////////////////////////////////////////////////////////////
+
+void APU::Envelope::clock(void) {
+    if (start) {
+        start = false;
+        decay = 15;
+        divider = period;
+    } else if (divider == 0) {
+        divider = period;
+        if (decay > 0) {
+            decay--;
+        } else if (loop) {
+            decay = 15;
+        }
+    } else {
+        divider--;
+    }
+}
+
+uint8_t APU::Envelope::volume(void) {
+    return (constant ? period : decay);
+}
+
+uint16_t APU::Pulse::target(void) {
+    int change = period >> sweep_shift;
+    if (!sweep_negate) {
+        return period + change;
+    }
+    // Pulse 1 negates with one's complement
+    int t = period - change - (second ? 0 : 1);
+    return (t < 0 ? 0 : t);
+}
+
+bool APU::Pulse::muted(void) {
+    return period < 8 || (!sweep_negate && target() > 0x7FF);
+}
+
+void APU::Pulse::sweep(void) {
+    if (sweep_divider == 0 && sweep_enabled && sweep_shift != 0 && !muted()) {
+        period = target();
+    }
+    if (sweep_divider == 0 || sweep_reload) {
+        sweep_divider = sweep_period;
+        sweep_reload = false;
+    } else {
+        sweep_divider--;
+    }
+}
+
+uint8_t APU::Pulse::output(void) {
+    if (length == 0 || muted() || !duty_table[duty][step]) {
+        return 0;
+    }
+    return envelope.volume();
+}
+
+void APU::Triangle::quarter(void) {
+    if (linear_reload) {
+        linear = linear_period;
+    } else if (linear > 0) {
+        linear--;
+    }
+    if (!control) {
+        linear_reload = false;
+    }
+}
+
+// Whether the sequencer moves; it is held at ultrasonic periods instead,
+// which would only be heard as a pop
+bool APU::Triangle::active(void) {
+    return length != 0 && linear != 0 && period >= 2;
+}
+
+uint8_t APU::Triangle::output(void) {
+    return triangle_table[step];
+}
+
+void APU::Noise::shift(void) {
+    uint16_t feedback = (lfsr ^ (lfsr >> (mode ? 6 : 1))) & 1;
+    lfsr = (lfsr >> 1) | (feedback << 14);
+}
+
+uint8_t APU::Noise::output(void) {
+    if (length == 0 || (lfsr & 1)) {
+        return 0;
+    }
+    return envelope.volume();
+}
+
+bool APU::DMC::active(void) {
+    return !silence || buffer_full || remaining != 0;
+}
+
+void APU::skip(uint64_t &next, uint32_t period, uint64_t cycle, uint32_t &clocks) {
+    clocks = 0;
+    if (next < cycle) {
+        clocks = (cycle - next + period - 1) / period;
+        next += (uint64_t)clocks * period;
+    }
+}
+
+void APU::pulse_clock(Pulse &p) {
+    p.step = (p.step - 1) & 7;
+    p.next += 2 * (p.period + 1);
+}
+
+void APU::triangle_clock(void) {
+    triangle.step = (triangle.step + 1) & 31;
+    triangle.next += triangle.period + 1;
+}
+
+void APU::noise_clock(void) {
+    noise.shift();
+    noise.next += noise.period;
+}
+
+void APU::dmc_clock(void) {
+    if (!dmc.silence) {
+        if (dmc.shift & 1) {
+            if (dmc.level <= 125) {
+                dmc.level += 2;
+            }
+        } else if (dmc.level >= 2) {
+            dmc.level -= 2;
+        }
+    }
+    dmc.shift >>= 1;
+    if (--dmc.bits == 0) {
+        dmc.bits = 8;
+        dmc.silence = !dmc.buffer_full;
+        if (dmc.buffer_full) {
+            dmc.shift = dmc.buffer;
+            dmc.buffer_full = false;
+            dmc_fetch();
+        }
+    }
+    dmc.next += dmc.period;
+}
+
+void APU::dmc_fetch(void) {
+    if (dmc.buffer_full || dmc.remaining == 0) {
+        return;
+    }
+    dmc.buffer = (dmc_read != NULL ? dmc_read(context, dmc.address) : 0x00);
+    dmc.buffer_full = true;
+    dmc.address = (dmc.address == 0xFFFF ? 0x8000 : dmc.address + 1);
+    if (--dmc.remaining == 0) {
+        if (dmc.loop) {
+            restart();
+        } else if (dmc.irq_enabled) {
+            dmc_irq = true;
+            update_irq();
+        }
+    }
+}
+
+void APU::restart(void) {
+    dmc.address = dmc.sample_address;
+    dmc.remaining = dmc.sample_length;
+}
+
+// Run the channels up to the cycle: channels whose output cannot change
+// only have their timers moved, the others are clocked in time order and
+// each change of the mixed output becomes a band-limited step
+void APU::run(uint64_t until_cycle) {
+    while (cycles < until_cycle) {
+        uint64_t step = frame_next();
+        bool frame = (step < until_cycle);
+        uint64_t stop = (frame ? step : until_cycle);
+
+        uint32_t clocks;
+        bool audible[2];
+        for (int i = 0; i < 2; i++) {
+            Pulse &p = pulse[i];
+            audible[i] = (synthesis && p.length != 0 && !p.muted() && p.envelope.volume() != 0);
+            if (!audible[i]) {
+                skip(p.next, 2 * (p.period + 1), stop, clocks);
+                p.step = (p.step - clocks) & 7;
+            }
+        }
+        bool tri = triangle.active();
+        if (!tri) {
+            skip(triangle.next, triangle.period + 1, stop, clocks);
+        } else if (!synthesis) {
+            skip(triangle.next, triangle.period + 1, stop, clocks);
+            triangle.step = (triangle.step + clocks) & 31;
+            tri = false;
+        }
+        bool noi = (synthesis && noise.length != 0 && noise.envelope.volume() != 0);
+        if (!noi) {
+            skip(noise.next, noise.period, stop, clocks);
+            const APUTables &t = tables();
+            for (int i = 0; clocks != 0; i++, clocks >>= 1) {
+                if (clocks & 1) {
+                    noise.lfsr = APUTables::jump(t.lfsr_jump[noise.mode][i], noise.lfsr);
+                }
+            }
+        }
+        bool dm = dmc.active();
+        if (!dm) {
+            skip(dmc.next, dmc.period, stop, clocks);
+            dmc.bits = 8 - (8 - dmc.bits + clocks) % 8;
+        }
+
+        for (;;) {
+            uint64_t t = stop;
+            if (audible[0] && pulse[0].next < t) {
+                t = pulse[0].next;
+            }
+            if (audible[1] && pulse[1].next < t) {
+                t = pulse[1].next;
+            }
+            if (tri && triangle.next < t) {
+                t = triangle.next;
+            }
+            if (noi && noise.next < t) {
+                t = noise.next;
+            }
+            if (dm && dmc.next < t) {
+                t = dmc.next;
+            }
+            if (t == stop) {
+                break;
+            }
+            if (audible[0] && pulse[0].next == t) {
+                pulse_clock(pulse[0]);
+            }
+            if (audible[1] && pulse[1].next == t) {
+                pulse_clock(pulse[1]);
+            }
+            if (tri && triangle.next == t) {
+                triangle_clock();
+            }
+            if (noi && noise.next == t) {
+                noise_clock();
+            }
+            if (dm && dmc.next == t) {
+                dmc_clock();
+            }
+            output(t);
+        }
+
+        cycles = stop;
+        if (frame) {
+            frame_clock();
+            output(stop);
+        }
+        finish(stop);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FRAME COUNTER
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t APU::frame_next(void) {
+    return frame_start + frame_steps[five_step][frame_step];
+}
+
+void APU::frame_clock(void) {
+    uint8_t step = frame_step++;
+    if (!five_step) {
+        if (step == 0 || step == 1 || step == 2 || step == 4) {
+            quarter_frame();
+        }
+        if (step == 1 || step == 4) {
+            half_frame();
+        }
+        if (step >= 3 && !irq_inhibit) {
+            frame_irq = true;
+            update_irq();
+        }
+    } else {
+        if (step == 0 || step == 1 || step == 2 || step == 4) {
+            quarter_frame();
+        }
+        if (step == 1 || step == 4) {
+            half_frame();
+        }
+    }
+    if (step == 5) {
+        frame_start += frame_steps[five_step][5];
+        frame_step = 0;
+    }
+}
+
+void APU::quarter_frame(void) {
+    pulse[0].envelope.clock();
+    pulse[1].envelope.clock();
+    noise.envelope.clock();
+    triangle.quarter();
+}
+
+void APU::half_frame(void) {
+    for (int i = 0; i < 2; i++) {
+        if (!pulse[i].halt && pulse[i].length > 0) {
+            pulse[i].length--;
+        }
+        pulse[i].sweep();
+    }
+    if (!triangle.control && triangle.length > 0) {
+        triangle.length--;
+    }
+    if (!noise.halt && noise.length > 0) {
+        noise.length--;
+    }
+}
+
+void APU::update_irq(void) {
+    bool level = frame_irq || dmc_irq;
+    if (level != irq_out) {
+        irq_out = level;
+        if (irq != NULL) {
+            irq(context, level);
+        }
+    }
+}
+
+uint64_t APU::next_event(void) {
+    uint64_t event = NO_EVENT;
+    if (!five_step && !irq_inhibit) {
+        // Steps 3-5 raise the flag, only the first of them matters
+        if (frame_irq) {
+            event = frame_start + frame_steps[0][5] + frame_steps[0][3];
+        } else if (frame_step <= 3) {
+            event = frame_start + frame_steps[0][3];
+        } else {
+            event = frame_next();
+        }
+    }
+    if (dmc.irq_enabled && !dmc.loop && dmc.remaining != 0 && !dmc_irq) {
+        // The buffer is refilled whenever the output unit empties it, every
+        // 8 clocks, the last fetch raises the flag
+        uint64_t t = cycles;
+        if (dmc.buffer_full) {
+            t = dmc.next + (dmc.bits - 1) * dmc.period;
+            t += (uint64_t)(dmc.remaining - 1) * 8 * dmc.period;
+        }
+        if (t < event) {
+            event = t;
+        }
+    }
+    return event;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CPU INTERFACE
+////////////////////////////////////////////////////////////////////////////////
+
+uint8_t APU::read(uint16_t address) {
+    if (address != 0x4015) {
+        return 0x00;
+    }
+    uint8_t data = (pulse[0].length != 0 ? 0x01 : 0)
+        | (pulse[1].length != 0 ? 0x02 : 0)
+        | (triangle.length != 0 ? 0x04 : 0)
+        | (noise.length != 0 ? 0x08 : 0)
+        | (dmc.remaining != 0 ? 0x10 : 0)
+        | (frame_irq ? 0x40 : 0)
+        | (dmc_irq ? 0x80 : 0);
+    frame_irq = false;
+    update_irq();
+    return data;
+}
+
+void APU::write(uint16_t address, uint8_t data) {
+    switch (address) {
+    case 0x4000:
+    case 0x4004: {
+        Pulse &p = pulse[(address >> 2) & 1];
+        p.duty = data >> 6;
+        p.halt = ((data & 0x20) != 0);
+        p.envelope.loop = p.halt;
+        p.envelope.constant = ((data & 0x10) != 0);
+        p.envelope.period = data & 0x0F;
+        break;
+    }
+    case 0x4001:
+    case 0x4005: {
+        Pulse &p = pulse[(address >> 2) & 1];
+        p.sweep_enabled = ((data & 0x80) != 0);
+        p.sweep_period = (data >> 4) & 7;
+        p.sweep_negate = ((data & 0x08) != 0);
+        p.sweep_shift = data & 7;
+        p.sweep_reload = true;
+        break;
+    }
+    case 0x4002:
+    case 0x4006: {
+        Pulse &p = pulse[(address >> 2) & 1];
+        p.period = (p.period & 0x700) | data;
+        break;
+    }
+    case 0x4003:
+    case 0x4007: {
+        Pulse &p = pulse[(address >> 2) & 1];
+        p.period = (p.period & 0xFF) | ((data & 7) << 8);
+        if (p.enabled) {
+            p.length = length_table[data >> 3];
+        }
+        p.step = 0;
+        p.envelope.start = true;
+        break;
+    }
+    case 0x4008:
+        triangle.control = ((data & 0x80) != 0);
+        triangle.linear_period = data & 0x7F;
+        break;
+    case 0x400A:
+        triangle.period = (triangle.period & 0x700) | data;
+        break;
+    case 0x400B:
+        triangle.period = (triangle.period & 0xFF) | ((data & 7) << 8);
+        if (triangle.enabled) {
+            triangle.length = length_table[data >> 3];
+        }
+        triangle.linear_reload = true;
+        break;
+    case 0x400C:
+        noise.halt = ((data & 0x20) != 0);
+        noise.envelope.loop = noise.halt;
+        noise.envelope.constant = ((data & 0x10) != 0);
+        noise.envelope.period = data & 0x0F;
+        break;
+    case 0x400E:
+        noise.mode = ((data & 0x80) != 0);
+        noise.period = noise_periods[data & 0x0F];
+        break;
+    case 0x400F:
+        if (noise.enabled) {
+            noise.length = length_table[data >> 3];
+        }
+        noise.envelope.start = true;
+        break;
+    case 0x4010:
+        dmc.irq_enabled = ((data & 0x80) != 0);
+        dmc.loop = ((data & 0x40) != 0);
+        dmc.period = dmc_periods[data & 0x0F];
+        if (!dmc.irq_enabled) {
+            dmc_irq = false;
+            update_irq();
+        }
+        break;
+    case 0x4011:
+        dmc.level = data & 0x7F;
+        break;
+    case 0x4012:
+        dmc.sample_address = 0xC000 | (data << 6);
+        break;
+    case 0x4013:
+        dmc.sample_length = (data << 4) | 1;
+        break;
+    case 0x4015:
+        pulse[0].enabled = ((data & 0x01) != 0);
+        pulse[1].enabled = ((data & 0x02) != 0);
+        triangle.enabled = ((data & 0x04) != 0);
+        noise.enabled = ((data & 0x08) != 0);
+        for (int i = 0; i < 2; i++) {
+            if (!pulse[i].enabled) {
+                pulse[i].length = 0;
+            }
+        }
+        if (!triangle.enabled) {
+            triangle.length = 0;
+        }
+        if (!noise.enabled) {
+            noise.length = 0;
+        }
+        if (!(data & 0x10)) {
+            dmc.remaining = 0;
+        } else if (dmc.remaining == 0) {
+            restart();
+            dmc_fetch();
+        }
+        dmc_irq = false;
+        update_irq();
+        break;
+    case 0x4017:
+        // The sequence restarts 3 or 4 cycles later, depending on the
+        // alignment with the APU clock; the 5-step mode clocks the units
+        // right away
+        five_step = ((data & 0x80) != 0);
+        irq_inhibit = ((data & 0x40) != 0);
+        if (irq_inhibit) {
+            frame_irq = false;
+            update_irq();
+        }
+        frame_start = cycles + 3 + (cycles & 1);
+        frame_step = 0;
+        if (five_step) {
+            quarter_frame();
+            half_frame();
+        }
+        break;
+    }
+    output(cycles);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// OUTPUT
+////////////////////////////////////////////////////////////////////////////////
+
+float APU::level(void) {
+    const APUTables &t = tables();
+    uint8_t tnd = 3 * triangle.output() + 2 * noise.output() + dmc.level;
+    return t.pulse[pulse[0].output() + pulse[1].output()] + t.tnd[tnd];
+}
+
+// Add the change of the mixed output as a band-limited step
+void APU::output(uint64_t cycle) {
+    if (!synthesis) {
+        return;
+    }
+    float now = level();
+    float delta = now - mix;
+    if (delta == 0.0f) {
+        return;
+    }
+    mix = now;
+    uint64_t frac = epoch_frac + (cycle - epoch_cycle) * SAMPLE_STEP;
+    uint64_t sample = epoch_sample + (frac >> 32);
+    const float *kernel = tables().blep[(frac >> 27) & (BLEP_PHASES - 1)];
+    for (int k = 0; k < BLEP_TAPS; k++) {
+        amp[(sample + k) & (AMP_SIZE - 1)] += delta * kernel[k];
+    }
+    amp_end = sample + BLEP_TAPS;
+}
+
+// Output the samples that no step at the cycle or later can reach, through
+// a DC blocker
+void APU::finish(uint64_t cycle) {
+    if (!synthesis) {
+        return;
+    }
+    uint64_t frac = epoch_frac + (cycle - epoch_cycle) * SAMPLE_STEP;
+    uint64_t end = epoch_sample + (frac >> 32);
+    epoch_cycle = cycle;
+    epoch_sample = end;
+    epoch_frac = frac & 0xFFFFFFFF;
+    for (; step_sample < end; step_sample++) {
+        if (step_sample >= amp_end && highpass == 0.0f) {
+            // Settled: the rest is silence
+            fill(end - step_sample);
+            step_sample = end;
+            break;
+        }
+        float &a = amp[step_sample & (AMP_SIZE - 1)];
+        integrator += a;
+        a = 0.0f;
+        highpass = integrator - last_in + 0.999f * highpass;
+        last_in = integrator;
+        if (fabsf(highpass) < 1e-6f) {
+            highpass = 0.0f;
+        }
+        int s = (int)lrintf(highpass * 32767.0f);
+        if (s > 32767) {
+            s = 32767;
+        } else if (s < -32768) {
+            s = -32768;
+        }
+        if (ring_write - ring_read == BUFFER_SIZE) {
+            ring_read++;
+        }
+        ring[ring_write++ % BUFFER_SIZE] = s;
+    }
+}
+
+void APU::fill(uint64_t n) {
+    if (n > BUFFER_SIZE) {
+        ring_write += n - BUFFER_SIZE;
+        n = BUFFER_SIZE;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        ring[ring_write++ % BUFFER_SIZE] = 0;
+    }
+    if (ring_write - ring_read > BUFFER_SIZE) {
+        ring_read = ring_write - BUFFER_SIZE;
+    }
+}
+
+uint32_t APU::available(void) {
+    return ring_write - ring_read;
+}
+
+uint32_t APU::samples(int16_t *out, uint32_t max) {
+    uint32_t n = available();
+    if (n > max) {
+        n = max;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = ring[ring_read++ % BUFFER_SIZE];
+    }
+    return n;
+}
+
+void APU::set_output(bool enable) {
+    if (enable && !synthesis) {
+        restart_output();
+    }
+    synthesis = enable;
+}
+
+// Output from the current cycle on, with no steps in flight
+void APU::restart_output(void) {
+    memset(amp, 0, sizeof(amp));
+    highpass = 0.0f;
+    epoch_cycle = cycles;
+    epoch_sample = 0;
+    epoch_frac = 0;
+    step_sample = 0;
+    amp_end = 0;
+    ring_read = 0;
+    ring_write = 0;
+    mix = level();
+    integrator = mix;
+    last_in = mix;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SAVE STATES
+////////////////////////////////////////////////////////////////////////////////
+
+void APU::Envelope::save(StateWriter &out) {
+    out.u8((start ? 0x80 : 0) | (loop ? 0x40 : 0) | (constant ? 0x20 : 0) | period);
+    out.u8((divider << 4) | decay);
+}
+
+void APU::Envelope::load(StateReader &in) {
+    uint8_t v = in.u8();
+    start = ((v & 0x80) != 0);
+    loop = ((v & 0x40) != 0);
+    constant = ((v & 0x20) != 0);
+    period = v & 0x0F;
+    v = in.u8();
+    divider = v >> 4;
+    decay = v & 0x0F;
+}
+
+void APU::Pulse::save(StateWriter &out) {
+    out.u8((enabled ? 0x80 : 0) | (halt ? 0x40 : 0) | (duty << 3) | step);
+    out.u16(period);
+    out.u8(length);
+    envelope.save(out);
+    out.u8((sweep_enabled ? 0x80 : 0) | (sweep_negate ? 0x40 : 0) | (sweep_reload ? 0x20 : 0)
+        | (sweep_period << 2));
+    out.u8((sweep_shift << 4) | sweep_divider);
+    out.u64(next);
+}
+
+void APU::Pulse::load(StateReader &in) {
+    uint8_t v = in.u8();
+    enabled = ((v & 0x80) != 0);
+    halt = ((v & 0x40) != 0);
+    duty = (v >> 3) & 3;
+    step = v & 7;
+    period = in.u16() & 0x7FF;
+    length = in.u8();
+    envelope.load(in);
+    v = in.u8();
+    sweep_enabled = ((v & 0x80) != 0);
+    sweep_negate = ((v & 0x40) != 0);
+    sweep_reload = ((v & 0x20) != 0);
+    sweep_period = (v >> 2) & 7;
+    v = in.u8();
+    sweep_shift = (v >> 4) & 7;
+    sweep_divider = v & 7;
+    next = in.u64();
+}
+
+void APU::Triangle::save(StateWriter &out) {
+    out.u8((enabled ? 0x80 : 0) | (control ? 0x40 : 0) | (linear_reload ? 0x20 : 0) | step);
+    out.u16(period);
+    out.u8(length);
+    out.u8(linear);
+    out.u8(linear_period);
+    out.u64(next);
+}
+
+void APU::Triangle::load(StateReader &in) {
+    uint8_t v = in.u8();
+    enabled = ((v & 0x80) != 0);
+    control = ((v & 0x40) != 0);
+    linear_reload = ((v & 0x20) != 0);
+    step = v & 31;
+    period = in.u16() & 0x7FF;
+    length = in.u8();
+    linear = in.u8() & 0x7F;
+    linear_period = in.u8() & 0x7F;
+    next = in.u64();
+}
+
+void APU::Noise::save(StateWriter &out) {
+    out.u8((enabled ? 0x80 : 0) | (halt ? 0x40 : 0) | (mode ? 0x20 : 0));
+    out.u16(lfsr);
+    out.u16(period);
+    out.u8(length);
+    envelope.save(out);
+    out.u64(next);
+}
+
+void APU::Noise::load(StateReader &in) {
+    uint8_t v = in.u8();
+    enabled = ((v & 0x80) != 0);
+    halt = ((v & 0x40) != 0);
+    mode = ((v & 0x20) != 0);
+    lfsr = in.u16() & 0x7FFF;
+    period = in.u16();
+    length = in.u8();
+    envelope.load(in);
+    next = in.u64();
+}
+
+void APU::DMC::save(StateWriter &out) {
+    out.u8((irq_enabled ? 0x80 : 0) | (loop ? 0x40 : 0) | (buffer_full ? 0x20 : 0)
+        | (silence ? 0x10 : 0) | (bits & 0x0F));
+    out.u16(period);
+    out.u8(level);
+    out.u16(sample_address);
+    out.u16(sample_length);
+    out.u16(address);
+    out.u16(remaining);
+    out.u8(buffer);
+    out.u8(shift);
+    out.u64(next);
+}
+
+void APU::DMC::load(StateReader &in) {
+    uint8_t v = in.u8();
+    irq_enabled = ((v & 0x80) != 0);
+    loop = ((v & 0x40) != 0);
+    buffer_full = ((v & 0x20) != 0);
+    silence = ((v & 0x10) != 0);
+    bits = v & 0x0F;
+    period = in.u16();
+    level = in.u8() & 0x7F;
+    sample_address = in.u16();
+    sample_length = in.u16();
+    address = in.u16();
+    remaining = in.u16();
+    buffer = in.u8();
+    shift = in.u8();
+    next = in.u64();
+}
+
+void APU::save(StateWriter &out) {
+    out.begin("APU ", 1);
+    out.u64(cycles);
+    pulse[0].save(out);
+    pulse[1].save(out);
+    triangle.save(out);
+    noise.save(out);
+    dmc.save(out);
+    out.u8((five_step ? 0x80 : 0) | (irq_inhibit ? 0x40 : 0) | (frame_irq ? 0x20 : 0)
+        | (dmc_irq ? 0x10 : 0) | frame_step);
+    out.u64(frame_start);
+    out.end();
+}
+
+bool APU::load(StateReader &in) {
+    if (in.find("APU ") != 1) {
+        return false;
+    }
+    cycles = in.u64();
+    pulse[0].load(in);
+    pulse[1].load(in);
+    triangle.load(in);
+    noise.load(in);
+    dmc.load(in);
+    uint8_t v = in.u8();
+    five_step = ((v & 0x80) != 0);
+    irq_inhibit = ((v & 0x40) != 0);
+    frame_irq = ((v & 0x20) != 0);
+    dmc_irq = ((v & 0x10) != 0);
+    frame_step = v & 0x07;
+    frame_start = in.u64();
+    if (frame_step > 5 || dmc.bits == 0 || dmc.bits > 8 || noise.period == 0 || dmc.period == 0) {
+        return false;
+    }
+    update_irq();
+    restart_output();
+    return in.ok();
+}
+
+void APU::log(FILE *stream) {
+    fprintf(stream, "APU P1=%03X/%3d P2=%03X/%3d T=%03X/%3d N=%X/%3d D=%4d/%02X F=%d%c%c%c\n",
+        pulse[0].period, pulse[0].length, pulse[1].period, pulse[1].length,
+        triangle.period, triangle.length, noise.period, noise.length,
+        dmc.remaining, dmc.level, frame_step,
+        (five_step ? '5' : '4'), (frame_irq ? 'F' : '-'), (dmc_irq ? 'D' : '-'));
+}
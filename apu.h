@@ -0,0 +1,223 @@
+#ifndef NES_APU_INCLUDED
+#define NES_APU_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include "state.h"
+
+// Audio processing unit: two pulse channels, triangle, noise, DMC and the
+// frame counter. The APU is clocked by CPU cycles but runs lazily: run() is
+// called only before register accesses, at its events and when samples are
+// requested, and channel state advances from one output change to the next.
+// Output level changes are fed as band-limited steps into a 48 kHz buffer.
+class APU {
+public:
+    APU(void);
+
+    uint64_t cycles;    // CPU cycles simulated so far
+
+    void reset(void);
+    void run(uint64_t until_cycle);
+
+    // CPU cycle of the next step that may raise the IRQ output, never later
+    // than the actual one; NO_EVENT if none can
+    static const uint64_t NO_EVENT = UINT64_MAX;
+    uint64_t next_event(void);
+
+    // $4000-$4013, $4015, $4017
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t data);
+
+    // Context passed to the handlers below
+    void *context;
+
+    // IRQ output (frame counter and DMC), called when the level changes
+    static const uint32_t IRQ_SOURCE = 1 << 1;
+    void (*irq)(void *context, bool level);
+
+    // DMC sample fetches from CPU memory
+    uint8_t (*dmc_read)(void *context, uint16_t address);
+
+    // Output: signed 16-bit mono samples, in a ring buffer of BUFFER_SIZE.
+    // The oldest samples are dropped if the buffer is not read in time.
+    static const int SAMPLE_RATE = 48000;
+    static const int BUFFER_SIZE = 8192;
+    uint32_t available(void);
+    uint32_t samples(int16_t *out, uint32_t max);
+
+    // Sample output on or off. When off, the channels advance without
+    // producing samples; turning it back on drops the samples not read yet.
+    void set_output(bool enable);
+
+    void log(FILE *stream);
+
+    // Save states (chunk "APU "): channels and frame counter. Samples not
+    // read yet are dropped by load().
+    void save(StateWriter &out);
+    bool load(StateReader &in);
+
+private:
+    APU(const APU &);
+    APU &operator=(const APU &);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // CHANNELS
+    ////////////////////////////////////////////////////////////////////////////
+
+    struct Envelope {
+        bool start;
+        bool loop;
+        bool constant;
+        uint8_t period;     // Or constant volume
+        uint8_t divider;
+        uint8_t decay;
+        void clock(void);
+        uint8_t volume(void);
+        void save(StateWriter &out);
+        void load(StateReader &in);
+    };
+
+    struct Pulse {
+        bool second;        // Pulse 2: two's complement negate
+        bool enabled;
+        uint8_t duty;
+        uint8_t step;       // Sequencer position
+        uint16_t period;
+        uint8_t length;
+        bool halt;
+        Envelope envelope;
+        bool sweep_enabled;
+        bool sweep_negate;
+        bool sweep_reload;
+        uint8_t sweep_period;
+        uint8_t sweep_shift;
+        uint8_t sweep_divider;
+        uint64_t next;      // Cycle of the next timer clock
+        uint16_t target(void);
+        bool muted(void);
+        void sweep(void);
+        uint8_t output(void);
+        void save(StateWriter &out);
+        void load(StateReader &in);
+    };
+
+    struct Triangle {
+        bool enabled;
+        uint8_t step;
+        uint16_t period;
+        uint8_t length;
+        bool control;       // Halts the length counter, keeps linear reload
+        uint8_t linear;
+        uint8_t linear_period;
+        bool linear_reload;
+        uint64_t next;
+        void quarter(void);
+        bool active(void);
+        uint8_t output(void);
+        void save(StateWriter &out);
+        void load(StateReader &in);
+    };
+
+    struct Noise {
+        bool enabled;
+        bool mode;          // Short sequence
+        uint16_t lfsr;
+        uint16_t period;
+        uint8_t length;
+        bool halt;
+        Envelope envelope;
+        uint64_t next;
+        void shift(void);
+        uint8_t output(void);
+        void save(StateWriter &out);
+        void load(StateReader &in);
+    };
+
+    struct DMC {
+        bool irq_enabled;
+        bool loop;
+        uint16_t period;
+        uint8_t level;
+        uint16_t sample_address;
+        uint16_t sample_length;
+        uint16_t address;   // Memory reader
+        uint16_t remaining; // Bytes left to fetch
+        uint8_t buffer;
+        bool buffer_full;
+        uint8_t shift;      // Output unit
+        uint8_t bits;
+        bool silence;
+        uint64_t next;
+        bool active(void);
+        void save(StateWriter &out);
+        void load(StateReader &in);
+    };
+
+    Pulse pulse[2];
+    Triangle triangle;
+    Noise noise;
+    DMC dmc;
+
+    // Timer clocks up to the cycle, for a channel whose output does not
+    // change in the meantime
+    static void skip(uint64_t &next, uint32_t period, uint64_t cycle, uint32_t &clocks);
+    void pulse_clock(Pulse &p);
+    void triangle_clock(void);
+    void noise_clock(void);
+    void dmc_clock(void);
+    void dmc_fetch(void);
+    void restart(void);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // FRAME COUNTER
+    ////////////////////////////////////////////////////////////////////////////
+
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    bool dmc_irq;
+    bool irq_out;
+    uint64_t frame_start;   // Cycle of step 0 of the sequence
+    uint8_t frame_step;     // Next step
+
+    uint64_t frame_next(void);
+    void frame_clock(void);
+    void quarter_frame(void);
+    void half_frame(void);
+    void update_irq(void);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // OUTPUT
+    ////////////////////////////////////////////////////////////////////////////
+
+    // Band-limited steps are added to amp as their derivative, spread over
+    // BLEP_TAPS samples; samples are final once no step can reach them
+    static const int BLEP_TAPS = 16;
+    static const int BLEP_PHASES = 32;
+    static const int AMP_SIZE = 1024;
+    float amp[AMP_SIZE];
+    float mix;              // Current mixer output
+    float integrator;
+    float highpass;         // DC blocker state
+    float last_in;
+
+    // Sample position: samples before epoch_cycle plus a 32-bit fraction
+    uint64_t epoch_cycle;
+    uint64_t epoch_sample;
+    uint64_t epoch_frac;
+    uint64_t step_sample;   // Samples done
+    uint64_t amp_end;       // Samples reached by the last step
+
+    int16_t ring[BUFFER_SIZE];
+    uint64_t ring_read;
+    uint64_t ring_write;
+    bool synthesis;         // Sample output on
+
+    void restart_output(void);
+    float level(void);
+    void output(uint64_t cycle);
+    void finish(uint64_t cycle);
+    void fill(uint64_t n);
+};
+
+#endif // NES_APU_INCLUDED
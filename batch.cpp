@@ -0,0 +1,174 @@
+#include <cstdint>
+#include <cstring>
+#include "batch.h"
+
+Batch::Batch(uint32_t threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    inputs = NULL;
+    outputs = NULL;
+    generation = 0;
+    idle = 0;
+    quit = false;
+    for (uint32_t i = 0; i < threads; i++) {
+        queues.push_back(new Queue);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&Batch::work, this, i));
+    }
+}
+
+Batch::~Batch(void) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    start.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    for (size_t i = 0; i < queues.size(); i++) {
+        delete queues[i];
+    }
+    for (size_t i = 0; i < consoles.size(); i++) {
+        delete consoles[i];
+    }
+}
+
+NES &Batch::add(void) {
+    consoles.push_back(new NES);
+    return *consoles.back();
+}
+
+NES &Batch::console(uint32_t i) {
+    return *consoles[i];
+}
+
+uint32_t Batch::size(void) {
+    return consoles.size();
+}
+
+uint32_t Batch::threads(void) {
+    return workers.size();
+}
+
+void Batch::run(const std::vector<std::vector<Input> > &inputs, std::vector<Output> &outputs) {
+    uint32_t n = consoles.size();
+    outputs.resize(n);
+    progress.assign(n, 0);
+    for (size_t w = 0; w < queues.size(); w++) {
+        queues[w]->items.resize(n);
+        queues[w]->head = 0;
+        queues[w]->tail = 0;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        Output &out = outputs[i];
+        uint32_t frames = (i < inputs.size() ? inputs[i].size() : 0);
+        out.stop = CPU6502::STOP_BUDGET;
+        out.frames = 0;
+        out.ram.resize(frames * sizeof(consoles[i]->ram));
+        out.frame.clear();
+        if (frames == 0) {
+            out.frame.assign(consoles[i]->ppu.frame, consoles[i]->ppu.frame + 240 * 256);
+            continue;
+        }
+        Queue &q = *queues[count % queues.size()];
+        q.items[q.tail++] = i;
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    this->inputs = &inputs;
+    this->outputs = &outputs;
+    std::unique_lock<std::mutex> guard(lock);
+    idle = 0;
+    generation++;
+    start.notify_all();
+    while (idle < workers.size()) {
+        done.wait(guard);
+    }
+    this->inputs = NULL;
+    this->outputs = NULL;
+}
+
+void Batch::work(uint32_t worker) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!quit && generation == seen) {
+                start.wait(guard);
+            }
+            if (quit) {
+                return;
+            }
+            seen = generation;
+        }
+        // Until there is nothing left to take. The consoles still running
+        // are then one per worker, each put back into the queue of its own
+        // worker after a frame and taken right back, so this worker would
+        // have nothing more to do in this run.
+        uint32_t console;
+        while (take(worker, console)) {
+            step(worker, console);
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            idle++;
+        }
+        done.notify_one();
+    }
+}
+
+// The newest console of the worker, or else the oldest one of another
+bool Batch::take(uint32_t worker, uint32_t &console) {
+    uint32_t n = consoles.size();
+    {
+        Queue &q = *queues[worker];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.head != q.tail) {
+            console = q.items[--q.tail % n];
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue &q = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.head != q.tail) {
+            console = q.items[q.head++ % n];
+            return true;
+        }
+    }
+    return false;
+}
+
+// One frame of a console, then back into the queue of the worker if it has
+// frames left
+void Batch::step(uint32_t worker, uint32_t console) {
+    NES &nes = *consoles[console];
+    const std::vector<Input> &in = (*inputs)[console];
+    Output &out = (*outputs)[console];
+    uint32_t f = progress[console];
+    nes.pad[0] = in[f].pad[0];
+    nes.pad[1] = in[f].pad[1];
+    CPU6502::Stop stop = nes.run_frame();
+    memcpy(&out.ram[f * sizeof(nes.ram)], nes.ram, sizeof(nes.ram));
+    progress[console] = ++f;
+    out.frames = f;
+    if (stop != CPU6502::STOP_BUDGET || f == in.size()) {
+        out.stop = stop;
+        out.ram.resize(f * sizeof(nes.ram));
+        out.frame.assign(nes.ppu.frame, nes.ppu.frame + 240 * 256);
+        return;
+    }
+    Queue &q = *queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.items[q.tail++ % consoles.size()] = console;
+}
@@ -0,0 +1,79 @@
+#ifndef NES_BATCH_INCLUDED
+#define NES_BATCH_INCLUDED
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "nes.h"
+
+// Many independent consoles in one process, run a frame at a time on a pool
+// of threads. Each worker has a queue of the consoles with frames left: it
+// runs its newest one, so that a console tends to stay on one core, and when
+// its queue is empty it steals the oldest one of another worker. A worker
+// with nothing left to steal is done with the run.
+class Batch {
+public:
+    // Pool of threads workers, 0 for one per core
+    Batch(uint32_t threads);
+    ~Batch(void);
+
+    // A new console, to set up (cartridge, reset) before run()
+    NES &add(void);
+    NES &console(uint32_t i);
+    uint32_t size(void);
+    uint32_t threads(void);
+
+    // Controllers of a console for one frame
+    struct Input {
+        uint8_t pad[2];
+    };
+
+    // What a console left after run()
+    struct Output {
+        CPU6502::Stop stop;             // STOP_BUDGET unless the CPU stopped
+        uint32_t frames;                // Frames run
+        std::vector<uint8_t> ram;       // RAM after each frame, 2 KiB each
+        std::vector<uint16_t> frame;    // PPU::frame at the end
+    };
+
+    // Run console i for inputs[i].size() frames with those inputs, from the
+    // state it is in, all consoles at once. A console whose CPU stops runs
+    // no more frames.
+    void run(const std::vector<std::vector<Input> > &inputs, std::vector<Output> &outputs);
+
+private:
+    Batch(const Batch &);
+    Batch &operator=(const Batch &);
+
+    std::vector<NES *> consoles;
+
+    // Consoles of a worker, oldest first, in a ring sized for all of them
+    struct Queue {
+        std::mutex lock;
+        std::vector<uint32_t> items;
+        uint32_t head;
+        uint32_t tail;
+    };
+    std::vector<Queue *> queues;
+    std::vector<std::thread> workers;
+
+    // Current run, shared with the workers
+    const std::vector<std::vector<Input> > *inputs;
+    std::vector<Output> *outputs;
+    std::vector<uint32_t> progress;     // Frames run by each console
+
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+    uint64_t generation;                // Runs started
+    uint32_t idle;                      // Workers done with the current run
+    bool quit;
+
+    void work(uint32_t worker);
+    bool take(uint32_t worker, uint32_t &console);
+    void step(uint32_t worker, uint32_t console);
+};
+
+#endif // NES_BATCH_INCLUDED
@@ -0,0 +1,449 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "nes.h"
+#include "test_game.h"
+
+// Benchmark suite: a fixed amount of emulation per benchmark, timed with the
+// wall clock, best of several runs. Every result is a rate, higher is
+// better:
+//  - cpu.*: 6502_functional_test.bin in emulated MHz, with and without the
+//    block cache, and millions of instructions per second for loops of one
+//    class of opcodes each;
+//  - ppu.*: millions of dots per second of a PPU alone, rendering
+//    background and sprites, with each renderer;
+//  - nes.*: frames per second of the whole console on synthetic ROMs.
+//
+//   bench [-r runs] [-o results.json] [-b baseline.json] [-t percent]
+//
+// -o writes the results as JSON. -b compares them with an earlier -o file
+// and fails if any result is more than percent (default 5) below it.
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point t0) {
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+struct Result {
+    std::string name;
+    double value;
+    const char *unit;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// CPU
+////////////////////////////////////////////////////////////////////////////////
+
+uint8_t image[0x10000];
+uint8_t mem[0x10000];
+
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
+}
+void cpu_write(void *context, uint16_t address, uint8_t data) {
+    ((uint8_t *)context)[address] = data;
+}
+
+void setup(CPU6502 &cpu, uint16_t start) {
+    cpu.context = mem;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.map(0x00, 0x100, mem, sizeof(mem), true);
+    cpu.reset();
+    cpu.opcode = mem[start];
+    cpu.PC = start;
+}
+
+// MHz of the functional test, 0 if it failed
+double functional(int block_cache) {
+    memcpy(mem, image, sizeof(mem));
+    CPU6502 cpu;
+    setup(cpu, 0x1000);
+    cpu.set_block_cache(block_cache != 0);
+    uint64_t start = cpu.cycles;
+    Clock::time_point t0 = Clock::now();
+    CPU6502::Stop stop = cpu.run(UINT64_MAX);
+    double s = seconds(t0);
+    if (stop != CPU6502::STOP_LOOP || cpu.PC != 0x3B1C) {
+        printf("Functional test failed at $%04X\n", cpu.PC);
+        return 0.0;
+    }
+    return (cpu.cycles - start) / s / 1e6;
+}
+
+// Loops of one class of opcodes: a pattern repeated, then JMP back. The
+// operand $FFFF of a JMP in a pattern stands for the next instruction.
+struct OpClass {
+    const char *name;
+    uint8_t length;
+    uint8_t pattern[16];
+};
+
+static const OpClass OP_CLASSES[] = {
+    // LDA #$12 / LDX $10 / LDY $0200 / LDA $0200,X
+    { "load", 10, { 0xA9, 0x12, 0xA6, 0x10, 0xAC, 0x00, 0x02, 0xBD, 0x00, 0x02 } },
+    // STA $10 / STX $0200 / STA $0200,X / STY $11
+    { "store", 10, { 0x85, 0x10, 0x8E, 0x00, 0x02, 0x9D, 0x00, 0x02, 0x84, 0x11 } },
+    // ADC #$01 / AND $10 / ORA $0200 / EOR #$55 / CMP #$40 / SBC $10
+    { "alu", 13, { 0x69, 0x01, 0x25, 0x10, 0x0D, 0x00, 0x02, 0x49, 0x55, 0xC9, 0x40, 0xE5, 0x10 } },
+    // INC $10 / ASL $0200 / ROR $10 / DEC $0201 / LSR A
+    { "rmw", 11, { 0xE6, 0x10, 0x0E, 0x00, 0x02, 0x66, 0x10, 0xCE, 0x01, 0x02, 0x4A } },
+    // BNE +0 (taken) / BEQ +0 (not taken)
+    { "branch", 4, { 0xD0, 0x00, 0xF0, 0x00 } },
+    // PHA / PLA / PHP / PLP
+    { "stack", 4, { 0x48, 0x68, 0x08, 0x28 } },
+    // TAX / INY / DEX / CLC / SEC / TYA / NOP / INX
+    { "implied", 8, { 0xAA, 0xC8, 0xCA, 0x18, 0x38, 0x98, 0xEA, 0xE8 } },
+    // JSR $0300 (RTS) / JMP next
+    { "jump", 6, { 0x20, 0x00, 0x03, 0x4C, 0xFF, 0xFF } },
+};
+
+static const uint16_t CLASS_START = 0x1000;
+static const int CLASS_REPEAT = 32;
+static const uint64_t CLASS_LOOPS = 100000;
+
+// Millions of instructions per second of a loop of OP_CLASSES[index]
+double op_class(int index) {
+    const OpClass &c = OP_CLASSES[index];
+    memset(mem, 0, sizeof(mem));
+    mem[0x0300] = 0x60;                 // RTS
+    uint16_t pc = CLASS_START;
+    for (int r = 0; r < CLASS_REPEAT; r++) {
+        for (int i = 0; i < c.length; i++) {
+            mem[pc + i] = c.pattern[i];
+        }
+        for (int i = 0; i + 2 < c.length; i++) {
+            if (c.pattern[i] == 0x4C && c.pattern[i + 1] == 0xFF && c.pattern[i + 2] == 0xFF) {
+                mem[pc + i + 1] = (pc + i + 3) & 0xFF;
+                mem[pc + i + 2] = (pc + i + 3) >> 8;
+            }
+        }
+        pc += c.length;
+    }
+    mem[pc] = 0x4C;                     // JMP CLASS_START
+    mem[pc + 1] = CLASS_START & 0xFF;
+    mem[pc + 2] = CLASS_START >> 8;
+
+    CPU6502 cpu;
+    setup(cpu, CLASS_START);
+    cpu.X = 1;                          // Z clear for the branches, no page crossing
+    cpu.Y = 1;
+    cpu.set_p(0x20);
+
+    // Instructions and cycles of a loop, as run by the CPU
+    uint64_t instructions = 0;
+    uint64_t start = cpu.cycles;
+    do {
+        cpu.step();
+        instructions++;
+    } while (cpu.PC != CLASS_START && instructions <= CLASS_REPEAT * c.length);
+    uint64_t until = cpu.cycles + CLASS_LOOPS * (cpu.cycles - start);
+
+    Clock::time_point t0 = Clock::now();
+    CPU6502::Stop stop = cpu.run(until);
+    double s = seconds(t0);
+    if (stop != CPU6502::STOP_BUDGET || cpu.cycles != until || cpu.PC != CLASS_START) {
+        printf("Class %s: stopped at $%04X\n", c.name, cpu.PC);
+        return 0.0;
+    }
+    return CLASS_LOOPS * instructions / s / 1e6;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PPU
+////////////////////////////////////////////////////////////////////////////////
+
+uint8_t vram[0x3000];
+
+uint8_t ppu_read(void *, uint16_t address) {
+    return vram[address % 0x3000];
+}
+void ppu_write(void *, uint16_t address, uint8_t data) {
+    vram[address % 0x3000] = data;
+}
+
+static const int PPU_FRAMES = 60;
+
+// Millions of dots per second: background and 64 sprites, 8 of them on
+// some lines, and sprite 0 moving every frame
+double ppu_dots(int renderer) {
+    uint32_t seed = 1;
+    for (int i = 0; i < 0x3000; i++) {
+        seed = seed * 1103515245 + 12345;
+        vram[i] = (seed >> 16) & (i < 0x2000 ? 0x5F : 0xFF);
+    }
+    PPU ppu;
+    ppu.renderer = (PPU::Renderer)renderer;
+    ppu.mem_read = ppu_read;
+    ppu.mem_write = ppu_write;
+    ppu.nmi = NULL;
+    ppu.reset();
+    ppu.write(0x2006, 0x3F);
+    ppu.write(0x2006, 0x00);
+    for (int i = 0; i < 32; i++) {
+        ppu.write(0x2007, i * 7 + 1);
+    }
+    ppu.write(0x2003, 0);
+    for (int i = 0; i < 64; i++) {
+        ppu.write(0x2004, (i < 8 ? 100 : i * 3));
+        ppu.write(0x2004, i);
+        ppu.write(0x2004, i & 0xE3);
+        ppu.write(0x2004, i * 4);
+    }
+    ppu.write(0x2000, 0x08);
+    ppu.write(0x2001, 0x1E);
+
+    uint64_t start = ppu.cycles;
+    Clock::time_point t0 = Clock::now();
+    for (int f = 0; f < PPU_FRAMES; f++) {
+        ppu.write(0x2003, 0);
+        ppu.write(0x2004, f * 3);
+        uint64_t frame = ppu.frame_count;
+        while (ppu.frame_count == frame) {
+            ppu.run(ppu.cycles + PPU::DOTS);
+        }
+    }
+    double s = seconds(t0);
+    return (ppu.cycles - start) / s / 1e6;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// NES
+////////////////////////////////////////////////////////////////////////////////
+
+// nes.game runs the game of test_game.h. Busy: rendering on, the main loop
+// sums a table in RAM without ever waiting, the NMI only counts frames.
+static const uint8_t BUSY[] = {
+    0xA9, 0x1E, 0x8D, 0x01, 0x20,   // LDA #$1E / STA $2001
+    0xA9, 0x80, 0x8D, 0x00, 0x20,   // LDA #$80 / STA $2000
+    0xA0, 0x00,                     // LDY #$00
+    0x18, 0xB9, 0x00, 0x03,         // CLC / LDA $0300,Y
+    0x65, 0x20, 0x85, 0x20,         // ADC $20 / STA $20
+    0x99, 0x00, 0x04,               // STA $0400,Y
+    0xC8, 0xD0, 0xF2,               // INY / BNE $800C
+    0xE6, 0x21, 0x4C, 0x0A, 0x80,   // INC $21 / JMP $800A
+    0xE6, 0x00,                     // NMI: INC $00
+    0x40 };                         // RTI
+
+static const uint16_t BUSY_NMI = 0x801F;
+static const int NES_FRAMES = 120;
+
+// Frames per second, 0 if the CPU stopped
+double nes_frames(int fast_forward) {
+    NES nes;
+    setup(nes);
+    for (int i = 0; i < 256; i++) {
+        nes.ram[0x300 + i] = i * 3;
+    }
+    nes.set_fast_forward(fast_forward != 0);
+
+    Clock::time_point t0 = Clock::now();
+    for (int f = 0; f < NES_FRAMES; f++) {
+        nes.pad[0] = (f / 7) * 37;
+        nes.pad[1] = (f / 5) * 91;
+        if (nes.run_frame() != CPU6502::STOP_BUDGET) {
+            printf("NES: CPU stopped at $%04X\n", nes.cpu.PC);
+            return 0.0;
+        }
+    }
+    return NES_FRAMES / seconds(t0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Results
+////////////////////////////////////////////////////////////////////////////////
+
+// Best of runs calls of f(arg)
+bool best(std::vector<Result> &results, const std::string &name, const char *unit, int runs,
+        double (*f)(int arg), int arg) {
+    double value = 0.0;
+    for (int r = 0; r < runs; r++) {
+        double v = f(arg);
+        if (v == 0.0) {
+            return false;
+        }
+        if (v > value) {
+            value = v;
+        }
+    }
+    Result result;
+    result.name = name;
+    result.value = value;
+    result.unit = unit;
+    results.push_back(result);
+    printf("  %-28s %10.2f %s\n", name.c_str(), value, unit);
+    return true;
+}
+
+bool write_json(const char *path, const std::vector<Result> &results, int runs) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    fprintf(out, "{\n  \"runs\": %d,\n  \"results\": {\n", runs);
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(out, "    \"%s\": %.3f%s\n", results[i].name.c_str(), results[i].value,
+            (i + 1 < results.size() ? "," : ""));
+    }
+    fprintf(out, "  },\n  \"units\": {\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(out, "    \"%s\": \"%s\"%s\n", results[i].name.c_str(), results[i].unit,
+            (i + 1 < results.size() ? "," : ""));
+    }
+    fprintf(out, "  }\n}\n");
+    return fclose(out) == 0;
+}
+
+// The "results" object of a file written by write_json(): names and numbers
+bool read_json(const char *path, std::vector<Result> &results) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        text.append(buffer, n);
+    }
+    fclose(in);
+
+    size_t at = text.find("\"results\"");
+    if (at == std::string::npos || (at = text.find('{', at)) == std::string::npos) {
+        return false;
+    }
+    size_t end = text.find('}', at);
+    if (end == std::string::npos) {
+        return false;
+    }
+    for (;;) {
+        size_t q0 = text.find('"', at);
+        if (q0 == std::string::npos || q0 > end) {
+            return true;
+        }
+        size_t q1 = text.find('"', q0 + 1);
+        size_t colon = text.find(':', q1);
+        if (q1 == std::string::npos || colon == std::string::npos || colon > end) {
+            return false;
+        }
+        char *after;
+        Result result;
+        result.name = text.substr(q0 + 1, q1 - q0 - 1);
+        result.value = strtod(text.c_str() + colon + 1, &after);
+        result.unit = "";
+        if (after == text.c_str() + colon + 1) {
+            return false;
+        }
+        results.push_back(result);
+        at = after - text.c_str();
+    }
+}
+
+// Results more than percent below the baseline; those missing from either
+// side are listed but do not fail
+bool compare(const std::vector<Result> &results, const std::vector<Result> &baseline, double percent) {
+    int regressions = 0;
+    printf("\nAgainst the baseline (threshold %.1f%%):\n", percent);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result *base = NULL;
+        for (size_t j = 0; j < baseline.size(); j++) {
+            if (baseline[j].name == results[i].name) {
+                base = &baseline[j];
+            }
+        }
+        if (base == NULL) {
+            printf("  %-28s %10.2f        new\n", results[i].name.c_str(), results[i].value);
+            continue;
+        }
+        double change = (base->value != 0.0 ? 100.0 * (results[i].value / base->value - 1.0) : 0.0);
+        bool regression = (change < -percent);
+        regressions += regression;
+        printf("  %-28s %10.2f %10.2f %+7.1f%%%s\n", results[i].name.c_str(), base->value,
+            results[i].value, change, (regression ? "  REGRESSION" : ""));
+    }
+    for (size_t j = 0; j < baseline.size(); j++) {
+        bool found = false;
+        for (size_t i = 0; i < results.size(); i++) {
+            found = found || (baseline[j].name == results[i].name);
+        }
+        if (!found) {
+            printf("  %-28s %10.2f        missing\n", baseline[j].name.c_str(), baseline[j].value);
+        }
+    }
+    printf("%d regression%s\n", regressions, (regressions == 1 ? "" : "s"));
+    return regressions == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    const char *output = NULL;
+    const char *baseline = NULL;
+    double threshold = 5.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-r runs] [-o results.json] [-b baseline.json] [-t percent]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    FILE *prog = fopen("6502_functional_test.bin", "r");
+    if (prog == NULL) {
+        fprintf(stderr, "Cannot open 6502_functional_test.bin\n");
+        return 1;
+    }
+    fread(image, 1, 0x10000, prog);
+    fclose(prog);
+
+    std::vector<Result> results;
+    bool ok = true;
+    printf("Best of %d runs:\n", runs);
+    ok = ok && best(results, "cpu.functional", "MHz", runs, functional, 0);
+    ok = ok && best(results, "cpu.functional.block_cache", "MHz", runs, functional, 1);
+    for (size_t i = 0; ok && i < sizeof(OP_CLASSES) / sizeof(OP_CLASSES[0]); i++) {
+        ok = best(results, std::string("cpu.class.") + OP_CLASSES[i].name, "MIPS", runs, op_class, i);
+    }
+    ok = ok && best(results, "ppu.dot", "Mdots/s", runs, ppu_dots, PPU::RENDER_DOT);
+    ok = ok && best(results, "ppu.scanline", "Mdots/s", runs, ppu_dots, PPU::RENDER_SCANLINE);
+    load_game();
+    ok = ok && best(results, "nes.game", "frames/s", runs, nes_frames, 0);
+    ok = ok && best(results, "nes.game.fast_forward", "frames/s", runs, nes_frames, 1);
+    load_prg(BUSY, sizeof(BUSY), BUSY_NMI);
+    ok = ok && best(results, "nes.busy", "frames/s", runs, nes_frames, 0);
+    if (!ok) {
+        return 1;
+    }
+
+    if (output != NULL && !write_json(output, results, runs)) {
+        fprintf(stderr, "Cannot write %s\n", output);
+        return 1;
+    }
+    if (baseline != NULL) {
+        std::vector<Result> base;
+        if (!read_json(baseline, base)) {
+            fprintf(stderr, "Cannot read %s\n", baseline);
+            return 1;
+        }
+        if (!compare(results, base, threshold)) {
+            return 1;
+        }
+    }
+    return 0;
+}
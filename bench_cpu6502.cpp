@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include "cpu6502.h"
+
+// Throughput benchmark: runs 6502_functional_test.bin to completion several
+// times and reports emulated cycles per second of wall-clock time, for both
+// kinds of bus:
+//  - handlers: every access calls the read / write handlers through their
+//    pointers, with the memory as their context;
+//  - mapped: the memory is mapped into the page tables, so that accesses are
+//    inlined into the opcode handlers and never call out.
+// Only the basic public interface of CPU6502 is used (handlers, map, reset
+// and step), so that the driver is easy to adapt to an older cpu6502.cpp for
+// comparison.
+
+uint8_t image[0x10000];
+
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
+}
+void cpu_write(void *context, uint16_t address, uint8_t data) {
+    ((uint8_t *)context)[address] = data;
+}
+
+// MHz of one run, 0 if the test failed
+double run(bool mapped) {
+    static uint8_t mem[0x10000];
+    memcpy(mem, image, sizeof(mem));
+    CPU6502 cpu;
+    cpu.context = mem;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    if (mapped) {
+        cpu.map(0x00, 0x100, mem, sizeof(mem), true);
+    }
+    cpu.reset();
+    cpu.opcode = mem[0x1000];
+    cpu.PC = 0x1000;
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    uint16_t prevPC = 0x1000;
+    for(;;) {
+        cpu.step();
+        if (cpu.PC == prevPC) {
+            break;
+        }
+        prevPC = cpu.PC;
+    }
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(t1 - t0).count();
+
+    if (cpu.PC != 0x3B1C) {
+        printf("Failed at $%04X.\n", cpu.PC);
+        return 0.0;
+    }
+    double mhz = cpu.cycles / s / 1e6;
+    printf("  %s: %llu cycles in %.3f s, %.1f MHz\n", (mapped ? "mapped" : "handlers"),
+        (unsigned long long)cpu.cycles, s, mhz);
+    return mhz;
+}
+
+int main(int argc, char **argv) {
+    int runs = (argc > 1 ? atoi(argv[1]) : 5);
+
+    FILE *prog = fopen("6502_functional_test.bin", "r");
+    if (prog == NULL) {
+        fprintf(stderr, "Cannot open 6502_functional_test.bin\n");
+        return 1;
+    }
+    fread(image, 1, 0x10000, prog);
+    fclose(prog);
+
+    double best[2] = { 0.0, 0.0 };
+    for (int r = 0; r < runs; r++) {
+        printf("Run %d:\n", r);
+        for (int mapped = 0; mapped < 2; mapped++) {
+            double mhz = run(mapped != 0);
+            if (mhz == 0.0) {
+                return 1;
+            }
+            if (mhz > best[mapped]) {
+                best[mapped] = mhz;
+            }
+        }
+    }
+    printf("Best: handlers %.1f MHz, mapped %.1f MHz (%.2fx)\n",
+        best[0], best[1], best[1] / best[0]);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cartridge.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Shared file mappings
+////////////////////////////////////////////////////////////////////////////////
+
+// A mapped file, identified by device and inode, plus size and modification
+// time so that a rewritten file is mapped again
+struct Cartridge::Image {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    const uint8_t *data;
+    int refs;
+    Image *next;
+};
+
+static std::mutex images_lock;
+Cartridge::Image *Cartridge::images = NULL;
+
+Cartridge::Image *Cartridge::open_image(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(images_lock);
+    for (Image *i = images; i != NULL; i = i->next) {
+        if (i->dev == st.st_dev && i->ino == st.st_ino &&
+                i->size == st.st_size && i->mtime.tv_sec == st.st_mtim.tv_sec &&
+                i->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            i->refs++;
+            close(fd);
+            return i;
+        }
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    Image *i = new Image;
+    i->dev = st.st_dev;
+    i->ino = st.st_ino;
+    i->size = st.st_size;
+    i->mtime = st.st_mtim;
+    i->data = (const uint8_t *)data;
+    i->refs = 1;
+    i->next = images;
+    images = i;
+    return i;
+}
+
+void Cartridge::close_image(Image *image) {
+    std::lock_guard<std::mutex> lock(images_lock);
+    if (--image->refs > 0) {
+        return;
+    }
+    for (Image **i = &images; *i != NULL; i = &(*i)->next) {
+        if (*i == image) {
+            *i = image->next;
+            break;
+        }
+    }
+    munmap((void *)image->data, image->size);
+    delete image;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cartridge
+////////////////////////////////////////////////////////////////////////////////
+
+Cartridge::Cartridge(void) {
+    image = NULL;
+    unload();
+}
+
+Cartridge::~Cartridge(void) {
+    unload();
+}
+
+void Cartridge::unload(void) {
+    if (image != NULL) {
+        close_image(image);
+        image = NULL;
+    }
+    nes2 = false;
+    mapper = 0;
+    submapper = 0;
+    mirroring = MIRROR_HORIZONTAL;
+    timing = TIMING_NTSC;
+    battery = false;
+    prg_ram_size = 0;
+    chr_ram_size = 0;
+    trainer = NULL;
+    prg = NULL;
+    prg_size = 0;
+    chr = NULL;
+    chr_size = 0;
+}
+
+bool Cartridge::load(const char *path) {
+    unload();
+    image = open_image(path);
+    if (image == NULL) {
+        fprintf(stderr, "Cartridge: cannot map %s\n", path);
+        return false;
+    }
+    if (!parse(image->data, image->size)) {
+        fprintf(stderr, "Cartridge: %s is not a valid iNES file\n", path);
+        unload();
+        return false;
+    }
+    return true;
+}
+
+// NES 2.0 ROM size: 12 bits of units, or exponent-multiplier form when the
+// upper 4 bits are all set
+static uint64_t rom_size(uint8_t lsb, uint8_t msb, uint32_t unit) {
+    if (msb == 0xF) {
+        return ((uint64_t)1 << (lsb >> 2)) * ((lsb & 3) * 2 + 1);
+    }
+    return (uint64_t)((msb << 8) | lsb) * unit;
+}
+
+// NES 2.0 RAM size: 64 << shift bytes, none for 0
+static uint32_t ram_size(uint8_t shift) {
+    return (shift == 0 ? 0 : 64 << shift);
+}
+
+bool Cartridge::parse(const uint8_t *data, uint64_t size) {
+    if (size < 16 || memcmp(data, "NES\x1A", 4) != 0) {
+        return false;
+    }
+    const uint8_t *h = data;
+    nes2 = ((h[7] & 0x0C) == 0x08);
+    mirroring = (h[6] & 0x08 ? MIRROR_FOUR : (h[6] & 0x01 ? MIRROR_VERTICAL : MIRROR_HORIZONTAL));
+    battery = ((h[6] & 0x02) != 0);
+
+    uint64_t prg_bytes;
+    uint64_t chr_bytes;
+    if (nes2) {
+        mapper = ((h[8] & 0x0F) << 8) | (h[7] & 0xF0) | (h[6] >> 4);
+        submapper = h[8] >> 4;
+        prg_bytes = rom_size(h[4], h[9] & 0x0F, 0x4000);
+        chr_bytes = rom_size(h[5], h[9] >> 4, 0x2000);
+        prg_ram_size = ram_size(h[10] & 0x0F) + ram_size(h[10] >> 4);
+        chr_ram_size = ram_size(h[11] & 0x0F) + ram_size(h[11] >> 4);
+        timing = (Timing)(h[12] & 3);
+    } else {
+        // Bytes 7-15 of old dumps can hold garbage such as "DiskDude!":
+        // byte 7 only counts when the padding is clean
+        bool clean = (h[12] == 0 && h[13] == 0 && h[14] == 0 && h[15] == 0);
+        mapper = (clean ? h[7] & 0xF0 : 0) | (h[6] >> 4);
+        submapper = 0;
+        prg_bytes = h[4] * 0x4000;
+        chr_bytes = h[5] * 0x2000;
+        prg_ram_size = (clean && h[8] != 0 ? h[8] : 1) * 0x2000;
+        chr_ram_size = (chr_bytes == 0 ? 0x2000 : 0);
+        timing = (clean && (h[9] & 1) ? TIMING_PAL : TIMING_NTSC);
+    }
+
+    uint64_t offset = 16;
+    if (h[6] & 0x04) {
+        trainer = data + offset;
+        offset += 512;
+    }
+    if (prg_bytes == 0 || offset + prg_bytes + chr_bytes > size) {
+        return false;
+    }
+    prg = data + offset;
+    prg_size = prg_bytes;
+    chr = (chr_bytes != 0 ? data + offset + prg_bytes : NULL);
+    chr_size = chr_bytes;
+    return true;
+}
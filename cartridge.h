@@ -0,0 +1,63 @@
+#ifndef NES_CARTRIDGE_INCLUDED
+#define NES_CARTRIDGE_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+
+// A cartridge image, from an iNES or NES 2.0 file. The file is mapped
+// read-only and the ROM pointers point into the mapping: cartridges loading
+// the same file in one process share one mapping.
+class Cartridge {
+public:
+    Cartridge(void);
+    ~Cartridge(void);
+
+    // Load a file, false with a message on stderr if it is not valid
+    bool load(const char *path);
+    void unload(void);
+
+    enum Mirroring {
+        MIRROR_HORIZONTAL,  // CIRAM A10 = PPU A11
+        MIRROR_VERTICAL,    // CIRAM A10 = PPU A10
+        MIRROR_FOUR         // 4 KiB of nametables on the cartridge
+    };
+    enum Timing {
+        TIMING_NTSC,
+        TIMING_PAL,
+        TIMING_MULTI,
+        TIMING_DENDY
+    };
+
+    // Header
+    bool nes2;
+    uint16_t mapper;
+    uint8_t submapper;
+    Mirroring mirroring;
+    Timing timing;
+    bool battery;
+    uint32_t prg_ram_size;  // Including battery-backed RAM
+    uint32_t chr_ram_size;  // Including battery-backed RAM
+
+    // ROM, in the file mapping
+    const uint8_t *trainer; // 512 bytes for $7000, NULL if none
+    const uint8_t *prg;
+    uint32_t prg_size;
+    const uint8_t *chr;
+    uint32_t chr_size;      // 0 with CHR RAM only
+
+private:
+    Cartridge(const Cartridge &);
+    Cartridge &operator=(const Cartridge &);
+
+    // Mapped files, shared by the cartridges
+    struct Image;
+    static Image *images;
+    static Image *open_image(const char *path);
+    static void close_image(Image *image);
+
+    Image *image;
+
+    bool parse(const uint8_t *data, uint64_t size);
+};
+
+#endif // NES_CARTRIDGE_INCLUDED
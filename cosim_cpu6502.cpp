@@ -0,0 +1,366 @@
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "Vcpu65xx.h"
+#include "verilated.h"
+#include "cpu6502.h"
+
+// Lockstep co-simulation of CPU6502 against the Verilated cpu65xx core on
+// 6502_functional_test.bin. The software core runs ahead by batches of
+// instructions into a trace: start cycle, PC, opcode, registers and bus
+// writes of each one. The RTL core then runs alone and is checked against
+// the trace at every instruction boundary:
+//  - on the opcode fetch cycle, the address bus is the PC;
+//  - on the next cycle, debugPc and debugOpcode are those of the
+//    instruction and debugA/X/Y/S hold the results of the previous one,
+//    which the core writes back during the fetch;
+//  - the writes of the previous instruction match, once repeated writes to
+//    the same address are merged (the dummy write of read-modify-write
+//    instructions).
+// When the opcode is not fetched on the expected cycle, but the RTL core
+// starts the instruction a few cycles earlier or later, the previous one
+// took a different number of cycles: the report is a cycle count, with the
+// expected and actual cycles of that instruction, rather than a wrong fetch
+// address.
+// It stops at the first divergence with the last instructions checked. The
+// RTL core is enabled on every clock, rather than every 4 as in
+// test_cpu6502_hw.cpp, and eval() is the bulk of the time.
+
+const vluint64_t CYCLES_RESET = 10;
+const vluint64_t CYCLES_MAX = 200000000L;
+const vluint16_t START = 0x1000;
+
+const int BATCH = 4096;     // Instructions per batch of the software core
+const int WRITES = 4;       // Bus writes per instruction, at most (BRK: 3)
+const int HISTORY = 8;      // Instructions in the report
+const int SLIP = 8;         // Cycles searched around a missed opcode fetch
+
+struct Instruction {
+  vluint64_t cycle;         // First cycle, the opcode fetch
+  vluint16_t pc;
+  vluint8_t opcode;
+  vluint8_t a, x, y, s;     // Before the instruction
+  int writes;               // First of its writes in the batch
+};
+
+struct Write {
+  vluint16_t address;
+  vluint8_t data;
+};
+
+// Software core, with all of memory behind its handlers so that every
+// write is seen
+struct Software {
+  CPU6502 cpu;
+  vluint8_t mem[0x10000];
+  Instruction trace[BATCH + 1];
+  Write writes[(BATCH + 1) * WRITES];
+  int count;                // Instructions in the trace
+  int write_count;
+  bool done;                // Reached the JMP * of the end of the test
+};
+
+uint8_t sw_read(void *context, uint16_t address) {
+  return ((Software *)context)->mem[address];
+}
+
+void sw_write(void *context, uint16_t address, uint8_t data) {
+  Software *sw = (Software *)context;
+  sw->mem[address] = data;
+  if (sw->write_count < (BATCH + 1) * WRITES) {
+    sw->writes[sw->write_count].address = address;
+    sw->writes[sw->write_count].data = data;
+  }
+  sw->write_count++;
+}
+
+// State before the next instruction
+void record(Software *sw) {
+  Instruction &in = sw->trace[sw->count++];
+  in.cycle = sw->cpu.cycles;
+  in.pc = sw->cpu.PC;
+  in.opcode = sw->cpu.opcode;
+  in.a = sw->cpu.A;
+  in.x = sw->cpu.X;
+  in.y = sw->cpu.Y;
+  in.s = sw->cpu.S;
+  in.writes = sw->write_count;
+  if (sw->count > 1 && in.pc == sw->trace[sw->count - 2].pc) {
+    sw->done = true;
+  }
+}
+
+// Next batch: the writes of instruction i are those from trace[i].writes to
+// trace[i + 1].writes, and the last instruction is not run yet. It comes
+// first in the next batch.
+void run_batch(Software *sw) {
+  sw->write_count = 0;
+  if (sw->count > 0) {
+    sw->trace[0] = sw->trace[sw->count - 1];
+    sw->trace[0].writes = 0;
+    sw->count = 1;
+  } else {
+    record(sw);
+  }
+  while (sw->count <= BATCH && !sw->done) {
+    sw->cpu.step();
+    record(sw);
+  }
+}
+
+// Writes, with repeated writes to the same address merged into the last
+int merge(const Write *in, int n, Write *out) {
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    if (m > 0 && out[m - 1].address == in[i].address) {
+      out[m - 1].data = in[i].data;
+    } else {
+      out[m++] = in[i];
+    }
+  }
+  return m;
+}
+
+Software sw;
+Instruction history[HISTORY];
+vluint64_t checked = 0;
+
+// Bus and debug outputs of the last cycles, by cycle
+struct Cycle {
+  vluint16_t addr;
+  vluint16_t pc;
+  vluint8_t opcode;
+};
+Cycle bus[2 * SLIP];
+
+// The RTL core fetched the opcode of in on cycle c: the next cycle shows it
+bool starts(const Instruction &in, vluint64_t c) {
+  const Cycle &fetch = bus[c % (2 * SLIP)];
+  const Cycle &after = bus[(c + 1) % (2 * SLIP)];
+  return fetch.addr == in.pc && after.pc == in.pc && after.opcode == in.opcode;
+}
+
+// Values of 16 bits print with 4 digits
+void report(const char *what, vluint64_t cycle, unsigned expected, unsigned actual) {
+  printf("\nMismatch at instruction %llu, cycle %llu: %s expected %02X, got %02X\n",
+    (unsigned long long)checked, (unsigned long long)cycle, what, expected, actual);
+  printf("Last instructions (registers before each one):\n");
+  printf("       cycle   PC  op  A  X  Y  S\n");
+  for (int i = 0; i < HISTORY; i++) {
+    if (checked + i < HISTORY) {
+      continue;
+    }
+    const Instruction &in = history[(checked + i) % HISTORY];
+    printf("%12llu %04X  %02X %02X %02X %02X %02X\n", (unsigned long long)in.cycle,
+      in.pc, in.opcode, in.a, in.x, in.y, in.s);
+  }
+}
+
+int main(int argc, char **argv, char **env) {
+  Verilated::commandArgs(argc, argv);
+
+  vluint8_t mem[0x10000];
+  FILE *prog = fopen("6502_functional_test.bin", "r");
+  if (prog == NULL) {
+    fprintf(stderr, "Cannot open 6502_functional_test.bin\n");
+    return 1;
+  }
+  printf("Read %lu bytes\n", fread(mem, 1, 0x10000, prog));
+  fclose(prog);
+
+  memcpy(sw.mem, mem, sizeof(mem));
+  sw.cpu.context = &sw;
+  sw.cpu.read = sw_read;
+  sw.cpu.write = sw_write;
+  sw.cpu.reset();
+  sw.cpu.opcode = sw.mem[START];
+  sw.cpu.PC = START;
+  sw.count = 0;
+  sw.done = false;
+  run_batch(&sw);
+  // Cycles of the trace count from the first opcode fetch
+  vluint64_t base = sw.trace[0].cycle;
+
+  Vcpu65xx *top = new Vcpu65xx;
+  top->enable = 1;
+  top->nmi_n = 1;
+  top->irq_n = 1;
+  top->so_n = 1;
+
+  Write hw_writes[64];
+  int hw_write_count = 0;
+  int next = 0;             // Instruction of the trace to check next
+  bool fetched = false;     // Its fetch cycle was checked
+  bool synced = false;      // The first opcode fetch was seen
+  vluint64_t cycle = 0;     // Cycles since then
+  const char *missed = NULL;  // Start of the instruction not seen on its cycle
+  unsigned missed_expected = 0;
+  unsigned missed_actual = 0;
+  vluint64_t missed_cycle = 0;
+  vluint64_t search = 0;    // Next cycle searched for its opcode fetch
+  vluint8_t clk = 0;
+  clock_t start = clock();
+
+  for (vluint64_t hc = 0; hc < (CYCLES_MAX << 1); hc++) {
+    vluint8_t reset = ((hc >> 1) < CYCLES_RESET ? 1 : 0);
+    clk ^= 1;
+    top->clk = clk;
+    top->reset = reset;
+    top->eval();
+
+    if (top->we) {
+      mem[top->addr] = top->dout;
+    }
+    if (top->addr == 0xFFFC) {
+      top->din = START & 0xFF;
+    } else if (top->addr == 0xFFFD) {
+      top->din = START >> 8;
+    } else {
+      top->din = mem[top->addr];
+    }
+    if (!clk || reset) {
+      continue;
+    }
+
+    // A new cycle has started: the bus shows it
+    if (!synced) {
+      if (top->addr != START) {
+        continue;
+      }
+      synced = true;
+    } else {
+      cycle++;
+    }
+    Cycle &now = bus[cycle % (2 * SLIP)];
+    now.addr = top->addr;
+    now.pc = top->debugPc;
+    now.opcode = top->debugOpcode;
+    if (top->we && hw_write_count < 64) {
+      hw_writes[hw_write_count].address = top->addr;
+      hw_writes[hw_write_count].data = top->dout;
+      hw_write_count++;
+    }
+
+    Instruction &in = sw.trace[next];
+    vluint64_t expected_fetch = in.cycle - base;
+    vluint64_t previous = (next > 0 ? sw.trace[next - 1].cycle - base : 0);
+    if (!fetched && missed == NULL && cycle == expected_fetch) {
+      if (top->addr != in.pc) {
+        missed = "fetch address";
+        missed_expected = in.pc;
+        missed_actual = top->addr;
+        missed_cycle = cycle;
+      } else {
+        // Writes of the previous instruction
+        if (next > 0) {
+          const Instruction &prev = sw.trace[next - 1];
+          Write expected[WRITES];
+          Write actual[64];
+          int n = merge(&sw.writes[prev.writes], in.writes - prev.writes, expected);
+          int m = merge(hw_writes, hw_write_count, actual);
+          if (n != m) {
+            report("write count", cycle, n, m);
+            return 1;
+          }
+          for (int i = 0; i < n; i++) {
+            if (expected[i].address != actual[i].address) {
+              report("write address", cycle, expected[i].address, actual[i].address);
+              return 1;
+            }
+            if (expected[i].data != actual[i].data) {
+              report("write data", cycle, expected[i].data, actual[i].data);
+              return 1;
+            }
+          }
+        }
+        hw_write_count = 0;
+        fetched = true;
+      }
+    } else if (fetched && cycle == expected_fetch + 1) {
+      const char *what = NULL;
+      unsigned expected = 0;
+      unsigned actual = 0;
+      if (top->debugPc != in.pc) {
+        what = "PC";
+        expected = in.pc;
+        actual = top->debugPc;
+      } else if (top->debugOpcode != in.opcode) {
+        what = "opcode";
+        expected = in.opcode;
+        actual = top->debugOpcode;
+      } else if (checked == 0) {
+        // Registers as left by reset: not compared
+      } else if (top->debugA != in.a) {
+        what = "A";
+        expected = in.a;
+        actual = top->debugA;
+      } else if (top->debugX != in.x) {
+        what = "X";
+        expected = in.x;
+        actual = top->debugX;
+      } else if (top->debugY != in.y) {
+        what = "Y";
+        expected = in.y;
+        actual = top->debugY;
+      } else if (top->debugS != in.s) {
+        what = "S";
+        expected = in.s;
+        actual = top->debugS;
+      }
+      if (what != NULL && (top->debugPc != in.pc || top->debugOpcode != in.opcode)) {
+        // Not this instruction: the bus was on its PC for another reason
+        missed = what;
+        missed_expected = expected;
+        missed_actual = actual;
+        missed_cycle = cycle;
+      } else if (what != NULL) {
+        report(what, cycle, expected, actual);
+        return 1;
+      } else {
+        history[checked % HISTORY] = in;
+        checked++;
+        fetched = false;
+        if (++next == sw.count) {
+          if (sw.done) {
+            double s = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("Success! Instructions: %llu, cycles: %llu, %.0f cycles/s\n",
+              (unsigned long long)checked, (unsigned long long)cycle, cycle / s);
+            top->final();
+            delete top;
+            return 0;
+          }
+          run_batch(&sw);
+          next = 1;
+        }
+      }
+    }
+    if (missed != NULL) {
+      // Not started on its cycle: started a few cycles before or after,
+      // the previous instruction took a different number of cycles
+      if (search + SLIP < expected_fetch) {
+        search = expected_fetch - SLIP;
+      }
+      if (search <= previous) {
+        search = previous + 1;
+      }
+      for (; search < cycle; search++) {
+        if (starts(in, search)) {
+          report("cycle count", search, expected_fetch - previous, search - previous);
+          return 1;
+        }
+      }
+      if (cycle == expected_fetch + SLIP) {
+        report(missed, missed_cycle, missed_expected, missed_actual);
+        return 1;
+      }
+    }
+
+    if (Verilated::gotFinish()) {
+      break;
+    }
+  }
+  printf("\nNo end of the test after %llu cycles\n", (unsigned long long)cycle);
+  top->final();
+  delete top;
+  return 1;
+}
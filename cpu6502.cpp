@@ -1,215 +1,515 @@
 #include <cstdint>
 #include <cstdio>
 #include "cpu6502.h"
+#ifdef CPU6502_PROFILE
+#include "profile.h"
+#endif
 
 CPU6502::CPU6502(void) {
-	irq = nmi = false;
+	nmi = false;
+	irq = 0;
+	events = 0;
+
+	context = NULL;
+	read = NULL;
+	write = NULL;
+	for (int i = 0; i < 256; i++) {
+		rd_page[i] = NULL;
+		wr_page[i] = NULL;
+	}
 
-	tmp = 0;
-	addr = 0;
+	blocks = NULL;
+	for (int i = 0; i < 256; i++) {
+		code_page[i] = NULL;
+		for (int j = 0; j < 8; j++) {
+			code_map[i][j] = 0;
+		}
+	}
+
+	breakpoint = NO_BREAKPOINT;
+	jam = false;
+	tracer = NULL;
+	trace_next = NULL;
+	trace_end = NULL;
+	trace_cycle = 0;
+	profiler = NULL;
+	access = Trace::ACCESS_NONE;
+	access_address = 0;
+	access_data = 0;
 	opcode = 0;
 	cycles = 0;
 }
 
+CPU6502::~CPU6502(void) {
+	delete[] blocks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory map
+////////////////////////////////////////////////////////////////////////////////
+
+void CPU6502::map(uint8_t page, uint16_t count, uint8_t *mem, uint32_t size, bool writable) {
+	for (uint16_t i = 0; i < count; i++) {
+		if (code_page[(page + i) & 0xFF] != NULL) {
+			invalidate(code_page[(page + i) & 0xFF]);
+		}
+	}
+	if (blocks != NULL) {
+		// The running block may have been switched out
+		events |= EVENT_CODE;
+	}
+	for (uint16_t i = 0; i < count; i++) {
+		uint8_t *p = mem + ((i << 8) % size);
+		rd_page[(page + i) & 0xFF] = p;
+		wr_page[(page + i) & 0xFF] = (writable ? p : NULL);
+#ifdef CPU6502_PROFILE
+		if (profiler != NULL) {
+			profiler->map((page + i) & 0xFF, p);
+		}
+#endif
+	}
+}
+
+void CPU6502::unmap(uint8_t page, uint16_t count) {
+	for (uint16_t i = 0; i < count; i++) {
+		if (code_page[(page + i) & 0xFF] != NULL) {
+			invalidate(code_page[(page + i) & 0xFF]);
+		}
+	}
+	if (blocks != NULL) {
+		events |= EVENT_CODE;
+	}
+	for (uint16_t i = 0; i < count; i++) {
+		rd_page[(page + i) & 0xFF] = NULL;
+		wr_page[(page + i) & 0xFF] = NULL;
+#ifdef CPU6502_PROFILE
+		if (profiler != NULL) {
+			profiler->map((page + i) & 0xFF, NULL);
+		}
+#endif
+	}
+}
+
+const uint8_t *CPU6502::memory(uint8_t page) {
+	return rd_page[page];
+}
+
+// Mapped pages are accessed inline, the rest is kept out of line so that rd()
+// and wr() stay small enough to be inlined into every handler
+inline uint8_t CPU6502::rd(uint16_t address) {
+	uint8_t *p = rd_page[address >> 8];
+	if (p != NULL) {
+		return p[address & 0xFF];
+	}
+	return rd_io(address);
+}
+
+uint8_t CPU6502::rd_io(uint16_t address) {
+	uint8_t data = read(context, address);
+	if (tracer != NULL) {
+		access = Trace::ACCESS_READ;
+		access_address = address;
+		access_data = data;
+	}
+	return data;
+}
+
+inline void CPU6502::wr(uint16_t address, uint8_t data) {
+	uint8_t *p = wr_page[address >> 8];
+	if (p != NULL) {
+		p[address & 0xFF] = data;
+	} else {
+		wr_io(address, data);
+	}
+}
+
+void CPU6502::wr_io(uint16_t address, uint8_t data) {
+	if (code_page[address >> 8] != NULL) {
+		code_write(address, data);
+	} else {
+		write(context, address, data);
+		if (tracer != NULL) {
+			access = Trace::ACCESS_WRITE;
+			access_address = address;
+			access_data = data;
+		}
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Subroutines - addressing modes & flags
 ////////////////////////////////////////////////////////////////////////////////
 
-void CPU6502::izx(void) {
-	uint16_t a = (read(PC++) + X) & 0xFF;
-	addr = (read(a + 1) << 8) | read(a);
+uint16_t CPU6502::izx(void) {
+	uint16_t a = (rd(PC++) + X) & 0xFF;
 	cycles += 6;
+	return (rd((a + 1) & 0xFF) << 8) | rd(a);
 }
 
-void CPU6502::izy(void) {
-	uint16_t a = read(PC++);
-	uint16_t paddr = (read((a + 1) & 0xFF) << 8) | read(a);
-	addr = (paddr + Y);
+uint16_t CPU6502::izy(void) {
+	uint16_t a = rd(PC++);
+	uint16_t paddr = (rd((a + 1) & 0xFF) << 8) | rd(a);
+	uint16_t addr = (paddr + Y);
 	if ( (paddr & 0x100) != (addr & 0x100) ) {
 		cycles += 6;
 	} else {
 		cycles += 5;
 	}
+	return addr;
 }
 
-void CPU6502::ind(void) {
-	uint16_t a = read(PC);
-	a |= read( (PC & 0xFF00) | ((PC + 1) & 0xFF) ) << 8;
-	addr = read(a);
-	addr |= (read(a + 1) << 8);
+uint16_t CPU6502::ind(void) {
+	uint16_t a = rd(PC++);
+	a |= (rd(PC++) << 8);
+	// The pointer high byte is fetched without carry into the page number
+	uint16_t addr = rd(a);
+	addr |= (rd( (a & 0xFF00) | ((a + 1) & 0xFF) ) << 8);
 	cycles += 5;
+	return addr;
 }
 
-void CPU6502::zp(void) {
-	addr = read(PC++);
+uint16_t CPU6502::zp(void) {
 	cycles += 3;
+	return rd(PC++);
 }
 
-void CPU6502::zpx(void) {
-	addr = (read(PC++) + X) & 0xFF;
+uint16_t CPU6502::zpx(void) {
 	cycles += 4;
+	return (rd(PC++) + X) & 0xFF;
 }
 
-void CPU6502::zpy(void) {
-	addr = (read(PC++) + Y) & 0xFF;
+uint16_t CPU6502::zpy(void) {
 	cycles += 4;
+	return (rd(PC++) + Y) & 0xFF;
 }
 
-void CPU6502::imp(void) {
+uint16_t CPU6502::imp(void) {
 	cycles += 2;
+	return 0;
 }
 
-void CPU6502::imm(void) {
-	addr = PC++;
+uint16_t CPU6502::imm(void) {
 	cycles += 2;
+	return PC++;
 }
 
-void CPU6502::abs(void) {
-	addr = read(PC++);
-	addr |= (read(PC++) << 8);
+uint16_t CPU6502::abs(void) {
+	uint16_t addr = rd(PC++);
+	addr |= (rd(PC++) << 8);
 	cycles += 4;
+	return addr;
 }
 
-void CPU6502::abx(void) {
-	uint16_t paddr = read(PC++);
-	paddr |= (read(PC++) << 8);
-	addr = (paddr + X);
+uint16_t CPU6502::abx(void) {
+	uint16_t paddr = rd(PC++);
+	paddr |= (rd(PC++) << 8);
+	uint16_t addr = (paddr + X);
 	if ( (paddr & 0x100) != (addr & 0x100) ) {
 		cycles += 5;
 	} else {
 		cycles += 4;
 	}
+	return addr;
 }
 
-void CPU6502::aby(void) {
-	uint16_t paddr = read(PC++);
-	paddr |= (read(PC++) << 8);
-	addr = (paddr + Y);
+uint16_t CPU6502::aby(void) {
+	uint16_t paddr = rd(PC++);
+	paddr |= (rd(PC++) << 8);
+	uint16_t addr = (paddr + Y);
 	if ( (paddr & 0x100) != (addr & 0x100) ) {
 		cycles += 5;
 	} else {
 		cycles += 4;
 	}
+	return addr;
 }
 
-void CPU6502::rel(void) {
-	addr = read(PC++);
+uint16_t CPU6502::rel(void) {
+	uint16_t addr = rd(PC++);
 	if (addr & 0x80) {
 		addr -= 0x100;
 	}
 	addr += PC;
 	cycles += 2;
+	return addr;
 }
 
-////////////////////////////////////////////////////////////////////////////////
+// The same modes in blocks, for operands decoded by the translator into arg:
+// same cycles, PC moved past the operand without reading it
+uint16_t CPU6502::izx_pre(void) {
+	PC++;
+	uint16_t a = (arg + X) & 0xFF;
+	cycles += 6;
+	return (rd((a + 1) & 0xFF) << 8) | rd(a);
+}
+
+uint16_t CPU6502::izy_pre(void) {
+	PC++;
+	uint16_t paddr = (rd((arg + 1) & 0xFF) << 8) | rd(arg);
+	uint16_t addr = (paddr + Y);
+	if ( (paddr & 0x100) != (addr & 0x100) ) {
+		cycles += 6;
+	} else {
+		cycles += 5;
+	}
+	return addr;
+}
+
+uint16_t CPU6502::ind_pre(void) {
+	PC += 2;
+	uint16_t addr = rd(arg);
+	addr |= (rd( (arg & 0xFF00) | ((arg + 1) & 0xFF) ) << 8);
+	cycles += 5;
+	return addr;
+}
+
+uint16_t CPU6502::zp_pre(void) {
+	PC++;
+	cycles += 3;
+	return arg;
+}
+
+uint16_t CPU6502::zpx_pre(void) {
+	PC++;
+	cycles += 4;
+	return (arg + X) & 0xFF;
+}
+
+uint16_t CPU6502::zpy_pre(void) {
+	PC++;
+	cycles += 4;
+	return (arg + Y) & 0xFF;
+}
 
-void CPU6502::rmw(void) {
-	write(addr, tmp & 0xFF);
+uint16_t CPU6502::abs_pre(void) {
+	PC += 2;
+	cycles += 4;
+	return arg;
+}
+
+uint16_t CPU6502::abx_pre(void) {
+	PC += 2;
+	uint16_t addr = (arg + X);
+	if ( (arg & 0x100) != (addr & 0x100) ) {
+		cycles += 5;
+	} else {
+		cycles += 4;
+	}
+	return addr;
+}
+
+uint16_t CPU6502::aby_pre(void) {
+	PC += 2;
+	uint16_t addr = (arg + Y);
+	if ( (arg & 0x100) != (addr & 0x100) ) {
+		cycles += 5;
+	} else {
+		cycles += 4;
+	}
+	return addr;
+}
+
+// Branch target from the offset in arg and the PC the block runs at, which
+// may be a mirror of the one it was translated at
+uint16_t CPU6502::rel_pre(void) {
+	PC++;
 	cycles += 2;
+	return PC + (int8_t)arg;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// N and Z are only evaluated when needed, from the last result kept in nz
 void CPU6502::fnz(uint16_t v) {
-	Z = ((v & 0xFF) == 0);
-	N = ((v & 0x80) != 0);
+	nz = v & 0xFF;
 }
 
 // Borrow
 void CPU6502::fnzb(uint16_t v) {
-	Z = ((v & 0xFF) == 0);
-	N = ((v & 0x80) != 0);
-	C = ((v & 0x100) == 0);
+	nz = v & 0xFF;
+	carry = ((v >> 8) & 1) ^ 1;
 }
 
 // Carry
 void CPU6502::fnzc(uint16_t v) {
-	Z = ((v & 0xFF) == 0);
-	N = ((v & 0x80) != 0);
-	C = ((v & 0x100) != 0);
+	nz = v & 0xFF;
+	carry = (v >> 8) & 1;
+}
+
+// Set N and Z independently of each other
+void CPU6502::fnz(bool n, bool z) {
+	nz = (z ? 0 : 1) | (n ? 0x100 : 0);
+}
+
+bool CPU6502::flag_n(void) {
+	return (nz & 0x180) != 0;
+}
+
+bool CPU6502::flag_z(void) {
+	return (nz & 0xFF) == 0;
+}
+
+// Inline for record(), which packs P for every instruction traced
+inline uint8_t CPU6502::pack_p(void) {
+	uint8_t p = (flag_n() ? 1 << 7 : 0);
+	p |= (overflow & 0x80 ? 1 << 6 : 0);
+	p |= 1 << 5;
+	p |= (D ? 1 << 3 : 0);
+	p |= (I ? 1 << 2 : 0);
+	p |= (flag_z() ? 1 << 1 : 0);
+	p |= carry;
+	return p;
+}
+
+uint8_t CPU6502::get_p(void) {
+	return pack_p();
+}
+
+void CPU6502::set_p(uint8_t p) {
+	fnz((p & 0x80) != 0, (p & 0x02) != 0);
+	overflow = (p & 0x40) << 1;
+	D = ((p & 0x08) != 0);
+	I = ((p & 0x04) != 0);
+	carry = p & 0x01;
+	irq_event();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Subroutines - opcode templates
+////////////////////////////////////////////////////////////////////////////////
+
+// Read the operand and feed it to the operation
+template<CPU6502::Mode mode, CPU6502::ReadOp op>
+void CPU6502::op_r(CPU6502 &cpu) {
+	uint16_t a = (cpu.*mode)();
+	(cpu.*op)(cpu.rd(a));
+}
+
+// Hand the effective address to the operation
+template<CPU6502::Mode mode, CPU6502::WriteOp op>
+void CPU6502::op_w(CPU6502 &cpu) {
+	(cpu.*op)((cpu.*mode)());
+}
+
+// Read, modify and write back the operand. I/O registers also see the
+// dummy write of the unmodified value, on the cycle before.
+template<CPU6502::Mode mode, CPU6502::ModifyOp op>
+void CPU6502::op_m(CPU6502 &cpu) {
+	uint16_t a = (cpu.*mode)();
+	uint8_t v = cpu.rd(a);
+	if (cpu.wr_page[a >> 8] == NULL) {
+		cpu.wr_io(a, v);
+	}
+	v = (cpu.*op)(v);
+	cpu.wr(a, v);
+	cpu.cycles += 2;
+}
+
+// Read, modify and write back the operand, then feed the result to a
+// second operation (undocumented combined opcodes)
+template<CPU6502::Mode mode, CPU6502::ModifyOp op, CPU6502::ReadOp op2>
+void CPU6502::op_x(CPU6502 &cpu) {
+	uint16_t a = (cpu.*mode)();
+	uint8_t v = cpu.rd(a);
+	if (cpu.wr_page[a >> 8] == NULL) {
+		cpu.wr_io(a, v);
+	}
+	v = (cpu.*op)(v);
+	cpu.wr(a, v);
+	cpu.cycles += 2;
+	(cpu.*op2)(v);
+}
+
+// Modify the accumulator
+template<CPU6502::ModifyOp op>
+void CPU6502::op_a(CPU6502 &cpu) {
+	cpu.imp();
+	cpu.A = (cpu.*op)(cpu.A);
 }
 
-void CPU6502::branch(bool taken) {
-	if (taken) {
-		if ( (addr & 0x100) != (PC & 0x100) ) {
-			cycles += 2;
+template<CPU6502::ImpliedOp op>
+void CPU6502::op_i(CPU6502 &cpu) {
+	cpu.imp();
+	(cpu.*op)();
+}
+
+template<CPU6502::Mode mode, CPU6502::Condition cond>
+void CPU6502::op_b(CPU6502 &cpu) {
+	uint16_t addr = (cpu.*mode)();
+	if ((cpu.*cond)()) {
+		if ( (addr & 0x100) != (cpu.PC & 0x100) ) {
+			cpu.cycles += 2;
 		} else {
-			cycles += 1;
+			cpu.cycles += 1;
 		}
-		PC = addr;
+		cpu.PC = addr;
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Subroutines - instructions
 ////////////////////////////////////////////////////////////////////////////////
-void CPU6502::adc(void) {
-	uint16_t v = read(addr);
-	uint16_t c = (C ? 1 : 0);
-	uint16_t r = A + v + c;
+void CPU6502::adc(uint8_t m) {
+	uint16_t r = A + m + carry;
 	if (D) {
-		uint8_t al = (A & 0x0F) + (v & 0x0F) + c;
+		uint8_t al = (A & 0x0F) + (m & 0x0F) + carry;
 		if (al > 9) al += 6;
-		uint8_t ah = (A >> 4) + (v >> 4) + ((al > 15) ? 1 : 0);
-		Z = ((r & 0xFF) == 0);
-		N = ((ah & 8) != 0);
-		V = ((~(A ^ v) & (A ^ (ah << 4)) & 0x80) != 0);
+		uint8_t ah = (A >> 4) + (m >> 4) + ((al > 15) ? 1 : 0);
+		fnz((ah & 8) != 0, (r & 0xFF) == 0);
+		overflow = ~(A ^ m) & (A ^ (ah << 4));
 		if (ah > 9) ah += 6;
-		C = (ah > 15);
+		carry = (ah > 15);
 		A = ((ah << 4) | (al & 15)) & 0xFF;
 	} else {
-		Z = ((r & 0xFF) == 0);
-		N = ((r & 0x80) != 0);
-		V = ((~(A ^ v) & (A ^ r) & 0x80) != 0);
-		C = ((r & 0x100) != 0);
+		nz = r & 0xFF;
+		overflow = ~(A ^ m) & (A ^ r);
+		carry = r >> 8;
 		A = r & 0xFF;
 	}
 }
 
-void CPU6502::ahx(void) {
-	tmp = ((addr >> 8) + 1) & A & X;
-	write(addr, tmp & 0xFF);
+void CPU6502::ahx(uint16_t a) {
+	wr(a, ((a >> 8) + 1) & A & X);
 }
 
-
-void CPU6502::alr(void) {
-	tmp = read(addr) & A;
+void CPU6502::alr(uint8_t v) {
+	uint16_t tmp = v & A;
 	tmp = ((tmp & 1) << 8) | (tmp >> 1);
 	fnzc(tmp);
 	A = tmp & 0xFF;
 }
 
-void CPU6502::anc(void) {
-	tmp = read(addr);
+void CPU6502::anc(uint8_t v) {
+	uint16_t tmp = v;
 	tmp |= ((tmp & 0x80) & (A & 0x80)) << 1;
 	fnzc(tmp);
 	A = tmp & 0xFF;
 }
 
-void CPU6502::_and(void) {
-	A &= read(addr);
+void CPU6502::_and(uint8_t v) {
+	A &= v;
 	fnz(A);
 }
 
-void CPU6502::ane(void) {
-	tmp = read(addr) & A & (A | 0xEE);
+void CPU6502::ane(uint8_t v) {
+	uint16_t tmp = v & A & (A | 0xEE);
 	fnz(tmp);
 	A = tmp & 0xFF;
 }
 
-void CPU6502::arr(void) {
-	tmp = read(addr) & A;
-	C = ((tmp & 0x80) != 0);
-	V = ((((tmp >> 7) & 1) ^ ((tmp >> 6) & 1)) != 0);
+void CPU6502::arr(uint8_t v) {
+	uint16_t tmp = v & A;
+	carry = (tmp >> 7) & 1;
+	overflow = (tmp ^ (tmp << 1)) & 0x80;
 	if (D) {
 		uint8_t al = (tmp & 0x0F) + (tmp & 1);
 		if (al > 5) al += 6;
 		uint8_t ah = ((tmp >> 4) & 0x0F) + ((tmp >> 4) & 1);
 		if (ah > 5) {
 			al += 6;
-			C = true;
+			carry = 1;
 		} else {
-			C = false;
+			carry = 0;
 		}
 		tmp = (ah << 4) | al;
 	}
@@ -217,84 +517,54 @@ void CPU6502::arr(void) {
 	A = tmp & 0xFF;
 }
 
-void CPU6502::asl(void) {
-	tmp = read(addr) << 1;
-	fnzc(tmp);
-	tmp &= 0xFF;
-}
-void CPU6502::asla(void) {
-	tmp = A << 1;
+uint8_t CPU6502::asl(uint8_t v) {
+	uint16_t tmp = v << 1;
 	fnzc(tmp);
-	A = tmp & 0xFF;
+	return tmp & 0xFF;
 }
 
-void CPU6502::bit(void) {
-	tmp = read(addr);
-	N = ((tmp & 0x80) != 0);
-	V = ((tmp & 0x40) != 0);
-	Z = ((tmp & A) == 0);
+void CPU6502::bit(uint8_t m) {
+	nz = (m & A) | ((m & 0x80) << 1);
+	overflow = (m & 0x40) << 1;
 }
 
 void CPU6502::brk(void) {
 	PC++;
-	write(S + 0x100, PC >> 8);
-	S = (S - 1) & 0xFF;
-	write(S + 0x100, PC & 0xFF);
-	S = (S - 1) & 0xFF;
-	uint8_t v = (N ? 1 << 7 : 0);
-	v |= (V ? 1 << 6 : 0);
-	v |= 3 << 4;
-	v |= (D ? 1 << 3 : 0);
-	v |= (I ? 1 << 2 : 0);
-	v |= (Z ? 1 << 1 : 0);
-	v |= (C ? 1 : 0);
-	write(S + 0x100, v);
-	S = (S - 1) & 0xFF;
-	I = true;
-	D = false;
-	PC = (read(0xFFFF) << 8) | read(0xFFFE);
-	cycles += 5;
+	interrupt(0xFFFE, true);
+	cycles -= 2;
 }
 
-void CPU6502::bcc(void) { branch( !C ); }
-void CPU6502::bcs(void) { branch( C ); }
-void CPU6502::beq(void) { branch( Z ); }
-void CPU6502::bne(void) { branch( !Z ); }
-void CPU6502::bmi(void) { branch( N ); }
-void CPU6502::bpl(void) { branch( !N ); }
-void CPU6502::bvc(void) { branch( !V ); }
-void CPU6502::bvs(void) { branch( V ); }
+bool CPU6502::bcc(void) { return !carry; }
+bool CPU6502::bcs(void) { return carry; }
+bool CPU6502::beq(void) { return flag_z(); }
+bool CPU6502::bne(void) { return !flag_z(); }
+bool CPU6502::bmi(void) { return flag_n(); }
+bool CPU6502::bpl(void) { return !flag_n(); }
+bool CPU6502::bvc(void) { return !(overflow & 0x80); }
+bool CPU6502::bvs(void) { return (overflow & 0x80); }
 
 
-void CPU6502::clc(void) { C = false; }
+void CPU6502::clc(void) { carry = 0; }
 void CPU6502::cld(void) { D = false; }
-void CPU6502::cli(void) { I = false; }
-void CPU6502::clv(void) { V = false; }
+void CPU6502::cli(void) { I = false; irq_event(); }
+void CPU6502::clv(void) { overflow = 0; }
 
-void CPU6502::cmp(void) {
-	tmp = A - read(addr);
-	fnzb(tmp);
-}
-
-void CPU6502::cpx(void) {
-	tmp = X - read(addr);
-	fnzb(tmp);
+void CPU6502::cmp(uint8_t v) {
+	fnzb(A - v);
 }
 
-void CPU6502::cpy(void) {
-	tmp = Y - read(addr);
-	fnzb(tmp);
+void CPU6502::cpx(uint8_t v) {
+	fnzb(X - v);
 }
 
-void CPU6502::dcp(void) {
-	tmp = (read(addr) - 1) & 0xFF;
-	tmp = A - tmp;
-	fnzb(tmp);
+void CPU6502::cpy(uint8_t v) {
+	fnzb(Y - v);
 }
 
-void CPU6502::dec(void) {
-	tmp = (read(addr) - 1) & 0xFF;
+uint8_t CPU6502::dec(uint8_t v) {
+	uint16_t tmp = (v - 1) & 0xFF;
 	fnz(tmp);
+	return tmp;
 }
 
 void CPU6502::dex(void) {
@@ -307,14 +577,15 @@ void CPU6502::dey(void) {
 	fnz(Y);
 }
 
-void CPU6502::eor(void) {
-	A ^= read(addr);
+void CPU6502::eor(uint8_t v) {
+	A ^= v;
 	fnz(A);
 }
 
-void CPU6502::inc(void) {
-	tmp = (read(addr) + 1) & 0xFF;
+uint8_t CPU6502::inc(uint8_t v) {
+	uint16_t tmp = (v + 1) & 0xFF;
 	fnz(tmp);
+	return tmp;
 }
 
 void CPU6502::inx(void) {
@@ -327,261 +598,178 @@ void CPU6502::iny(void) {
 	fnz(Y);
 }
 
-void CPU6502::isc(void) {
-	uint16_t v = (read(addr) + 1) & 0xFF;
-	uint16_t c = 1 - (C ? 1 : 0);
-	uint16_t r = A - v - c;
-	if (D) {
-		uint8_t al = (A & 0x0F) - (v & 0x0F) - c;
-		if (al > 0x80) al -= 6;
-		uint8_t ah = (A >> 4) - (v >> 4) - ((al > 0x80) ? 1 : 0);
-		Z = ((r & 0xFF) == 0);
-		N = ((r & 0x80) != 0);
-		V = (((A ^ v) & (A ^ r) & 0x80) != 0);
-		C = ((r & 0x100) != 0) ? 0 : 1;
-		if (ah > 0x80) ah -= 6;
-		A = ((ah << 4) | (al & 15)) & 0xFF;
-	} else {
-		Z = ((r & 0xFF) == 0);
-		N = ((r & 0x80) != 0);
-		V = (((A ^ v) & (A ^ r) & 0x80) != 0);
-		C = ((r & 0x100) != 0) ? 0 : 1;
-		A = r & 0xFF;
-	}
-}
-
-
-void CPU6502::jmp(void) {
-	PC = addr;
+void CPU6502::jmp(uint16_t a) {
+	PC = a;
 	cycles--;
 }
 
-void CPU6502::jsr(void) {
-	write(S + 0x100, (PC - 1) >> 8);
+void CPU6502::jsr(uint16_t a) {
+	wr(S + 0x100, (PC - 1) >> 8);
 	S = (S - 1) & 0xFF;
-	write(S + 0x100, (PC - 1) & 0xFF);
+	wr(S + 0x100, (PC - 1) & 0xFF);
 	S = (S - 1) & 0xFF;
-	PC = addr;
+	PC = a;
 	cycles += 2;
 }
 
-void CPU6502::las(void) {
-	S = X = A = read(addr) & S;
+void CPU6502::las(uint8_t v) {
+	S = X = A = v & S;
 	fnz(A);
 }
 
 
-void CPU6502::lax(void) {
-	X = A = read(addr);
+void CPU6502::lax(uint8_t v) {
+	X = A = v;
 	fnz(A);
 }
 
 
-void CPU6502::lda(void) {
-	A = read(addr);
+void CPU6502::lda(uint8_t v) {
+	A = v;
 	fnz(A);
 }
 
-void CPU6502::ldx(void) {
-	X = read(addr);
+void CPU6502::ldx(uint8_t v) {
+	X = v;
 	fnz(X);
 }
 
-void CPU6502::ldy(void) {
-	Y = read(addr);
+void CPU6502::ldy(uint8_t v) {
+	Y = v;
 	fnz(Y);
 }
 
-void CPU6502::ora(void) {
-	A |= read(addr);
+void CPU6502::ora(uint8_t v) {
+	A |= v;
 	fnz(A);
 }
 
-void CPU6502::rol(void) {
-	tmp = (read(addr) << 1) | (C ? 1 : 0);
+uint8_t CPU6502::rol(uint8_t v) {
+	uint16_t tmp = (v << 1) | carry;
 	fnzc(tmp);
-	tmp &= 0xFF;
-}
-void CPU6502::rla(void) {
-	tmp = (A << 1) | (C ? 1 : 0);
-	fnzc(tmp);
-	A = tmp & 0xFF;
+	return tmp & 0xFF;
 }
 
-void CPU6502::ror(void) {
-	tmp = read(addr);
-	tmp = ((tmp & 1) << 8) | ((C ? 1 : 0) << 7) | (tmp >> 1);
+uint8_t CPU6502::ror(uint8_t v) {
+	uint16_t tmp = ((v & 1) << 8) | (carry << 7) | (v >> 1);
 	fnzc(tmp);
-	tmp &= 0xFF;
-}
-void CPU6502::rra(void) {
-	tmp = ((A & 1) << 8) | ((C ? 1 : 0) << 7) | (A >> 1);
-	fnzc(tmp);
-	A = tmp & 0xFF;
+	return tmp & 0xFF;
 }
 
 void CPU6502::kil(void) {
-
+	// The CPU stays stuck on the opcode until the next reset
+	PC--;
+	jam = true;
 }
 
-void CPU6502::lsr(void) {
-	tmp = read(addr);
-	tmp = ((tmp & 1) << 8) | (tmp >> 1);
-	fnzc(tmp);
-	tmp &= 0xFF;
-}
-void CPU6502::lsra(void) {
-	tmp = ((A & 1) << 8) | (A >> 1);
+uint8_t CPU6502::lsr(uint8_t v) {
+	uint16_t tmp = ((v & 1) << 8) | (v >> 1);
 	fnzc(tmp);
-	A = tmp & 0xFF;
+	return tmp & 0xFF;
 }
 
 
-void CPU6502::nop(void) { }
+void CPU6502::nop(uint16_t) { }
 
 void CPU6502::pha(void) {
-	write(S + 0x100, A);
+	wr(S + 0x100, A);
 	S = (S - 1) & 0xFF;
 	cycles++;
 }
 
 void CPU6502::php(void) {
-	uint8_t v = (N ? 1 << 7 : 0);
-	v |= (V ? 1 << 6 : 0);
-	v |= 3 << 4;
-	v |= (D ? 1 << 3 : 0);
-	v |= (I ? 1 << 2 : 0);
-	v |= (Z ? 1 << 1 : 0);
-	v |= (C ? 1 : 0);
-	write(S + 0x100, v);
+	wr(S + 0x100, get_p() | (1 << 4));
 	S = (S - 1) & 0xFF;
 	cycles++;
 }
 
 void CPU6502::pla(void) {
 	S = (S + 1) & 0xFF;
-	A = read(S + 0x100);
+	A = rd(S + 0x100);
 	fnz(A);
 	cycles += 2;
 }
 
 void CPU6502::plp(void) {
 	S = (S + 1) & 0xFF;
-	tmp = read(S + 0x100);
-	N = ((tmp & 0x80) != 0);
-	V = ((tmp & 0x40) != 0);
-	D = ((tmp & 0x08) != 0);
-	I = ((tmp & 0x04) != 0);
-	Z = ((tmp & 0x02) != 0);
-	C = ((tmp & 0x01) != 0);
+	set_p(rd(S + 0x100));
 	cycles += 2;
 }
 
 void CPU6502::rti(void) {
 	S = (S + 1) & 0xFF;
-	tmp = read(S + 0x100);
-	N = ((tmp & 0x80) != 0);
-	V = ((tmp & 0x40) != 0);
-	D = ((tmp & 0x08) != 0);
-	I = ((tmp & 0x04) != 0);
-	Z = ((tmp & 0x02) != 0);
-	C = ((tmp & 0x01) != 0);
+	set_p(rd(S + 0x100));
 	S = (S + 1) & 0xFF;
-	PC = read(S + 0x100);
+	PC = rd(S + 0x100);
 	S = (S + 1) & 0xFF;
-	PC |= read(S + 0x100) << 8;
+	PC |= rd(S + 0x100) << 8;
 	cycles += 4;
 }
 
 void CPU6502::rts(void) {
 	S = (S + 1) & 0xFF;
-	PC = read(S + 0x100);
+	PC = rd(S + 0x100);
 	S = (S + 1) & 0xFF;
-	PC |= read(S + 0x100) << 8;
+	PC |= rd(S + 0x100) << 8;
 	PC++;
 	cycles += 4;
 }
 
-void CPU6502::sax(void) {
-	write(addr, A & X);
+void CPU6502::sax(uint16_t a) {
+	wr(a, A & X);
 }
 
-void CPU6502::sbc(void) {
-	uint16_t v = read(addr);
-	uint16_t c = 1 - (C ? 1 : 0);
-	uint16_t r = A - v - c;
+void CPU6502::sbc(uint8_t m) {
+	uint16_t b = carry ^ 1;
+	uint16_t r = A - m - b;
+	nz = r & 0xFF;
+	overflow = (A ^ m) & (A ^ r);
+	carry = ((r >> 8) & 1) ^ 1;
 	if (D) {
-		uint8_t al = (A & 0x0F) - (v & 0x0F) - c;
+		uint8_t al = (A & 0x0F) - (m & 0x0F) - b;
 		if (al > 0x80) al -= 6;
-		uint8_t ah = (A >> 4) - (v >> 4) - ((al > 0x80) ? 1 : 0);
-		Z = ((r & 0xFF) == 0);
-		N = ((r & 0x80) != 0);
-		V = (((A ^ v) & (A ^ r) & 0x80) != 0);
-		C = ((r & 0x100) != 0) ? 0 : 1;
+		uint8_t ah = (A >> 4) - (m >> 4) - ((al > 0x80) ? 1 : 0);
 		if (ah > 0x80) ah -= 6;
 		A = ((ah << 4) | (al & 15)) & 0xFF;
 	} else {
-		Z = ((r & 0xFF) == 0);
-		N = ((r & 0x80) != 0);
-		V = (((A ^ v) & (A ^ r) & 0x80) != 0);
-		C = ((r & 0x100) != 0) ? 0 : 1;
 		A = r & 0xFF;
 	}
 }
 
-void CPU6502::sbx(void) {
-	tmp = read(addr) - (A & X);
+void CPU6502::sbx(uint8_t v) {
+	uint16_t tmp = v - (A & X);
 	fnzb(tmp);
 	X = (tmp & 0xFF);
 }
 
-void CPU6502::sec(void) { C = 1; }
+void CPU6502::sec(void) { carry = 1; }
 void CPU6502::sed(void) { D = 1; }
-void CPU6502::sei(void) { I = 1; }
+void CPU6502::sei(void) { I = 1; irq_event(); }
 
-void CPU6502::shs(void) {
-	tmp = ((addr >> 8) + 1) & A & X;
-	write(addr, tmp & 0xFF);
-	S = (tmp & 0xFF);
+void CPU6502::shs(uint16_t a) {
+	uint8_t v = ((a >> 8) + 1) & A & X;
+	wr(a, v);
+	S = v;
 }
 
-void CPU6502::shx(void) {
-	tmp = ((addr >> 8) + 1) & X;
-	write(addr, tmp & 0xFF);
+void CPU6502::shx(uint16_t a) {
+	wr(a, ((a >> 8) + 1) & X);
 }
 
-void CPU6502::shy(void) {
-	tmp = ((addr >> 8) + 1) & Y;
-	write(addr, tmp & 0xFF);
+void CPU6502::shy(uint16_t a) {
+	wr(a, ((a >> 8) + 1) & Y);
 }
 
-
-void CPU6502::slo(void) {
-	tmp = read(addr) << 1;
-	tmp |= A;
-	fnzc(tmp);
-	A = tmp & 0xFF;
-}
-
-void CPU6502::sre(void) {
-	uint8_t v = read(addr);
-	tmp = ((v & 1) << 8) | (v >> 1);
-	tmp ^= A;
-	fnzc(tmp);
-	A = tmp & 0xFF;
-}
-
-
-void CPU6502::sta(void) {
-	write(addr, A);
+void CPU6502::sta(uint16_t a) {
+	wr(a, A);
 }
 
-void CPU6502::stx(void) {
-	write(addr, X);
+void CPU6502::stx(uint16_t a) {
+	wr(a, X);
 }
 
-void CPU6502::sty(void) {
-	write(addr, Y);
+void CPU6502::sty(uint16_t a) {
+	wr(a, Y);
 }
 
 void CPU6502::tax(void) {
@@ -613,305 +801,1047 @@ void CPU6502::tya(void) {
 	fnz(A);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Opcode table
+////////////////////////////////////////////////////////////////////////////////
+
+// Each opcode gets a handler for step() and one for blocks. Where the
+// addressing mode has a *_pre variant, the operand of the block handler is
+// decoded by the translator, otherwise both handlers are the same.
+#define PRE_izx     izx_pre
+#define PRE_izy     izy_pre
+#define PRE_ind     ind_pre
+#define PRE_zp      zp_pre
+#define PRE_zpx     zpx_pre
+#define PRE_zpy     zpy_pre
+#define PRE_imp     imp
+#define PRE_imm     imm
+#define PRE_abs     abs_pre
+#define PRE_abx     abx_pre
+#define PRE_aby     aby_pre
+
+#define R(m, o)     { &CPU6502::op_r<&CPU6502::m, &CPU6502::o>, \
+                      &CPU6502::op_r<&CPU6502::PRE_##m, &CPU6502::o> }
+#define W(m, o)     { &CPU6502::op_w<&CPU6502::m, &CPU6502::o>, \
+                      &CPU6502::op_w<&CPU6502::PRE_##m, &CPU6502::o> }
+#define M(m, o)     { &CPU6502::op_m<&CPU6502::m, &CPU6502::o>, \
+                      &CPU6502::op_m<&CPU6502::PRE_##m, &CPU6502::o> }
+#define X(m, o, o2) { &CPU6502::op_x<&CPU6502::m, &CPU6502::o, &CPU6502::o2>, \
+                      &CPU6502::op_x<&CPU6502::m, &CPU6502::o, &CPU6502::o2> }
+#define A(o)        { &CPU6502::op_a<&CPU6502::o>, &CPU6502::op_a<&CPU6502::o> }
+#define I(o)        { &CPU6502::op_i<&CPU6502::o>, &CPU6502::op_i<&CPU6502::o> }
+#define B(c)        { &CPU6502::op_b<&CPU6502::rel, &CPU6502::c>, \
+                      &CPU6502::op_b<&CPU6502::rel_pre, &CPU6502::c> }
+
+const CPU6502::Handlers CPU6502::handlers[256] = {
+/*  BRK     */ I(brk),
+/*  ORA izx */ R(izx, ora),
+/* *KIL     */ I(kil),
+/* *SLO izx */ X(izx, asl, ora),
+/* *NOP zp  */ W(zp, nop),
+/*  ORA zp  */ R(zp, ora),
+/*  ASL zp  */ M(zp, asl),
+/* *SLO zp  */ X(zp, asl, ora),
+/*  PHP     */ I(php),
+/*  ORA imm */ R(imm, ora),
+/*  ASL     */ A(asl),
+/* *ANC imm */ R(imm, anc),
+/* *NOP abs */ W(abs, nop),
+/*  ORA abs */ R(abs, ora),
+/*  ASL abs */ M(abs, asl),
+/* *SLO abs */ X(abs, asl, ora),
+
+/*  BPL rel */ B(bpl),
+/*  ORA izy */ R(izy, ora),
+/* *KIL     */ I(kil),
+/* *SLO izy */ X(izy, asl, ora),
+/* *NOP zpx */ W(zpx, nop),
+/*  ORA zpx */ R(zpx, ora),
+/*  ASL zpx */ M(zpx, asl),
+/* *SLO zpx */ X(zpx, asl, ora),
+/*  CLC     */ I(clc),
+/*  ORA aby */ R(aby, ora),
+/* *NOP     */ W(imp, nop),
+/* *SLO aby */ X(aby, asl, ora),
+/* *NOP abx */ W(abx, nop),
+/*  ORA abx */ R(abx, ora),
+/*  ASL abx */ M(abx, asl),
+/* *SLO abx */ X(abx, asl, ora),
+
+/*  JSR abs */ W(abs, jsr),
+/*  AND izx */ R(izx, _and),
+/* *KIL     */ I(kil),
+/* *RLA izx */ X(izx, rol, _and),
+/*  BIT zp  */ R(zp, bit),
+/*  AND zp  */ R(zp, _and),
+/*  ROL zp  */ M(zp, rol),
+/* *RLA zp  */ X(zp, rol, _and),
+/*  PLP     */ I(plp),
+/*  AND imm */ R(imm, _and),
+/*  ROL     */ A(rol),
+/* *ANC imm */ R(imm, anc),
+/*  BIT abs */ R(abs, bit),
+/*  AND abs */ R(abs, _and),
+/*  ROL abs */ M(abs, rol),
+/* *RLA abs */ X(abs, rol, _and),
+
+/*  BMI rel */ B(bmi),
+/*  AND izy */ R(izy, _and),
+/* *KIL     */ I(kil),
+/* *RLA izy */ X(izy, rol, _and),
+/* *NOP zpx */ W(zpx, nop),
+/*  AND zpx */ R(zpx, _and),
+/*  ROL zpx */ M(zpx, rol),
+/* *RLA zpx */ X(zpx, rol, _and),
+/*  SEC     */ I(sec),
+/*  AND aby */ R(aby, _and),
+/* *NOP     */ W(imp, nop),
+/* *RLA aby */ X(aby, rol, _and),
+/* *NOP abx */ W(abx, nop),
+/*  AND abx */ R(abx, _and),
+/*  ROL abx */ M(abx, rol),
+/* *RLA abx */ X(abx, rol, _and),
+
+/*  RTI     */ I(rti),
+/*  EOR izx */ R(izx, eor),
+/* *KIL     */ I(kil),
+/* *SRE izx */ X(izx, lsr, eor),
+/* *NOP zp  */ W(zp, nop),
+/*  EOR zp  */ R(zp, eor),
+/*  LSR zp  */ M(zp, lsr),
+/* *SRE zp  */ X(zp, lsr, eor),
+/*  PHA     */ I(pha),
+/*  EOR imm */ R(imm, eor),
+/*  LSR     */ A(lsr),
+/* *ALR imm */ R(imm, alr),
+/*  JMP abs */ W(abs, jmp),
+/*  EOR abs */ R(abs, eor),
+/*  LSR abs */ M(abs, lsr),
+/* *SRE abs */ X(abs, lsr, eor),
+
+/*  BVC rel */ B(bvc),
+/*  EOR izy */ R(izy, eor),
+/* *KIL     */ I(kil),
+/* *SRE izy */ X(izy, lsr, eor),
+/* *NOP zpx */ W(zpx, nop),
+/*  EOR zpx */ R(zpx, eor),
+/*  LSR zpx */ M(zpx, lsr),
+/* *SRE zpx */ X(zpx, lsr, eor),
+/*  CLI     */ I(cli),
+/*  EOR aby */ R(aby, eor),
+/* *NOP     */ W(imp, nop),
+/* *SRE aby */ X(aby, lsr, eor),
+/* *NOP abx */ W(abx, nop),
+/*  EOR abx */ R(abx, eor),
+/*  LSR abx */ M(abx, lsr),
+/* *SRE abx */ X(abx, lsr, eor),
+
+/*  RTS     */ I(rts),
+/*  ADC izx */ R(izx, adc),
+/* *KIL     */ I(kil),
+/* *RRA izx */ X(izx, ror, adc),
+/* *NOP zp  */ W(zp, nop),
+/*  ADC zp  */ R(zp, adc),
+/*  ROR zp  */ M(zp, ror),
+/* *RRA zp  */ X(zp, ror, adc),
+/*  PLA     */ I(pla),
+/*  ADC imm */ R(imm, adc),
+/*  ROR     */ A(ror),
+/* *ARR imm */ R(imm, arr),
+/*  JMP ind */ W(ind, jmp),
+/*  ADC abs */ R(abs, adc),
+/*  ROR abs */ M(abs, ror),
+/* *RRA abs */ X(abs, ror, adc),
+
+/*  BVS rel */ B(bvs),
+/*  ADC izy */ R(izy, adc),
+/* *KIL     */ I(kil),
+/* *RRA izy */ X(izy, ror, adc),
+/* *NOP zpx */ W(zpx, nop),
+/*  ADC zpx */ R(zpx, adc),
+/*  ROR zpx */ M(zpx, ror),
+/* *RRA zpx */ X(zpx, ror, adc),
+/*  SEI     */ I(sei),
+/*  ADC aby */ R(aby, adc),
+/* *NOP     */ W(imp, nop),
+/* *RRA aby */ X(aby, ror, adc),
+/* *NOP abx */ W(abx, nop),
+/*  ADC abx */ R(abx, adc),
+/*  ROR abx */ M(abx, ror),
+/* *RRA abx */ X(abx, ror, adc),
+
+/* *NOP imm */ W(imm, nop),
+/*  STA izx */ W(izx, sta),
+/* *NOP imm */ W(imm, nop),
+/* *SAX izx */ W(izx, sax),
+/*  STY zp  */ W(zp, sty),
+/*  STA zp  */ W(zp, sta),
+/*  STX zp  */ W(zp, stx),
+/* *SAX zp  */ W(zp, sax),
+/*  DEY     */ I(dey),
+/* *NOP imm */ W(imm, nop),
+/*  TXA     */ I(txa),
+/* *ANE imm */ R(imm, ane),
+/*  STY abs */ W(abs, sty),
+/*  STA abs */ W(abs, sta),
+/*  STX abs */ W(abs, stx),
+/* *SAX abs */ W(abs, sax),
+
+/*  BCC rel */ B(bcc),
+/*  STA izy */ W(izy, sta),
+/* *KIL     */ I(kil),
+/* *AHX izy */ W(izy, ahx),
+/*  STY zpx */ W(zpx, sty),
+/*  STA zpx */ W(zpx, sta),
+/*  STX zpy */ W(zpy, stx),
+/* *SAX zpy */ W(zpy, sax),
+/*  TYA     */ I(tya),
+/*  STA aby */ W(aby, sta),
+/*  TXS     */ I(txs),
+/* *SHS aby */ W(aby, shs),
+/* *SHY abx */ W(abx, shy),
+/*  STA abx */ W(abx, sta),
+/* *SHX aby */ W(aby, shx),
+/* *AHX aby */ W(aby, ahx),
+
+/*  LDY imm */ R(imm, ldy),
+/*  LDA izx */ R(izx, lda),
+/*  LDX imm */ R(imm, ldx),
+/* *LAX izx */ R(izx, lax),
+/*  LDY zp  */ R(zp, ldy),
+/*  LDA zp  */ R(zp, lda),
+/*  LDX zp  */ R(zp, ldx),
+/* *LAX zp  */ R(zp, lax),
+/*  TAY     */ I(tay),
+/*  LDA imm */ R(imm, lda),
+/*  TAX     */ I(tax),
+/* *LAX imm */ R(imm, lax),
+/*  LDY abs */ R(abs, ldy),
+/*  LDA abs */ R(abs, lda),
+/*  LDX abs */ R(abs, ldx),
+/* *LAX abs */ R(abs, lax),
+
+/*  BCS rel */ B(bcs),
+/*  LDA izy */ R(izy, lda),
+/* *KIL     */ I(kil),
+/* *LAX izy */ R(izy, lax),
+/*  LDY zpx */ R(zpx, ldy),
+/*  LDA zpx */ R(zpx, lda),
+/*  LDX zpy */ R(zpy, ldx),
+/* *LAX zpy */ R(zpy, lax),
+/*  CLV     */ I(clv),
+/*  LDA aby */ R(aby, lda),
+/*  TSX     */ I(tsx),
+/* *LAS aby */ R(aby, las),
+/*  LDY abx */ R(abx, ldy),
+/*  LDA abx */ R(abx, lda),
+/*  LDX aby */ R(aby, ldx),
+/* *LAX aby */ R(aby, lax),
+
+/*  CPY imm */ R(imm, cpy),
+/*  CMP izx */ R(izx, cmp),
+/* *NOP imm */ W(imm, nop),
+/* *DCP izx */ X(izx, dec, cmp),
+/*  CPY zp  */ R(zp, cpy),
+/*  CMP zp  */ R(zp, cmp),
+/*  DEC zp  */ M(zp, dec),
+/* *DCP zp  */ X(zp, dec, cmp),
+/*  INY     */ I(iny),
+/*  CMP imm */ R(imm, cmp),
+/*  DEX     */ I(dex),
+/* *SBX imm */ R(imm, sbx),
+/*  CPY abs */ R(abs, cpy),
+/*  CMP abs */ R(abs, cmp),
+/*  DEC abs */ M(abs, dec),
+/* *DCP abs */ X(abs, dec, cmp),
+
+/*  BNE rel */ B(bne),
+/*  CMP izy */ R(izy, cmp),
+/* *KIL     */ I(kil),
+/* *DCP izy */ X(izy, dec, cmp),
+/* *NOP zpx */ W(zpx, nop),
+/*  CMP zpx */ R(zpx, cmp),
+/*  DEC zpx */ M(zpx, dec),
+/* *DCP zpx */ X(zpx, dec, cmp),
+/*  CLD     */ I(cld),
+/*  CMP aby */ R(aby, cmp),
+/* *NOP     */ W(imp, nop),
+/* *DCP aby */ X(aby, dec, cmp),
+/* *NOP abx */ W(abx, nop),
+/*  CMP abx */ R(abx, cmp),
+/*  DEC abx */ M(abx, dec),
+/* *DCP abx */ X(abx, dec, cmp),
+
+/*  CPX imm */ R(imm, cpx),
+/*  SBC izx */ R(izx, sbc),
+/* *NOP imm */ W(imm, nop),
+/* *ISC izx */ X(izx, inc, sbc),
+/*  CPX zp  */ R(zp, cpx),
+/*  SBC zp  */ R(zp, sbc),
+/*  INC zp  */ M(zp, inc),
+/* *ISC zp  */ X(zp, inc, sbc),
+/*  INX     */ I(inx),
+/*  SBC imm */ R(imm, sbc),
+/*  NOP     */ W(imp, nop),
+/* *SBC imm */ R(imm, sbc),
+/*  CPX abs */ R(abs, cpx),
+/*  SBC abs */ R(abs, sbc),
+/*  INC abs */ M(abs, inc),
+/* *ISC abs */ X(abs, inc, sbc),
+
+/*  BEQ rel */ B(beq),
+/*  SBC izy */ R(izy, sbc),
+/* *KIL     */ I(kil),
+/* *ISC izy */ X(izy, inc, sbc),
+/* *NOP zpx */ W(zpx, nop),
+/*  SBC zpx */ R(zpx, sbc),
+/*  INC zpx */ M(zpx, inc),
+/* *ISC zpx */ X(zpx, inc, sbc),
+/*  SED     */ I(sed),
+/*  SBC aby */ R(aby, sbc),
+/* *NOP     */ W(imp, nop),
+/* *ISC aby */ X(aby, inc, sbc),
+/* *NOP abx */ W(abx, nop),
+/*  SBC abx */ R(abx, sbc),
+/*  INC abx */ M(abx, inc),
+/* *ISC abx */ X(abx, inc, sbc)
+};
+
+#undef R
+#undef W
+#undef M
+#undef X
+#undef A
+#undef I
+#undef B
+
+const CPU6502::OpInfo CPU6502::opinfo[256] = {
+/*  BRK     */ { 1, 7, true },
+/*  ORA izx */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *SLO izx */ { 2, 8, false },
+/* *NOP zp  */ { 2, 3, false },
+/*  ORA zp  */ { 2, 3, false },
+/*  ASL zp  */ { 2, 5, false },
+/* *SLO zp  */ { 2, 5, false },
+/*  PHP     */ { 1, 3, false },
+/*  ORA imm */ { 2, 2, false },
+/*  ASL     */ { 1, 2, false },
+/* *ANC imm */ { 2, 2, false },
+/* *NOP abs */ { 3, 4, false },
+/*  ORA abs */ { 3, 4, false },
+/*  ASL abs */ { 3, 6, false },
+/* *SLO abs */ { 3, 6, false },
+
+/*  BPL rel */ { 2, 4, true },
+/*  ORA izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *SLO izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  ORA zpx */ { 2, 4, false },
+/*  ASL zpx */ { 2, 6, false },
+/* *SLO zpx */ { 2, 6, false },
+/*  CLC     */ { 1, 2, false },
+/*  ORA aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *SLO aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  ORA abx */ { 3, 5, false },
+/*  ASL abx */ { 3, 7, false },
+/* *SLO abx */ { 3, 7, false },
+
+/*  JSR abs */ { 3, 6, true },
+/*  AND izx */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *RLA izx */ { 2, 8, false },
+/*  BIT zp  */ { 2, 3, false },
+/*  AND zp  */ { 2, 3, false },
+/*  ROL zp  */ { 2, 5, false },
+/* *RLA zp  */ { 2, 5, false },
+/*  PLP     */ { 1, 4, false },
+/*  AND imm */ { 2, 2, false },
+/*  ROL     */ { 1, 2, false },
+/* *ANC imm */ { 2, 2, false },
+/*  BIT abs */ { 3, 4, false },
+/*  AND abs */ { 3, 4, false },
+/*  ROL abs */ { 3, 6, false },
+/* *RLA abs */ { 3, 6, false },
+
+/*  BMI rel */ { 2, 4, true },
+/*  AND izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *RLA izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  AND zpx */ { 2, 4, false },
+/*  ROL zpx */ { 2, 6, false },
+/* *RLA zpx */ { 2, 6, false },
+/*  SEC     */ { 1, 2, false },
+/*  AND aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *RLA aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  AND abx */ { 3, 5, false },
+/*  ROL abx */ { 3, 7, false },
+/* *RLA abx */ { 3, 7, false },
+
+/*  RTI     */ { 1, 6, true },
+/*  EOR izx */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *SRE izx */ { 2, 8, false },
+/* *NOP zp  */ { 2, 3, false },
+/*  EOR zp  */ { 2, 3, false },
+/*  LSR zp  */ { 2, 5, false },
+/* *SRE zp  */ { 2, 5, false },
+/*  PHA     */ { 1, 3, false },
+/*  EOR imm */ { 2, 2, false },
+/*  LSR     */ { 1, 2, false },
+/* *ALR imm */ { 2, 2, false },
+/*  JMP abs */ { 3, 3, true },
+/*  EOR abs */ { 3, 4, false },
+/*  LSR abs */ { 3, 6, false },
+/* *SRE abs */ { 3, 6, false },
+
+/*  BVC rel */ { 2, 4, true },
+/*  EOR izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *SRE izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  EOR zpx */ { 2, 4, false },
+/*  LSR zpx */ { 2, 6, false },
+/* *SRE zpx */ { 2, 6, false },
+/*  CLI     */ { 1, 2, false },
+/*  EOR aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *SRE aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  EOR abx */ { 3, 5, false },
+/*  LSR abx */ { 3, 7, false },
+/* *SRE abx */ { 3, 7, false },
+
+/*  RTS     */ { 1, 6, true },
+/*  ADC izx */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *RRA izx */ { 2, 8, false },
+/* *NOP zp  */ { 2, 3, false },
+/*  ADC zp  */ { 2, 3, false },
+/*  ROR zp  */ { 2, 5, false },
+/* *RRA zp  */ { 2, 5, false },
+/*  PLA     */ { 1, 4, false },
+/*  ADC imm */ { 2, 2, false },
+/*  ROR     */ { 1, 2, false },
+/* *ARR imm */ { 2, 2, false },
+/*  JMP ind */ { 3, 4, true },
+/*  ADC abs */ { 3, 4, false },
+/*  ROR abs */ { 3, 6, false },
+/* *RRA abs */ { 3, 6, false },
+
+/*  BVS rel */ { 2, 4, true },
+/*  ADC izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *RRA izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  ADC zpx */ { 2, 4, false },
+/*  ROR zpx */ { 2, 6, false },
+/* *RRA zpx */ { 2, 6, false },
+/*  SEI     */ { 1, 2, false },
+/*  ADC aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *RRA aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  ADC abx */ { 3, 5, false },
+/*  ROR abx */ { 3, 7, false },
+/* *RRA abx */ { 3, 7, false },
+
+/* *NOP imm */ { 2, 2, false },
+/*  STA izx */ { 2, 6, false },
+/* *NOP imm */ { 2, 2, false },
+/* *SAX izx */ { 2, 6, false },
+/*  STY zp  */ { 2, 3, false },
+/*  STA zp  */ { 2, 3, false },
+/*  STX zp  */ { 2, 3, false },
+/* *SAX zp  */ { 2, 3, false },
+/*  DEY     */ { 1, 2, false },
+/* *NOP imm */ { 2, 2, false },
+/*  TXA     */ { 1, 2, false },
+/* *ANE imm */ { 2, 2, false },
+/*  STY abs */ { 3, 4, false },
+/*  STA abs */ { 3, 4, false },
+/*  STX abs */ { 3, 4, false },
+/* *SAX abs */ { 3, 4, false },
+
+/*  BCC rel */ { 2, 4, true },
+/*  STA izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *AHX izy */ { 2, 6, false },
+/*  STY zpx */ { 2, 4, false },
+/*  STA zpx */ { 2, 4, false },
+/*  STX zpy */ { 2, 4, false },
+/* *SAX zpy */ { 2, 4, false },
+/*  TYA     */ { 1, 2, false },
+/*  STA aby */ { 3, 5, false },
+/*  TXS     */ { 1, 2, false },
+/* *SHS aby */ { 3, 5, false },
+/* *SHY abx */ { 3, 5, false },
+/*  STA abx */ { 3, 5, false },
+/* *SHX aby */ { 3, 5, false },
+/* *AHX aby */ { 3, 5, false },
+
+/*  LDY imm */ { 2, 2, false },
+/*  LDA izx */ { 2, 6, false },
+/*  LDX imm */ { 2, 2, false },
+/* *LAX izx */ { 2, 6, false },
+/*  LDY zp  */ { 2, 3, false },
+/*  LDA zp  */ { 2, 3, false },
+/*  LDX zp  */ { 2, 3, false },
+/* *LAX zp  */ { 2, 3, false },
+/*  TAY     */ { 1, 2, false },
+/*  LDA imm */ { 2, 2, false },
+/*  TAX     */ { 1, 2, false },
+/* *LAX imm */ { 2, 2, false },
+/*  LDY abs */ { 3, 4, false },
+/*  LDA abs */ { 3, 4, false },
+/*  LDX abs */ { 3, 4, false },
+/* *LAX abs */ { 3, 4, false },
+
+/*  BCS rel */ { 2, 4, true },
+/*  LDA izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *LAX izy */ { 2, 6, false },
+/*  LDY zpx */ { 2, 4, false },
+/*  LDA zpx */ { 2, 4, false },
+/*  LDX zpy */ { 2, 4, false },
+/* *LAX zpy */ { 2, 4, false },
+/*  CLV     */ { 1, 2, false },
+/*  LDA aby */ { 3, 5, false },
+/*  TSX     */ { 1, 2, false },
+/* *LAS aby */ { 3, 5, false },
+/*  LDY abx */ { 3, 5, false },
+/*  LDA abx */ { 3, 5, false },
+/*  LDX aby */ { 3, 5, false },
+/* *LAX aby */ { 3, 5, false },
+
+/*  CPY imm */ { 2, 2, false },
+/*  CMP izx */ { 2, 6, false },
+/* *NOP imm */ { 2, 2, false },
+/* *DCP izx */ { 2, 8, false },
+/*  CPY zp  */ { 2, 3, false },
+/*  CMP zp  */ { 2, 3, false },
+/*  DEC zp  */ { 2, 5, false },
+/* *DCP zp  */ { 2, 5, false },
+/*  INY     */ { 1, 2, false },
+/*  CMP imm */ { 2, 2, false },
+/*  DEX     */ { 1, 2, false },
+/* *SBX imm */ { 2, 2, false },
+/*  CPY abs */ { 3, 4, false },
+/*  CMP abs */ { 3, 4, false },
+/*  DEC abs */ { 3, 6, false },
+/* *DCP abs */ { 3, 6, false },
+
+/*  BNE rel */ { 2, 4, true },
+/*  CMP izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *DCP izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  CMP zpx */ { 2, 4, false },
+/*  DEC zpx */ { 2, 6, false },
+/* *DCP zpx */ { 2, 6, false },
+/*  CLD     */ { 1, 2, false },
+/*  CMP aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *DCP aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  CMP abx */ { 3, 5, false },
+/*  DEC abx */ { 3, 7, false },
+/* *DCP abx */ { 3, 7, false },
+
+/*  CPX imm */ { 2, 2, false },
+/*  SBC izx */ { 2, 6, false },
+/* *NOP imm */ { 2, 2, false },
+/* *ISC izx */ { 2, 8, false },
+/*  CPX zp  */ { 2, 3, false },
+/*  SBC zp  */ { 2, 3, false },
+/*  INC zp  */ { 2, 5, false },
+/* *ISC zp  */ { 2, 5, false },
+/*  INX     */ { 1, 2, false },
+/*  SBC imm */ { 2, 2, false },
+/*  NOP     */ { 1, 2, false },
+/* *SBC imm */ { 2, 2, false },
+/*  CPX abs */ { 3, 4, false },
+/*  SBC abs */ { 3, 4, false },
+/*  INC abs */ { 3, 6, false },
+/* *ISC abs */ { 3, 6, false },
+
+/*  BEQ rel */ { 2, 4, true },
+/*  SBC izy */ { 2, 6, false },
+/* *KIL     */ { 1, 2, true },
+/* *ISC izy */ { 2, 8, false },
+/* *NOP zpx */ { 2, 4, false },
+/*  SBC zpx */ { 2, 4, false },
+/*  INC zpx */ { 2, 6, false },
+/* *ISC zpx */ { 2, 6, false },
+/*  SED     */ { 1, 2, false },
+/*  SBC aby */ { 3, 5, false },
+/* *NOP     */ { 1, 2, false },
+/* *ISC aby */ { 3, 7, false },
+/* *NOP abx */ { 3, 5, false },
+/*  SBC abx */ { 3, 5, false },
+/*  INC abx */ { 3, 7, false },
+/* *ISC abx */ { 3, 7, false }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // CPU control
 ////////////////////////////////////////////////////////////////////////////////
 
-void CPU6502::reset(void) {
-	A = X = Y = S = 0;
-	N = C = V = false;
-	Z = true;
-	I = D = false;
+// Push PC and P, then jump through vector: 7 cycles
+void CPU6502::interrupt(uint16_t vector, bool b) {
+	wr(S + 0x100, PC >> 8);
+	S = (S - 1) & 0xFF;
+	wr(S + 0x100, PC & 0xFF);
+	S = (S - 1) & 0xFF;
+	wr(S + 0x100, get_p() | (b ? 1 << 4 : 0));
+	S = (S - 1) & 0xFF;
+	I = true;
+	D = false;
+	events &= ~EVENT_IRQ;
+	PC = (rd(vector + 1) << 8) | rd(vector);
+	cycles += 7;
+}
 
-	opcode = 0x4C;
-	PC = (read(0xFFFD) << 8) | read(0xFFFC);
+// Slow path, entered between instructions when events is not zero
+void CPU6502::service(void) {
+	events &= ~(EVENT_CODE | EVENT_STALL | EVENT_YIELD);
+	if (jam) {
+		return;
+	}
+	if (events & EVENT_NMI) {
+		events &= ~EVENT_NMI;
+		interrupt(0xFFFA, false);
+	} else if (events & EVENT_IRQ) {
+		interrupt(0xFFFE, false);
+	}
 }
 
-void CPU6502::step(void) {
+// EVENT_IRQ only while an IRQ can be taken, so that a masked IRQ held for a
+// long time does not send every instruction through service()
+void CPU6502::irq_event(void) {
+	if (irq != 0 && !I) {
+		events |= EVENT_IRQ;
+	} else {
+		events &= ~EVENT_IRQ;
+	}
+}
+
+void CPU6502::set_nmi(bool level) {
+	if (level && !nmi) {
+		events |= EVENT_NMI;
+	}
+	nmi = level;
+}
+
+void CPU6502::set_irq(uint32_t source, bool level) {
+	if (level) {
+		irq |= source;
+	} else {
+		irq &= ~source;
+	}
+	irq_event();
+}
+
+void CPU6502::stall(uint32_t n) {
+	cycles += n;
+	if (blocks != NULL) {
+		// The rest of the running block may not fit in the budget anymore
+		events |= EVENT_STALL;
+	}
+}
+
+void CPU6502::yield(void) {
+	events |= EVENT_YIELD;
+}
+
+void CPU6502::reset(void) {
+	A = X = Y = 0;
+	S = 0xFD;
+	set_p(0x06);
+	jam = false;
+	events &= ~EVENT_NMI;
+
+	PC = (rd(0xFFFD) << 8) | rd(0xFFFC);
+	opcode = rd(PC);
+	cycles += 7;
+}
+
+// The state before the next instruction, as printed by log(), into r, with
+// the cycles since last
+inline Trace::Record *CPU6502::record(Trace::Record *r, uint64_t last) {
+	r->pc = PC;
+	r->opcode = opcode;
+	r->a = A;
+	r->x = X;
+	r->y = Y;
+	r->s = S;
+	r->p = pack_p();
+	r->delta = cycles - last;
+	r->address = access_address;
+	r->data = access_data;
+	r->access = access;
+	access = Trace::ACCESS_NONE;
+	return r + 1;
+}
+
+// Hand the records filled to the trace thread, and reserve the next batch
+void CPU6502::trace_batch(void) {
+	tracer->commit(trace_next);
+	trace_next = tracer->reserve(trace_end);
+}
+
+inline bool CPU6502::profiling(void) {
+#ifdef CPU6502_PROFILE
+	return profiler != NULL;
+#else
+	return false;
+#endif
+}
+
+// One instruction, PC on its opcode
+inline void CPU6502::execute(void) {
+#ifdef CPU6502_PROFILE
+	if (profiler != NULL) {
+		profiled();
+		return;
+	}
+#endif
 	PC++;
-	switch(opcode) {
-/*  BRK     */ case 0x00: imp(); brk(); break;
-/*  ORA izx */ case 0x01: izx(); ora(); break;
-/* *KIL     */ case 0x02: imp(); kil(); break;
-/* *SLO izx */ case 0x03: izx(); slo(); rmw(); break;
-/* *NOP zp  */ case 0x04: zp(); nop(); break;
-/*  ORA zp  */ case 0x05: zp(); ora(); break;
-/*  ASL zp  */ case 0x06: zp(); asl(); rmw(); break;
-/* *SLO zp  */ case 0x07: zp(); slo(); rmw(); break;
-/*  PHP     */ case 0x08: imp(); php(); break;
-/*  ORA imm */ case 0x09: imm(); ora(); break;
-/*  ASL     */ case 0x0A: imp(); asla(); break;
-/* *ANC imm */ case 0x0B: imm(); anc(); break;
-/* *NOP abs */ case 0x0C: abs(); nop(); break;
-/*  ORA abs */ case 0x0D: abs(); ora(); break;
-/*  ASL abs */ case 0x0E: abs(); asl(); rmw(); break;
-/* *SLO abs */ case 0x0F: abs(); slo(); rmw(); break;
-
-/*  BPL rel */ case 0x10: rel(); bpl(); break;
-/*  ORA izy */ case 0x11: izy(); ora(); break;
-/* *KIL     */ case 0x12: imp(); kil(); break;
-/* *SLO izy */ case 0x13: izy(); slo(); rmw(); break;
-/* *NOP zpx */ case 0x14: zpx(); nop(); break;
-/*  ORA zpx */ case 0x15: zpx(); ora(); break;
-/*  ASL zpx */ case 0x16: zpx(); asl(); rmw(); break;
-/* *SLO zpx */ case 0x17: zpx(); slo(); rmw(); break;
-/*  CLC     */ case 0x18: imp(); clc(); break;
-/*  ORA aby */ case 0x19: aby(); ora(); break;
-/* *NOP     */ case 0x1A: imp(); nop(); break;
-/* *SLO aby */ case 0x1B: aby(); slo(); rmw(); break;
-/* *NOP abx */ case 0x1C: abx(); nop(); break;
-/*  ORA abx */ case 0x1D: abx(); ora(); break;
-/*  ASL abx */ case 0x1E: abx(); asl(); rmw(); break;
-/* *SLO abx */ case 0x1F: abx(); slo(); rmw(); break;
-
-/*  JSR abs */ case 0x20: abs(); jsr(); break;
-/*  AND izx */ case 0x21: izx(); _and(); break;
-/* *KIL     */ case 0x22: imp(); kil(); break;
-/* *RLA izx */ case 0x23: izx(); rla(); rmw(); break;
-/*  BIT zp  */ case 0x24: zp(); bit(); break;
-/*  AND zp  */ case 0x25: zp(); _and(); break;
-/*  ROL zp  */ case 0x26: zp(); rol(); rmw(); break;
-/* *RLA zp  */ case 0x27: zp(); rla(); rmw(); break;
-/*  PLP     */ case 0x28: imp(); plp(); break;
-/*  AND imm */ case 0x29: imm(); _and(); break;
-/*  ROL     */ case 0x2A: imp(); rla(); break;
-/* *ANC imm */ case 0x2B: imm(); anc(); break;
-/*  BIT abs */ case 0x2C: abs(); bit(); break;
-/*  AND abs */ case 0x2D: abs(); _and(); break;
-/*  ROL abs */ case 0x2E: abs(); rol(); rmw(); break;
-/* *RLA abs */ case 0x2F: abs(); rla(); rmw(); break;
-
-/*  BMI rel */ case 0x30: rel(); bmi(); break;
-/*  AND izy */ case 0x31: izy(); _and(); break;
-/* *KIL     */ case 0x32: imp(); kil(); break;
-/* *RLA izy */ case 0x33: izy(); rla(); rmw(); break;
-/* *NOP zpx */ case 0x34: zpx(); nop(); break;
-/*  AND zpx */ case 0x35: zpx(); _and(); break;
-/*  ROL zpx */ case 0x36: zpx(); rol(); rmw(); break;
-/* *RLA zpx */ case 0x37: zpx(); rla(); rmw(); break;
-/*  SEC     */ case 0x38: imp(); sec(); break;
-/*  AND aby */ case 0x39: aby(); _and(); break;
-/* *NOP     */ case 0x3A: imp(); nop(); break;
-/* *RLA aby */ case 0x3B: aby(); rla(); rmw(); break;
-/* *NOP abx */ case 0x3C: abx(); nop(); break;
-/*  AND abx */ case 0x3D: abx(); _and(); break;
-/*  ROL abx */ case 0x3E: abx(); rol(); rmw(); break;
-/* *RLA abx */ case 0x3F: abx(); rla(); rmw(); break;
-
-/*  RTI     */ case 0x40: imp(); rti(); break;
-/*  EOR izx */ case 0x41: izx(); eor(); break;
-/* *KIL     */ case 0x42: imp(); kil(); break;
-/* *SRE izx */ case 0x43: izx(); sre(); rmw(); break;
-/* *NOP zp  */ case 0x44: zp(); nop(); break;
-/*  EOR zp  */ case 0x45: zp(); eor(); break;
-/*  LSR zp  */ case 0x46: zp(); lsr(); rmw(); break;
-/* *SRE zp  */ case 0x47: zp(); sre(); rmw(); break;
-/*  PHA     */ case 0x48: imp(); pha(); break;
-/*  EOR imm */ case 0x49: imm(); eor(); break;
-/*  LSR     */ case 0x4A: imp(); lsra(); break;
-/* *ALR imm */ case 0x4B: imm(); alr(); break;
-/*  JMP abs */ case 0x4C: abs(); jmp(); break;
-/*  EOR abs */ case 0x4D: abs(); eor(); break;
-/*  LSR abs */ case 0x4E: abs(); lsr(); rmw(); break;
-/* *SRE abs */ case 0x4F: abs(); sre(); rmw(); break;
-
-/*  BVC rel */ case 0x50: rel(); bvc(); break;
-/*  EOR izy */ case 0x51: izy(); eor(); break;
-/* *KIL     */ case 0x52: imp(); kil(); break;
-/* *SRE izy */ case 0x53: izy(); sre(); rmw(); break;
-/* *NOP zpx */ case 0x54: zpx(); nop(); break;
-/*  EOR zpx */ case 0x55: zpx(); eor(); break;
-/*  LSR zpx */ case 0x56: zpx(); lsr(); rmw(); break;
-/* *SRE zpx */ case 0x57: zpx(); sre(); rmw(); break;
-/*  CLI     */ case 0x58: imp(); cli(); break;
-/*  EOR aby */ case 0x59: aby(); eor(); break;
-/* *NOP     */ case 0x5A: imp(); nop(); break;
-/* *SRE aby */ case 0x5B: aby(); sre(); rmw(); break;
-/* *NOP abx */ case 0x5C: abx(); nop(); break;
-/*  EOR abx */ case 0x5D: abx(); eor(); break;
-/*  LSR abx */ case 0x5E: abx(); lsr(); rmw(); break;
-/* *SRE abx */ case 0x5F: abx(); sre(); rmw(); break;
-
-/*  RTS     */ case 0x60: imp(); rts(); break;
-/*  ADC izx */ case 0x61: izx(); adc(); break;
-/* *KIL     */ case 0x62: imp(); kil(); break;
-/* *RRA izx */ case 0x63: izx(); rra(); rmw(); break;
-/* *NOP zp  */ case 0x64: zp(); nop(); break;
-/*  ADC zp  */ case 0x65: zp(); adc(); break;
-/*  ROR zp  */ case 0x66: zp(); ror(); rmw(); break;
-/* *RRA zp  */ case 0x67: zp(); rra(); rmw(); break;
-/*  PLA     */ case 0x68: imp(); pla(); break;
-/*  ADC imm */ case 0x69: imm(); adc(); break;
-/*  ROR     */ case 0x6A: imp(); rra(); break;
-/* *ARR imm */ case 0x6B: imm(); arr(); break;
-/*  JMP ind */ case 0x6C: ind(); jmp(); break;
-/*  ADC abs */ case 0x6D: abs(); adc(); break;
-/*  ROR abs */ case 0x6E: abs(); ror(); rmw(); break;
-/* *RRA abs */ case 0x6F: abs(); rra(); rmw(); break;
-
-/*  BVS rel */ case 0x70: rel(); bvs(); break;
-/*  ADC izy */ case 0x71: izy(); adc(); break;
-/* *KIL     */ case 0x72: imp(); kil(); break;
-/* *RRA izy */ case 0x73: izy(); rra(); rmw(); break;
-/* *NOP zpx */ case 0x74: zpx(); nop(); break;
-/*  ADC zpx */ case 0x75: zpx(); adc(); break;
-/*  ROR zpx */ case 0x76: zpx(); ror(); rmw(); break;
-/* *RRA zpx */ case 0x77: zpx(); rra(); rmw(); break;
-/*  SEI     */ case 0x78: imp(); sei(); break;
-/*  ADC aby */ case 0x79: aby(); adc(); break;
-/* *NOP     */ case 0x7A: imp(); nop(); break;
-/* *RRA aby */ case 0x7B: aby(); rra(); rmw(); break;
-/* *NOP abx */ case 0x7C: abx(); nop(); break;
-/*  ADC abx */ case 0x7D: abx(); adc(); break;
-/*  ROR abx */ case 0x7E: abx(); ror(); rmw(); break;
-/* *RRA abx */ case 0x7F: abx(); rra(); rmw(); break;
-
-/* *NOP imm */ case 0x80: imm(); nop(); break;
-/*  STA izx */ case 0x81: izx(); sta(); break;
-/* *NOP imm */ case 0x82: imm(); nop(); break;
-/* *SAX izx */ case 0x83: izx(); sax(); break;
-/*  STY zp  */ case 0x84: zp(); sty(); break;
-/*  STA zp  */ case 0x85: zp(); sta(); break;
-/*  STX zp  */ case 0x86: zp(); stx(); break;
-/* *SAX zp  */ case 0x87: zp(); sax(); break;
-/*  DEY     */ case 0x88: imp(); dey(); break;
-/* *NOP imm */ case 0x89: imm(); nop(); break;
-/*  TXA     */ case 0x8A: imp(); txa(); break;
-/* *ANE imm */ case 0x8B: imm(); ane(); break;
-/*  STY abs */ case 0x8C: abs(); sty(); break;
-/*  STA abs */ case 0x8D: abs(); sta(); break;
-/*  STX abs */ case 0x8E: abs(); stx(); break;
-/* *SAX abs */ case 0x8F: abs(); sax(); break;
-
-/*  BCC rel */ case 0x90: rel(); bcc(); break;
-/*  STA izy */ case 0x91: izy(); sta(); break;
-/* *KIL     */ case 0x92: imp(); kil(); break;
-/* *AHX izy */ case 0x93: izy(); ahx(); break;
-/*  STY zpx */ case 0x94: zpx(); sty(); break;
-/*  STA zpx */ case 0x95: zpx(); sta(); break;
-/*  STX zpy */ case 0x96: zpy(); stx(); break;
-/* *SAX zpy */ case 0x97: zpy(); sax(); break;
-/*  TYA     */ case 0x98: imp(); tya(); break;
-/*  STA aby */ case 0x99: aby(); sta(); break;
-/*  TXS     */ case 0x9A: imp(); txs(); break;
-/* *SHS aby */ case 0x9B: aby(); shs(); break;
-/* *SHY abx */ case 0x9C: abx(); shy(); break;
-/*  STA abx */ case 0x9D: abx(); sta(); break;
-/* *SHX aby */ case 0x9E: aby(); shx(); break;
-/* *AHX aby */ case 0x9F: aby(); ahx(); break;
-
-/*  LDY imm */ case 0xA0: imm(); ldy(); break;
-/*  LDA izx */ case 0xA1: izx(); lda(); break;
-/*  LDX imm */ case 0xA2: imm(); ldx(); break;
-/* *LAX izx */ case 0xA3: izx(); lax(); break;
-/*  LDY zp  */ case 0xA4: zp(); ldy(); break;
-/*  LDA zp  */ case 0xA5: zp(); lda(); break;
-/*  LDX zp  */ case 0xA6: zp(); ldx(); break;
-/* *LAX zp  */ case 0xA7: zp(); lax(); break;
-/*  TAY     */ case 0xA8: imp(); tay(); break;
-/*  LDA imm */ case 0xA9: imm(); lda(); break;
-/*  TAX     */ case 0xAA: imp(); tax(); break;
-/* *LAX imm */ case 0xAB: imm(); lax(); break;
-/*  LDY abs */ case 0xAC: abs(); ldy(); break;
-/*  LDA abs */ case 0xAD: abs(); lda(); break;
-/*  LDX abs */ case 0xAE: abs(); ldx(); break;
-/* *LAX abs */ case 0xAF: abs(); lax(); break;
-
-/*  BCS rel */ case 0xB0: rel(); bcs(); break;
-/*  LDA izy */ case 0xB1: izy(); lda(); break;
-/* *KIL     */ case 0xB2: imp(); kil(); break;
-/* *LAX izy */ case 0xB3: izy(); lax(); break;
-/*  LDY zpx */ case 0xB4: zpx(); ldy(); break;
-/*  LDA zpx */ case 0xB5: zpx(); lda(); break;
-/*  LDX zpy */ case 0xB6: zpy(); ldx(); break;
-/* *LAX zpy */ case 0xB7: zpy(); lax(); break;
-/*  CLV     */ case 0xB8: imp(); clv(); break;
-/*  LDA aby */ case 0xB9: aby(); lda(); break;
-/*  TSX     */ case 0xBA: imp(); tsx(); break;
-/* *LAS aby */ case 0xBB: aby(); las(); break;
-/*  LDY abx */ case 0xBC: abx(); ldy(); break;
-/*  LDA abx */ case 0xBD: abx(); lda(); break;
-/*  LDX aby */ case 0xBE: aby(); ldx(); break;
-/* *LAX aby */ case 0xBF: aby(); lax(); break;
-
-/*  CPY imm */ case 0xC0: imm(); cpy(); break;
-/*  CMP izx */ case 0xC1: izx(); cmp(); break;
-/* *NOP imm */ case 0xC2: imm(); nop(); break;
-/* *DCP izx */ case 0xC3: izx(); dcp(); rmw(); break;
-/*  CPY zp  */ case 0xC4: zp(); cpy(); break;
-/*  CMP zp  */ case 0xC5: zp(); cmp(); break;
-/*  DEC zp  */ case 0xC6: zp(); dec(); rmw(); break;
-/* *DCP zp  */ case 0xC7: zp(); dcp(); rmw(); break;
-/*  INY     */ case 0xC8: imp(); iny(); break;
-/*  CMP imm */ case 0xC9: imm(); cmp(); break;
-/*  DEX     */ case 0xCA: imp(); dex(); break;
-/* *SBX imm */ case 0xCB: imm(); sbx(); break;
-/*  CPY abs */ case 0xCC: abs(); cpy(); break;
-/*  CMP abs */ case 0xCD: abs(); cmp(); break;
-/*  DEC abs */ case 0xCE: abs(); dec(); rmw(); break;
-/* *DCP abs */ case 0xCF: abs(); dcp(); rmw(); break;
-
-/*  BNE rel */ case 0xD0: rel(); bne(); break;
-/*  CMP izy */ case 0xD1: izy(); cmp(); break;
-/* *KIL     */ case 0xD2: imp(); kil(); break;
-/* *DCP izy */ case 0xD3: izy(); dcp(); rmw(); break;
-/* *NOP zpx */ case 0xD4: zpx(); nop(); break;
-/*  CMP zpx */ case 0xD5: zpx(); cmp(); break;
-/*  DEC zpx */ case 0xD6: zpx(); dec(); rmw(); break;
-/* *DCP zpx */ case 0xD7: zpx(); dcp(); rmw(); break;
-/*  CLD     */ case 0xD8: imp(); cld(); break;
-/*  CMP aby */ case 0xD9: aby(); cmp(); break;
-/* *NOP     */ case 0xDA: imp(); nop(); break;
-/* *DCP aby */ case 0xDB: aby(); dcp(); rmw(); break;
-/* *NOP abx */ case 0xDC: abx(); nop(); break;
-/*  CMP abx */ case 0xDD: abx(); cmp(); break;
-/*  DEC abx */ case 0xDE: abx(); dec(); rmw(); break;
-/* *DCP abx */ case 0xDF: abx(); dcp(); rmw(); break;
-
-/*  CPX imm */ case 0xE0: imm(); cpx(); break;
-/*  SBC izx */ case 0xE1: izx(); sbc(); break;
-/* *NOP imm */ case 0xE2: imm(); nop(); break;
-/* *ISC izx */ case 0xE3: izx(); isc(); rmw(); break;
-/*  CPX zp  */ case 0xE4: zp(); cpx(); break;
-/*  SBC zp  */ case 0xE5: zp(); sbc(); break;
-/*  INC zp  */ case 0xE6: zp(); inc(); rmw(); break;
-/* *ISC zp  */ case 0xE7: zp(); isc(); rmw(); break;
-/*  INX     */ case 0xE8: imp(); inx(); break;
-/*  SBC imm */ case 0xE9: imm(); sbc(); break;
-/*  NOP     */ case 0xEA: imp(); nop(); break;
-/* *SBC imm */ case 0xEB: imm(); sbc(); break;
-/*  CPX abs */ case 0xEC: abs(); cpx(); break;
-/*  SBC abs */ case 0xED: abs(); sbc(); break;
-/*  INC abs */ case 0xEE: abs(); inc(); rmw(); break;
-/* *ISC abs */ case 0xEF: abs(); isc(); rmw(); break;
-
-/*  BEQ rel */ case 0xF0: rel(); beq(); break;
-/*  SBC izy */ case 0xF1: izy(); sbc(); break;
-/* *KIL     */ case 0xF2: imp(); kil(); break;
-/* *ISC izy */ case 0xF3: izy(); isc(); rmw(); break;
-/* *NOP zpx */ case 0xF4: zpx(); nop(); break;
-/*  SBC zpx */ case 0xF5: zpx(); sbc(); break;
-/*  INC zpx */ case 0xF6: zpx(); inc(); rmw(); break;
-/* *ISC zpx */ case 0xF7: zpx(); isc(); rmw(); break;
-/*  SED     */ case 0xF8: imp(); sed(); break;
-/*  SBC aby */ case 0xF9: aby(); sbc(); break;
-/* *NOP     */ case 0xFA: imp(); nop(); break;
-/* *ISC aby */ case 0xFB: aby(); isc(); rmw(); break;
-/* *NOP abx */ case 0xFC: abx(); nop(); break;
-/*  SBC abx */ case 0xFD: abx(); sbc(); break;
-/*  INC abx */ case 0xFE: abx(); inc(); rmw(); break;
-/* *ISC abx */ case 0xFF: abx(); isc(); rmw(); break;
-	}
-	opcode = read(PC);
+	handlers[opcode].step(*this);
+}
+
+void CPU6502::step(void) {
+	if (tracer != NULL) {
+		if (trace_next == trace_end) {
+			trace_batch();
+		}
+		trace_next = record(trace_next, trace_cycle);
+		trace_cycle = cycles;
+	}
+	execute();
+	if (events) {
+		service();
+	}
+	opcode = rd(PC);
+}
+
+// Run instructions until the cycle counter reaches until_cycle, or until one
+// of the other stop conditions fires after an instruction.
+CPU6502::Stop CPU6502::run(uint64_t until_cycle) {
+	if (tracer != NULL) {
+		return run_traced(until_cycle);
+	}
+	while (cycles < until_cycle) {
+		uint16_t pc = PC;
+		Block *b = NULL;
+		if (blocks != NULL && breakpoint == NO_BREAKPOINT && !profiling()) {
+			b = translate();
+		}
+		if (b != NULL && cycles + b->cycles <= until_cycle) {
+			// The budget cannot run out before the last instruction
+			uint16_t page = pc & 0xFF00;
+			for (int i = 0; i < b->count; i++) {
+				pc = PC;
+				PC++;
+				arg = b->args[i];
+				b->ops[i](*this);
+				if (events | (PC ^ (page + b->next[i]))) {
+					break;
+				}
+			}
+		} else {
+			execute();
+		}
+		uint32_t e = events;
+		if (e) {
+			service();
+		}
+		opcode = rd(PC);
+		if (PC == pc) {
+			return (jam ? STOP_KIL : STOP_LOOP);
+		}
+		if (PC == breakpoint) {
+			return STOP_BREAKPOINT;
+		}
+		if (e & EVENT_YIELD) {
+			return STOP_YIELD;
+		}
+	}
+	return STOP_BUDGET;
+}
+
+// run() with a record before each instruction, without the block cache. The
+// place in the ring and the cycle of the last record are kept in locals.
+CPU6502::Stop CPU6502::run_traced(uint64_t until_cycle) {
+	Trace::Record *r = trace_next;
+	Trace::Record *end = trace_end;
+	uint64_t last = trace_cycle;
+	Stop stop = STOP_BUDGET;
+	while (cycles < until_cycle) {
+		uint16_t pc = PC;
+		if (r == end) {
+			trace_next = r;
+			trace_batch();
+			r = trace_next;
+			end = trace_end;
+		}
+		r = record(r, last);
+		last = cycles;
+		execute();
+		uint32_t e = events;
+		if (e) {
+			service();
+		}
+		opcode = rd(PC);
+		if (PC == pc) {
+			stop = (jam ? STOP_KIL : STOP_LOOP);
+			break;
+		}
+		if (PC == breakpoint) {
+			stop = STOP_BREAKPOINT;
+			break;
+		}
+		if (e & EVENT_YIELD) {
+			stop = STOP_YIELD;
+			break;
+		}
+	}
+	trace_next = r;
+	trace_cycle = last;
+	return stop;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Block cache
+////////////////////////////////////////////////////////////////////////////////
+
+void CPU6502::set_block_cache(bool enable) {
+	if (enable && blocks == NULL) {
+		blocks = new Block[BLOCK_CACHE_SIZE];
+		for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+			blocks[i].key = NULL;
+		}
+	} else if (!enable && blocks != NULL) {
+		for (int i = 0; i < 256; i++) {
+			if (code_page[i] != NULL) {
+				invalidate(code_page[i]);
+			}
+		}
+		delete[] blocks;
+		blocks = NULL;
+	}
+}
+
+static inline unsigned block_hash(const uint8_t *key, unsigned size) {
+	uintptr_t k = (uintptr_t)key;
+	return (k ^ (k >> 12)) & (size - 1);
+}
+
+// Find or translate the block starting at PC, NULL if PC is not in memory
+// or the instruction at PC crosses the end of the page
+CPU6502::Block *CPU6502::translate(void) {
+	uint8_t *mem = rd_page[PC >> 8];
+	if (mem == NULL) {
+		return NULL;
+	}
+	uint16_t first = PC & 0xFF;
+	Block *b = &blocks[block_hash(mem + first, BLOCK_CACHE_SIZE)];
+	if (b->key == mem + first) {
+		return b;
+	}
+
+	// Blocks hold the operands they decoded: these, and all the opcodes, need
+	// to stay unchanged for the block to remain valid. Branches keep their
+	// offset, the target depends on the PC the block runs at.
+	uint32_t used[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	uint16_t off = first;
+	b->key = NULL;
+	b->count = 0;
+	b->cycles = 0;
+	while (b->count < BLOCK_OPS) {
+		const OpInfo &info = opinfo[mem[off]];
+		const Handlers &h = handlers[mem[off]];
+		if (off + info.length > 0x100) {
+			break;
+		}
+		int bytes = (h.block != h.step ? info.length : 1);
+		for (int i = 0; i < bytes; i++) {
+			used[(off + i) >> 5] |= (1u << ((off + i) & 31));
+		}
+		b->ops[b->count] = h.block;
+		b->args[b->count] = (info.length == 3 ? (mem[off + 2] << 8) | mem[off + 1]
+			: info.length == 2 ? mem[off + 1] : 0);
+		b->cycles += info.cycles;
+		off += info.length;
+		b->next[b->count++] = off;
+		if (info.jump && (mem[off - info.length] & 0x1F) != 0x10) {
+			// Not a conditional branch
+			break;
+		}
+	}
+	if (b->count == 0) {
+		return NULL;
+	}
+	b->key = mem + first;
+	if (wr_page[PC >> 8] != NULL || code_page[PC >> 8] != NULL) {
+		protect(PC >> 8, used);
+	}
+	return b;
+}
+
+// Route writes to a RAM page, and all its mirrors, through code_write(), which
+// drops the blocks of the page when one of the bytes in mask is modified
+void CPU6502::protect(uint8_t page, const uint32_t *mask) {
+	uint8_t *mem = rd_page[page];
+	for (int i = 0; i < 256; i++) {
+		if (rd_page[i] == mem && (wr_page[i] == mem || code_page[i] == mem)) {
+			wr_page[i] = NULL;
+			code_page[i] = mem;
+			for (int j = 0; j < 8; j++) {
+				code_map[i][j] |= mask[j];
+			}
+		}
+	}
+}
+
+// Drop the blocks translated from a page of memory and lift the write
+// protection on it
+void CPU6502::invalidate(const uint8_t *mem) {
+	for (uint16_t a = 0; a < 0x100; a++) {
+		Block *b = &blocks[block_hash(mem + a, BLOCK_CACHE_SIZE)];
+		if (b->key == mem + a) {
+			b->key = NULL;
+		}
+	}
+	for (int i = 0; i < 256; i++) {
+		if (code_page[i] == mem) {
+			wr_page[i] = code_page[i];
+			code_page[i] = NULL;
+			for (int j = 0; j < 8; j++) {
+				code_map[i][j] = 0;
+			}
+		}
+	}
+	events |= EVENT_CODE;
+}
+
+void CPU6502::code_write(uint16_t address, uint8_t data) {
+	uint8_t *mem = code_page[address >> 8];
+	uint8_t a = address & 0xFF;
+	mem[a] = data;
+	if (code_map[address >> 8][a >> 5] & (1u << (a & 31))) {
+		invalidate(mem);
+	}
+}
+
+void CPU6502::save(StateWriter &out) {
+	out.begin("CPU ", 1);
+	out.u16(PC);
+	out.u8(A);
+	out.u8(X);
+	out.u8(Y);
+	out.u8(S);
+	out.u8(get_p());
+	out.u8((nmi ? 1 << 0 : 0) | (jam ? 1 << 1 : 0)
+		| (events & EVENT_NMI ? 1 << 2 : 0) | (irq != 0 ? 1 << 3 : 0));
+	out.u32(irq);
+	out.u8(opcode);
+	out.u64(cycles);
+	out.end();
+}
+
+bool CPU6502::load(StateReader &in) {
+	if (in.find("CPU ") != 1) {
+		return false;
+	}
+	PC = in.u16();
+	A = in.u8();
+	X = in.u8();
+	Y = in.u8();
+	S = in.u8();
+	set_p(in.u8());
+	uint8_t flags = in.u8();
+	nmi = ((flags & (1 << 0)) != 0);
+	jam = ((flags & (1 << 1)) != 0);
+	events = (flags & (1 << 2) ? EVENT_NMI : 0);
+	irq = in.u32();
+	irq_event();
+	opcode = in.u8();
+	cycles = in.u64();
+	if (blocks != NULL) {
+		set_block_cache(false);
+		set_block_cache(true);
+	}
+	return in.ok();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Tracing
+////////////////////////////////////////////////////////////////////////////////
+
+void CPU6502::set_trace(Trace *trace) {
+	if (tracer != NULL) {
+		tracer->commit(trace_next);
+	}
+	tracer = trace;
+	trace_next = NULL;
+	trace_end = NULL;
+	if (trace != NULL) {
+		trace_next = trace->reserve(trace_end);
+	}
+	trace_cycle = (trace != NULL ? trace->start_cycle() : 0);
+	access = Trace::ACCESS_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Profiling
+////////////////////////////////////////////////////////////////////////////////
+
+void CPU6502::set_profile(Profile *profile) {
+	profiler = profile;
+#ifdef CPU6502_PROFILE
+	if (profiler != NULL) {
+		for (int i = 0; i < 256; i++) {
+			profiler->map(i, rd_page[i]);
+		}
+	}
+#endif
+}
+
+#ifdef CPU6502_PROFILE
+// execute() with the counters: the cycles of the instruction are those until
+// the next one, but for interrupts, serviced after
+void CPU6502::profiled(void) {
+	uint16_t pc = PC;
+	uint8_t op = opcode;
+	uint64_t start = cycles;
+	uint64_t t = Profile::now();
+	PC++;
+	handlers[op].step(*this);
+	t = Profile::now() - t;
+	uint64_t n = cycles - start;
+	Profile::Counter &c = profiler->pages[pc >> 8][pc & 0xFF];
+	c.count++;
+	c.cycles += n;
+	profiler->opcodes[op].count++;
+	profiler->opcodes[op].cycles += n;
+	profiler->ticks[op] += t;
+}
+#endif
+
 void CPU6502::log(FILE *stream) {
 	fprintf(stream, "nPC=%04X cyc=%012llu [%02X] %c%c%c%c%c%c A=%02X X=%02X Y=%02X S=%02X\n",
-		PC, cycles % 1000000000, opcode,
-		(C ? 'C' : '-'),
-		(N ? 'N' : '-'),
-		(Z ? 'Z' : '-'),
-		(V ? 'V' : '-'),
+		PC, (unsigned long long)(cycles % 1000000000), opcode,
+		(carry ? 'C' : '-'),
+		(flag_n() ? 'N' : '-'),
+		(flag_z() ? 'Z' : '-'),
+		(overflow & 0x80 ? 'V' : '-'),
 		(D ? 'D' : '-'),
 		(I ? 'I' : '-'),
 		A, X, Y, S);
@@ -3,126 +3,313 @@
 
 #include <cstdint>
 #include <cstdio>
+#include "state.h"
+#include "trace.h"
+
+class Profile;
 
 class CPU6502 {
 public:
     uint16_t PC;        // Program Counter
     uint8_t A, X, Y, S; // Registers
-    bool N, Z, C, V;    // ALU Flags
-    bool I, D;          // Other Flags
+    bool I, D;          // Other Flags, see get_p() for the ALU flags
+
+    bool nmi;           // NMI Request Logic Level
+    uint32_t irq;       // IRQ Request Logic Levels, one bit per source
 
-    bool irq, nmi;      // Interrupt Requests Logic Levels
+    // Pending events, tested once between instructions
+    static const uint32_t EVENT_NMI = 1 << 0;   // NMI edge detected
+    static const uint32_t EVENT_IRQ = 1 << 1;   // IRQ asserted and I clear
+    static const uint32_t EVENT_CODE = 1 << 2;  // Translated code changed
+    static const uint32_t EVENT_STALL = 1 << 3; // Cycles added by stall()
+    static const uint32_t EVENT_YIELD = 1 << 4; // yield() called
+    uint32_t events;
 
     uint8_t opcode;     // Current Opcode
     uint64_t cycles;    // Cycles Counter
 
+    uint32_t breakpoint; // Address where run() stops, NO_BREAKPOINT if none
+
+    // Reasons for run() to return
+    enum Stop {
+        STOP_BUDGET,        // Cycle budget used up
+        STOP_BREAKPOINT,    // PC reached the breakpoint address
+        STOP_KIL,           // KIL opcode jammed the CPU
+        STOP_LOOP,          // Instruction jumped to itself
+        STOP_YIELD          // A handler called yield()
+    };
+    static const uint32_t NO_BREAKPOINT = 0x10000;
+
     CPU6502(void);
+    ~CPU6502(void);
+
+    // Handlers for the pages that are not mapped to memory (I/O), called
+    // with context
+    void *context;
+    uint8_t (*read)(void *context, uint16_t address);
+    void (*write)(void *context, uint16_t address, uint8_t data);
+
+    // Memory map, by 256-byte pages: count pages starting at page are backed
+    // by mem, repeated every size bytes (a multiple of 256) for mirroring.
+    // Read-only pages still hand writes to the write handler. Accesses to
+    // mapped pages are inlined and do not call out: see bench_cpu6502.cpp.
+    void map(uint8_t page, uint16_t count, uint8_t *mem, uint32_t size, bool writable);
+    void unmap(uint8_t page, uint16_t count);
+
+    // Memory behind a page, NULL for I/O
+    const uint8_t *memory(uint8_t page);
+
+    // Halt for n cycles (DMA), charged to the cycle budget of run()
+    void stall(uint32_t n);
+
+    // Make run() return after the current instruction, for handlers whose
+    // side effects move a deadline of the caller
+    void yield(void);
 
-    uint8_t (*read)(uint16_t address);
-    void (*write)(uint16_t address, uint8_t data);
+    // Processor status, packed as pushed on the stack (B clear)
+    uint8_t get_p(void);
+    void set_p(uint8_t p);
+
+    void set_nmi(bool level);
+    void set_irq(uint32_t source, bool level);
 
     void reset(void);
     void step(void);
+    Stop run(uint64_t until_cycle);
     void log(FILE *stream);
+
+    // Save states (chunk "CPU "): registers, interrupt lines and cycles.
+    // Loading flushes the block cache, as memory is restored behind it.
+    void save(StateWriter &out);
+    bool load(StateReader &in);
+
+    // Block cache mode for run(): straight-line code is translated once into
+    // a list of handlers with their operands decoded, and executed without
+    // per-instruction dispatch.
+    void set_block_cache(bool enable);
+
+    // Record each instruction run from now on into trace (see trace.h),
+    // NULL to stop. The block cache is not used while tracing. Only accesses
+    // through the read / write handlers are recorded: those to mapped pages
+    // are inlined into the opcode handlers, and tracing them would slow down
+    // every memory access.
+    void set_trace(Trace *trace);
+
+    // Count each instruction run from now on into profile (see profile.h),
+    // NULL to stop. The block cache is not used while profiling. Counting is
+    // only compiled in with CPU6502_PROFILE defined: without it, profile is
+    // kept but left untouched.
+    void set_profile(Profile *profile);
 private:
-	  uint16_t addr;
-    uint16_t tmp;
-
-    void izx(void);
-    void izy(void);
-    void ind(void);
-    void zp(void);
-    void zpx(void);
-    void zpy(void);
-    void imp(void);
-    void imm(void);
-    void abs(void);
-    void abx(void);
-    void aby(void);
-    void rel(void);
-    void rmw(void);
+    CPU6502(const CPU6502 &);
+    CPU6502 &operator=(const CPU6502 &);
+
+    // Opcode dispatch: each entry of the handlers table is an instantiation
+    // of one of the op_* templates below for a given (addressing mode,
+    // operation) pair, so that both get inlined into a single function.
+    typedef void (*Handler)(CPU6502 &cpu);
+    typedef uint16_t (CPU6502::*Mode)(void);
+    typedef void (CPU6502::*ReadOp)(uint8_t v);
+    typedef void (CPU6502::*WriteOp)(uint16_t a);
+    typedef uint8_t (CPU6502::*ModifyOp)(uint8_t v);
+    typedef void (CPU6502::*ImpliedOp)(void);
+    typedef bool (CPU6502::*Condition)(void);
+
+    // Blocks use their own handlers, taking the operand decoded in arg
+    struct Handlers {
+        Handler step;
+        Handler block;      // Same as step for modes without a *_pre variant
+    };
+    static const Handlers handlers[256];
+
+    // ALU Flags, evaluated lazily
+    uint16_t nz;        // Last result: Z if low byte is 0, N if bit 7 or 8 set
+    uint8_t carry;      // 0 or 1
+    uint8_t overflow;   // V in bit 7
+
+    // Static properties of each opcode, for the block translator
+    struct OpInfo {
+        uint8_t length;     // Instruction bytes
+        uint8_t cycles;     // Cycles, worst case
+        bool jump;          // May change PC non-sequentially
+    };
+    static const OpInfo opinfo[256];
+
+    // A translated block, keyed by the host address of its first opcode so
+    // that the same PC in different banks gets different blocks, and the
+    // mirrors of a bank share them: branches keep their offset. Blocks
+    // never cross a 256-byte page, and go on past conditional branches:
+    // they are left as soon as PC is not the next op, taken branch or not.
+    static const int BLOCK_OPS = 32;
+    static const int BLOCK_CACHE_SIZE = 4096;
+    struct Block {
+        const uint8_t *key;
+        uint16_t cycles;    // Cycles, worst case
+        uint8_t count;
+        Handler ops[BLOCK_OPS];
+        uint16_t args[BLOCK_OPS];   // Operand of each op, decoded
+        uint16_t next[BLOCK_OPS];   // Page offset of the op after each one
+    };
+
+    Block *blocks;              // Block cache, NULL when disabled
+    uint8_t *code_page[256];    // Writable pages holding translated code
+    uint32_t code_map[256][8];  // Bytes of these pages used by blocks
+    uint16_t arg;               // Operand of the block op running
+
+    Block *translate(void);
+    void protect(uint8_t page, const uint32_t *mask);
+    void invalidate(const uint8_t *mem);
+    void code_write(uint16_t address, uint8_t data);
+
+    bool jam;           // Set by KIL
+
+    // Tracing, with the last access through the handlers since the last
+    // record. Records are filled in place in the ring of tracer, from
+    // trace_next up to trace_end, the end of the batch reserved.
+    Trace *tracer;
+    Trace::Record *trace_next;
+    Trace::Record *trace_end;
+    uint64_t trace_cycle;   // Of the last record
+    uint16_t access_address;
+    uint8_t access_data;
+    uint8_t access;
+    Trace::Record *record(Trace::Record *r, uint64_t last);
+    void trace_batch(void);
+    Stop run_traced(uint64_t until_cycle);
+
+    Profile *profiler;
+    void profiled(void);
+    bool profiling(void);
+    void execute(void);
+
+    uint8_t *rd_page[256];  // Backing memory per page, NULL for I/O
+    uint8_t *wr_page[256];
+
+    uint8_t rd(uint16_t address);
+    void wr(uint16_t address, uint8_t data);
+    uint8_t rd_io(uint16_t address);
+    void wr_io(uint16_t address, uint8_t data);
+
+    void interrupt(uint16_t vector, bool b);
+    void service(void);
+    void irq_event(void);
+
+    template<Mode mode, ReadOp op> static void op_r(CPU6502 &cpu);
+    template<Mode mode, WriteOp op> static void op_w(CPU6502 &cpu);
+    template<Mode mode, ModifyOp op> static void op_m(CPU6502 &cpu);
+    template<Mode mode, ModifyOp op, ReadOp op2> static void op_x(CPU6502 &cpu);
+    template<ModifyOp op> static void op_a(CPU6502 &cpu);
+    template<ImpliedOp op> static void op_i(CPU6502 &cpu);
+    template<Mode mode, Condition cond> static void op_b(CPU6502 &cpu);
+
+    uint16_t izx(void);
+    uint16_t izy(void);
+    uint16_t ind(void);
+    uint16_t zp(void);
+    uint16_t zpx(void);
+    uint16_t zpy(void);
+    uint16_t imp(void);
+    uint16_t imm(void);
+    uint16_t abs(void);
+    uint16_t abx(void);
+    uint16_t aby(void);
+    uint16_t rel(void);
+    uint16_t izx_pre(void);
+    uint16_t izy_pre(void);
+    uint16_t ind_pre(void);
+    uint16_t zp_pre(void);
+    uint16_t zpx_pre(void);
+    uint16_t zpy_pre(void);
+    uint16_t abs_pre(void);
+    uint16_t abx_pre(void);
+    uint16_t aby_pre(void);
+    uint16_t rel_pre(void);
     void fnz(uint16_t v);
     void fnzb(uint16_t v);
     void fnzc(uint16_t v);
-    void branch(bool taken);
-
-    void adc(void);
-    void ahx(void);
-    void anc(void);
-    void _and(void);
-    void ane(void);
-    void alr(void);
-    void arr(void);
-    void asl(void);
-    void asla(void);
-    void bit(void);
+    void fnz(bool n, bool z);
+    bool flag_n(void);
+    bool flag_z(void);
+    uint8_t pack_p(void);
+
+    // Read operations
+    void adc(uint8_t m);
+    void anc(uint8_t v);
+    void _and(uint8_t v);
+    void ane(uint8_t v);
+    void alr(uint8_t v);
+    void arr(uint8_t v);
+    void bit(uint8_t m);
+    void cmp(uint8_t v);
+    void cpx(uint8_t v);
+    void cpy(uint8_t v);
+    void eor(uint8_t v);
+    void las(uint8_t v);
+    void lax(uint8_t v);
+    void lda(uint8_t v);
+    void ldx(uint8_t v);
+    void ldy(uint8_t v);
+    void ora(uint8_t v);
+    void sbc(uint8_t m);
+    void sbx(uint8_t v);
+
+    // Write operations
+    void ahx(uint16_t a);
+    void jmp(uint16_t a);
+    void jsr(uint16_t a);
+    void nop(uint16_t a);
+    void sax(uint16_t a);
+    void shs(uint16_t a);
+    void shx(uint16_t a);
+    void shy(uint16_t a);
+    void sta(uint16_t a);
+    void stx(uint16_t a);
+    void sty(uint16_t a);
+
+    // Read-modify-write operations
+    uint8_t asl(uint8_t v);
+    uint8_t dec(uint8_t v);
+    uint8_t inc(uint8_t v);
+    uint8_t lsr(uint8_t v);
+    uint8_t rol(uint8_t v);
+    uint8_t ror(uint8_t v);
+
+    // Implied operations
     void brk(void);
-    void bcc(void);
-    void bcs(void);
-    void beq(void);
-    void bne(void);
-    void bmi(void);
-    void bpl(void);
-    void bvc(void);
-    void bvs(void);
     void clc(void);
     void cld(void);
     void cli(void);
     void clv(void);
-    void cmp(void);
-    void cpx(void);
-    void cpy(void);
-    void dcp(void);
-    void dec(void);
     void dex(void);
     void dey(void);
-    void eor(void);
-    void inc(void);
     void inx(void);
     void iny(void);
-    void isc(void);
-    void jmp(void);
-    void jsr(void);
     void kil(void);
-    void lda(void);
-    void ldx(void);
-    void ldy(void);
-    void ora(void);
-    void rol(void);
-    void rla(void);
-    void ror(void);
-    void rra(void);
-    void las(void);
-    void lax(void);
-    void lsr(void);
-    void lsra(void);
-    void nop(void);
     void pha(void);
     void php(void);
     void pla(void);
     void plp(void);
     void rti(void);
     void rts(void);
-    void sax(void);
-    void sbc(void);
-    void sbx(void);
     void sec(void);
     void sed(void);
     void sei(void);
-    void shs(void);
-    void shx(void);
-    void shy(void);
-    void slo(void);
-    void sre(void);
-    void sta(void);
-    void stx(void);
-    void sty(void);
     void tax(void);
     void tay(void);
     void tsx(void);
     void txa(void);
     void txs(void);
     void tya(void);
+
+    // Branch conditions
+    bool bcc(void);
+    bool bcs(void);
+    bool beq(void);
+    bool bne(void);
+    bool bmi(void);
+    bool bpl(void);
+    bool bvc(void);
+    bool bvs(void);
 };
 
 #endif // NES_CPU6502_INCLUDED
@@ -0,0 +1,542 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "mapper.h"
+
+Mapper::Mapper(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+    : cart(cart), cpu(cpu), ppu(ppu), ciram(ciram) {
+    counts_a12 = false;
+
+    // Mapped by 256-byte pages
+    prg_ram_size = cart.prg_ram_size;
+    if (prg_ram_size != 0 && prg_ram_size < 0x100) {
+        prg_ram_size = 0x100;
+    }
+    prg_ram = NULL;
+    if (prg_ram_size != 0) {
+        prg_ram = new uint8_t[prg_ram_size];
+        memset(prg_ram, 0, prg_ram_size);
+        if (cart.trainer != NULL && prg_ram_size >= 0x2000) {
+            memcpy(&prg_ram[0x1000], cart.trainer, 512);
+        }
+    }
+
+    chr_ram_size = 0;
+    chr_ram = NULL;
+    if (cart.chr_size == 0) {
+        chr_ram_size = (cart.chr_ram_size >= 0x2000 ? cart.chr_ram_size : 0x2000);
+        chr_ram = new uint8_t[chr_ram_size];
+        memset(chr_ram, 0, chr_ram_size);
+    }
+
+    nt_ram = NULL;
+    if (cart.mirroring == Cartridge::MIRROR_FOUR) {
+        nt_ram = new uint8_t[0x800];
+        memset(nt_ram, 0, 0x800);
+    }
+}
+
+Mapper::~Mapper(void) {
+    delete[] prg_ram;
+    delete[] chr_ram;
+    delete[] nt_ram;
+}
+
+// Power-up state: NROM, 32 KiB of PRG, 8 KiB of CHR, mirroring from the
+// header
+void Mapper::reset(void) {
+    prg_ram_enable(true, true);
+    prg(0x8000, 0x8000, 0);
+    chr(0x0000, 0x2000, 0);
+    switch (cart.mirroring) {
+    case Cartridge::MIRROR_HORIZONTAL:
+        mirror(MIRROR_HORIZONTAL);
+        break;
+    case Cartridge::MIRROR_VERTICAL:
+        mirror(MIRROR_VERTICAL);
+        break;
+    case Cartridge::MIRROR_FOUR:
+        mirror(MIRROR_FOUR);
+        break;
+    }
+}
+
+// Open bus, approximated
+uint8_t Mapper::read(uint16_t) {
+    return 0x00;
+}
+
+void Mapper::write(uint16_t, uint8_t) {
+}
+
+uint64_t Mapper::next_event(void) {
+    return PPU::NO_EVENT;
+}
+
+void Mapper::a12(void) {
+}
+
+void Mapper::save(StateWriter &out) {
+    out.begin("MAPR", 1);
+    out.u16(cart.mapper);
+    out.u32(cart.prg_size);
+    out.bytes(prg_ram, prg_ram_size);
+    out.bytes(chr_ram, chr_ram_size);
+    if (nt_ram != NULL) {
+        out.bytes(nt_ram, 0x800);
+    }
+    save_registers(out);
+    out.end();
+}
+
+bool Mapper::load(StateReader &in) {
+    if (in.find("MAPR") != 1 || in.u16() != cart.mapper || in.u32() != cart.prg_size) {
+        return false;
+    }
+    in.bytes(prg_ram, prg_ram_size);
+    in.bytes(chr_ram, chr_ram_size);
+    if (nt_ram != NULL) {
+        in.bytes(nt_ram, 0x800);
+    }
+    load_registers(in);
+    return in.ok();
+}
+
+void Mapper::save_registers(StateWriter &) {
+}
+
+// Fixed banks
+void Mapper::load_registers(StateReader &) {
+    Mapper::reset();
+}
+
+void Mapper::prg(uint16_t address, uint32_t size, int bank) {
+    uint8_t *rom = (uint8_t *)cart.prg;
+    if (cart.prg_size < size) {
+        // Smaller ROM, mirrored
+        cpu.map(address >> 8, size >> 8, rom, cart.prg_size, false);
+        return;
+    }
+    int count = cart.prg_size / size;
+    bank %= count;
+    if (bank < 0) {
+        bank += count;
+    }
+    cpu.map(address >> 8, size >> 8, rom + bank * size, size, false);
+}
+
+void Mapper::chr(uint16_t address, uint32_t size, int bank) {
+    uint8_t *mem = (chr_ram != NULL ? chr_ram : (uint8_t *)cart.chr);
+    uint32_t total = (chr_ram != NULL ? chr_ram_size : cart.chr_size);
+    if (total < size) {
+        ppu.map(address >> 10, size >> 10, mem, total, chr_ram != NULL);
+        return;
+    }
+    int count = total / size;
+    bank %= count;
+    if (bank < 0) {
+        bank += count;
+    }
+    ppu.map(address >> 10, size >> 10, mem + bank * size, size, chr_ram != NULL);
+}
+
+void Mapper::mirror(Mirroring mirroring) {
+    static const uint8_t layouts[5][4] = {
+        { 0, 0, 1, 1 },
+        { 0, 1, 0, 1 },
+        { 0, 0, 0, 0 },
+        { 1, 1, 1, 1 },
+        { 0, 1, 2, 3 }
+    };
+    if (mirroring == MIRROR_FOUR && nt_ram == NULL) {
+        mirroring = MIRROR_VERTICAL;
+    }
+    for (int i = 0; i < 4; i++) {
+        uint8_t page = layouts[mirroring][i];
+        uint8_t *mem = (page < 2 ? &ciram[page * 0x400] : &nt_ram[(page - 2) * 0x400]);
+        ppu.map(8 + i, 1, mem, 0x400, true);
+    }
+}
+
+void Mapper::prg_ram_enable(bool enable, bool writable) {
+    if (prg_ram == NULL) {
+        return;
+    }
+    if (enable) {
+        cpu.map(0x60, 0x20, prg_ram, prg_ram_size, writable);
+    } else {
+        cpu.unmap(0x60, 0x20);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mapper 0: NROM, fixed banks
+////////////////////////////////////////////////////////////////////////////////
+
+class NROM : public Mapper {
+public:
+    NROM(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+        : Mapper(cart, cpu, ppu, ciram) {
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Mapper 1: MMC1, registers loaded serially
+////////////////////////////////////////////////////////////////////////////////
+
+class MMC1 : public Mapper {
+public:
+    MMC1(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+        : Mapper(cart, cpu, ppu, ciram) {
+    }
+
+    void reset(void) {
+        Mapper::reset();
+        shift = 0x10;
+        control = 0x0C;
+        chr0 = 0;
+        chr1 = 0;
+        prg_bank = 0;
+        last_write = 0;
+        update();
+    }
+
+    void write(uint16_t address, uint8_t data) {
+        if (address < 0x8000) {
+            return;
+        }
+        // Of two writes on consecutive cycles, such as the dummy write and
+        // the write of a read-modify-write instruction, only the first counts
+        bool ignored = (last_write != 0 && cpu.cycles - last_write <= 1);
+        last_write = cpu.cycles;
+        if (ignored) {
+            return;
+        }
+        if (data & 0x80) {
+            shift = 0x10;
+            control |= 0x0C;
+            update();
+            return;
+        }
+        // The marker bit reaches bit 0 with the fifth write
+        bool done = ((shift & 1) != 0);
+        shift = (shift >> 1) | ((data & 1) << 4);
+        if (done) {
+            switch ((address >> 13) & 3) {
+            case 0:
+                control = shift;
+                break;
+            case 1:
+                chr0 = shift;
+                break;
+            case 2:
+                chr1 = shift;
+                break;
+            case 3:
+                prg_bank = shift;
+                break;
+            }
+            shift = 0x10;
+            update();
+        }
+    }
+
+protected:
+    void save_registers(StateWriter &out) {
+        out.u8(shift);
+        out.u8(control);
+        out.u8(chr0);
+        out.u8(chr1);
+        out.u8(prg_bank);
+    }
+
+    void load_registers(StateReader &in) {
+        shift = in.u8();
+        control = in.u8();
+        chr0 = in.u8();
+        chr1 = in.u8();
+        prg_bank = in.u8();
+        last_write = 0;
+        update();
+    }
+
+private:
+    uint8_t shift;
+    uint8_t control;
+    uint8_t chr0;
+    uint8_t chr1;
+    uint8_t prg_bank;
+    uint64_t last_write;    // CPU cycle of the last register write, 0 if none
+
+    void update(void) {
+        static const Mirroring mirroring[4] = {
+            MIRROR_SINGLE_A, MIRROR_SINGLE_B, MIRROR_VERTICAL, MIRROR_HORIZONTAL };
+        mirror(mirroring[control & 3]);
+
+        // 512 KiB boards (SUROM) select the 256 KiB half with CHR bank bit 4
+        int outer = (cart.prg_size > 0x40000 && (chr0 & 0x10) ? 16 : 0);
+        int bank = outer | (prg_bank & 0x0F);
+        switch ((control >> 2) & 3) {
+        case 0:
+        case 1:
+            prg(0x8000, 0x8000, bank >> 1);
+            break;
+        case 2:
+            prg(0x8000, 0x4000, outer);
+            prg(0xC000, 0x4000, bank);
+            break;
+        case 3:
+            prg(0x8000, 0x4000, bank);
+            prg(0xC000, 0x4000, outer | 0x0F);
+            break;
+        }
+
+        if (control & 0x10) {
+            chr(0x0000, 0x1000, chr0);
+            chr(0x1000, 0x1000, chr1);
+        } else {
+            chr(0x0000, 0x2000, chr0 >> 1);
+        }
+
+        prg_ram_enable((prg_bank & 0x10) == 0, true);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Mapper 2: UxROM, 16 KiB at $8000, last bank at $C000
+////////////////////////////////////////////////////////////////////////////////
+
+class UxROM : public Mapper {
+public:
+    UxROM(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+        : Mapper(cart, cpu, ppu, ciram) {
+    }
+
+    void reset(void) {
+        Mapper::reset();
+        bank = 0;
+        prg(0x8000, 0x4000, 0);
+        prg(0xC000, 0x4000, -1);
+    }
+
+    void write(uint16_t address, uint8_t data) {
+        if (address >= 0x8000) {
+            bank = data;
+            prg(0x8000, 0x4000, bank);
+        }
+    }
+
+protected:
+    void save_registers(StateWriter &out) {
+        out.u8(bank);
+    }
+
+    void load_registers(StateReader &in) {
+        Mapper::reset();
+        bank = in.u8();
+        prg(0x8000, 0x4000, bank);
+        prg(0xC000, 0x4000, -1);
+    }
+
+private:
+    uint8_t bank;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Mapper 3: CNROM, 8 KiB of CHR
+////////////////////////////////////////////////////////////////////////////////
+
+class CNROM : public Mapper {
+public:
+    CNROM(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+        : Mapper(cart, cpu, ppu, ciram) {
+    }
+
+    void reset(void) {
+        Mapper::reset();
+        bank = 0;
+    }
+
+    void write(uint16_t address, uint8_t data) {
+        if (address >= 0x8000) {
+            bank = data;
+            chr(0x0000, 0x2000, bank);
+        }
+    }
+
+protected:
+    void save_registers(StateWriter &out) {
+        out.u8(bank);
+    }
+
+    void load_registers(StateReader &in) {
+        Mapper::reset();
+        bank = in.u8();
+        chr(0x0000, 0x2000, bank);
+    }
+
+private:
+    uint8_t bank;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Mapper 4: MMC3, 8 KiB PRG / 1-2 KiB CHR banks and a scanline counter
+////////////////////////////////////////////////////////////////////////////////
+
+class MMC3 : public Mapper {
+public:
+    MMC3(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram)
+        : Mapper(cart, cpu, ppu, ciram) {
+        counts_a12 = true;
+    }
+
+    void reset(void) {
+        Mapper::reset();
+        static const uint8_t banks[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+        memcpy(regs, banks, sizeof(regs));
+        select = 0;
+        mirroring = (cart.mirroring == Cartridge::MIRROR_HORIZONTAL ? 1 : 0);
+        protect = 0x80;
+        latch = 0;
+        counter = 0;
+        reload = false;
+        irq_enabled = false;
+        cpu.set_irq(IRQ_SOURCE, false);
+        update();
+        control();
+    }
+
+    void write(uint16_t address, uint8_t data) {
+        switch (address & 0xE001) {
+        case 0x8000:
+            select = data;
+            update();
+            break;
+        case 0x8001:
+            regs[select & 7] = data;
+            update();
+            break;
+        case 0xA000:
+            mirroring = data & 1;
+            control();
+            break;
+        case 0xA001:
+            protect = data & 0xC0;
+            control();
+            break;
+        case 0xC000:
+            latch = data;
+            break;
+        case 0xC001:
+            counter = 0;
+            reload = true;
+            break;
+        case 0xE000:
+            irq_enabled = false;
+            cpu.set_irq(IRQ_SOURCE, false);
+            break;
+        case 0xE001:
+            irq_enabled = true;
+            break;
+        }
+    }
+
+    // The counter is clocked by PPU A12 rising edges, once per line with
+    // the usual pattern table settings
+    void a12(void) {
+        if (counter == 0 || reload) {
+            counter = latch;
+            reload = false;
+        } else {
+            counter--;
+        }
+        if (counter == 0 && irq_enabled) {
+            cpu.set_irq(IRQ_SOURCE, true);
+        }
+    }
+
+    uint64_t next_event(void) {
+        if (!irq_enabled) {
+            return PPU::NO_EVENT;
+        }
+        return ppu.a12_event(counter == 0 || reload ? latch + 1 : counter);
+    }
+
+protected:
+    void save_registers(StateWriter &out) {
+        out.u8(select);
+        out.bytes(regs, sizeof(regs));
+        out.u8(mirroring | protect | (reload ? 0x02 : 0) | (irq_enabled ? 0x04 : 0));
+        out.u8(latch);
+        out.u8(counter);
+    }
+
+    void load_registers(StateReader &in) {
+        select = in.u8();
+        in.bytes(regs, sizeof(regs));
+        uint8_t flags = in.u8();
+        mirroring = flags & 0x01;
+        protect = flags & 0xC0;
+        reload = ((flags & 0x02) != 0);
+        irq_enabled = ((flags & 0x04) != 0);
+        latch = in.u8();
+        counter = in.u8();
+        update();
+        control();
+    }
+
+private:
+    uint8_t select;
+    uint8_t regs[8];
+    uint8_t mirroring;      // $A000
+    uint8_t protect;        // $A001
+    uint8_t latch;
+    uint8_t counter;
+    bool reload;
+    bool irq_enabled;
+
+    void control(void) {
+        if (cart.mirroring != Cartridge::MIRROR_FOUR) {
+            mirror(mirroring ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+        }
+        prg_ram_enable((protect & 0x80) != 0, (protect & 0x40) == 0);
+    }
+
+    void update(void) {
+        if (select & 0x40) {
+            prg(0x8000, 0x2000, -2);
+            prg(0xC000, 0x2000, regs[6]);
+        } else {
+            prg(0x8000, 0x2000, regs[6]);
+            prg(0xC000, 0x2000, -2);
+        }
+        prg(0xA000, 0x2000, regs[7]);
+        prg(0xE000, 0x2000, -1);
+
+        uint16_t invert = (select & 0x80 ? 0x1000 : 0x0000);
+        chr(0x0000 ^ invert, 0x0800, regs[0] >> 1);
+        chr(0x0800 ^ invert, 0x0800, regs[1] >> 1);
+        chr(0x1000 ^ invert, 0x0400, regs[2]);
+        chr(0x1400 ^ invert, 0x0400, regs[3]);
+        chr(0x1800 ^ invert, 0x0400, regs[4]);
+        chr(0x1C00 ^ invert, 0x0400, regs[5]);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+Mapper *Mapper::create(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram) {
+    switch (cart.mapper) {
+    case 0:
+        return new NROM(cart, cpu, ppu, ciram);
+    case 1:
+        return new MMC1(cart, cpu, ppu, ciram);
+    case 2:
+        return new UxROM(cart, cpu, ppu, ciram);
+    case 3:
+        return new CNROM(cart, cpu, ppu, ciram);
+    case 4:
+        return new MMC3(cart, cpu, ppu, ciram);
+    }
+    return NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef NES_MAPPER_INCLUDED
+#define NES_MAPPER_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include "cartridge.h"
+#include "cpu6502.h"
+#include "ppu.h"
+
+// Cartridge hardware between the ROM and the CPU and PPU buses. Banks are
+// mapped into the page tables of the CPU and the PPU, so that bank switching
+// is done on register writes and reads never go through the mapper.
+class Mapper {
+public:
+    // Mapper for cart, NULL if not supported. ciram is the 2 KiB of
+    // nametable RAM of the console.
+    static Mapper *create(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram);
+    virtual ~Mapper(void);
+
+    // CPU IRQ source of the cartridge
+    static const uint32_t IRQ_SOURCE = 1 << 0;
+
+    virtual void reset(void);
+
+    // CPU accesses to $4020-$FFFF that are not mapped to memory
+    virtual uint8_t read(uint16_t address);
+    virtual void write(uint16_t address, uint8_t data);
+
+    // PPU cycle of the next dot that may assert the IRQ, never later than
+    // the actual one; PPU::NO_EVENT if none can
+    virtual uint64_t next_event(void);
+
+    // PPU A12 rising edges, if the mapper counts them
+    bool counts_a12;
+    virtual void a12(void);
+
+    // Save states (chunk "MAPR"): cartridge RAM and registers. The state
+    // must come from the same cartridge.
+    void save(StateWriter &out);
+    bool load(StateReader &in);
+
+protected:
+    Mapper(Cartridge &cart, CPU6502 &cpu, PPU &ppu, uint8_t *ciram);
+
+    Cartridge &cart;
+    CPU6502 &cpu;
+    PPU &ppu;
+    uint8_t *ciram;
+
+    uint8_t *prg_ram;       // At $6000, NULL if none
+    uint32_t prg_ram_size;
+    uint8_t *chr_ram;       // Instead of CHR ROM, NULL if none
+    uint32_t chr_ram_size;
+    uint8_t *nt_ram;        // 2 more KiB of nametables for 4 screens
+
+    // Map bank number bank, in units of size, at address; negative banks
+    // count from the end
+    void prg(uint16_t address, uint32_t size, int bank);
+    void chr(uint16_t address, uint32_t size, int bank);
+
+    // Nametable layouts, as the 1 KiB nametable RAM page of each quadrant
+    enum Mirroring {
+        MIRROR_HORIZONTAL,
+        MIRROR_VERTICAL,
+        MIRROR_SINGLE_A,
+        MIRROR_SINGLE_B,
+        MIRROR_FOUR
+    };
+    void mirror(Mirroring mirroring);
+
+    // PRG RAM at $6000-$7FFF, as memory or left to read() / write()
+    void prg_ram_enable(bool enable, bool writable);
+
+    // Registers of the subclass; loading maps the banks again
+    virtual void save_registers(StateWriter &out);
+    virtual void load_registers(StateReader &in);
+
+private:
+    Mapper(const Mapper &);
+    Mapper &operator=(const Mapper &);
+};
+
+#endif // NES_MAPPER_INCLUDED
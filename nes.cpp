@@ -0,0 +1,324 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "nes.h"
+
+NES::NES(void) {
+    deadline = 0;
+    mapper = NULL;
+    memset(ram, 0, sizeof(ram));
+    memset(ciram, 0, sizeof(ciram));
+    pad[0] = pad[1] = 0;
+    pad_shift[0] = pad_shift[1] = 0;
+    pad_strobe = false;
+
+    // $0000-$1FFF: RAM, mirrored 4 times
+    cpu.map(0x00, 0x20, ram, sizeof(ram), true);
+    cpu.context = this;
+    ppu.context = this;
+    apu.context = this;
+    cpu.read = io_read;
+    cpu.write = io_write;
+    ppu.nmi = ppu_nmi;
+    apu.irq = apu_irq;
+    apu.dmc_read = apu_dmc_read;
+}
+
+NES::~NES(void) {
+    eject();
+}
+
+bool NES::insert(Cartridge &cart) {
+    eject();
+    mapper = Mapper::create(cart, cpu, ppu, ciram);
+    if (mapper == NULL) {
+        fprintf(stderr, "NES: mapper %d not supported\n", cart.mapper);
+        return false;
+    }
+    ppu.a12 = (mapper->counts_a12 ? ppu_a12 : NULL);
+    mapper->reset();
+    return true;
+}
+
+void NES::eject(void) {
+    if (mapper == NULL) {
+        return;
+    }
+    delete mapper;
+    mapper = NULL;
+    cpu.unmap(0x60, 0xA0);
+    cpu.set_irq(Mapper::IRQ_SOURCE, false);
+    ppu.unmap(0, 16);
+    ppu.a12 = NULL;
+}
+
+void NES::reset(void) {
+    pad_strobe = false;
+    if (mapper != NULL) {
+        mapper->reset();
+    }
+    ppu.reset();
+    cpu.reset();
+    apu.cycles = cpu.cycles;
+    apu.reset();
+}
+
+CPU6502::Stop NES::run(uint64_t until_cycle) {
+    while (cpu.cycles < until_cycle) {
+        deadline = until_cycle;
+        uint64_t event = next_event();
+        if (event < deadline) {
+            deadline = event;
+        }
+        CPU6502::Stop stop = cpu.run(deadline);
+        if (stop == CPU6502::STOP_LOOP && idle() && cpu.cycles < deadline) {
+            // Waiting for an interrupt: skip the iterations up to the event
+            cpu.cycles += (deadline - cpu.cycles + 2) / 3 * 3;
+        }
+        sync();
+        // The APU only catches up for its interrupts
+        if (apu.next_event() < cpu.cycles) {
+            apu.run(cpu.cycles);
+        }
+        if (stop == CPU6502::STOP_KIL || stop == CPU6502::STOP_BREAKPOINT) {
+            return stop;
+        }
+    }
+    return CPU6502::STOP_BUDGET;
+}
+
+CPU6502::Stop NES::run_frame(void) {
+    sync();
+    uint64_t frame = ppu.frame_count;
+    while (ppu.frame_count == frame) {
+        // Dots left, one too many on odd frames
+        uint64_t dots = (PPU::SCANLINES - 1 - ppu.scanline) * PPU::DOTS + PPU::DOTS - ppu.dot;
+        CPU6502::Stop stop = run(cpu.cycles + (dots + 2) / 3);
+        if (stop != CPU6502::STOP_BUDGET) {
+            return stop;
+        }
+    }
+    return CPU6502::STOP_BUDGET;
+}
+
+void NES::set_fast_forward(bool enable) {
+    ppu.draw = !enable;
+    apu.set_output(!enable);
+}
+
+size_t NES::state_size(void) {
+    StateWriter out(NULL, 0);
+    save(out);
+    return out.size();
+}
+
+size_t NES::save(uint8_t *buffer, size_t size) {
+    StateWriter out(buffer, size);
+    save(out);
+    return (out.ok() ? out.size() : 0);
+}
+
+uint64_t NES::hash(void) {
+    StateWriter out(NULL, 0);
+    save(out);
+    return out.hash();
+}
+
+void NES::save(StateWriter &out) {
+    out.begin("RAM ", 1);
+    out.bytes(ram, sizeof(ram));
+    out.bytes(ciram, sizeof(ciram));
+    out.end();
+    out.begin("PADS", 1);
+    out.u8(pad[0]);
+    out.u8(pad[1]);
+    out.u8(pad_shift[0]);
+    out.u8(pad_shift[1]);
+    out.u8(pad_strobe ? 1 : 0);
+    out.end();
+    cpu.save(out);
+    ppu.save(out);
+    apu.save(out);
+    if (mapper != NULL) {
+        mapper->save(out);
+    }
+}
+
+// The CPU goes last, for its interrupt lines to win over the callbacks
+bool NES::load(const uint8_t *buffer, size_t size) {
+    StateReader in(buffer, size);
+    if (in.find("RAM ") != 1) {
+        return false;
+    }
+    in.bytes(ram, sizeof(ram));
+    in.bytes(ciram, sizeof(ciram));
+    if (!in.ok() || in.find("PADS") != 1) {
+        return false;
+    }
+    pad[0] = in.u8();
+    pad[1] = in.u8();
+    pad_shift[0] = in.u8();
+    pad_shift[1] = in.u8();
+    pad_strobe = (in.u8() != 0);
+    if (!in.ok()) {
+        return false;
+    }
+    if (mapper != NULL && !mapper->load(in)) {
+        return false;
+    }
+    return ppu.load(in) && apu.load(in) && cpu.load(in);
+}
+
+// The PPU catches up with the CPU
+void NES::sync(void) {
+    ppu.run(cpu.cycles * 3);
+}
+
+uint32_t NES::audio(int16_t *out, uint32_t max) {
+    apu.run(cpu.cycles);
+    return apu.samples(out, max);
+}
+
+// CPU cycle by which the PPU, the mapper or the APU may have raised an
+// interrupt: they are done with a cycle once their counter moved past it
+uint64_t NES::next_event(void) {
+    uint64_t event = ppu.next_event();
+    if (mapper != NULL) {
+        uint64_t irq = mapper->next_event();
+        if (irq < event) {
+            event = irq;
+        }
+    }
+    event = (event == PPU::NO_EVENT ? UINT64_MAX : (event + 3) / 3);
+    uint64_t apu_event = apu.next_event();
+    if (apu_event != APU::NO_EVENT && apu_event + 1 < event) {
+        event = apu_event + 1;
+    }
+    return event;
+}
+
+// The instruction jumping to itself is a JMP or a branch, 3 cycles without
+// side effects
+bool NES::idle(void) {
+    return cpu.opcode == 0x4C || (cpu.opcode & 0x1F) == 0x10;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// I/O
+////////////////////////////////////////////////////////////////////////////////
+
+uint8_t NES::io_read(void *context, uint16_t address) {
+    NES *nes = (NES *)context;
+    if ((address & 0xE000) == 0x2000) {
+        nes->sync();
+        return nes->ppu.read(address);
+    }
+    if (address == 0x4015) {
+        nes->apu.run(nes->cpu.cycles);
+        uint8_t data = nes->apu.read(address);
+        // Acknowledging the frame IRQ moves the next one
+        if (nes->next_event() < nes->deadline) {
+            nes->cpu.yield();
+        }
+        return data;
+    }
+    if (address >= 0x4020) {
+        if (nes->mapper == NULL) {
+            fprintf(stderr, "NES: unmapped read @%04X\n", address);
+            return 0x00;
+        }
+        nes->sync();
+        return nes->mapper->read(address);
+    }
+    if (address == 0x4016 || address == 0x4017) {
+        return nes->pad_read(address & 1);
+    }
+    return 0x00;
+}
+
+void NES::io_write(void *context, uint16_t address, uint8_t data) {
+    NES *nes = (NES *)context;
+    if ((address & 0xE000) == 0x2000) {
+        nes->sync();
+        nes->ppu.write(address, data);
+        // Enabling the NMI, or changing the pattern tables under the MMC3
+        // counter, may bring the next event forward
+        if (nes->next_event() < nes->deadline) {
+            nes->cpu.yield();
+        }
+    } else if (address == 0x4014) {
+        nes->sync();
+        nes->oam_dma(data);
+    } else if (address == 0x4016) {
+        nes->pad_strobe = ((data & 1) != 0);
+        if (nes->pad_strobe) {
+            nes->pad_shift[0] = nes->pad[0];
+            nes->pad_shift[1] = nes->pad[1];
+        }
+    } else if (address < 0x4018) {
+        nes->apu.run(nes->cpu.cycles);
+        nes->apu.write(address, data);
+        if (nes->next_event() < nes->deadline) {
+            nes->cpu.yield();
+        }
+    } else if (address >= 0x4020) {
+        if (nes->mapper == NULL) {
+            fprintf(stderr, "NES: unmapped write @%04X : %02X\n", address, data);
+            return;
+        }
+        nes->sync();
+        nes->mapper->write(address, data);
+        if (nes->next_event() < nes->deadline) {
+            nes->cpu.yield();
+        }
+    }
+}
+
+// Standard controller: the buttons are latched while the strobe is high and
+// shifted out from A on; 1s follow the 8 buttons. Bits 5-7 are open bus,
+// usually $40 from the address.
+uint8_t NES::pad_read(int port) {
+    if (pad_strobe) {
+        pad_shift[port] = pad[port];
+    }
+    uint8_t data = 0x40 | (pad_shift[port] & 1);
+    pad_shift[port] = (pad_shift[port] >> 1) | 0x80;
+    return data;
+}
+
+void NES::ppu_nmi(void *context, bool level) {
+    ((NES *)context)->cpu.set_nmi(level);
+}
+
+void NES::ppu_a12(void *context) {
+    ((NES *)context)->mapper->a12();
+}
+
+void NES::apu_irq(void *context, bool level) {
+    ((NES *)context)->cpu.set_irq(APU::IRQ_SOURCE, level);
+}
+
+// DMC fetches halt the CPU for 4 cycles, charged when the APU catches up
+uint8_t NES::apu_dmc_read(void *context, uint16_t address) {
+    NES *nes = (NES *)context;
+    const uint8_t *page = nes->cpu.memory(address >> 8);
+    uint8_t data = (page != NULL ? page[address & 0xFF] : io_read(context, address));
+    nes->cpu.stall(4);
+    return data;
+}
+
+// OAM DMA: a page of memory is copied in one go, an I/O page is read
+// through the handlers. The CPU is halted for 513 cycles, plus one when
+// the transfer starts on an odd cycle.
+void NES::oam_dma(uint8_t page) {
+    const uint8_t *data = cpu.memory(page);
+    uint8_t buffer[256];
+    if (data == NULL) {
+        for (int i = 0; i < 256; i++) {
+            buffer[i] = io_read(this, (page << 8) | i);
+        }
+        data = buffer;
+    }
+    ppu.oam_dma(data);
+    cpu.stall(513 + (cpu.cycles & 1));
+}
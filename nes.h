@@ -0,0 +1,102 @@
+#ifndef NES_NES_INCLUDED
+#define NES_NES_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include "apu.h"
+#include "cartridge.h"
+#include "cpu6502.h"
+#include "mapper.h"
+#include "ppu.h"
+
+// The console: CPU, PPU and APU, the 2 KiB of work RAM, the I/O registers and
+// two standard controllers. The mapper of the inserted cartridge maps its
+// memory into the page tables of cpu and ppu, and the 2 KiB of nametable RAM.
+// The bus handlers get the NES as their context: instances share no state and
+// may run on different threads.
+class NES {
+public:
+    NES(void);
+    ~NES(void);
+
+    CPU6502 cpu;
+    PPU ppu;
+    APU apu;
+    uint8_t ram[0x800];
+    uint8_t ciram[0x800];   // Nametable RAM
+
+    // Controller buttons, as read serially from $4016 / $4017: A, B, Select,
+    // Start, Up, Down, Left, Right from bit 0
+    static const uint8_t BUTTON_A = 1 << 0;
+    static const uint8_t BUTTON_B = 1 << 1;
+    static const uint8_t BUTTON_SELECT = 1 << 2;
+    static const uint8_t BUTTON_START = 1 << 3;
+    static const uint8_t BUTTON_UP = 1 << 4;
+    static const uint8_t BUTTON_DOWN = 1 << 5;
+    static const uint8_t BUTTON_LEFT = 1 << 6;
+    static const uint8_t BUTTON_RIGHT = 1 << 7;
+    uint8_t pad[2];
+
+    // Connect cart, which must outlive the NES or the next eject(). Returns
+    // false if its mapper is not supported.
+    bool insert(Cartridge &cart);
+    void eject(void);
+
+    void reset(void);
+
+    // Run until the CPU cycle counter reaches until_cycle, with the PPU at
+    // 3 dots per CPU cycle. The CPU runs ahead of the PPU up to its next
+    // event, and the PPU catches up when the CPU accesses it. Returns
+    // STOP_BUDGET, or STOP_KIL / STOP_BREAKPOINT from the CPU.
+    CPU6502::Stop run(uint64_t until_cycle);
+
+    // Run until the PPU starts the next frame
+    CPU6502::Stop run_frame(void);
+
+    // Fast-forward: no pixels and no audio samples are output, but the
+    // state is the same as when running normally, sprite 0 hits included
+    void set_fast_forward(bool enable);
+
+    // Audio samples up to the current cycle, see APU::samples()
+    uint32_t audio(int16_t *out, uint32_t max);
+
+    // Save states of the whole machine, see state.h. save() writes to the
+    // buffer without allocating and returns the size, or 0 if it does not
+    // fit in size bytes. The size only depends on the cartridge, see
+    // state_size(). load() needs the same cartridge inserted; on failure
+    // the machine must be reset.
+    size_t state_size(void);
+    size_t save(uint8_t *buffer, size_t size);
+    bool load(const uint8_t *buffer, size_t size);
+
+    // Hash of the save state, to check that runs are deterministic
+    uint64_t hash(void);
+
+private:
+    NES(const NES &);
+    NES &operator=(const NES &);
+
+    Mapper *mapper;     // NULL if no cartridge
+
+    uint64_t deadline;  // CPU cycle the current CPU run stops at
+
+    uint8_t pad_shift[2];   // Controller shift registers
+    bool pad_strobe;
+
+    void sync(void);
+    uint64_t next_event(void);
+    bool idle(void);
+
+    static uint8_t io_read(void *context, uint16_t address);
+    static void io_write(void *context, uint16_t address, uint8_t data);
+    static void ppu_nmi(void *context, bool level);
+    static void ppu_a12(void *context);
+    static void apu_irq(void *context, bool level);
+    static uint8_t apu_dmc_read(void *context, uint16_t address);
+
+    void oam_dma(uint8_t page);
+    uint8_t pad_read(int port);
+    void save(StateWriter &out);
+};
+
+#endif // NES_NES_INCLUDED
@@ -1,9 +1,42 @@
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include "ppu.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 PPU::PPU(void) {
     cycles = 0;
+    frame_count = 0;
+    context = NULL;
+    mem_read = NULL;
+    mem_write = NULL;
+    a12 = NULL;
+    for (int i = 0; i < 16; i++) {
+        rd_page[i] = NULL;
+        wr_page[i] = NULL;
+        ro_page[i] = false;
+    }
+    nmi = NULL;
+    nmi_out = false;
+    renderer = RENDER_SCANLINE;
+    draw = true;
+    frame_skip = 0;
+    for (int i = 0; i < 32; i++) {
+        palette[i] = 0x0F;
+    }
+    // Power-up contents are not defined: zeros, for runs to be repeatable
+    memset(OAM, 0, sizeof(OAM));
+    memset(tile_lo, 0, sizeof(tile_lo));
+    memset(tile_hi, 0, sizeof(tile_hi));
+    memset(tile_at, 0, sizeof(tile_at));
+    for (int i = 0; i < 240 * 256; i++) {
+        frame[i] = 0x0F;
+    }
 }
 
 void PPU::reset(void) {
@@ -13,7 +46,6 @@ void PPU::reset(void) {
     ////////////////////////////////////////////////////////////////////////////
 
     // PPUCTRL
-    nt_base = 0x2000;
     add32 = false;
     sppt_base = 0x0000;
     bgpt_base = 0x0000;
@@ -43,47 +75,171 @@ void PPU::reset(void) {
     // OAMDATA
     oam_data = 0x00;
 
-    // For 16-bit registers
-    second_write = false;
-
-    // PPUSCROLL
-    scroll_x = 0x00;
-    scroll_y = 0x00;
-
-    // PPUADDR
-    ppu_addr = 0x0000;
+    // PPUSCROLL / PPUADDR
+    v = 0x0000;
+    t = 0x0000;
+    x = 0;
+    w = false;
 
     // PPUDATA
     ppu_data = 0x00;
 
-    // OAMDMA
-    oam_dma_base = 0x0000;
-
     ////////////////////////////////////////////////////////////////////////////
     // INTERNAL PROCESSING
     ////////////////////////////////////////////////////////////////////////////
 
+    scanline = 0;
+    dot = 0;
+    odd = false;
+
+    bg_nt = 0;
+    bg_at = 0;
+    bg_lo = 0;
+    bg_hi = 0;
+    bg_shift_lo = 0;
+    bg_shift_hi = 0;
+    bg_shift_at_lo = 0;
+    bg_shift_at_hi = 0;
 
+    sprite_lists = false;
+    sp_count = 0;
+    sp_zero = false;
+    line_ready = false;
+    line_scan = false;
+    composed = 0;
+    decoded = 0;
+    sp_drawn = false;
 
+    update_a12();
+    update_nmi();
+}
+
+void PPU::map(uint8_t page, uint8_t count, uint8_t *mem, uint32_t size, bool writable) {
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t *p = mem + ((i << 10) % size);
+        uint8_t j = (page + i) & 15;
+        rd_page[j] = p;
+        wr_page[j] = (writable ? p : NULL);
+        ro_page[j] = !writable;
+        // Nametables are mirrored at $3000
+        if (j >= 8 && j < 12) {
+            rd_page[j + 4] = rd_page[j];
+            wr_page[j + 4] = wr_page[j];
+            ro_page[j + 4] = ro_page[j];
+        }
+    }
+}
+
+void PPU::unmap(uint8_t page, uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t j = (page + i) & 15;
+        rd_page[j] = NULL;
+        wr_page[j] = NULL;
+        ro_page[j] = false;
+        if (j >= 8 && j < 12) {
+            rd_page[j + 4] = NULL;
+            wr_page[j + 4] = NULL;
+            ro_page[j + 4] = false;
+        }
+    }
+}
+
+inline uint8_t PPU::rd(uint16_t address) {
+    uint8_t *p = rd_page[address >> 10];
+    if (p != NULL) {
+        return p[address & 0x3FF];
+    }
+    return mem_read(context, address);
+}
+
+inline void PPU::wr(uint16_t address, uint8_t data) {
+    uint8_t *p = wr_page[address >> 10];
+    if (p != NULL) {
+        p[address & 0x3FF] = data;
+    } else if (!ro_page[address >> 10]) {
+        mem_write(context, address, data);
+    }
+}
+
+// Pixels of the current frame are output
+bool PPU::drawing(void) {
+    return draw && frame_count % (frame_skip + 1) == 0;
+}
+
+bool PPU::rendering(void) {
+    return showbg || showsp;
+}
+
+void PPU::update_nmi(void) {
+    bool level = nmi_vbl && vbl;
+    if (level != nmi_out) {
+        nmi_out = level;
+        if (nmi != NULL) {
+            nmi(context, level);
+        }
+    }
+}
+
+// A12 rises on the first fetch from $1000-$1FFF after a run of fetches from
+// $0000-$0FFF: at the sprite fetches (8x16 sprites take either table,
+// unused slots fetch tile $FF) or at the fetches for the next line
+void PPU::update_a12(void) {
+    bool sp = (ssz16 || sppt_base != 0);
+    bool bg = (bgpt_base != 0);
+    if (sp && !bg) {
+        a12_dot = 260;
+    } else if (bg && !sp) {
+        a12_dot = 324;
+    } else {
+        a12_dot = DOTS;
+    }
+}
+
+uint8_t PPU::vram_read(uint16_t address) {
+    address &= 0x3FFF;
+    if (address >= 0x3F00) {
+        // $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C
+        uint8_t i = address & 0x1F;
+        return palette[(i & 0x13) == 0x10 ? i & 0x0F : i];
+    }
+    return rd(address);
+}
+
+void PPU::vram_write(uint16_t address, uint8_t data) {
+    address &= 0x3FFF;
+    if (address >= 0x3F00) {
+        uint8_t i = address & 0x1F;
+        palette[(i & 0x13) == 0x10 ? i & 0x0F : i] = data & 0x3F;
+    } else {
+        wr(address, data);
+    }
+}
+
+uint16_t PPU::emphasis(void) {
+    return (r_em ? 1 << 6 : 0) | (g_em ? 1 << 7 : 0) | (b_em ? 1 << 8 : 0);
 }
 
 void PPU::write(uint16_t address, uint8_t data) {
-    if (address == 0x4014) {
-        oam_dma_base = data;
-        // TODO: Implement DMA transfer
-    } else if ((address & 0xE000) == 0x2000) {
+    if ((address & 0xE000) == 0x2000) {
+        flush();
         last_write = data;
         switch(address & 7) {
         case 0x0:
-            nt_base = 0x2000 | ((data & 3) << 10);
+            if (((data & (1 << 5)) != 0) != ssz16) {
+                sprite_lists = false;
+            }
+            t = (t & 0x73FF) | ((data & 3) << 10);
             add32 = ( (data & (1 << 2)) != 0 );
             sppt_base = ( data & (1 << 3) ? 0x1000 : 0x0000);
             bgpt_base = ( data & (1 << 4) ? 0x1000 : 0x0000);
             ssz16 = ( (data & (1 << 5)) != 0 );
             bdout = ( (data & (1 << 6)) != 0 );
             nmi_vbl = ( (data & (1 << 7)) != 0 );
+            update_a12();
+            update_nmi();
             break;
-        case 0x1:
+        case 0x1: {
+            bool render = rendering();
             grayscale = ( (data & (1 << 0)) != 0 );
             showbg_left = ( (data & (1 << 1)) != 0 );
             showsp_left = ( (data & (1 << 2)) != 0 );
@@ -92,36 +248,41 @@ void PPU::write(uint16_t address, uint8_t data) {
             r_em = ( (data & (1 << 5)) != 0 );
             g_em = ( (data & (1 << 6)) != 0 );
             b_em = ( (data & (1 << 7)) != 0 );
+            // Fetches stop or resume: the rest of the line is output by dot
+            if (rendering() != render) {
+                line_ready = false;
+                line_scan = false;
+            }
             break;
+        }
         case 0x3:
             oam_addr = data;
             break;
         case 0x4:
             OAM[oam_addr++] = data;
+            sprite_lists = false;
             break;
         case 0x5:
-            if (second_write) {
-                scroll_y = data;
+            if (w) {
+                t = (t & 0x0C1F) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
             } else {
-                scroll_x = data;
+                t = (t & 0x7FE0) | (data >> 3);
+                x = data & 0x07;
             }
-            second_write = !second_write;
+            w = !w;
             break;
         case 0x6:
-            if (second_write) {
-                ppu_addr = (ppu_addr & 0xFF00) | data;
+            if (w) {
+                t = (t & 0x7F00) | data;
+                v = t;
             } else {
-                ppu_addr = (ppu_addr & 0x00FF) | ((uint16_t)data << 8);
+                t = (t & 0x00FF) | ((data & 0x3F) << 8);
             }
-            second_write = !second_write;
+            w = !w;
             break;
         case 0x7:
-            mem_write(ppu_addr, data);
-            if (add32) {
-                ppu_addr += 32;
-            } else {
-                ppu_addr += 1;
-            }
+            vram_write(v, data);
+            v = (v + (add32 ? 32 : 1)) & 0x7FFF;
             break;
         default:
             fprintf(stderr, "PPU: write to a RO register @%04X : %02X\n", address, data);
@@ -132,26 +293,39 @@ void PPU::write(uint16_t address, uint8_t data) {
     }
 }
 
+void PPU::oam_dma(const uint8_t *data) {
+    memcpy(&OAM[oam_addr], data, 256 - oam_addr);
+    memcpy(&OAM[0], data + 256 - oam_addr, oam_addr);
+    sprite_lists = false;
+}
+
 uint8_t PPU::read(uint16_t address) {
     uint8_t data = 0xFF;
     if ((address & 0xE000) == 0x2000) {
+        flush();
         switch(address & 7) {
         case 0x2:
             data = last_write & 0x1F;
             data |= (sp_ovf ? (1 << 5) : 0);
             data |= (sp0_hit ? (1 << 6) : 0);
             data |= (vbl ? (1 << 7) : 0);
+            vbl = false;
+            w = false;
+            update_nmi();
             break;
         case 0x4:
             data = OAM[oam_addr];
             break;
         case 0x7:
-            data = mem_read(ppu_addr); // FIXME
-            if (add32) {
-                ppu_addr += 32;
+            // Reads below the palettes are delayed through a buffer
+            if ((v & 0x3FFF) >= 0x3F00) {
+                data = vram_read(v);
+                ppu_data = rd((v & 0x3FFF) - 0x1000);
             } else {
-                ppu_addr += 1;
+                data = ppu_data;
+                ppu_data = rd(v & 0x3FFF);
             }
+            v = (v + (add32 ? 32 : 1)) & 0x7FFF;
             break;
         default:
             fprintf(stderr, "PPU: read from a WO register @%04X\n", address);
@@ -163,6 +337,925 @@ uint8_t PPU::read(uint16_t address) {
     return data;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Rendering
+////////////////////////////////////////////////////////////////////////////////
+
+// Background fetches, one memory access every two dots
+void PPU::fetch(void) {
+    uint16_t fine_y = (v >> 12) & 7;
+    switch ((dot - 1) & 7) {
+    case 0:
+        reload();
+        bg_nt = rd(0x2000 | (v & 0x0FFF));
+        break;
+    case 2:
+        bg_at = rd(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+        if (v & 0x40) {
+            bg_at >>= 4;
+        }
+        if (v & 0x02) {
+            bg_at >>= 2;
+        }
+        bg_at &= 3;
+        break;
+    case 4:
+        bg_lo = rd(bgpt_base + (bg_nt << 4) + fine_y);
+        break;
+    case 6: {
+        bg_hi = rd(bgpt_base + (bg_nt << 4) + fine_y + 8);
+        // Tiles 0-1 of the next line are fetched at dots 321-336
+        int i = (dot < 257 ? (dot >> 3) + 2 : (dot - 321) >> 3);
+        tile_lo[i] = bg_lo;
+        tile_hi[i] = bg_hi;
+        tile_at[i] = bg_at << 2;
+        break;
+    }
+    case 7:
+        inc_x();
+        break;
+    }
+}
+
+// Load the fetched tile into the low bytes of the shift registers
+void PPU::reload(void) {
+    bg_shift_lo = (bg_shift_lo & 0xFF00) | bg_lo;
+    bg_shift_hi = (bg_shift_hi & 0xFF00) | bg_hi;
+    bg_shift_at_lo = (bg_shift_at_lo & 0xFF00) | (bg_at & 1 ? 0xFF : 0x00);
+    bg_shift_at_hi = (bg_shift_at_hi & 0xFF00) | (bg_at & 2 ? 0xFF : 0x00);
+}
+
+void PPU::inc_x(void) {
+    if ((v & 0x001F) == 31) {
+        v &= ~0x001F;
+        v ^= 0x0400;
+    } else {
+        v++;
+    }
+}
+
+void PPU::inc_y(void) {
+    if ((v & 0x7000) != 0x7000) {
+        v += 0x1000;
+    } else {
+        v &= ~0x7000;
+        uint16_t y = (v & 0x03E0) >> 5;
+        if (y == 29) {
+            y = 0;
+            v ^= 0x0800;
+        } else if (y == 31) {
+            y = 0;
+        } else {
+            y++;
+        }
+        v = (v & ~0x03E0) | (y << 5);
+    }
+}
+
+void PPU::pixel(void) {
+    uint16_t px = dot - 1;
+    uint8_t p = 0;
+    if (showbg && (showbg_left || px >= 8)) {
+        uint16_t bit = 0x8000 >> x;
+        p = ((bg_shift_lo & bit) ? 1 : 0) | ((bg_shift_hi & bit) ? 2 : 0);
+        if (p != 0) {
+            p |= ((bg_shift_at_lo & bit) ? 4 : 0) | ((bg_shift_at_hi & bit) ? 8 : 0);
+        }
+    }
+    // The first opaque sprite pixel in OAM order wins, then its priority
+    // bit selects between it and an opaque background pixel
+    if (showsp && (showsp_left || px >= 8)) {
+        for (int i = 0; i < sp_count; i++) {
+            uint16_t offset = (uint16_t)(px - sp_x[i]);
+            if (offset >= 8) {
+                continue;
+            }
+            uint8_t bit = 0x80 >> offset;
+            uint8_t s = ((sp_lo[i] & bit) ? 1 : 0) | ((sp_hi[i] & bit) ? 2 : 0);
+            if (s == 0) {
+                continue;
+            }
+            if (i == 0 && sp_zero && p != 0 && px != 255) {
+                sp0_hit = true;
+            }
+            if ((sp_attr[i] & 0x20) == 0 || p == 0) {
+                p = 0x10 | ((sp_attr[i] & 3) << 2) | s;
+            }
+            break;
+        }
+    }
+    if (!drawing()) {
+        return;
+    }
+    uint8_t color = palette[p];
+    if (grayscale) {
+        color &= 0x30;
+    }
+    frame[scanline * 256 + px] = color | emphasis();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sprites
+////////////////////////////////////////////////////////////////////////////////
+
+static uint8_t flip(uint8_t b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+static void decode(const uint8_t *lo, const uint8_t *hi, const uint8_t *bits, int n, uint8_t *out);
+
+// Sprite lists of all lines from the current OAM. A line takes the first 8
+// sprites in range; past them, the hardware goes on comparing Y but also
+// steps through the other bytes of each sprite it skips, so that the
+// overflow flag both misses sprites and catches tiles or attributes.
+void PPU::bucket(void) {
+    int height = (ssz16 ? 16 : 8);
+    for (int line = 0; line < 240; line++) {
+        line_sprite_count[line] = 0;
+        line_sprite_ovf[line] = false;
+    }
+    for (int i = 0; i < 64; i++) {
+        int y = OAM[i * 4];
+        for (int line = y; line < y + height && line < 240; line++) {
+            if (line_sprite_count[line] < 8) {
+                line_sprites[line][line_sprite_count[line]++] = i;
+            }
+        }
+    }
+    for (int line = 0; line < 240; line++) {
+        if (line_sprite_count[line] < 8) {
+            continue;
+        }
+        int m = 0;
+        for (int n = line_sprites[line][7] + 1; n < 64; n++) {
+            if ((unsigned)(line - OAM[n * 4 + m]) < (unsigned)height) {
+                line_sprite_ovf[line] = true;
+                break;
+            }
+            m = (m + 1) & 3;
+        }
+    }
+    sprite_lists = true;
+}
+
+// Fetch the patterns of the sprites of the next line, as done over dots
+// 257-320 of the current line
+void PPU::evaluate(void) {
+    sp_count = 0;
+    sp_zero = false;
+    if (scanline >= 240 || !rendering()) {
+        return;
+    }
+    if (!sprite_lists) {
+        bucket();
+    }
+    int height = (ssz16 ? 16 : 8);
+    int count = line_sprite_count[scanline];
+    if (line_sprite_ovf[scanline]) {
+        sp_ovf = true;
+    }
+    for (int n = 0; n < count; n++) {
+        uint8_t i = line_sprites[scanline][n];
+        const uint8_t *sprite = &OAM[i * 4];
+        int row = scanline - sprite[0];
+        uint8_t tile = sprite[1];
+        uint8_t attr = sprite[2];
+        if (attr & 0x80) {
+            row = height - 1 - row;
+        }
+        uint16_t address;
+        if (ssz16) {
+            address = ((tile & 1) << 12) | ((tile & 0xFE) << 4) | ((row & 8) << 1) | (row & 7);
+        } else {
+            address = sppt_base | (tile << 4) | row;
+        }
+        uint8_t lo = rd(address);
+        uint8_t hi = rd(address + 8);
+        if (attr & 0x40) {
+            lo = flip(lo);
+            hi = flip(hi);
+        }
+        sp_lo[n] = lo;
+        sp_hi[n] = hi;
+        sp_attr[n] = attr;
+        sp_x[n] = sprite[3];
+    }
+    sp_count = count;
+    sp_zero = (count != 0 && line_sprites[scanline][0] == 0);
+    sp_drawn = false;
+}
+
+// Sprite layer of the line for the scanline renderer, drawn back to front
+// when the line is composed
+void PPU::draw_sprites(void) {
+    uint8_t bits[8] = { 0 };
+    uint8_t pixels[8 * 8];
+    for (int i = 0; i < sp_count; i++) {
+        bits[i] = ((sp_attr[i] & 3) << 2) | (sp_attr[i] & 0x20) | (i == 0 && sp_zero ? 0x40 : 0);
+    }
+    decode(sp_lo, sp_hi, bits, (sp_count + 1) & ~1, pixels);
+    memset(sp_line, 0, sizeof(sp_line));
+    for (int i = sp_count - 1; i >= 0; i--) {
+        uint8_t *out = &sp_line[sp_x[i]];
+        for (int j = 0; j < 8; j++) {
+            if (pixels[i * 8 + j] != 0) {
+                out[j] = pixels[i * 8 + j];
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scanline renderer
+////////////////////////////////////////////////////////////////////////////////
+
+// Decode n (even) rows of 8 pixels from their two bitplanes: each pixel is
+// its 2-bit value, ORed with the row's bits when not 0
+static void decode(const uint8_t *lo, const uint8_t *hi, const uint8_t *bits, int n, uint8_t *out) {
+#if defined(__SSE2__)
+    const __m128i mask = _mm_setr_epi8(
+        (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < n; i += 2) {
+        __m128i l = _mm_unpacklo_epi64(_mm_set1_epi8((char)lo[i]), _mm_set1_epi8((char)lo[i + 1]));
+        __m128i h = _mm_unpacklo_epi64(_mm_set1_epi8((char)hi[i]), _mm_set1_epi8((char)hi[i + 1]));
+        __m128i b = _mm_unpacklo_epi64(_mm_set1_epi8((char)bits[i]), _mm_set1_epi8((char)bits[i + 1]));
+        l = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(l, mask), mask), one);
+        h = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(h, mask), mask), two);
+        __m128i p = _mm_or_si128(l, h);
+        p = _mm_or_si128(p, _mm_andnot_si128(_mm_cmpeq_epi8(p, zero), b));
+        _mm_storeu_si128((__m128i *)&out[i * 8], p);
+    }
+#elif defined(__ARM_NEON)
+    static const uint8_t masks[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+    const uint8x16_t mask = vld1q_u8(masks);
+    for (int i = 0; i < n; i += 2) {
+        uint8x16_t l = vcombine_u8(vdup_n_u8(lo[i]), vdup_n_u8(lo[i + 1]));
+        uint8x16_t h = vcombine_u8(vdup_n_u8(hi[i]), vdup_n_u8(hi[i + 1]));
+        uint8x16_t b = vcombine_u8(vdup_n_u8(bits[i]), vdup_n_u8(bits[i + 1]));
+        uint8x16_t p = vorrq_u8(vandq_u8(vtstq_u8(l, mask), vdupq_n_u8(1)),
+                                vandq_u8(vtstq_u8(h, mask), vdupq_n_u8(2)));
+        p = vorrq_u8(p, vandq_u8(vtstq_u8(p, p), b));
+        vst1q_u8(&out[i * 8], p);
+    }
+#else
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 8; j++) {
+            uint8_t p = ((lo[i] >> (7 - j)) & 1) | (((hi[i] >> (7 - j)) & 1) << 1);
+            out[i * 8 + j] = (p != 0 ? p | bits[i] : 0);
+        }
+    }
+#endif
+}
+
+// Priority multiplexer, from background and sprite pixels as decoded (0 when
+// transparent or clipped) to a palette index
+static inline uint8_t mux(uint8_t b, uint8_t s) {
+    if (s != 0 && ((s & 0x20) == 0 || b == 0)) {
+        return 0x10 | (s & 0x0F);
+    }
+    return b;
+}
+
+// Decode the background tiles of the current line up to pixel last
+void PPU::decode_tiles(uint16_t last) {
+    uint8_t need = ((last - 1 + x) >> 3) + 1;
+    if (need > decoded) {
+        uint8_t from = decoded & ~1;
+        decode(&tile_lo[from], &tile_hi[from], &tile_at[from], (need - from + 1) & ~1, &bg_line[from * 8]);
+        decoded = need;
+    }
+}
+
+// Output pixels [first, last) of the current line. Pixel px of the line is
+// bit 7 - (px + x) % 8 of tile (px + x) / 8, as shifted out by pixel().
+void PPU::compose(uint16_t first, uint16_t last) {
+    if (!drawing()) {
+        hit(first, last);
+        return;
+    }
+    decode_tiles(last);
+    if (!sp_drawn) {
+        draw_sprites();
+        sp_drawn = true;
+    }
+
+    const uint8_t *bg = &bg_line[x];
+    uint16_t *out = &frame[scanline * 256];
+    uint8_t gray = (grayscale ? 0x30 : 0x3F);
+    uint16_t em = emphasis();
+    bool sprites = (showsp && sp_count != 0);
+
+#if defined(__AVX2__)
+    const int SPAN = 32;
+    const __m256i bg_on = _mm256_set1_epi8(showbg ? -1 : 0);
+    const __m256i sp_on = _mm256_set1_epi8(sprites ? -1 : 0);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i front = _mm256_set1_epi8(0x20);
+    const __m256i zero_bit = _mm256_set1_epi8(0x40);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i high = _mm256_set1_epi8(0x10);
+    const __m256i pal0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&palette[0]));
+    const __m256i pal1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&palette[16]));
+    const __m256i mono = _mm256_set1_epi8(gray);
+    const __m256i emph = _mm256_set1_epi16(em);
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+    const int SPAN = 16;
+#else
+    const int SPAN = 256;
+#endif
+#if defined(__SSE2__) && !defined(__AVX2__)
+    const __m128i bg_on = _mm_set1_epi8(showbg ? -1 : 0);
+    const __m128i sp_on = _mm_set1_epi8(sprites ? -1 : 0);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i front = _mm_set1_epi8(0x20);
+    const __m128i zero_bit = _mm_set1_epi8(0x40);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    const __m128i high = _mm_set1_epi8(0x10);
+#if defined(__SSSE3__)
+    const __m128i pal0 = _mm_loadu_si128((const __m128i *)&palette[0]);
+    const __m128i pal1 = _mm_loadu_si128((const __m128i *)&palette[16]);
+    const __m128i mono = _mm_set1_epi8(gray);
+    const __m128i emph = _mm_set1_epi16(em);
+#endif
+#elif defined(__ARM_NEON)
+    const uint8x16_t bg_on = vdupq_n_u8(showbg ? 0xFF : 0);
+    const uint8x16_t sp_on = vdupq_n_u8(sprites ? 0xFF : 0);
+    const uint8x16_t front = vdupq_n_u8(0x20);
+    const uint8x16_t zero_bit = vdupq_n_u8(0x40);
+    const uint8x16_t low = vdupq_n_u8(0x0F);
+    const uint8x16_t high = vdupq_n_u8(0x10);
+#if defined(__aarch64__)
+    const uint8x16x2_t pal = { { vld1q_u8(&palette[0]), vld1q_u8(&palette[16]) } };
+    const uint8x16_t mono = vdupq_n_u8(gray);
+    const uint16x8_t emph = vdupq_n_u16(em);
+#endif
+#endif
+
+    uint16_t px = first;
+    while (px < last) {
+        // Vector spans, past the left clipping window
+        if (px >= 8 && last - px >= SPAN) {
+#if defined(__AVX2__)
+            __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&bg[px]), bg_on);
+            __m256i s = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&sp_line[px]), sp_on);
+            __m256i b0 = _mm256_cmpeq_epi8(b, zero);
+            __m256i s0 = _mm256_cmpeq_epi8(s, zero);
+            __m256i sp = _mm256_andnot_si256(s0, _mm256_or_si256(b0,
+                _mm256_cmpeq_epi8(_mm256_and_si256(s, front), zero)));
+            __m256i i = _mm256_blendv_epi8(b, _mm256_or_si256(_mm256_and_si256(s, low), high), sp);
+            uint32_t hit = _mm256_movemask_epi8(_mm256_andnot_si256(b0,
+                _mm256_cmpeq_epi8(_mm256_and_si256(s, zero_bit), zero_bit)));
+            if (px + SPAN > 255) {
+                hit &= ~(1u << (255 - px));
+            }
+            if (hit != 0) {
+                sp0_hit = true;
+            }
+            __m256i c = _mm256_blendv_epi8(_mm256_shuffle_epi8(pal0, i), _mm256_shuffle_epi8(pal1, i),
+                _mm256_cmpeq_epi8(_mm256_and_si256(i, high), high));
+            c = _mm256_and_si256(c, mono);
+            _mm256_storeu_si256((__m256i *)&out[px],
+                _mm256_or_si256(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(c)), emph));
+            _mm256_storeu_si256((__m256i *)&out[px + 16],
+                _mm256_or_si256(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1)), emph));
+            px += SPAN;
+            continue;
+#elif defined(__SSE2__)
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)&bg[px]), bg_on);
+            __m128i s = _mm_and_si128(_mm_loadu_si128((const __m128i *)&sp_line[px]), sp_on);
+            __m128i b0 = _mm_cmpeq_epi8(b, zero);
+            __m128i s0 = _mm_cmpeq_epi8(s, zero);
+            __m128i sp = _mm_andnot_si128(s0, _mm_or_si128(b0,
+                _mm_cmpeq_epi8(_mm_and_si128(s, front), zero)));
+            __m128i i = _mm_or_si128(_mm_and_si128(sp, _mm_or_si128(_mm_and_si128(s, low), high)),
+                _mm_andnot_si128(sp, b));
+            uint32_t hit = _mm_movemask_epi8(_mm_andnot_si128(b0,
+                _mm_cmpeq_epi8(_mm_and_si128(s, zero_bit), zero_bit)));
+            if (px + SPAN > 255) {
+                hit &= ~(1u << (255 - px));
+            }
+            if (hit != 0) {
+                sp0_hit = true;
+            }
+#if defined(__SSSE3__)
+            __m128i hi = _mm_cmpeq_epi8(_mm_and_si128(i, high), high);
+            __m128i c = _mm_or_si128(_mm_and_si128(hi, _mm_shuffle_epi8(pal1, i)),
+                _mm_andnot_si128(hi, _mm_shuffle_epi8(pal0, i)));
+            c = _mm_and_si128(c, mono);
+            _mm_storeu_si128((__m128i *)&out[px], _mm_or_si128(_mm_unpacklo_epi8(c, zero), emph));
+            _mm_storeu_si128((__m128i *)&out[px + 8], _mm_or_si128(_mm_unpackhi_epi8(c, zero), emph));
+#else
+            uint8_t index[16];
+            _mm_storeu_si128((__m128i *)index, i);
+            for (int j = 0; j < 16; j++) {
+                out[px + j] = (palette[index[j]] & gray) | em;
+            }
+#endif
+            px += SPAN;
+            continue;
+#elif defined(__ARM_NEON)
+            uint8x16_t b = vandq_u8(vld1q_u8(&bg[px]), bg_on);
+            uint8x16_t s = vandq_u8(vld1q_u8(&sp_line[px]), sp_on);
+            uint8x16_t b0 = vceqq_u8(b, vdupq_n_u8(0));
+            uint8x16_t s1 = vtstq_u8(s, s);
+            uint8x16_t sp = vandq_u8(s1, vorrq_u8(b0, vceqq_u8(vandq_u8(s, front), vdupq_n_u8(0))));
+            uint8x16_t i = vbslq_u8(sp, vorrq_u8(vandq_u8(s, low), high), b);
+            uint8x16_t hits = vbicq_u8(vtstq_u8(s, zero_bit), b0);
+            uint8_t hit[16];
+            vst1q_u8(hit, hits);
+            for (int j = 0; j < 16; j++) {
+                if (hit[j] != 0 && px + j != 255) {
+                    sp0_hit = true;
+                }
+            }
+#if defined(__aarch64__)
+            uint8x16_t c = vandq_u8(vqtbl2q_u8(pal, i), mono);
+            vst1q_u16(&out[px], vorrq_u16(vmovl_u8(vget_low_u8(c)), emph));
+            vst1q_u16(&out[px + 8], vorrq_u16(vmovl_u8(vget_high_u8(c)), emph));
+#else
+            uint8_t index[16];
+            vst1q_u8(index, i);
+            for (int j = 0; j < 16; j++) {
+                out[px + j] = (palette[index[j]] & gray) | em;
+            }
+#endif
+            px += SPAN;
+            continue;
+#endif
+        }
+        uint8_t b = (showbg && (showbg_left || px >= 8) ? bg[px] : 0);
+        uint8_t s = (sprites && (showsp_left || px >= 8) ? sp_line[px] : 0);
+        if ((s & 0x40) && b != 0 && px != 255) {
+            sp0_hit = true;
+        }
+        out[px] = (palette[mux(b, s)] & gray) | em;
+        px++;
+    }
+}
+
+// Sprite 0 hit only, over the pixels [first, last) that sprite 0 covers:
+// its opaque pixels are intersected with those of the two background tiles
+// under it, as bit masks of their patterns, without decoding
+void PPU::hit(uint16_t first, uint16_t last) {
+    if (sp0_hit || !sp_zero || !showsp || !showbg) {
+        return;
+    }
+    uint16_t sx = sp_x[0];
+    uint16_t from = sx;
+    uint16_t to = sx + 8;
+    if ((!showbg_left || !showsp_left) && from < 8) {
+        from = 8;
+    }
+    if (from < first) {
+        from = first;
+    }
+    // Never at x = 255
+    if (to > 255) {
+        to = 255;
+    }
+    if (to > last) {
+        to = last;
+    }
+    if (from >= to) {
+        return;
+    }
+    uint16_t px = sx + x;
+    uint8_t t = px >> 3;
+    uint16_t bg = (((tile_lo[t] | tile_hi[t]) << 8) | (tile_lo[t + 1] | tile_hi[t + 1])) << (px & 7);
+    uint8_t range = (0xFF >> (from - sx)) & ~(0xFF >> (to - sx));
+    if ((bg >> 8) & (sp_lo[0] | sp_hi[0]) & range) {
+        sp0_hit = true;
+    }
+}
+
+// Output the pixels of the line up to the current dot, before a register
+// access can change how they look or read back the sprite 0 hit
+void PPU::flush(void) {
+    if (line_scan && dot >= 1) {
+        uint16_t done = (dot > 257 ? 256 : dot - 1);
+        if (done > composed) {
+            compose(composed, done);
+            composed = done;
+        }
+    }
+}
+
+// One dot
 void PPU::step(void) {
+    bool render = rendering();
+    if (scanline < 240 || scanline == PRERENDER_LINE) {
+        if (render) {
+            if ((dot >= 2 && dot < 258) || (dot >= 321 && dot < 338)) {
+                bg_shift_lo <<= 1;
+                bg_shift_hi <<= 1;
+                bg_shift_at_lo <<= 1;
+                bg_shift_at_hi <<= 1;
+                fetch();
+            }
+            if (dot == 256) {
+                inc_y();
+            } else if (dot == 257) {
+                reload();
+                v = (v & ~0x041F) | (t & 0x041F);
+            } else if (dot == 321) {
+                line_ready = true;
+            } else if (dot == 338 || dot == 340) {
+                bg_nt = rd(0x2000 | (v & 0x0FFF));
+            }
+            if (scanline == PRERENDER_LINE && dot >= 280 && dot < 305) {
+                v = (v & ~0x7BE0) | (t & 0x7BE0);
+            }
+            if (dot == a12_dot && a12 != NULL) {
+                a12(context);
+            }
+        }
+        if (scanline < 240 && dot >= 1 && dot <= 256) {
+            if (dot == 1) {
+                line_scan = (renderer == RENDER_SCANLINE && render && line_ready);
+                composed = 0;
+                decoded = 0;
+            }
+            if (!line_scan) {
+                pixel();
+            }
+        }
+        if (dot == 257) {
+            flush();
+            line_scan = false;
+            evaluate();
+        }
+    }
+    if (dot == 1) {
+        if (scanline == VBLANK_LINE) {
+            vbl = true;
+            update_nmi();
+        } else if (scanline == PRERENDER_LINE) {
+            vbl = false;
+            sp0_hit = false;
+            sp_ovf = false;
+            update_nmi();
+        }
+    }
+
+    cycles++;
+    dot++;
+    // The last dot of the pre-render line is skipped on odd frames
+    if (scanline == PRERENDER_LINE && dot == 340 && odd && render) {
+        dot++;
+    }
+    if (dot == DOTS) {
+        dot = 0;
+        scanline++;
+        if (scanline == SCANLINES) {
+            scanline = 0;
+            frame_count++;
+            odd = !odd;
+        }
+    }
+}
+
+// Advance n dots without fetches, within the current line: the line is idle
+// (post-render, vblank) or rendering is disabled
+void PPU::advance(uint32_t n) {
+    if (scanline < 240 && drawing()) {
+        uint16_t first = (dot < 1 ? 1 : dot);
+        uint16_t last = (dot + n > 257 ? 257 : dot + n);
+        uint8_t color = palette[0];
+        if (grayscale) {
+            color &= 0x30;
+        }
+        uint16_t *out = &frame[scanline * 256];
+        for (uint16_t i = first; i < last; i++) {
+            out[i - 1] = color | emphasis();
+        }
+    }
+    // No sprite evaluation without rendering
+    if ((scanline < 240 || scanline == PRERENDER_LINE) && dot <= 257 && dot + n > 257) {
+        sp_count = 0;
+        sp_zero = false;
+    }
+    cycles += n;
+    dot += n;
+    if (dot == DOTS) {
+        dot = 0;
+        scanline++;
+        if (scanline == SCANLINES) {
+            scanline = 0;
+            frame_count++;
+            odd = !odd;
+        }
+    }
+}
+
+// The 8 dots of a tile fetch, from dot 2 + 8k to 9 + 8k of a rendered line
+// that is output by compose(), or of the pre-render line: as step() does,
+// with the shifts done at once
+void PPU::fetch_tile(void) {
+    uint16_t fine_y = (v >> 12) & 7;
+    bg_at = rd(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+    if (v & 0x40) {
+        bg_at >>= 4;
+    }
+    if (v & 0x02) {
+        bg_at >>= 2;
+    }
+    bg_at &= 3;
+    bg_lo = rd(bgpt_base + (bg_nt << 4) + fine_y);
+    bg_hi = rd(bgpt_base + (bg_nt << 4) + fine_y + 8);
+    int i = ((dot + 5) >> 3) + 2;
+    tile_lo[i] = bg_lo;
+    tile_hi[i] = bg_hi;
+    tile_at[i] = bg_at << 2;
+    inc_x();
+    bg_shift_lo = (bg_shift_lo << 8) | bg_lo;
+    bg_shift_hi = (bg_shift_hi << 8) | bg_hi;
+    bg_shift_at_lo = (bg_shift_at_lo << 8) | (bg_at & 1 ? 0xFF : 0x00);
+    bg_shift_at_hi = (bg_shift_at_hi << 8) | (bg_at & 2 ? 0xFF : 0x00);
+    bg_nt = rd(0x2000 | (v & 0x0FFF));
+    cycles += 8;
+    dot += 8;
+}
+
+// Dots 258-320 of a rendered line, up to n of them: no fetches, only the
+// vertical scroll copy of the pre-render line
+void PPU::hblank(uint32_t n) {
+    if (scanline == PRERENDER_LINE && dot < 305 && dot + n > 280) {
+        v = (v & ~0x7BE0) | (t & 0x7BE0);
+    }
+    cycles += n;
+    dot += n;
+}
+
+// Run until the dot counter reaches until_cycle, skipping over idle dots
+// and fetching tiles at once where nothing else happens
+void PPU::run(uint64_t until_cycle) {
+    while (cycles < until_cycle) {
+        if (!rendering() || (scanline >= 240 && scanline < PRERENDER_LINE)) {
+            if (dot == 1 && (scanline == VBLANK_LINE || scanline == PRERENDER_LINE)) {
+                step();
+                continue;
+            }
+            uint32_t n = DOTS - dot;
+            if (dot < 1 && (scanline == VBLANK_LINE || scanline == PRERENDER_LINE)) {
+                n = 1 - dot;
+            }
+            if (n > until_cycle - cycles) {
+                n = until_cycle - cycles;
+            }
+            advance(n);
+        } else if ((dot & 7) == 2 && dot < 250 && until_cycle - cycles >= 8
+            && (line_scan || scanline == PRERENDER_LINE)) {
+            fetch_tile();
+        } else if (dot >= 258 && dot < 321 && (a12 == NULL || a12_dot < dot || a12_dot > 320)) {
+            uint32_t n = 321 - dot;
+            if (n > until_cycle - cycles) {
+                n = until_cycle - cycles;
+            }
+            hblank(n);
+        } else {
+            step();
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Color output
+////////////////////////////////////////////////////////////////////////////////
+
+// NTSC palette, RGB
+static const uint8_t ntsc[64][3] = {
+    {  84,  84,  84 }, {   0,  30, 116 }, {   8,  16, 144 }, {  48,   0, 136 },
+    {  68,   0, 100 }, {  92,   0,  48 }, {  84,   4,   0 }, {  60,  24,   0 },
+    {  32,  42,   0 }, {   8,  58,   0 }, {   0,  64,   0 }, {   0,  60,   0 },
+    {   0,  50,  60 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+    { 152, 150, 152 }, {   8,  76, 196 }, {  48,  50, 236 }, {  92,  30, 228 },
+    { 136,  20, 176 }, { 160,  20, 100 }, { 152,  34,  32 }, { 120,  60,   0 },
+    {  84,  90,   0 }, {  40, 114,   0 }, {   8, 124,   0 }, {   0, 118,  40 },
+    {   0, 102, 120 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+    { 236, 238, 236 }, {  76, 154, 236 }, { 120, 124, 236 }, { 176,  98, 236 },
+    { 228,  84, 236 }, { 236,  88, 180 }, { 236, 106, 100 }, { 212, 136,  32 },
+    { 160, 170,   0 }, { 116, 196,   0 }, {  76, 208,  32 }, {  56, 204, 108 },
+    {  56, 180, 204 }, {  60,  60,  60 }, {   0,   0,   0 }, {   0,   0,   0 },
+    { 236, 238, 236 }, { 168, 204, 236 }, { 188, 188, 236 }, { 212, 178, 236 },
+    { 236, 174, 236 }, { 236, 174, 212 }, { 236, 180, 176 }, { 228, 196, 144 },
+    { 204, 210, 120 }, { 180, 222, 120 }, { 168, 226, 144 }, { 152, 226, 180 },
+    { 160, 214, 228 }, { 160, 162, 160 }, {   0,   0,   0 }, {   0,   0,   0 }
+};
+
+// Frame values to RGBA: each emphasis bit darkens the two other channels
+struct RGBATable {
+    uint32_t lut[512];
+    RGBATable(void) {
+        for (int i = 0; i < 512; i++) {
+            uint8_t pixel[4];
+            for (int c = 0; c < 3; c++) {
+                int value = ntsc[i & 0x3F][c];
+                if ((i >> 6) & ~(1 << c)) {
+                    value = value * 209 / 256;
+                }
+                pixel[c] = value;
+            }
+            pixel[3] = 0xFF;
+            memcpy(&lut[i], pixel, 4);
+        }
+    }
+};
+
+void PPU::rgba(uint32_t *out) {
+    static const RGBATable table;
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= 240 * 256; i += 8) {
+        __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&frame[i]));
+        _mm256_storeu_si256((__m256i *)&out[i],
+            _mm256_i32gather_epi32((const int *)table.lut, index, 4));
+    }
+#endif
+    for (; i < 240 * 256; i++) {
+        out[i] = table.lut[frame[i]];
+    }
+}
+
+uint64_t PPU::next_event(void) {
+    if (!nmi_vbl) {
+        return NO_EVENT;
+    }
+    uint64_t dots;
+    if (scanline < VBLANK_LINE || (scanline == VBLANK_LINE && dot <= 1)) {
+        dots = (VBLANK_LINE - scanline) * DOTS + 1 - dot;
+    } else {
+        dots = (SCANLINES - scanline) * DOTS - dot + VBLANK_LINE * DOTS + 1;
+        // Assume the pre-render line is one dot shorter if it may be
+        if (odd && (scanline < PRERENDER_LINE || dot < 340)) {
+            dots--;
+        }
+    }
+    return cycles + dots;
+}
+
+uint64_t PPU::a12_event(uint32_t n) {
+    if (a12_dot == DOTS || !rendering() || n == 0) {
+        return NO_EVENT;
+    }
+    uint64_t c = cycles;
+    uint16_t line = scanline;
+    uint16_t d = dot;
+    bool o = odd;
+    for (;;) {
+        if ((line < 240 || line == PRERENDER_LINE) && d <= a12_dot) {
+            if (--n == 0) {
+                return c + (a12_dot - d);
+            }
+        }
+        uint16_t length = (line == PRERENDER_LINE && o ? DOTS - 1 : DOTS);
+        c += (d < length ? length : DOTS) - d;
+        d = 0;
+        line++;
+        if (line == SCANLINES) {
+            line = 0;
+            o = !o;
+        }
+    }
+}
+
+void PPU::save(StateWriter &out) {
+    out.begin("PPU ", 1);
+    out.u64(cycles);
+    out.u16(scanline);
+    out.u16(dot);
+    out.u64(frame_count);
+    out.u8((add32 ? 1 << 2 : 0) | (sppt_base ? 1 << 3 : 0) | (bgpt_base ? 1 << 4 : 0)
+        | (ssz16 ? 1 << 5 : 0) | (bdout ? 1 << 6 : 0) | (nmi_vbl ? 1 << 7 : 0));
+    out.u8((grayscale ? 1 << 0 : 0) | (showbg_left ? 1 << 1 : 0) | (showsp_left ? 1 << 2 : 0)
+        | (showbg ? 1 << 3 : 0) | (showsp ? 1 << 4 : 0)
+        | (r_em ? 1 << 5 : 0) | (g_em ? 1 << 6 : 0) | (b_em ? 1 << 7 : 0));
+    out.u8((sp_ovf ? 1 << 0 : 0) | (sp0_hit ? 1 << 1 : 0) | (vbl ? 1 << 2 : 0)
+        | (w ? 1 << 3 : 0) | (odd ? 1 << 4 : 0) | (nmi_out ? 1 << 5 : 0)
+        | (line_ready ? 1 << 6 : 0) | (line_scan ? 1 << 7 : 0));
+    out.u8(last_write);
+    out.u8(oam_addr);
+    out.u8(oam_data);
+    out.u16(v);
+    out.u16(t);
+    out.u8(x);
+    out.u8(ppu_data);
+    out.bytes(OAM, sizeof(OAM));
+    out.bytes(palette, sizeof(palette));
+
+    out.u8(bg_nt);
+    out.u8(bg_at);
+    out.u8(bg_lo);
+    out.u8(bg_hi);
+    out.u16(bg_shift_lo);
+    out.u16(bg_shift_hi);
+    out.u16(bg_shift_at_lo);
+    out.u16(bg_shift_at_hi);
+    // All 8 sprite slots, unused ones as zeros, so that the size of a state
+    // does not change
+    out.u8(sp_count | (sp_zero ? 0x80 : 0));
+    for (int i = 0; i < 8; i++) {
+        bool used = (i < sp_count);
+        out.u8(used ? sp_lo[i] : 0);
+        out.u8(used ? sp_hi[i] : 0);
+        out.u8(used ? sp_attr[i] : 0);
+        out.u8(used ? sp_x[i] : 0);
+    }
+    out.bytes(tile_lo, sizeof(tile_lo));
+    out.bytes(tile_hi, sizeof(tile_hi));
+    out.bytes(tile_at, sizeof(tile_at));
+    out.u16(composed);
+    out.end();
+}
+
+bool PPU::load(StateReader &in) {
+    if (in.find("PPU ") != 1) {
+        return false;
+    }
+    cycles = in.u64();
+    scanline = in.u16();
+    dot = in.u16();
+    frame_count = in.u64();
+    uint8_t ctrl = in.u8();
+    add32 = ((ctrl & (1 << 2)) != 0);
+    sppt_base = (ctrl & (1 << 3) ? 0x1000 : 0x0000);
+    bgpt_base = (ctrl & (1 << 4) ? 0x1000 : 0x0000);
+    ssz16 = ((ctrl & (1 << 5)) != 0);
+    bdout = ((ctrl & (1 << 6)) != 0);
+    nmi_vbl = ((ctrl & (1 << 7)) != 0);
+    uint8_t mask = in.u8();
+    grayscale = ((mask & (1 << 0)) != 0);
+    showbg_left = ((mask & (1 << 1)) != 0);
+    showsp_left = ((mask & (1 << 2)) != 0);
+    showbg = ((mask & (1 << 3)) != 0);
+    showsp = ((mask & (1 << 4)) != 0);
+    r_em = ((mask & (1 << 5)) != 0);
+    g_em = ((mask & (1 << 6)) != 0);
+    b_em = ((mask & (1 << 7)) != 0);
+    uint8_t flags = in.u8();
+    sp_ovf = ((flags & (1 << 0)) != 0);
+    sp0_hit = ((flags & (1 << 1)) != 0);
+    vbl = ((flags & (1 << 2)) != 0);
+    w = ((flags & (1 << 3)) != 0);
+    odd = ((flags & (1 << 4)) != 0);
+    nmi_out = ((flags & (1 << 5)) != 0);
+    line_ready = ((flags & (1 << 6)) != 0);
+    line_scan = ((flags & (1 << 7)) != 0);
+    last_write = in.u8();
+    oam_addr = in.u8();
+    oam_data = in.u8();
+    v = in.u16();
+    t = in.u16();
+    x = in.u8();
+    ppu_data = in.u8();
+    in.bytes(OAM, sizeof(OAM));
+    in.bytes(palette, sizeof(palette));
+
+    bg_nt = in.u8();
+    bg_at = in.u8();
+    bg_lo = in.u8();
+    bg_hi = in.u8();
+    bg_shift_lo = in.u16();
+    bg_shift_hi = in.u16();
+    bg_shift_at_lo = in.u16();
+    bg_shift_at_hi = in.u16();
+    uint8_t count = in.u8();
+    sp_count = count & 0x0F;
+    sp_zero = ((count & 0x80) != 0);
+    if (sp_count > 8) {
+        return false;
+    }
+    for (int i = 0; i < 8; i++) {
+        sp_lo[i] = in.u8();
+        sp_hi[i] = in.u8();
+        sp_attr[i] = in.u8();
+        sp_x[i] = in.u8();
+    }
+    in.bytes(tile_lo, sizeof(tile_lo));
+    in.bytes(tile_hi, sizeof(tile_hi));
+    in.bytes(tile_at, sizeof(tile_at));
+    composed = in.u16();
+
+    // Derived state
+    sprite_lists = false;
+    decoded = 0;
+    sp_drawn = false;
+    update_a12();
+    return in.ok();
+}
 
+void PPU::log(FILE *stream) {
+    fprintf(stream, "PPU line=%3d dot=%3d v=%04X t=%04X x=%d w=%d %c%c%c\n",
+        scanline, dot, v, t, x, (w ? 1 : 0),
+        (vbl ? 'V' : '-'),
+        (sp0_hit ? 'S' : '-'),
+        (sp_ovf ? 'O' : '-'));
 }
@@ -3,22 +3,87 @@
 
 #include <cstdint>
 #include <cstdio>
+#include "state.h"
 
 class PPU {
 public:
     PPU(void);
 
-    uint32_t cycles;
+    uint64_t cycles;    // Dots since power-up
 
     void reset(void);
     void step(void);
+    void run(uint64_t until_cycle);
+
+    // Cycle of the next dot that may raise the NMI output, never later than
+    // the actual one; NO_EVENT if none can. The other effects of the PPU
+    // are only seen through its registers.
+    static const uint64_t NO_EVENT = UINT64_MAX;
+    uint64_t next_event(void);
+
+    // Cycle of the n-th next a12() call (n >= 1), if the PPU configuration
+    // stays the same; NO_EVENT if there are none
+    uint64_t a12_event(uint32_t n);
     void log(FILE *stream);
 
+    // Save states (chunk "PPU "): registers, OAM, palettes and the rendering
+    // pipeline, but not the frame output. The memory map is the mapper's.
+    void save(StateWriter &out);
+    bool load(StateReader &in);
+
     uint8_t read(uint16_t address);
     void write(uint16_t address, uint8_t data);
-    
-    uint8_t (*mem_read)(uint16_t address);
-    void (*mem_write)(uint16_t address, uint8_t data);
+
+    // OAM DMA: 256 bytes written through OAMDATA at once
+    void oam_dma(const uint8_t *data);
+
+    // Context passed to all the handlers below
+    void *context;
+
+    // Handlers for the pages of $0000-$3EFF that are not mapped to memory
+    uint8_t (*mem_read)(void *context, uint16_t address);
+    void (*mem_write)(void *context, uint16_t address, uint8_t data);
+
+    // Memory map, by 1 KiB pages of $0000-$3FFF ($3000-$3EFF mirror
+    // $2000-$2EFF): count pages starting at page are backed by mem,
+    // repeated every size bytes. Writes to read-only pages are dropped.
+    void map(uint8_t page, uint8_t count, uint8_t *mem, uint32_t size, bool writable);
+    void unmap(uint8_t page, uint8_t count);
+
+    // Called when PPU A12 rises on a rendered line, NULL if not needed
+    void (*a12)(void *context);
+
+    // NMI output, called when the level changes
+    void (*nmi)(void *context, bool level);
+
+    // Timing
+    static const int DOTS = 341;
+    static const int SCANLINES = 262;
+    static const int VBLANK_LINE = 241;
+    static const int PRERENDER_LINE = 261;
+
+    uint16_t scanline;
+    uint16_t dot;
+    uint64_t frame_count;
+
+    // Output: 6-bit color index, emphasis bits in bits 6-8
+    uint16_t frame[240 * 256];
+
+    // Pixel output, per dot (reference) or by spans of a scanline with SIMD
+    // decoding and compositing. Both produce the same frames.
+    enum Renderer { RENDER_DOT, RENDER_SCANLINE };
+    Renderer renderer;
+
+    // Write pixels to frame. When false, lines are not composed and only
+    // their sprite 0 hit is computed: the state seen by the CPU is the same.
+    bool draw;
+
+    // Frames not drawn after each drawn one, as with draw false (headless
+    // runs: 0 draws all of them)
+    uint32_t frame_skip;
+
+    // Convert frame to RGBA (bytes R, G, B, A in memory)
+    void rgba(uint32_t *out);
 
 private:
 
@@ -26,15 +91,14 @@ private:
     // CPU INTERFACE
     ////////////////////////////////////////////////////////////////////////////
 
-    // PPUCTRL
-    uint16_t nt_base;
+    // PPUCTRL (nametable select goes to t)
     bool add32;
     uint16_t sppt_base;
     uint16_t bgpt_base;
     bool ssz16;
     bool bdout;
     bool nmi_vbl;
-    
+
     // PPUMASK
     bool grayscale;
     bool showbg_left;
@@ -57,22 +121,16 @@ private:
     // OAMDATA
     uint8_t oam_data;
 
-    // For 16-bit registers
-    bool second_write;
-
-    // PPUSCROLL
-    uint8_t scroll_x;
-    uint8_t scroll_y;
-
-    // PPUADDR
-    uint16_t ppu_addr;
+    // PPUSCROLL / PPUADDR, as "loopy" registers:
+    // v and t are yyy NN YYYYY XXXXX (fine Y, nametable, coarse Y, coarse X)
+    uint16_t v;         // Current VRAM address
+    uint16_t t;         // Temporary VRAM address
+    uint8_t x;          // Fine X scroll
+    bool w;             // Write toggle
 
-    // PPUDATA
+    // PPUDATA read buffer
     uint8_t ppu_data;
 
-    // OAMDMA
-    uint16_t oam_dma_base;
-
     ////////////////////////////////////////////////////////////////////////////
     // INTERNAL PROCESSING
     ////////////////////////////////////////////////////////////////////////////
@@ -80,8 +138,85 @@ private:
     // OAM
     uint8_t OAM[256];
 
-    uint16_t scanline;
-    uint16_t dot;
+    // Palette RAM
+    uint8_t palette[32];
+
+    bool odd;           // Odd frame
+    bool nmi_out;       // Current NMI output level
+
+    // Background fetch latches and shift registers
+    uint8_t bg_nt;
+    uint8_t bg_at;
+    uint8_t bg_lo;
+    uint8_t bg_hi;
+    uint16_t bg_shift_lo;
+    uint16_t bg_shift_hi;
+    uint16_t bg_shift_at_lo;
+    uint16_t bg_shift_at_hi;
+
+    // Sprites found by evaluation on each line, as OAM indexes, bucketed in
+    // one pass over OAM and rebuilt only after OAM or the sprite size change
+    uint8_t line_sprites[240][8];
+    uint8_t line_sprite_count[240];
+    bool line_sprite_ovf[240];
+    bool sprite_lists;  // Up to date
+
+    // Sprites of the current line, fetched at the end of the previous line
+    uint8_t sp_count;
+    bool sp_zero;       // Sprite 0 is the first of them
+    uint8_t sp_lo[8];
+    uint8_t sp_hi[8];
+    uint8_t sp_attr[8];
+    uint8_t sp_x[8];
+
+    // Scanline renderer: background tiles of the line as fetched (2 from the
+    // previous line, 32 during the line) decoded to 4-bit palette indexes,
+    // and sprites decoded to 4-bit palette index | priority | sprite 0 bits
+    uint8_t tile_lo[34];
+    uint8_t tile_hi[34];
+    uint8_t tile_at[34];    // Palette, shifted to bits 2-3
+    uint8_t bg_line[34 * 8];
+    uint8_t sp_line[256 + 8];
+    bool sp_drawn;      // sp_line is of the current sprites
+    bool line_ready;    // Rendering was on for the prefetch of the next line
+    bool line_scan;     // Current line is output by compose()
+    uint16_t composed;  // Pixels of the current line output so far
+    uint8_t decoded;    // Tiles of the current line decoded so far
+
+    uint8_t *rd_page[16];
+    uint8_t *wr_page[16];
+    bool ro_page[16];       // Mapped read-only
+
+    // Dot of the rendered lines where A12 rises, for the pattern tables
+    // of background and sprites in use; DOTS if it stays low or high
+    uint16_t a12_dot;
+    void update_a12(void);
+
+    uint8_t rd(uint16_t address);
+    void wr(uint16_t address, uint8_t data);
+
+    bool rendering(void);
+    bool drawing(void);
+    void update_nmi(void);
+    uint8_t vram_read(uint16_t address);
+    void vram_write(uint16_t address, uint8_t data);
+    uint16_t emphasis(void);
+
+    void fetch(void);
+    void reload(void);
+    void inc_x(void);
+    void inc_y(void);
+    void pixel(void);
+    void bucket(void);
+    void evaluate(void);
+    void draw_sprites(void);
+    void flush(void);
+    void decode_tiles(uint16_t last);
+    void compose(uint16_t first, uint16_t last);
+    void hit(uint16_t first, uint16_t last);
+    void advance(uint32_t n);
+    void fetch_tile(void);
+    void hblank(uint32_t n);
 
 };
 
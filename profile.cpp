@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "profile.h"
+
+Profile::Profile(void) {
+    memset(pages, 0, sizeof(pages));
+    memset(banks, 0, sizeof(banks));
+    clear();
+}
+
+Profile::~Profile(void) {
+    for (std::map<Key, Page *>::iterator i = table.begin(); i != table.end(); ++i) {
+        delete i->second;
+    }
+}
+
+void Profile::clear(void) {
+    memset(opcodes, 0, sizeof(opcodes));
+    memset(ticks, 0, sizeof(ticks));
+    for (std::map<Key, Page *>::iterator i = table.begin(); i != table.end(); ++i) {
+        memset(i->second->counters, 0, sizeof(i->second->counters));
+    }
+}
+
+void Profile::map(uint8_t page, const uint8_t *mem) {
+    Key key(mem, page);
+    std::map<Key, Page *>::iterator i = table.find(key);
+    if (i == table.end()) {
+        Page *p = new Page;
+        p->bank = banks[page]++;
+        memset(p->counters, 0, sizeof(p->counters));
+        i = table.insert(std::make_pair(key, p)).first;
+    }
+    pages[page] = i->second->counters;
+}
+
+static bool most_cycles(const Profile::Entry &a, const Profile::Entry &b) {
+    if (a.counter.cycles != b.counter.cycles) {
+        return a.counter.cycles > b.counter.cycles;
+    }
+    return (a.pc != b.pc ? a.pc < b.pc : a.bank < b.bank);
+}
+
+void Profile::entries(std::vector<Entry> &out) {
+    out.clear();
+    for (std::map<Key, Page *>::iterator i = table.begin(); i != table.end(); ++i) {
+        const Page &p = *i->second;
+        for (int j = 0; j < 256; j++) {
+            if (p.counters[j].count == 0) {
+                continue;
+            }
+            Entry e;
+            e.pc = (i->first.second << 8) | j;
+            e.bank = p.bank;
+            e.counter = p.counters[j];
+            out.push_back(e);
+        }
+    }
+    std::sort(out.begin(), out.end(), most_cycles);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Report
+////////////////////////////////////////////////////////////////////////////////
+
+// Lines of an AS65 listing that hold an address:
+//   "1003 : a2ff             label   ldx #$ff  ;comment"
+// with the label, if any, in column 24 and '>' in column 23 for the lines
+// of a macro.
+struct Listing {
+    std::map<uint16_t, std::string> source;    // First line of code per address
+    std::map<uint16_t, std::string> labels;    // Last label per address
+};
+
+static bool hex4(const char *s, uint16_t &value) {
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        int d = (c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+            : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1);
+        if (d < 0) {
+            return false;
+        }
+        value = (value << 4) | d;
+    }
+    return true;
+}
+
+static bool read_listing(const char *path, Listing &listing) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        size_t n = strcspn(line, "\r\n");
+        line[n] = '\0';
+        uint16_t address;
+        if (n < 24 || strncmp(line + 4, " : ", 3) != 0 || !hex4(line, address)) {
+            continue;
+        }
+        const char *text = line + 24;
+        while (*text == ' ') {
+            text++;
+        }
+        if (line[7] != ' ' && *text != '\0' && listing.source.find(address) == listing.source.end()) {
+            listing.source[address] = text;
+        }
+        char c = line[24];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
+            size_t length = strcspn(line + 24, " \t:;");
+            listing.labels[address] = std::string(line + 24, length);
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+struct Routine {
+    const std::string *label;
+    uint16_t address;
+    Profile::Counter counter;
+};
+
+static bool most_routine_cycles(const Routine &a, const Routine &b) {
+    if (a.counter.cycles != b.counter.cycles) {
+        return a.counter.cycles > b.counter.cycles;
+    }
+    return a.address < b.address;
+}
+
+struct MostOpcodeCycles {
+    const Profile::Counter *opcodes;
+    MostOpcodeCycles(const Profile::Counter *opcodes) : opcodes(opcodes) {}
+    bool operator()(int a, int b) const {
+        return opcodes[a].cycles > opcodes[b].cycles;
+    }
+};
+
+static double percent(uint64_t part, uint64_t total) {
+    return (total != 0 ? 100.0 * part / total : 0.0);
+}
+
+bool Profile::report(FILE *out, const char *listing, uint32_t top) {
+    Listing lst;
+    bool ok = (listing == NULL || read_listing(listing, lst));
+
+    uint64_t count = 0;
+    uint64_t cycles = 0;
+    std::vector<int> ops;
+    for (int i = 0; i < 256; i++) {
+        count += opcodes[i].count;
+        cycles += opcodes[i].cycles;
+        if (opcodes[i].count != 0) {
+            ops.push_back(i);
+        }
+    }
+    fprintf(out, "%llu instructions, %llu cycles\n", (unsigned long long)count,
+        (unsigned long long)cycles);
+
+    std::stable_sort(ops.begin(), ops.end(), MostOpcodeCycles(opcodes));
+    fprintf(out, "\nOpcodes by cycles:\n  op        count       cycles      %%  cyc/op  ticks/op\n");
+    for (size_t i = 0; i < ops.size() && i < top; i++) {
+        const Counter &c = opcodes[ops[i]];
+        fprintf(out, "  %02X %12llu %12llu %6.2f %7.2f %9.1f\n", ops[i], (unsigned long long)c.count,
+            (unsigned long long)c.cycles, percent(c.cycles, cycles), (double)c.cycles / c.count,
+            (double)ticks[ops[i]] / c.count);
+    }
+
+    std::vector<Entry> pcs;
+    entries(pcs);
+    fprintf(out, "\nPCs by cycles:\n  PC   bank        count       cycles      %%  source\n");
+    for (size_t i = 0; i < pcs.size() && i < top; i++) {
+        const Entry &e = pcs[i];
+        std::map<uint16_t, std::string>::const_iterator s = lst.source.find(e.pc);
+        fprintf(out, "  %04X %4u %12llu %12llu %6.2f  %s\n", e.pc, e.bank,
+            (unsigned long long)e.counter.count, (unsigned long long)e.counter.cycles,
+            percent(e.counter.cycles, cycles), (s != lst.source.end() ? s->second.c_str() : ""));
+    }
+
+    if (lst.labels.empty()) {
+        return ok;
+    }
+    // Each PC goes to the closest label at or before it
+    std::vector<Routine> routines;
+    std::map<uint16_t, size_t> index;
+    for (size_t i = 0; i < pcs.size(); i++) {
+        std::map<uint16_t, std::string>::const_iterator l = lst.labels.upper_bound(pcs[i].pc);
+        if (l == lst.labels.begin()) {
+            continue;
+        }
+        --l;
+        std::map<uint16_t, size_t>::iterator r = index.find(l->first);
+        if (r == index.end()) {
+            Routine routine;
+            routine.label = &l->second;
+            routine.address = l->first;
+            routine.counter.count = 0;
+            routine.counter.cycles = 0;
+            r = index.insert(std::make_pair(l->first, routines.size())).first;
+            routines.push_back(routine);
+        }
+        routines[r->second].counter.count += pcs[i].counter.count;
+        routines[r->second].counter.cycles += pcs[i].counter.cycles;
+    }
+    std::sort(routines.begin(), routines.end(), most_routine_cycles);
+    fprintf(out, "\nRoutines by cycles:\n  addr        count       cycles      %%  label\n");
+    for (size_t i = 0; i < routines.size() && i < top; i++) {
+        const Routine &r = routines[i];
+        fprintf(out, "  %04X %12llu %12llu %6.2f  %s\n", r.address, (unsigned long long)r.counter.count,
+            (unsigned long long)r.counter.cycles, percent(r.counter.cycles, cycles), r.label->c_str());
+    }
+    return ok;
+}
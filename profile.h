@@ -0,0 +1,83 @@
+#ifndef NES_PROFILE_INCLUDED
+#define NES_PROFILE_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Where guest code spends its cycles, counted by a CPU6502 built with
+// CPU6502_PROFILE defined (see CPU6502::set_profile()): executions and
+// cycles per opcode and per PC, and host time stamp counter ticks per opcode
+// handler. The counters belong to one CPU and are plain integers, read them
+// from its thread or once it is stopped.
+//
+// Per-PC counters are kept by 256-byte page of the memory behind the PC, so
+// that the same PC in different banks is counted apart.
+class Profile {
+public:
+    struct Counter {
+        uint64_t count;     // Instructions run
+        uint64_t cycles;    // Their cycles, with DMA stalls, without interrupts
+    };
+
+    Counter opcodes[256];
+    uint64_t ticks[256];    // Host ticks in the handlers, 0 without a counter
+    Counter *pages[256];    // Per-PC counters of the pages mapped in the CPU
+
+    Profile(void);
+    ~Profile(void);
+
+    // Zero all the counters
+    void clear(void);
+
+    // Page of the CPU now backed by mem, NULL for I/O: called by the CPU
+    // when its memory map changes
+    void map(uint8_t page, const uint8_t *mem);
+
+    // Counters of one PC. Banks number the memories seen behind its page, in
+    // the order they were mapped.
+    struct Entry {
+        uint16_t pc;
+        uint16_t bank;
+        Counter counter;
+    };
+
+    // PCs that ran, most cycles first
+    void entries(std::vector<Entry> &out);
+
+    // Opcodes, then PCs, then routines by cycles, top lines of each. With a
+    // listing of the assembler (such as 6502_functional_test.lst), the PCs
+    // show their source line and the routines are those of its labels,
+    // whatever the bank. False if listing cannot be read.
+    bool report(FILE *out, const char *listing, uint32_t top);
+
+    // Host time stamp counter
+    static uint64_t now(void);
+
+private:
+    Profile(const Profile &);
+    Profile &operator=(const Profile &);
+
+    struct Page {
+        uint16_t bank;
+        Counter counters[256];
+    };
+    typedef std::pair<const uint8_t *, uint8_t> Key;    // Memory, CPU page
+    std::map<Key, Page *> table;
+    uint16_t banks[256];    // Memories seen per CPU page
+};
+
+inline uint64_t Profile::now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+#endif // NES_PROFILE_INCLUDED
@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include "cpu6502.h"
+#include "profile.h"
+
+// Profile of 6502_functional_test.bin, joined with its listing: where the
+// test spends its cycles, and the host cost of each opcode handler. Built
+// with CPU6502_PROFILE defined. The argument is the lines of each table.
+
+uint8_t mem[0x10000];
+
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
+}
+void cpu_write(void *context, uint16_t address, uint8_t data) {
+    ((uint8_t *)context)[address] = data;
+}
+
+int main(int argc, char **argv) {
+    uint32_t top = (argc > 1 ? atoi(argv[1]) : 20);
+    FILE *prog = fopen("6502_functional_test.bin", "r");
+    if (prog == NULL) {
+        fprintf(stderr, "Cannot open 6502_functional_test.bin\n");
+        return 1;
+    }
+    fread(mem, 1, 0x10000, prog);
+    fclose(prog);
+
+    CPU6502 cpu;
+    Profile profile;
+    cpu.context = mem;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.map(0x00, 0x100, mem, sizeof(mem), true);
+    cpu.reset();
+    cpu.opcode = mem[0x1000];
+    cpu.PC = 0x1000;
+    cpu.set_profile(&profile);
+    CPU6502::Stop stop = cpu.run(UINT64_MAX);
+    cpu.set_profile(NULL);
+    if (stop != CPU6502::STOP_LOOP || cpu.PC != 0x3B1C) {
+        printf("Failed at $%04X.\n", cpu.PC);
+        return 1;
+    }
+    if (!profile.report(stdout, "6502_functional_test.lst", top)) {
+        fprintf(stderr, "Cannot read 6502_functional_test.lst\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <cstdint>
+#include <cstring>
+#include "rewind.h"
+
+Rewind::Rewind(NES &nes, uint32_t frames, size_t bytes, uint32_t interval) : nes(nes) {
+    size = nes.state_size();
+    capacity = (frames > 1 ? frames - 1 : 1);
+    entries = new Entry[capacity];
+    data_size = bytes;
+    data = new uint8_t[data_size];
+    last = new uint8_t[size];
+    state = new uint8_t[size];
+    // Worst case: a literal token every 128 bytes
+    scratch = new uint8_t[size + size / 64 + 16];
+    this->interval = (interval > 0 ? interval : 1);
+    clear();
+}
+
+Rewind::~Rewind(void) {
+    delete[] entries;
+    delete[] data;
+    delete[] last;
+    delete[] state;
+    delete[] scratch;
+}
+
+void Rewind::clear(void) {
+    first = 0;
+    stored = 0;
+    tail = 0;
+    has_last = false;
+    serial = 0;
+}
+
+uint32_t Rewind::count(void) {
+    return stored + (has_last ? 1 : 0);
+}
+
+size_t Rewind::used(void) {
+    if (stored == 0) {
+        return 0;
+    }
+    size_t head = entry(0).offset;
+    // Bytes skipped at the end of the ring when a state did not fit there
+    // are counted as used
+    return (tail > head ? tail - head : data_size - head + tail);
+}
+
+size_t Rewind::memory(void) {
+    return data_size + capacity * sizeof(Entry) + 2 * size + (size + size / 64 + 16);
+}
+
+Rewind::Entry &Rewind::entry(uint32_t i) {
+    return entries[(first + i) % capacity];
+}
+
+// Find room for length contiguous bytes after the newest state, dropping the
+// oldest ones as needed
+bool Rewind::allocate(size_t length, size_t &offset) {
+    if (length > data_size) {
+        return false;
+    }
+    if (stored == capacity) {
+        first = (first + 1) % capacity;
+        stored--;
+    }
+    while (stored > 0) {
+        size_t head = entry(0).offset;
+        if (tail > head) {
+            if (tail + length <= data_size) {
+                break;
+            }
+            if (length <= head) {
+                tail = 0;
+                break;
+            }
+        } else if (tail + length <= head) {
+            break;
+        }
+        first = (first + 1) % capacity;
+        stored--;
+    }
+    if (stored == 0 && tail + length > data_size) {
+        tail = 0;
+    }
+    offset = tail;
+    tail += length;
+    return true;
+}
+
+// Run-length code a XOR b (b NULL for zeros): a control byte below $80 is
+// followed by that many + 1 literal bytes; otherwise, with the next byte,
+// it skips 15 bits worth of zero bytes
+size_t Rewind::encode(const uint8_t *a, const uint8_t *b, uint8_t *out) {
+    size_t n = 0;
+    size_t i = 0;
+    while (i < size) {
+        size_t zeros = 0;
+        while (i + zeros < size && a[i + zeros] == (b != NULL ? b[i + zeros] : 0)) {
+            zeros++;
+        }
+        i += zeros;
+        while (zeros > 0) {
+            size_t run = (zeros > 0x7FFF ? 0x7FFF : zeros);
+            out[n++] = 0x80 | (run >> 8);
+            out[n++] = run & 0xFF;
+            zeros -= run;
+        }
+        if (i == size) {
+            break;
+        }
+
+        // Literals, until 3 unchanged bytes in a row
+        size_t control = n++;
+        size_t length = 0;
+        while (i < size && length < 128) {
+            if (i + 3 <= size && b != NULL && a[i] == b[i] && a[i + 1] == b[i + 1] && a[i + 2] == b[i + 2]) {
+                break;
+            }
+            if (i + 3 <= size && b == NULL && a[i] == 0 && a[i + 1] == 0 && a[i + 2] == 0) {
+                break;
+            }
+            out[n++] = a[i] ^ (b != NULL ? b[i] : 0);
+            i++;
+            length++;
+        }
+        out[control] = length - 1;
+    }
+    return n;
+}
+
+// XOR a compressed state into out, cleared first for a keyframe
+void Rewind::apply(const Entry &e, uint8_t *out) {
+    if (e.keyframe) {
+        memset(out, 0, size);
+    }
+    const uint8_t *in = &data[e.offset];
+    const uint8_t *end = in + e.length;
+    size_t i = 0;
+    while (in < end) {
+        uint8_t control = *in++;
+        if (control & 0x80) {
+            i += ((control & 0x7F) << 8) | *in++;
+        } else {
+            for (int n = 0; n <= control; n++) {
+                out[i++] ^= *in++;
+            }
+        }
+    }
+}
+
+void Rewind::push(void) {
+    if (nes.save(state, size) != size) {
+        // Another cartridge: the history is of no use
+        clear();
+        return;
+    }
+    if (has_last) {
+        bool keyframe = ((serial - 1) % interval == 0);
+        size_t length = encode(last, (keyframe ? NULL : state), scratch);
+        size_t offset;
+        if (allocate(length, offset)) {
+            memcpy(&data[offset], scratch, length);
+            Entry &e = entry(stored++);
+            e.offset = offset;
+            e.length = length;
+            e.keyframe = keyframe;
+        } else {
+            // The older states need this one
+            first = stored = 0;
+            tail = 0;
+        }
+    }
+    uint8_t *swap = last;
+    last = state;
+    state = swap;
+    has_last = true;
+    serial++;
+}
+
+uint32_t Rewind::back(uint32_t n) {
+    if (!has_last || n == 0) {
+        return 0;
+    }
+    if (n > count()) {
+        n = count();
+    }
+    if (n > 1) {
+        // Rebuild the target from the nearest keyframe above it, or from
+        // the newest state
+        uint32_t target = stored - (n - 1);
+        uint32_t i = target;
+        while (i < stored && !entry(i).keyframe) {
+            i++;
+        }
+        if (i < stored) {
+            apply(entry(i), last);
+        }
+        while (i > target) {
+            apply(entry(--i), last);
+        }
+        tail = entry(target).offset;
+        stored = target;
+    }
+    if (!nes.load(last, size)) {
+        clear();
+        return 0;
+    }
+
+    // The loaded state is dropped: make the next one whole
+    if (stored > 0) {
+        stored--;
+        apply(entry(stored), last);
+        tail = entry(stored).offset;
+    } else {
+        has_last = false;
+    }
+    serial -= n;
+    return n;
+}
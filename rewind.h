@@ -0,0 +1,74 @@
+#ifndef NES_REWIND_INCLUDED
+#define NES_REWIND_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include "nes.h"
+
+// Rewind history of a NES: save states pushed once per frame, kept in fixed
+// memory allocated up front. The newest state is kept whole; each older one
+// is stored run-length compressed, as a keyframe every interval states and
+// otherwise as its XOR with the next newer state. Stepping back one state
+// applies a single delta, and when the memory is full the oldest states are
+// dropped without touching the others.
+class Rewind {
+public:
+    // Up to frames states in bytes of compressed storage, for the cartridge
+    // currently inserted in nes
+    Rewind(NES &nes, uint32_t frames, size_t bytes, uint32_t interval);
+    ~Rewind(void);
+
+    // Record the current state
+    void push(void);
+
+    // Load the n-th newest state (n >= 1) and drop it with the newer ones,
+    // so that the next call goes further back. Costs at most interval delta
+    // applications. Returns the number of states stepped back, 0 if there
+    // are none or the load failed.
+    uint32_t back(uint32_t n);
+
+    // States recorded
+    uint32_t count(void);
+
+    // Bytes of compressed storage in use, and allocated in total
+    size_t used(void);
+    size_t memory(void);
+
+    void clear(void);
+
+private:
+    Rewind(const Rewind &);
+    Rewind &operator=(const Rewind &);
+
+    NES &nes;
+    size_t size;            // Save state size
+
+    // Compressed states, oldest first, in a ring of descriptors over a ring
+    // of bytes where each one is contiguous
+    struct Entry {
+        uint32_t offset;
+        uint32_t length;
+        bool keyframe;
+    };
+    Entry *entries;
+    uint32_t capacity;      // Descriptors
+    uint32_t first;         // Oldest descriptor
+    uint32_t stored;        // Descriptors in use
+    uint8_t *data;
+    size_t data_size;
+    size_t tail;            // Where the next one goes
+
+    uint8_t *last;          // Newest state, if any
+    bool has_last;
+    uint8_t *state;         // State being pushed
+    uint8_t *scratch;       // Compression output
+    uint64_t serial;        // States pushed, for the keyframe interval
+    uint32_t interval;
+
+    Entry &entry(uint32_t i);
+    bool allocate(size_t length, size_t &offset);
+    size_t encode(const uint8_t *a, const uint8_t *b, uint8_t *out);
+    void apply(const Entry &e, uint8_t *out);
+};
+
+#endif // NES_REWIND_INCLUDED
@@ -0,0 +1,137 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "rollback.h"
+
+Rollback::Rollback(NES &nes, int player, uint32_t window) : nes(nes) {
+    local = player;
+    this->window = (window > 0 ? window : 1);
+    size = nes.state_size();
+    states = new uint8_t[this->window * size];
+    hashes = new uint64_t[this->window];
+    inputs = new uint8_t[2 * this->window][2];
+    known = new bool[2 * this->window];
+    memset(inputs, 0, 2 * this->window * 2);
+    memset(known, 0, 2 * this->window * sizeof(bool));
+    latest = 0;
+    frames = 0;
+    confirmed = 0;
+    pending = NONE;
+    rollbacks = 0;
+    replayed = 0;
+}
+
+Rollback::~Rollback(void) {
+    delete[] states;
+    delete[] hashes;
+    delete[] inputs;
+    delete[] known;
+}
+
+// Save the state at the start of the frame, then run it
+void Rollback::step(uint32_t frame) {
+    uint32_t s = frame % window;
+    hashes[s] = nes.hash();
+    nes.save(&states[s * size], size);
+    uint32_t i = frame % (2 * window);
+    if (!known[i]) {
+        inputs[i][1 - local] = latest;
+    }
+    nes.pad[0] = inputs[i][0];
+    nes.pad[1] = inputs[i][1];
+    nes.run_frame();
+}
+
+void Rollback::catch_up(void) {
+    if (pending == NONE) {
+        return;
+    }
+    if (!nes.load(&states[(pending % window) * size], size)) {
+        fprintf(stderr, "Rollback: cannot load frame %u\n", pending);
+        pending = NONE;
+        return;
+    }
+    nes.set_fast_forward(true);
+    for (uint32_t f = pending; f < frames; f++) {
+        step(f);
+    }
+    nes.set_fast_forward(false);
+    rollbacks++;
+    replayed += frames - pending;
+    pending = NONE;
+}
+
+void Rollback::frame(uint8_t input) {
+    catch_up();
+    inputs[frames % (2 * window)][local] = input;
+    step(frames);
+    frames++;
+    // The slot of the frame now allowed furthest ahead was one that left
+    // the window
+    known[(frames + window - 1) % (2 * window)] = false;
+}
+
+bool Rollback::remote(uint32_t frame, uint8_t input) {
+    if (frame + window < frames || frame >= frames + window) {
+        return false;
+    }
+    uint32_t i = frame % (2 * window);
+    if (known[i]) {
+        return true;
+    }
+    known[i] = true;
+    if (frame < frames && inputs[i][1 - local] != input && (pending == NONE || frame < pending)) {
+        pending = frame;
+    }
+    inputs[i][1 - local] = input;
+    latest = input;
+    while (confirmed < frames + window && known[confirmed % (2 * window)]) {
+        confirmed++;
+    }
+    return true;
+}
+
+bool Rollback::checksum(uint32_t frame, uint64_t &hash) {
+    if (frame >= frames || frame + window < frames || frame > confirmed
+        || (pending != NONE && frame > pending)) {
+        return false;
+    }
+    hash = hashes[frame % window];
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LOOPBACK TRANSPORT
+////////////////////////////////////////////////////////////////////////////////
+
+Loopback::Loopback(uint32_t latency) {
+    this->latency = latency;
+    now = 0;
+    head[0] = head[1] = 0;
+    tail[0] = tail[1] = 0;
+}
+
+void Loopback::send(int to, uint32_t frame, uint8_t input) {
+    if (tail[to] - head[to] == QUEUE) {
+        fprintf(stderr, "Loopback: queue full\n");
+        return;
+    }
+    Message &m = queue[to][tail[to]++ % QUEUE];
+    m.due = now + latency;
+    m.frame = frame;
+    m.input = input;
+}
+
+bool Loopback::receive(int to, uint32_t &frame, uint8_t &input) {
+    if (head[to] == tail[to] || queue[to][head[to] % QUEUE].due > now) {
+        return false;
+    }
+    Message &m = queue[to][head[to]++ % QUEUE];
+    frame = m.frame;
+    input = m.input;
+    return true;
+}
+
+void Loopback::tick(void) {
+    now++;
+}
@@ -0,0 +1,94 @@
+#ifndef NES_ROLLBACK_INCLUDED
+#define NES_ROLLBACK_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include "nes.h"
+
+// Two-player session with rollback: each peer runs its own NES, applies the
+// local input at once and predicts the remote one by repeating the last one
+// received. When a remote input arrives late and differs from its
+// prediction, the next frame first loads the state from before that input
+// and runs the frames since again in fast-forward with the corrected inputs.
+// The states of the last window frames are kept for that, with a hash to
+// compare between peers.
+class Rollback {
+public:
+    // Session for player (0 or 1) on nes, which must be reset already
+    Rollback(NES &nes, int player, uint32_t window);
+    ~Rollback(void);
+
+    // Run the next frame with the local input
+    void frame(uint8_t input);
+
+    // Run the frames with late inputs again now, rather than at the next
+    // frame()
+    void catch_up(void);
+
+    // Remote input of a frame, in frame order. Returns false if the frame is
+    // out of the window: too late to correct, or too far ahead.
+    bool remote(uint32_t frame, uint8_t input);
+
+    uint32_t frames;        // Frames run
+    uint32_t confirmed;     // Frames from the first one with the remote input
+
+    // Hash of the state at the start of a frame, if its inputs are all
+    // confirmed and it is still in the window
+    bool checksum(uint32_t frame, uint64_t &hash);
+
+    // Statistics
+    uint32_t rollbacks;     // Times a frame was loaded again
+    uint32_t replayed;      // Frames run again
+
+private:
+    Rollback(const Rollback &);
+    Rollback &operator=(const Rollback &);
+
+    static const uint32_t NONE = UINT32_MAX;
+
+    NES &nes;
+    int local;
+    uint32_t window;
+    size_t size;
+
+    // State at the start of each of the last window frames
+    uint8_t *states;
+    uint64_t *hashes;
+
+    // Inputs from window frames back to window frames ahead, by player
+    uint8_t (*inputs)[2];
+    bool *known;            // Remote input received
+    uint8_t latest;         // Last remote input received, the prediction
+
+    uint32_t pending;       // First frame to run again, NONE if none
+
+    void step(uint32_t frame);
+};
+
+// Transport between two sessions in the same process: inputs reach the
+// other peer in order, latency frames after they are sent
+class Loopback {
+public:
+    Loopback(uint32_t latency);
+
+    void send(int to, uint32_t frame, uint8_t input);
+    bool receive(int to, uint32_t &frame, uint8_t &input);
+
+    // One frame passes
+    void tick(void);
+
+private:
+    static const uint32_t QUEUE = 256;
+    struct Message {
+        uint64_t due;
+        uint32_t frame;
+        uint8_t input;
+    };
+    Message queue[2][QUEUE];
+    uint32_t head[2];
+    uint32_t tail[2];
+    uint64_t now;
+    uint32_t latency;
+};
+
+#endif // NES_ROLLBACK_INCLUDED
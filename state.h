@@ -0,0 +1,177 @@
+#ifndef NES_STATE_INCLUDED
+#define NES_STATE_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Save state format: a header, then chunks made of a 4-character tag, a
+// 32-bit payload length and a version byte. Readers look chunks up by tag
+// and skip the ones they do not know. Values are little-endian, flags are
+// packed in bytes by their owner.
+static const char STATE_MAGIC[4] = { 'N', 'E', 'S', 'S' };
+static const uint16_t STATE_VERSION = 1;
+static const size_t STATE_HEADER = 8;
+static const size_t CHUNK_HEADER = 9;
+
+// Serializes into a caller-provided buffer; with a NULL buffer, only counts
+// the bytes needed and hashes them
+class StateWriter {
+public:
+    StateWriter(uint8_t *buffer, size_t size) : buffer(buffer), capacity(size), pos(0), chunk(0), digest(FNV_OFFSET) {
+        bytes(STATE_MAGIC, 4);
+        u16(STATE_VERSION);
+        u16(0);
+    }
+
+    void begin(const char *tag, uint8_t version) {
+        bytes(tag, 4);
+        chunk = pos;
+        u32(0);
+        u8(version);
+    }
+
+    // Patch the length of the current chunk
+    void end(void) {
+        if (buffer != NULL && pos <= capacity) {
+            uint32_t length = pos - chunk - 5;
+            for (int i = 0; i < 4; i++) {
+                buffer[chunk + i] = length >> (8 * i);
+            }
+        }
+    }
+
+    void u8(uint8_t v) {
+        if (buffer == NULL) {
+            digest = (digest ^ v) * FNV_PRIME;
+        } else if (pos < capacity) {
+            buffer[pos] = v;
+        }
+        pos++;
+    }
+    void u16(uint16_t v) {
+        u8(v);
+        u8(v >> 8);
+    }
+    void u32(uint32_t v) {
+        u16(v);
+        u16(v >> 16);
+    }
+    void u64(uint64_t v) {
+        u32(v);
+        u32(v >> 32);
+    }
+    void bytes(const void *data, size_t n) {
+        if (buffer == NULL) {
+            const uint8_t *p = (const uint8_t *)data;
+            for (size_t i = 0; i < n; i++) {
+                digest = (digest ^ p[i]) * FNV_PRIME;
+            }
+        } else if (n != 0 && pos + n <= capacity) {
+            memcpy(&buffer[pos], data, n);
+        }
+        pos += n;
+    }
+
+    size_t size(void) {
+        return pos;
+    }
+    // Everything fit in the buffer
+    bool ok(void) {
+        return buffer != NULL && pos <= capacity;
+    }
+
+    // FNV-1a hash of the bytes, without a buffer. The chunk lengths are
+    // not patched in and not hashed.
+    uint64_t hash(void) {
+        return digest;
+    }
+
+private:
+    static const uint64_t FNV_OFFSET = 0xCBF29CE484222325ULL;
+    static const uint64_t FNV_PRIME = 0x100000001B3ULL;
+
+    uint8_t *buffer;
+    size_t capacity;
+    size_t pos;
+    size_t chunk;
+    uint64_t digest;
+};
+
+class StateReader {
+public:
+    StateReader(const uint8_t *buffer, size_t size) : buffer(buffer), size(size), pos(0), limit(0), error(false) {
+        valid = (size >= STATE_HEADER && memcmp(buffer, STATE_MAGIC, 4) == 0
+            && (buffer[4] | (buffer[5] << 8)) <= STATE_VERSION);
+    }
+
+    // Move to the payload of the chunk with the tag; returns its version,
+    // or -1 if there is none
+    int find(const char *tag) {
+        size_t p = STATE_HEADER;
+        while (valid && p + CHUNK_HEADER <= size) {
+            uint32_t length = buffer[p + 4] | (buffer[p + 5] << 8)
+                | (buffer[p + 6] << 16) | ((uint32_t)buffer[p + 7] << 24);
+            if (length > size - p - CHUNK_HEADER) {
+                break;
+            }
+            if (memcmp(&buffer[p], tag, 4) == 0) {
+                pos = p + CHUNK_HEADER;
+                limit = pos + length;
+                error = false;
+                return buffer[p + 8];
+            }
+            p += CHUNK_HEADER + length;
+        }
+        pos = limit = 0;
+        error = true;
+        return -1;
+    }
+
+    uint8_t u8(void) {
+        if (pos >= limit) {
+            error = true;
+            return 0;
+        }
+        return buffer[pos++];
+    }
+    uint16_t u16(void) {
+        uint16_t v = u8();
+        return v | (u8() << 8);
+    }
+    uint32_t u32(void) {
+        uint32_t v = u16();
+        return v | ((uint32_t)u16() << 16);
+    }
+    uint64_t u64(void) {
+        uint64_t v = u32();
+        return v | ((uint64_t)u32() << 32);
+    }
+    void bytes(void *data, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        if (pos + n > limit) {
+            error = true;
+            memset(data, 0, n);
+            return;
+        }
+        memcpy(data, &buffer[pos], n);
+        pos += n;
+    }
+
+    // No read went past the end of the chunk
+    bool ok(void) {
+        return valid && !error;
+    }
+
+private:
+    const uint8_t *buffer;
+    size_t size;
+    size_t pos;
+    size_t limit;
+    bool valid;
+    bool error;
+};
+
+#endif // NES_STATE_INCLUDED
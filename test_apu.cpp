@@ -0,0 +1,255 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "nes.h"
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+bool irq_level = false;
+void apu_irq(void *, bool level) {
+    irq_level = level;
+}
+
+int fetches = 0;
+uint8_t dmc_read(void *, uint16_t address) {
+    fetches++;
+    return address * 0x35;
+}
+
+void test_frame_counter(void) {
+    APU apu;
+    apu.irq = apu_irq;
+    irq_level = false;
+
+    // 4-step sequence, restarted 3 cycles after the write
+    apu.write(0x4017, 0x00);
+    check(apu.next_event() == 3 + 29828, "frame IRQ event");
+    apu.run(3 + 29828);
+    check(!irq_level, "no frame IRQ before step 3");
+    apu.run(3 + 29829);
+    check(irq_level, "frame IRQ");
+    check(apu.read(0x4015) == 0x40 && !irq_level, "frame IRQ acknowledged");
+    check(apu.next_event() == 3 + 29829, "frame IRQ raised again");
+    apu.run(3 + 29831);
+    check(apu.read(0x4015) == 0x40, "frame IRQ on the last step");
+    check(apu.next_event() == 3 + 29830 + 29828, "next frame IRQ event");
+
+    // Inhibited, 5-step
+    apu.write(0x4017, 0x40);
+    check(apu.next_event() == APU::NO_EVENT, "frame IRQ inhibited");
+    apu.write(0x4017, 0x80);
+    apu.run(apu.cycles + 3 * 37282);
+    check(!irq_level && apu.next_event() == APU::NO_EVENT, "no frame IRQ in 5-step mode");
+
+    // Length counters: two half frames per 4-step sequence
+    apu.write(0x4017, 0x40);
+    uint64_t start = apu.cycles + 3;
+    apu.write(0x4015, 0x01);
+    apu.write(0x4003, 0x18);
+    check(apu.read(0x4015) == 0x01, "length counter loaded");
+    apu.run(start + 29829);
+    check(apu.read(0x4015) == 0x01, "length counter running");
+    apu.run(start + 29830);
+    check(apu.read(0x4015) == 0x00, "length counter expired");
+    apu.write(0x4015, 0x00);
+    apu.write(0x4003, 0x18);
+    check(apu.read(0x4015) == 0x00, "length counter not loaded when disabled");
+}
+
+void test_dmc(void) {
+    APU apu;
+    apu.irq = apu_irq;
+    apu.dmc_read = dmc_read;
+    irq_level = false;
+    fetches = 0;
+
+    // 17 bytes from $C000 at the highest rate, first one fetched at once
+    apu.write(0x4017, 0x40);
+    apu.write(0x4010, 0x8F);
+    apu.write(0x4012, 0x00);
+    apu.write(0x4013, 0x01);
+    apu.write(0x4015, 0x10);
+    check(fetches == 1 && apu.read(0x4015) == 0x10, "DMC started");
+    uint64_t event = apu.next_event();
+    apu.run(event);
+    check(fetches == 16 && !irq_level, "no DMC IRQ before the last fetch");
+    apu.run(event + 1);
+    check(fetches == 17 && irq_level, "DMC IRQ");
+    check(apu.read(0x4015) == 0x80, "DMC IRQ flag");
+    apu.write(0x4015, 0x00);
+    check(!irq_level, "DMC IRQ acknowledged");
+}
+
+// A 440 Hz square wave, after silence
+void test_output(void) {
+    APU apu;
+    std::vector<int16_t> out(APU::BUFFER_SIZE);
+    apu.run(178977);
+    uint32_t n = apu.samples(&out[0], out.size());
+    check(n == 4799 || n == 4800, "samples of silence");
+    bool quiet = true;
+    for (uint32_t i = 0; i < n; i++) {
+        quiet = quiet && abs(out[i]) < 2;
+    }
+    check(quiet, "silence");
+
+    apu.write(0x4000, 0xBF);
+    apu.write(0x4002, 253);
+    apu.write(0x4015, 0x01);
+    apu.write(0x4003, 0x00);
+    int crossings = 0;
+    int peak = 0;
+    int16_t last = 0;
+    uint32_t total = 0;
+    for (int i = 0; i < 60; i++) {
+        apu.run(178977 + (i + 1) * 1789773 / 60);
+        n = apu.samples(&out[0], out.size());
+        for (uint32_t j = 0; j < n; j++) {
+            crossings += (last < 0 && out[j] >= 0);
+            last = out[j];
+            peak = (abs(out[j]) > peak ? abs(out[j]) : peak);
+        }
+        total += n;
+    }
+    check(total >= 47999 && total <= 48001, "sample rate");
+    check(crossings >= 438 && crossings <= 442, "square wave frequency");
+    check(peak > 2000 && peak < 32767, "square wave amplitude");
+}
+
+// Register writes at fixed cycles, with the APU run only at the writes or
+// in small random steps: the output and the flags must not depend on it
+struct Write {
+    uint32_t cycle;
+    uint16_t address;
+    uint8_t data;
+};
+
+static const Write program[] = {
+    {    100, 0x4017, 0x00 }, {    200, 0x4015, 0x1F },
+    {    300, 0x4000, 0x9A }, {    310, 0x4001, 0xA2 }, {    320, 0x4002, 0x80 }, {    330, 0x4003, 0x21 },
+    {    400, 0x4004, 0x5F }, {    410, 0x4006, 0x40 }, {    420, 0x4007, 0x09 },
+    {    500, 0x4008, 0x20 }, {    510, 0x400A, 0xC0 }, {    520, 0x400B, 0x08 },
+    {    600, 0x400C, 0x03 }, {    610, 0x400E, 0x05 }, {    620, 0x400F, 0x10 },
+    {    700, 0x4010, 0x8C }, {    710, 0x4012, 0x10 }, {    720, 0x4013, 0x02 }, {    730, 0x4015, 0x1F },
+    {  40000, 0x400E, 0x83 }, {  50000, 0x4011, 0x40 }, {  60000, 0x4001, 0x00 },
+    {  70000, 0x4017, 0x80 }, {  90000, 0x4015, 0x0F }, { 120000, 0x4008, 0x00 },
+    { 150000, 0x400B, 0x30 }, { 200000, 0x4015, 0x00 }, { 250000, 0x4017, 0x00 }
+};
+
+std::vector<int16_t> run_program(bool lazy, std::vector<uint8_t> &status) {
+    APU apu;
+    apu.dmc_read = dmc_read;
+    std::vector<int16_t> samples;
+    int16_t buffer[256];
+    uint32_t seed = 1;
+    const uint64_t until = 300000;
+    size_t w = 0;
+    while (apu.cycles < until) {
+        uint64_t next = (w < sizeof(program) / sizeof(program[0]) ? program[w].cycle : until);
+        if (!lazy) {
+            seed = seed * 1103515245 + 12345;
+            uint64_t step = apu.cycles + 1 + (seed >> 16) % 100;
+            if (step < next) {
+                next = step;
+            }
+        }
+        apu.run(next);
+        if (w < sizeof(program) / sizeof(program[0]) && apu.cycles == program[w].cycle) {
+            apu.write(program[w].address, program[w].data);
+            if (program[w].address == 0x4015) {
+                status.push_back(apu.read(0x4015));
+            }
+            w++;
+        }
+        uint32_t n;
+        while ((n = apu.samples(buffer, 256)) != 0) {
+            samples.insert(samples.end(), buffer, buffer + n);
+        }
+    }
+    status.push_back(apu.read(0x4015));
+    return samples;
+}
+
+void test_lazy(void) {
+    std::vector<uint8_t> sa, sb;
+    std::vector<int16_t> a = run_program(true, sa);
+    std::vector<int16_t> b = run_program(false, sb);
+    check(a.size() > 8000, "samples");
+    check(a == b, "same samples");
+    check(sa == sb, "same status");
+    int changes = 0;
+    for (size_t i = 1; i < a.size(); i++) {
+        changes += (a[i] != a[i - 1]);
+    }
+    check(changes > 1000, "sound");
+}
+
+// Frame IRQs through the CPU, with the APU run by instruction or only when
+// accessed or due
+uint8_t prg[0x8000];
+
+std::vector<uint64_t> run_frame_irq(bool lockstep, uint64_t until) {
+    NES nes;
+    nes.cpu.map(0x80, 0x80, prg, sizeof(prg), false);
+    nes.reset();
+    std::vector<uint64_t> irqs;
+    if (lockstep) {
+        while (nes.cpu.cycles < until) {
+            nes.cpu.step();
+            nes.ppu.run(nes.cpu.cycles * 3);
+            nes.apu.run(nes.cpu.cycles);
+            if (nes.cpu.PC == 0x8010) {
+                irqs.push_back(nes.cpu.cycles);
+            }
+        }
+    } else {
+        nes.cpu.breakpoint = 0x8010;
+        while (nes.run(until) == CPU6502::STOP_BREAKPOINT) {
+            irqs.push_back(nes.cpu.cycles);
+        }
+    }
+    irqs.push_back(nes.cpu.cycles);
+    irqs.push_back(nes.ram[0]);
+    return irqs;
+}
+
+void test_frame_irq(void) {
+    static const uint8_t code[] = {
+        0xA9, 0x00, 0x8D, 0x17, 0x40,   // LDA #$00 / STA $4017
+        0x58,                           // CLI
+        0x4C, 0x06, 0x80,               // JMP *
+        0, 0, 0, 0, 0, 0, 0,
+        0xAD, 0x15, 0x40,               // IRQ: LDA $4015
+        0xE6, 0x00, 0x40 };             // INC $00 / RTI
+    memset(prg, 0, sizeof(prg));
+    memcpy(prg, code, sizeof(code));
+    prg[0x7FFC] = 0x00;
+    prg[0x7FFD] = 0x80;
+    prg[0x7FFE] = 0x10;
+    prg[0x7FFF] = 0x80;
+    uint64_t until = 10 * 29830 + 100;
+    std::vector<uint64_t> a = run_frame_irq(true, until);
+    std::vector<uint64_t> b = run_frame_irq(false, until);
+    check(a.size() == 12 && a.back() == 10, "frame IRQs taken");
+    check(a == b, "frame IRQs at the same cycles");
+}
+
+int main() {
+    test_frame_counter();
+    test_dmc();
+    test_output();
+    test_lazy();
+    test_frame_irq();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,117 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "batch.h"
+#include "test_game.h"
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Inputs that change every few frames, different for each console
+Batch::Input input(uint32_t console, uint32_t frame) {
+    Batch::Input in;
+    for (int p = 0; p < 2; p++) {
+        uint32_t h = (frame / (3 + p * 2) + 1) * 2654435761u + (console * 2 + p) * 40503u;
+        in.pad[p] = (h >> 13) & 0xFF;
+    }
+    return in;
+}
+
+// Consoles with runs of different lengths, twice in a row on 4 workers: the
+// same RAM after each frame and the same final frame as when run one by one
+void test_batch(void) {
+    const uint32_t CONSOLES = 8;
+    Batch batch(4);
+    check(batch.threads() == 4, "workers");
+    for (uint32_t i = 0; i < CONSOLES; i++) {
+        setup(batch.add());
+    }
+    check(batch.size() == CONSOLES, "consoles");
+
+    std::vector<std::vector<Batch::Input> > inputs[2];
+    std::vector<Batch::Output> outputs[2];
+    for (int run = 0; run < 2; run++) {
+        inputs[run].resize(CONSOLES);
+        for (uint32_t i = 0; i < CONSOLES; i++) {
+            uint32_t frames = (run == 0 ? 5 + (i % 4) * 10 : (i == 3 ? 0 : 20));
+            for (uint32_t f = 0; f < frames; f++) {
+                inputs[run][i].push_back(input(i, run * 100 + f));
+            }
+        }
+        batch.run(inputs[run], outputs[run]);
+    }
+
+    bool same = true;
+    bool hits = true;
+    for (uint32_t i = 0; i < CONSOLES; i++) {
+        NES nes;
+        setup(nes);
+        for (int run = 0; run < 2; run++) {
+            const Batch::Output &out = outputs[run][i];
+            same = same && out.stop == CPU6502::STOP_BUDGET && out.frames == inputs[run][i].size();
+            same = same && out.ram.size() == out.frames * sizeof(nes.ram);
+            for (uint32_t f = 0; f < inputs[run][i].size() && same; f++) {
+                nes.pad[0] = inputs[run][i][f].pad[0];
+                nes.pad[1] = inputs[run][i][f].pad[1];
+                nes.run_frame();
+                same = memcmp(&out.ram[f * sizeof(nes.ram)], nes.ram, sizeof(nes.ram)) == 0;
+            }
+            same = same && out.frame.size() == 240 * 256
+                && memcmp(&out.frame[0], nes.ppu.frame, sizeof(nes.ppu.frame)) == 0;
+        }
+        same = same && batch.console(i).hash() == nes.hash();
+        hits = hits && nes.ram[0x05] > 5;
+    }
+    check(same, "same as one by one");
+    check(hits, "sprite 0 hits");
+}
+
+// Frames per second of many consoles in fast-forward, on one worker and on
+// one per core
+void test_throughput(void) {
+    uint32_t cores = std::thread::hardware_concurrency();
+    if (cores == 0) {
+        cores = 1;
+    }
+    const uint32_t FRAMES = 20;
+    uint32_t consoles = 4 * cores;
+    double rate[2];
+    uint32_t threads[2] = { 1, cores };
+    for (int t = 0; t < 2; t++) {
+        Batch batch(threads[t]);
+        std::vector<std::vector<Batch::Input> > inputs(consoles);
+        for (uint32_t i = 0; i < consoles; i++) {
+            NES &nes = batch.add();
+            setup(nes);
+            nes.set_fast_forward(true);
+            for (uint32_t f = 0; f < FRAMES; f++) {
+                inputs[i].push_back(input(i, f));
+            }
+        }
+        std::vector<Batch::Output> outputs;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        batch.run(inputs, outputs);
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        rate[t] = consoles * FRAMES / std::chrono::duration<double>(t1 - t0).count();
+    }
+    printf("Batch: %u consoles, 1 thread %.0f frames/s, %u threads %.0f frames/s (%.2fx)\n",
+        consoles, rate[0], cores, rate[1], rate[1] / rate[0]);
+}
+
+int main() {
+    load_game();
+    test_batch();
+    test_throughput();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,89 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include "cartridge.h"
+
+const char *path = "test_cartridge.nes";
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Header, then each 1 KiB of the file filled with its index
+void write_rom(const uint8_t *header, uint32_t size) {
+    FILE *f = fopen(path, "wb");
+    fwrite(header, 1, 16, f);
+    for (uint32_t i = 0; i < size; i++) {
+        fputc(i >> 10, f);
+    }
+    fclose(f);
+}
+
+void test_ines(void) {
+    // 32 KiB PRG, 8 KiB CHR, mapper 1, vertical, battery
+    static const uint8_t header[16] = { 'N', 'E', 'S', 0x1A, 2, 1, 0x13, 0x00 };
+    write_rom(header, 0xA000);
+
+    Cartridge a;
+    check(a.load(path), "load iNES");
+    check(!a.nes2 && a.mapper == 1, "iNES mapper");
+    check(a.mirroring == Cartridge::MIRROR_VERTICAL && a.battery, "iNES flags");
+    check(a.prg_size == 0x8000 && a.prg[0x400] == 1, "iNES PRG");
+    check(a.chr_size == 0x2000 && a.chr == a.prg + 0x8000 && a.chr[0] == 32, "iNES CHR");
+    check(a.prg_ram_size == 0x2000 && a.chr_ram_size == 0, "iNES RAM sizes");
+    check(a.trainer == NULL, "no trainer");
+
+    // The same file in a second cartridge shares the mapping
+    Cartridge b;
+    check(b.load(path), "load again");
+    check(b.prg == a.prg, "shared mapping");
+    a.unload();
+    check(b.prg[0x7C00] == 31, "mapping kept by the other cartridge");
+}
+
+void test_nes2(void) {
+    // Mapper 260 submapper 1, PRG 2^15 bytes in exponent form, no CHR ROM
+    // but 8 KiB of CHR RAM, trainer, four screens, PAL
+    static const uint8_t header[16] = {
+        'N', 'E', 'S', 0x1A, 15 << 2, 0, 0x4C, 0x08, 0x11, 0x0F, 0x07, 0x07, 0x01 };
+    write_rom(header, 512 + 0x8000);
+
+    Cartridge c;
+    check(c.load(path), "load NES 2.0");
+    check(c.nes2 && c.mapper == 260 && c.submapper == 1, "NES 2.0 mapper");
+    check(c.mirroring == Cartridge::MIRROR_FOUR && c.timing == Cartridge::TIMING_PAL, "NES 2.0 flags");
+    check(c.trainer != NULL && c.prg == c.trainer + 512, "trainer");
+    check(c.prg_size == 0x8000 && c.chr == NULL && c.chr_size == 0, "NES 2.0 ROM sizes");
+    check(c.prg_ram_size == 0x2000 && c.chr_ram_size == 0x2000, "NES 2.0 RAM sizes");
+}
+
+void test_invalid(void) {
+    // Garbage in bytes 7-15 of an old dump, PRG cut short
+    static const uint8_t header[16] = {
+        'N', 'E', 'S', 0x1A, 2, 0, 0x40, 'D', 'i', 's', 'k', 'D', 'u', 'd', 'e', '!' };
+    write_rom(header, 0x8000);
+    Cartridge c;
+    check(c.load(path) && c.mapper == 4, "DiskDude! header");
+    write_rom(header, 0x7FFF);
+    check(!c.load(path) && c.prg == NULL, "truncated file");
+    static const uint8_t bad[16] = { 'N', 'E', 'S', 0x00, 1 };
+    write_rom(bad, 0x4000);
+    check(!c.load(path), "bad magic");
+}
+
+int main() {
+    test_ines();
+    test_nes2();
+    test_invalid();
+    unlink(path);
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -1,44 +1,238 @@
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
 #include "cpu6502.h"
 
+uint8_t image[0x10000];
 uint8_t mem[0x10000];
+uint8_t mem2[0x10000];
 
-uint8_t cpu_read(uint16_t address) {
-    return mem[address];
+// The context is the 64 KiB of memory
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
 }
-void cpu_write(uint16_t address, uint8_t data) {
+void cpu_write(void *context, uint16_t address, uint8_t data) {
     // if (address >= 0x0005 && address < 0x000A) {
     //   printf("WR @%04X : %02X\n", address, data);
     // }
+    ((uint8_t *)context)[address] = data;
+}
+
+bool same(CPU6502 &a, CPU6502 &b) {
+    return a.PC == b.PC && a.A == b.A && a.X == b.X && a.Y == b.Y && a.S == b.S
+        && a.get_p() == b.get_p() && a.cycles == b.cycles;
+}
+
+// Run the interpreter and the block cache side by side, in slices of a few
+// hundred cycles, and compare the state after every slice
+bool test_block_cache(void) {
+    memcpy(mem, image, sizeof(mem));
+    memcpy(mem2, image, sizeof(mem2));
+
+    CPU6502 ref, cpu;
+    ref.read = cpu.read = cpu_read;
+    ref.write = cpu.write = cpu_write;
+    ref.context = mem;
+    cpu.context = mem2;
+    ref.map(0x00, 0x100, mem, 0x10000, true);
+    cpu.map(0x00, 0x100, mem2, 0x10000, true);
+    cpu.set_block_cache(true);
+    ref.reset();
+    cpu.reset();
+    ref.opcode = cpu.opcode = image[0x1000];
+    ref.PC = cpu.PC = 0x1000;
+
+    for (uint64_t until = 0; ; until += 331) {
+        CPU6502::Stop s1 = ref.run(until);
+        CPU6502::Stop s2 = cpu.run(until);
+        if (s1 != CPU6502::STOP_BUDGET && memcmp(mem, mem2, sizeof(mem)) != 0) {
+            s2 = CPU6502::STOP_BUDGET;
+        }
+        if (s1 != s2 || !same(ref, cpu)) {
+            printf("Block cache: mismatch before cycle %llu\n", (unsigned long long)until);
+            ref.log(stdout);
+            cpu.log(stdout);
+            return false;
+        }
+        if (s1 != CPU6502::STOP_BUDGET) {
+            break;
+        }
+    }
+    printf("Block cache: Success! Cycles: %llu\n", (unsigned long long)cpu.cycles);
+    return true;
+}
+
+// Blocks decode operands once: writing one must drop the block
+bool test_operand_write(void) {
+    static const uint8_t code[] = {
+        0xAD, 0x00, 0x03,                   // LDA $0300
+        0xEE, 0x01, 0x04,                   // INC $0401
+        0x4C, 0x00, 0x04                    // JMP $0400
+    };
+    memset(mem, 0, sizeof(mem));
+    memcpy(mem + 0x0400, code, sizeof(code));
+    mem[0x0300] = 1;
+    mem[0x0301] = 2;
+    mem[0x0302] = 3;
+    CPU6502 cpu;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.context = mem;
+    cpu.map(0x00, 0x100, mem, 0x10000, true);
+    cpu.set_block_cache(true);
+    cpu.reset();
+    cpu.opcode = mem[0x0400];
+    cpu.PC = 0x0400;
+
+    bool ok = true;
+    for (int i = 1; i <= 3 && ok; i++) {
+        cpu.run(cpu.cycles + 13);
+        ok = (cpu.PC == 0x0400 && cpu.A == i);
+    }
+    if (!ok) {
+        printf("Operand write: failed at $%04X, A = %d\n", cpu.PC, cpu.A);
+    }
+    return ok;
+}
+
+// The same code run through a mirror: blocks translated at one address must
+// branch within the other
+bool test_block_mirror(void) {
+    static const uint8_t code[] = {
+        0xA2, 0x03,                         // LDX #$03
+        0xCA,                               // DEX
+        0xD0, 0xFD,                         // BNE $x202
+        0xF0, 0xFE                          // BEQ $x205
+    };
+    memset(mem, 0, sizeof(mem));
+    memcpy(mem + 0x0200, code, sizeof(code));
+    CPU6502 cpu;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.context = mem;
+    cpu.map(0x00, 0x20, mem, 0x800, true);  // 2 KiB of RAM, mirrored 4 times
+    cpu.set_block_cache(true);
+    cpu.reset();
+
+    bool ok = true;
+    static const uint16_t starts[] = { 0x0200, 0x0A00 };
+    for (int i = 0; i < 2; i++) {
+        cpu.opcode = mem[0x0200];
+        cpu.PC = starts[i];
+        CPU6502::Stop stop = cpu.run(cpu.cycles + 100);
+        if (stop != CPU6502::STOP_LOOP || cpu.PC != starts[i] + 5) {
+            printf("Block mirror: from $%04X, stopped at $%04X\n", starts[i], cpu.PC);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Data written to I/O by test_rmw_write
+uint8_t io_writes[4];
+int io_write_count;
+
+void io_write(void *, uint16_t address, uint8_t data) {
+    if (io_write_count < 4) {
+        io_writes[io_write_count] = data;
+    }
+    io_write_count++;
     mem[address] = data;
 }
 
+// Read-modify-write instructions write the unmodified value first to I/O,
+// and only the result to memory
+bool test_rmw_write(void) {
+    static const uint8_t code[] = {
+        0xEE, 0x00, 0x40,                   // INC $4000
+        0xEE, 0x00, 0x03                    // INC $0300
+    };
+    memset(mem, 0, sizeof(mem));
+    memcpy(mem + 0x0400, code, sizeof(code));
+    mem[0x4000] = 0x41;
+    CPU6502 cpu;
+    cpu.read = cpu_read;
+    cpu.write = io_write;
+    cpu.context = mem;
+    cpu.map(0x00, 0x40, mem, 0x4000, true);
+    cpu.reset();
+    cpu.opcode = mem[0x0400];
+    cpu.PC = 0x0400;
+
+    io_write_count = 0;
+    cpu.step();
+    cpu.step();
+    bool ok = (io_write_count == 2 && io_writes[0] == 0x41 && io_writes[1] == 0x42
+        && mem[0x0300] == 1);
+    if (!ok) {
+        printf("RMW write: %d writes to I/O\n", io_write_count);
+    }
+    return ok;
+}
+
+// A masked IRQ leaves events clear; CLI and RTI unmask it
+bool test_irq_mask(void) {
+    memset(mem, 0xEA, sizeof(mem));         // NOP
+    mem[0x0400] = 0x78;                     // SEI
+    mem[0x0403] = 0x58;                     // CLI
+    mem[0x0500] = 0x40;                     // RTI
+    mem[0xFFFE] = 0x00;
+    mem[0xFFFF] = 0x05;
+    CPU6502 cpu;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.context = mem;
+    cpu.map(0x00, 0x100, mem, 0x10000, true);
+    cpu.reset();
+    cpu.opcode = mem[0x0400];
+    cpu.PC = 0x0400;
+
+    cpu.step();
+    cpu.set_irq(1, true);
+    bool ok = (cpu.events == 0);
+    cpu.step();
+    cpu.step();
+    ok = ok && cpu.PC == 0x0403 && cpu.events == 0;
+    cpu.step();                             // CLI, then the IRQ
+    ok = ok && cpu.PC == 0x0500 && cpu.I && cpu.events == 0;
+    cpu.step();                             // RTI, then the IRQ again
+    ok = ok && cpu.PC == 0x0500 && cpu.events == 0;
+    cpu.set_irq(1, false);
+    cpu.step();
+    ok = ok && cpu.PC == 0x0404 && !cpu.I && cpu.events == 0;
+    if (!ok) {
+        printf("IRQ mask: failed at $%04X\n", cpu.PC);
+    }
+    return ok;
+}
+
 int main() {
     FILE *prog = fopen("6502_functional_test.bin", "r");
-    printf("Read %lu bytes\n", fread(mem, 1, 0x10000, prog));
+    printf("Read %lu bytes\n", fread(image, 1, 0x10000, prog));
     fclose(prog);
+    memcpy(mem, image, sizeof(mem));
 
     CPU6502 cpu;
     cpu.read = cpu_read;
     cpu.write = cpu_write;
+    cpu.context = mem;
+    cpu.map(0x00, 0x100, mem, 0x10000, true);
     cpu.reset();
-    cpu.opcode = cpu_read(0x1000);
+    cpu.opcode = mem[0x1000];
     cpu.PC = 0x1000;
     // cpu.log(stdout);
-    uint16_t prevPC = 0x1000;
-    for(;;) {
-        cpu.step();
-        // cpu.log(stdout);
-        if (cpu.PC == prevPC) {
-            break;
-        }
-        prevPC = cpu.PC;
-    }
-    if (cpu.PC == 0x3B1C) {
-        printf("Success! Cycles: %llu\n", cpu.cycles);
+    CPU6502::Stop stop = cpu.run(UINT64_MAX);
+    if (stop == CPU6502::STOP_LOOP && cpu.PC == 0x3B1C) {
+        printf("Success! Cycles: %llu\n", (unsigned long long)cpu.cycles);
     } else {
         printf("Failed at $%04X.\n", cpu.PC);
+        return 1;
     }
 
+    bool ok = test_block_cache();
+    ok = test_operand_write() && ok;
+    ok = test_block_mirror() && ok;
+    ok = test_rmw_write() && ok;
+    ok = test_irq_mask() && ok;
+    return (ok ? 0 : 1);
 }
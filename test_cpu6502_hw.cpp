@@ -1,76 +1,99 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include "Vcpu65xx.h"
 #include "verilated.h"
 
 #if VM_TRACE
+#if VM_TRACE_FST
+#include "verilated_fst_c.h"
+typedef VerilatedFstC Trace;
+#define TRACE_FILE "verilator_tb.fst"
+#else
 #include "verilated_vcd_c.h"
+typedef VerilatedVcdC Trace;
+#define TRACE_FILE "verilator_tb.vcd"
+#endif
 #endif
 
-// const vluint64_t CYCLES_TOTAL = (1L << 29);
-const vluint64_t CYCLES_TOTAL = 400000L * 1000L;
-const vluint64_t CYCLES_RESET = 10;
-const vluint64_t CYCLES_ENABLE = (1L << 2) - 1L;
-
-#define CYCLES_PER_PS 1000
-#define LOG_DURATION_US 100
-
-int main(int argc, char **argv, char **env) {
-  vluint64_t hc = 0;
-  vluint64_t us = 0;
-  vluint64_t us_log_start = 0;
-
-  vluint64_t cycles = 0;
-
-  vluint8_t mem[0x10000];
-
-  vluint8_t clk = 0;
-  vluint8_t enable = 0;
-  vluint8_t reset = 1;
-  vluint8_t nmi_n = 1;
-  vluint8_t irq_n = 1;
-  vluint8_t so_n = 1;
-  vluint8_t din;
-
-  Verilated::commandArgs(argc, argv);
+// Runs 6502_functional_test.bin on the core. Options, as plusargs:
+//   +cycles=N          stop after N cycles (default 400M)
+//   +enable=N          enable the core on one clock out of N (default 4)
+//   +trigger_pc=HHHH   trace around the first cycle where debugPc is HHHH
+//   +trigger_addr=HHHH trace around the first cycle with HHHH on the bus
+//   +before=N          cycles traced before the trigger (default 1000)
+//   +after=N           cycles traced from the trigger on (default 1000)
+//   +trace_from=N      trace before + after cycles from cycle N, as printed
+//                      by a trigger run
+// With a trigger, a first run without the trace finds its cycle, then a
+// second one traces the window: the model is deterministic. Models built
+// without -trace / --trace-fst ignore the trace options.
+//
+// The memory is read and written once per clock, after the rising edge:
+// the core only changes state there.
 
-  FILE *prog = fopen("6502_functional_test.bin", "r");
-  printf("Read %lu bytes\n", fread(mem, 1, 0x10000, prog));
-  fclose(prog);
+const vluint64_t CYCLES_RESET = 10;
+const vluint64_t NONE = ~(vluint64_t)0;
+const vluint64_t PROGRESS_MASK = (1L << 24) - 1;   // Cycles between reports
+
+vluint8_t image[0x10000];
+vluint8_t mem[0x10000];
+
+// Options
+vluint64_t max_cycles = 400000L * 1000L;
+vluint64_t enable_every = 4;
+vluint64_t trigger_pc = NONE;
+vluint64_t trigger_addr = NONE;
+vluint64_t before = 1000;
+vluint64_t after = 1000;
+
+vluint64_t option(const char *name, vluint64_t value, int base) {
+  const char *arg = Verilated::commandArgsPlusMatch(name);
+  if (arg[0] == '\0') {
+    return value;
+  }
+  // "+name=value"
+  return strtoull(arg + strlen(name) + 2, NULL, base);
+}
 
-  // Init top verilog instance
-  Vcpu65xx* top = new Vcpu65xx;
+struct Run {
+  vluint64_t cycles;    // Enabled cycles out of reset
+  vluint64_t trigger;   // Cycle of the trigger, NONE if not seen
+  bool success;
+  double seconds;
+};
+
+// One run from power-up, tracing the cycles [trace_from, trace_to). Stops at
+// the trigger if stop_at_trigger.
+Run simulate(vluint64_t trace_from, vluint64_t trace_to, bool stop_at_trigger) {
+  Run run;
+  run.cycles = 0;
+  run.trigger = NONE;
+  run.success = false;
+  memcpy(mem, image, sizeof(mem));
+
+  Vcpu65xx *top = new Vcpu65xx;
+  top->nmi_n = 1;
+  top->irq_n = 1;
+  top->so_n = 1;
 
-  #if VM_TRACE
-    // Init VCD trace dump
+#if VM_TRACE
+  Trace *tfp = NULL;
+  if (trace_from != NONE) {
     Verilated::traceEverOn(true);
-    VerilatedVcdC* tfp = new VerilatedVcdC;
-    top->trace (tfp, 99);
-    tfp->spTrace()->set_time_resolution ("1 ps");
-    tfp->open ("verilator_tb.vcd");
-  #endif
-
-  us_log_start = (CYCLES_TOTAL * CYCLES_PER_PS / 1000000) - LOG_DURATION_US;
-
-  for(hc = 0L; hc < (CYCLES_TOTAL << 1); hc++) {
-    reset = ((hc >> 1) < CYCLES_RESET ? 1 : 0);
-    enable = (((hc >> 1) & CYCLES_ENABLE) == CYCLES_ENABLE ? 1 : 0);
-
-    if (clk && !reset && enable) {
-      cycles++;
-    }
-
-    if ((hc >> 1) * CYCLES_PER_PS / 1000000 >= us) {
-      printf("@ %lu us\r", us);
-      us++;
-    }
+    tfp = new Trace;
+    top->trace(tfp, 99);
+    tfp->open(TRACE_FILE);
+  }
+#endif
 
-    clk ^= 1;
-    top->clk = clk;
-    top->enable = enable;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (vluint64_t clock = 0; run.cycles < max_cycles; clock++) {
+    bool reset = (clock < CYCLES_RESET);
+    bool enable = (clock % enable_every == enable_every - 1);
     top->reset = reset;
-    top->nmi_n = nmi_n;
-    top->irq_n = irq_n;
-    top->so_n = so_n;
-
+    top->enable = enable;
+    top->clk = 1;
     top->eval();
 
     if (top->we) {
@@ -84,27 +107,103 @@ int main(int argc, char **argv, char **env) {
       top->din = mem[top->addr];
     }
 
+    bool tracing = false;
 #if VM_TRACE
-    // Dump signals into VCD file
-    if (tfp && (us >= us_log_start)) {
-			tfp->dump(hc * (CYCLES_PER_PS >> 1));
-		}
+    tracing = (tfp != NULL && run.cycles >= trace_from && run.cycles < trace_to);
+    if (tracing) {
+      tfp->dump(clock * 2);
+    }
 #endif
 
+    top->clk = 0;
+    top->eval();
+#if VM_TRACE
+    if (tracing) {
+      tfp->dump(clock * 2 + 1);
+    }
+#endif
+
+    if (!enable || reset) {
+      continue;
+    }
+    run.cycles++;
+    if (run.trigger == NONE && (top->debugPc == trigger_pc || top->addr == trigger_addr)) {
+      run.trigger = run.cycles;
+      if (stop_at_trigger) {
+        break;
+      }
+    }
     if (top->debugPc == 0x3B1E) {
-      printf("\nSuccess! Cycles: %lu\n", cycles);
+      run.success = true;
+      break;
+    }
+    if ((run.cycles & PROGRESS_MASK) == 0) {
+      printf("@ %llu Mcycles\r", (unsigned long long)(run.cycles / 1000000));
+      fflush(stdout);
+    }
+    if (Verilated::gotFinish()) {
       break;
     }
-
-    if (Verilated::gotFinish())  exit(0);
   }
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  run.seconds = std::chrono::duration<double>(t1 - t0).count();
+
   top->final();
+#if VM_TRACE
+  if (tfp != NULL) {
+    tfp->close();
+    delete tfp;
+  }
+#endif
+  delete top;
+  return run;
+}
 
-  printf("\nDone.\n");
+int main(int argc, char **argv, char **env) {
+  Verilated::commandArgs(argc, argv);
+  max_cycles = option("cycles", max_cycles, 10);
+  enable_every = option("enable", enable_every, 10);
+  trigger_pc = option("trigger_pc", trigger_pc, 16);
+  trigger_addr = option("trigger_addr", trigger_addr, 16);
+  before = option("before", before, 10);
+  after = option("after", after, 10);
+  vluint64_t trace_from = option("trace_from", NONE, 10);
+  if (enable_every == 0) {
+    enable_every = 1;
+  }
+
+  FILE *prog = fopen("6502_functional_test.bin", "r");
+  if (prog == NULL) {
+    fprintf(stderr, "Cannot open 6502_functional_test.bin\n");
+    return 1;
+  }
+  printf("Read %lu bytes\n", fread(image, 1, 0x10000, prog));
+  fclose(prog);
+  printf("Core enabled on 1 clock out of %llu\n", (unsigned long long)enable_every);
 
-  #if VM_TRACE
-    if (tfp) tfp->close();
-  #endif
+#if VM_TRACE
+  if (trace_from == NONE && (trigger_pc != NONE || trigger_addr != NONE)) {
+    Run find = simulate(NONE, NONE, true);
+    if (find.trigger == NONE) {
+      printf("\nNo trigger in %llu cycles\n", (unsigned long long)find.cycles);
+      return 1;
+    }
+    printf("\nTrigger at cycle %llu\n", (unsigned long long)find.trigger);
+    trace_from = (find.trigger > before ? find.trigger - before : 0);
+  }
+#endif
+  vluint64_t trace_to = (trace_from == NONE ? NONE : trace_from + before + after);
 
-  exit(0);
+  Run run = simulate(trace_from, trace_to, false);
+  if (run.success) {
+    printf("\nSuccess! Cycles: %llu\n", (unsigned long long)run.cycles);
+  } else {
+    printf("\nNo success after %llu cycles\n", (unsigned long long)run.cycles);
+  }
+  printf("%.3f s, %.0f cycles/s\n", run.seconds, run.cycles / run.seconds);
+  if (trace_from != NONE) {
+    printf("Traced cycles %llu to %llu\n", (unsigned long long)trace_from,
+      (unsigned long long)trace_to);
+  }
+  return (run.success ? 0 : 1);
 }
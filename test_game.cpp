@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <cstring>
+#include "test_game.h"
+
+uint8_t prg[0x8000];
+uint8_t chr[0x2000];
+
+void load_prg(const uint8_t *code, size_t size, uint16_t nmi) {
+    memset(prg, 0, sizeof(prg));
+    memcpy(prg, code, size);
+    prg[0x7FFA] = nmi & 0xFF;
+    prg[0x7FFB] = nmi >> 8;
+    prg[0x7FFC] = 0x00;
+    prg[0x7FFD] = 0x80;
+    for (int i = 0; i < 0x2000; i++) {
+        chr[i] = i * 7 + (i >> 8);
+    }
+}
+
+void insert(NES &nes) {
+    nes.cpu.map(0x80, 0x80, prg, sizeof(prg), false);
+    nes.ppu.map(0, 8, chr, sizeof(chr), false);
+    nes.ppu.map(8, 4, nes.ciram, sizeof(nes.ciram), true);
+    for (int i = 0; i < 0x800; i++) {
+        nes.ciram[i] = i * 13 + (i >> 7);
+    }
+    nes.reset();
+}
+
+void load_game(void) {
+    static const uint8_t code[] = {
+        0xA9, 0x3F, 0x8D, 0x06, 0x20,   // LDA #$3F / STA $2006
+        0xA9, 0x00, 0x8D, 0x06, 0x20,   // LDA #$00 / STA $2006
+        0xA2, 0x00,                     // LDX #$00
+        0x8E, 0x07, 0x20, 0xE8,         // STX $2007 / INX
+        0xE0, 0x20, 0xD0, 0xF8,         // CPX #$20 / BNE $800C
+        0xA9, 0x1E, 0x8D, 0x01, 0x20,   // LDA #$1E / STA $2001
+        0xA9, 0x80, 0x8D, 0x00, 0x20,   // LDA #$80 / STA $2000
+        0x2C, 0x02, 0x20, 0x50, 0xFB,   // BIT $2002 / BVC $801E
+        0xE6, 0x05,                     // INC $05
+        0x2C, 0x02, 0x20, 0x70, 0xFB,   // BIT $2002 / BVS $8025
+        0x4C, 0x1E, 0x80,               // JMP $801E
+        0xA9, 0x01, 0x8D, 0x16, 0x40,   // NMI: LDA #$01 / STA $4016
+        0xA9, 0x00, 0x8D, 0x16, 0x40,   // LDA #$00 / STA $4016
+        0xA2, 0x08,                     // LDX #$08
+        0xAD, 0x16, 0x40, 0x4A,         // LDA $4016 / LSR A
+        0x26, 0x10, 0xCA, 0xD0, 0xF7,   // ROL $10 / DEX / BNE $8039
+        0xA2, 0x08,                     // LDX #$08
+        0xAD, 0x17, 0x40, 0x4A,         // LDA $4017 / LSR A
+        0x26, 0x11, 0xCA, 0xD0, 0xF7,   // ROL $11 / DEX / BNE $8044
+        0xA5, 0x12, 0x18,               // LDA $12 / CLC
+        0x65, 0x10, 0x85, 0x12,         // ADC $10 / STA $12
+        0x8D, 0x03, 0x02,               // STA $0203
+        0xA5, 0x13, 0x0A, 0x45, 0x11,   // LDA $13 / ASL A / EOR $11
+        0x69, 0x00, 0x85, 0x13,         // ADC #$00 / STA $13
+        0x29, 0x7F, 0x8D, 0x00, 0x02,   // AND #$7F / STA $0200
+        0xA9, 0x02, 0x8D, 0x14, 0x40,   // LDA #$02 / STA $4014
+        0xE6, 0x00,                     // INC $00
+        0x40 };                         // RTI
+    load_prg(code, sizeof(code), 0x802D);
+}
+
+void setup(NES &nes) {
+    insert(nes);
+    for (int i = 0; i < 256; i++) {
+        nes.ram[0x200 + i] = i * 5;
+    }
+    nes.ram[0x201] = 0x31;
+    nes.ram[0x202] = 0x00;
+}
@@ -0,0 +1,26 @@
+#ifndef NES_TEST_GAME_INCLUDED
+#define NES_TEST_GAME_INCLUDED
+
+#include <cstdint>
+#include "nes.h"
+
+// Cartridge of the NES tests and bench: 32 KiB of PRG ROM at $8000 and 8 KiB
+// of CHR ROM; the nametables are in CIRAM
+extern uint8_t prg[0x8000];
+extern uint8_t chr[0x2000];
+
+// Code at $8000, run on reset, with its NMI handler at nmi
+void load_prg(const uint8_t *code, size_t size, uint16_t nmi);
+
+// Plug the cartridge into nes, fill the nametables, and reset
+void insert(NES &nes);
+
+// A game: each NMI reads both controllers, moves sprite 0 by them and copies
+// OAM by DMA; the main loop counts sprite 0 hits in $05, so its timing
+// depends on where sprite 0 is drawn over the background
+void load_game(void);
+
+// The cartridge in nes, with the sprites of the game in RAM
+void setup(NES &nes);
+
+#endif // NES_TEST_GAME_INCLUDED
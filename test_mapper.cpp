@@ -0,0 +1,302 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "nes.h"
+
+const char *path = "test_mapper.nes";
+
+// PRG ROM, each 1 KiB filled with its index unless code is patched in
+uint8_t prg[0x40000];
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+void fill_prg(uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        prg[i] = i >> 10;
+    }
+}
+
+// iNES file with prg_size bytes of prg, then CHR ROM with each 1 KiB filled
+// with $80 | its index
+void write_rom(int mapper, uint8_t flags, uint32_t prg_size, uint32_t chr_size) {
+    uint8_t header[16] = { 'N', 'E', 'S', 0x1A };
+    header[4] = prg_size >> 14;
+    header[5] = chr_size >> 13;
+    header[6] = (mapper << 4) | flags;
+    header[7] = mapper & 0xF0;
+    FILE *f = fopen(path, "wb");
+    fwrite(header, 1, 16, f);
+    fwrite(prg, 1, prg_size, f);
+    for (uint32_t i = 0; i < chr_size; i++) {
+        fputc(0x80 | (i >> 10), f);
+    }
+    fclose(f);
+}
+
+// PPU memory through PPUADDR / PPUDATA
+uint8_t peek(NES &nes, uint16_t address) {
+    nes.ppu.write(0x2006, address >> 8);
+    nes.ppu.write(0x2006, address & 0xFF);
+    nes.ppu.read(0x2007);
+    return nes.ppu.read(0x2007);
+}
+void poke(NES &nes, uint16_t address, uint8_t data) {
+    nes.ppu.write(0x2006, address >> 8);
+    nes.ppu.write(0x2006, address & 0xFF);
+    nes.ppu.write(0x2007, data);
+}
+
+// Nametables sharing memory with the one at $2000, as a mask of quadrants
+uint8_t mirrors(NES &nes) {
+    for (int i = 0; i < 4; i++) {
+        poke(nes, 0x2000 + i * 0x400, i + 1);
+    }
+    // Written last, the value of the quadrants sharing with $2000 is left
+    uint8_t first = peek(nes, 0x2000);
+    uint8_t m = 0;
+    for (int i = 1; i < 4; i++) {
+        if (peek(nes, 0x2000 + i * 0x400) == first) {
+            m |= 1 << i;
+        }
+    }
+    return m;
+}
+
+void test_nrom(void) {
+    // 16 KiB PRG mirrored at $C000, 8 KiB CHR, vertical mirroring
+    fill_prg(0x4000);
+    write_rom(0, 0x01, 0x4000, 0x2000);
+    Cartridge cart;
+    check(cart.load(path), "NROM load");
+    NES nes;
+    check(nes.insert(cart), "NROM insert");
+    nes.reset();
+    check(nes.cpu.memory(0x84)[0] == 1 && nes.cpu.memory(0xC4)[0] == 1, "NROM PRG");
+    check(nes.cpu.memory(0x60) != NULL, "NROM PRG RAM");
+    check(peek(nes, 0x0400) == 0x81 && peek(nes, 0x1C00) == 0x87, "NROM CHR");
+    poke(nes, 0x0400, 0x00);
+    check(peek(nes, 0x0400) == 0x81, "NROM CHR ROM read-only");
+    check(mirrors(nes) == (1 << 2), "NROM vertical mirroring");
+    nes.eject();
+    check(nes.cpu.memory(0x80) == NULL, "NROM ejected");
+}
+
+void test_uxrom(void) {
+    // 128 KiB PRG, CHR RAM
+    fill_prg(0x20000);
+    write_rom(2, 0x00, 0x20000, 0);
+    Cartridge cart;
+    cart.load(path);
+    NES nes;
+    check(nes.insert(cart), "UxROM insert");
+    nes.reset();
+    check(nes.cpu.memory(0x80)[0] == 0 && nes.cpu.memory(0xC0)[0] == 112, "UxROM power-up banks");
+    nes.cpu.write(nes.cpu.context, 0x8000, 3);
+    check(nes.cpu.memory(0x80)[0] == 48 && nes.cpu.memory(0xC0)[0] == 112, "UxROM bank switch");
+    poke(nes, 0x1234, 0x5A);
+    check(peek(nes, 0x1234) == 0x5A, "UxROM CHR RAM");
+    check(mirrors(nes) == (1 << 1), "UxROM horizontal mirroring");
+}
+
+void test_cnrom(void) {
+    fill_prg(0x8000);
+    write_rom(3, 0x00, 0x8000, 0x8000);
+    Cartridge cart;
+    cart.load(path);
+    NES nes;
+    check(nes.insert(cart), "CNROM insert");
+    nes.reset();
+    check(peek(nes, 0x0000) == 0x80, "CNROM power-up bank");
+    nes.cpu.write(nes.cpu.context, 0x8000, 2);
+    check(peek(nes, 0x0000) == 0x90 && peek(nes, 0x1C00) == 0x97, "CNROM bank switch");
+}
+
+// Register write by an STA abs, 4 cycles after the previous one
+void sta(NES &nes, uint16_t address, uint8_t data) {
+    nes.cpu.cycles += 4;
+    nes.cpu.write(nes.cpu.context, address, data);
+}
+
+// MMC1 register load, bit 0 first
+void mmc1_write(NES &nes, uint16_t address, uint8_t data) {
+    for (int i = 0; i < 5; i++) {
+        sta(nes, address, (data >> i) & 1);
+    }
+}
+
+void test_mmc1(void) {
+    // 256 KiB PRG, 128 KiB CHR
+    fill_prg(0x40000);
+    write_rom(1, 0x00, 0x40000, 0x20000);
+    Cartridge cart;
+    cart.load(path);
+    NES nes;
+    check(nes.insert(cart), "MMC1 insert");
+    nes.reset();
+    check(nes.cpu.memory(0x80)[0] == 0 && nes.cpu.memory(0xC0)[0] == 240, "MMC1 power-up banks");
+    mmc1_write(nes, 0xE000, 5);
+    check(nes.cpu.memory(0x80)[0] == 80 && nes.cpu.memory(0xC0)[0] == 240, "MMC1 PRG mode 3");
+
+    // PRG mode 2, 4 KiB CHR banks, one screen
+    mmc1_write(nes, 0x8000, 0x18);
+    check(nes.cpu.memory(0x80)[0] == 0 && nes.cpu.memory(0xC0)[0] == 80, "MMC1 PRG mode 2");
+    check(mirrors(nes) == 0x0E, "MMC1 one screen");
+    mmc1_write(nes, 0xA000, 3);
+    mmc1_write(nes, 0xC000, 7);
+    check(peek(nes, 0x0000) == 0x8C && peek(nes, 0x1000) == 0x9C, "MMC1 4 KiB CHR banks");
+
+    // 32 KiB PRG, 8 KiB CHR, vertical
+    mmc1_write(nes, 0x8000, 0x02);
+    check(nes.cpu.memory(0x80)[0] == 64 && nes.cpu.memory(0xC0)[0] == 80, "MMC1 32 KiB PRG");
+    check(peek(nes, 0x0000) == 0x88 && peek(nes, 0x1000) == 0x8C, "MMC1 8 KiB CHR");
+    check(mirrors(nes) == (1 << 2), "MMC1 vertical mirroring");
+
+    // Reset of the shift register, in the middle of a load
+    sta(nes, 0x8000, 1);
+    sta(nes, 0x8000, 0x80);
+    check(nes.cpu.memory(0x80)[0] == 80 && nes.cpu.memory(0xC0)[0] == 240, "MMC1 reset");
+    mmc1_write(nes, 0xE000, 0x10);
+    check(nes.cpu.memory(0x60) == NULL, "MMC1 PRG RAM disabled");
+
+    // The second of two writes on consecutive cycles is ignored
+    mmc1_write(nes, 0xE000, 0x00);
+    sta(nes, 0xE000, 0);
+    nes.cpu.cycles += 1;
+    nes.cpu.write(nes.cpu.context, 0xE000, 1);
+    sta(nes, 0xE000, 0);
+    sta(nes, 0xE000, 0);
+    sta(nes, 0xE000, 0);
+    sta(nes, 0xE000, 1);
+    check(nes.cpu.memory(0x60) == NULL, "MMC1 write on the next cycle");
+}
+
+void test_mmc3(void) {
+    // 128 KiB PRG, 64 KiB CHR
+    fill_prg(0x20000);
+    write_rom(4, 0x00, 0x20000, 0x10000);
+    Cartridge cart;
+    cart.load(path);
+    NES nes;
+    check(nes.insert(cart), "MMC3 insert");
+    nes.reset();
+    check(nes.cpu.memory(0xC0)[0] == 112 && nes.cpu.memory(0xE0)[0] == 120, "MMC3 fixed banks");
+    nes.cpu.write(nes.cpu.context, 0x8000, 6);
+    nes.cpu.write(nes.cpu.context, 0x8001, 3);
+    nes.cpu.write(nes.cpu.context, 0x8000, 7);
+    nes.cpu.write(nes.cpu.context, 0x8001, 5);
+    check(nes.cpu.memory(0x80)[0] == 24 && nes.cpu.memory(0xA0)[0] == 40, "MMC3 PRG banks");
+    nes.cpu.write(nes.cpu.context, 0x8000, 0x40);
+    check(nes.cpu.memory(0x80)[0] == 112 && nes.cpu.memory(0xC0)[0] == 24, "MMC3 PRG mode 1");
+
+    nes.cpu.write(nes.cpu.context, 0x8000, 0);
+    nes.cpu.write(nes.cpu.context, 0x8001, 4);
+    nes.cpu.write(nes.cpu.context, 0x8000, 2);
+    nes.cpu.write(nes.cpu.context, 0x8001, 9);
+    check(peek(nes, 0x0000) == 0x84 && peek(nes, 0x0400) == 0x85, "MMC3 2 KiB CHR bank");
+    check(peek(nes, 0x1000) == 0x89, "MMC3 1 KiB CHR bank");
+    nes.cpu.write(nes.cpu.context, 0x8000, 0x80);
+    check(peek(nes, 0x0000) == 0x89 && peek(nes, 0x1000) == 0x84, "MMC3 CHR inversion");
+
+    nes.cpu.write(nes.cpu.context, 0xA000, 1);
+    check(mirrors(nes) == (1 << 1), "MMC3 horizontal mirroring");
+    nes.cpu.write(nes.cpu.context, 0xA001, 0x00);
+    check(nes.cpu.memory(0x60) == NULL, "MMC3 PRG RAM disabled");
+    nes.cpu.write(nes.cpu.context, 0xA001, 0x80);
+    check(nes.cpu.memory(0x60) != NULL, "MMC3 PRG RAM enabled");
+}
+
+// Scanline IRQ, handled with a new latch value each time, while the main
+// loop waits in a JMP * or keeps reading memory. The last bank is at $E000.
+void load_mmc3_irq(bool idle) {
+    static const uint8_t code[] = {
+        0x78, 0xA2, 0xFF, 0x9A,         // SEI / LDX #$FF / TXS
+        0xA9, 0x40, 0x8D, 0x17, 0x40,   // LDA #$40 / STA $4017
+        0xA9, 0x08, 0x8D, 0x00, 0x20,   // LDA #$08 / STA $2000
+        0xA9, 0x18, 0x8D, 0x01, 0x20,   // LDA #$18 / STA $2001
+        0xA9, 0x05, 0x8D, 0x00, 0xC0,   // LDA #$05 / STA $C000
+        0x8D, 0x01, 0xC0,               // STA $C001
+        0x8D, 0x01, 0xE0,               // STA $E001
+        0x58,                           // CLI
+        0xA5, 0x01, 0x4C, 0x1F, 0xE0,   // LDA $01 / JMP $E01F
+        0x8D, 0x00, 0xE0,               // IRQ: STA $E000
+        0xE6, 0x00, 0xA5, 0x00,         // INC $00 / LDA $00
+        0x29, 0x0F, 0x09, 0x02,         // AND #$0F / ORA #$02
+        0x8D, 0x00, 0xC0,               // STA $C000
+        0x8D, 0x01, 0xE0,               // STA $E001
+        0x40 };                         // RTI
+    uint8_t *bank = &prg[0x1E000];
+    memcpy(bank, code, sizeof(code));
+    if (idle) {
+        static const uint8_t jmp[] = { 0x4C, 0x21, 0xE0 };
+        memcpy(&bank[0x21], jmp, sizeof(jmp));
+    }
+    bank[0x1FFC] = 0x00;
+    bank[0x1FFD] = 0xE0;
+    bank[0x1FFE] = 0x24;
+    bank[0x1FFF] = 0xE0;
+}
+
+// CPU cycles at which the IRQ handler is entered
+std::vector<uint64_t> run_mmc3_irq(bool lockstep, uint64_t until) {
+    Cartridge cart;
+    cart.load(path);
+    NES nes;
+    nes.insert(cart);
+    nes.reset();
+    std::vector<uint64_t> irqs;
+    if (lockstep) {
+        while (nes.cpu.cycles < until) {
+            nes.cpu.step();
+            nes.ppu.run(nes.cpu.cycles * 3);
+            if (nes.cpu.PC == 0xE024) {
+                irqs.push_back(nes.cpu.cycles);
+            }
+        }
+    } else {
+        nes.cpu.breakpoint = 0xE024;
+        while (nes.run(until) == CPU6502::STOP_BREAKPOINT) {
+            irqs.push_back(nes.cpu.cycles);
+        }
+    }
+    irqs.push_back(nes.cpu.cycles);
+    irqs.push_back(nes.ppu.cycles);
+    irqs.push_back(nes.ram[0]);
+    return irqs;
+}
+
+void test_mmc3_irq(void) {
+    // 10 frames, run by instruction or up to the predicted IRQs
+    uint64_t until = 10 * 89342 / 3;
+    for (int idle = 0; idle < 2; idle++) {
+        fill_prg(0x20000);
+        load_mmc3_irq(idle != 0);
+        write_rom(4, 0x00, 0x20000, 0x10000);
+        std::vector<uint64_t> a = run_mmc3_irq(true, until);
+        std::vector<uint64_t> b = run_mmc3_irq(false, until);
+        check(a.size() > 100, "MMC3 IRQs taken");
+        check(a == b, "MMC3 IRQs at the same cycles");
+    }
+}
+
+int main() {
+    test_nrom();
+    test_uxrom();
+    test_cnrom();
+    test_mmc1();
+    test_mmc3();
+    test_mmc3_irq();
+    unlink(path);
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "nes.h"
+#include "test_game.h"
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+void test_oam_dma(void) {
+    NES nes;
+
+    // LDA #$10 / STA $2003 / LDA #$02 / STA $4014 / LDA #$80 / STA $4014 /
+    // JMP *
+    static const uint8_t code[] = {
+        0xA9, 0x10, 0x8D, 0x03, 0x20,
+        0xA9, 0x02, 0x8D, 0x14, 0x40,
+        0xA9, 0x80, 0x8D, 0x14, 0x40,
+        0x4C, 0x0F, 0x80 };
+    load_prg(code, sizeof(code), 0x0000);
+    insert(nes);
+    for (int i = 0; i < 256; i++) {
+        nes.ram[0x200 + i] = i;
+    }
+
+    // From RAM, starting at OAMADDR $10
+    nes.cpu.step();
+    nes.cpu.step();
+    nes.cpu.step();
+    uint64_t start = nes.cpu.cycles;
+    nes.cpu.step();
+    uint64_t cycles = nes.cpu.cycles - start;
+    check(cycles == 4 + 513 || cycles == 4 + 514, "DMA stall");
+    check(((start + 4) & 1) == (cycles == 4 + 514 ? 1 : 0), "DMA stall on odd cycles");
+    bool ok = true;
+    for (int i = 0; i < 256; i++) {
+        nes.ppu.write(0x2003, (0x10 + i) & 0xFF);
+        ok = ok && nes.ppu.read(0x2004) == i;
+    }
+    check(ok, "DMA from RAM");
+
+    // From ROM, within run()
+    nes.ppu.write(0x2003, 0x00);
+    start = nes.cpu.cycles;
+    nes.run(start + 600);
+    check(nes.cpu.PC == 0x800F, "run() through the DMA");
+    check(nes.cpu.cycles - start < 600 + 3 + 514, "DMA stall within the budget");
+    nes.ppu.write(0x2003, 0x00);
+    check(nes.ppu.read(0x2004) == 0xA9, "DMA from ROM");
+
+    // Same with the block cache
+    nes.cpu.set_block_cache(true);
+    nes.reset();
+    start = nes.cpu.cycles;
+    nes.cpu.run(start + 40);
+    check(nes.cpu.cycles < start + 40 + 3 + 514, "DMA stall ends the block");
+}
+
+// Program counting NMIs at $00 and vblank flags seen by polling at $01,
+// or waiting in a JMP * loop when idle
+void load_vblank_counter(bool idle) {
+    static const uint8_t code[] = {
+        0xA9, 0x80, 0x8D, 0x00, 0x20,   // LDA #$80 / STA $2000
+        0x2C, 0x02, 0x20, 0x10, 0xFB,   // BIT $2002 / BPL *-3
+        0xE6, 0x01, 0x4C, 0x05, 0x80,   // INC $01 / JMP $8005
+        0x00,
+        0xE6, 0x00, 0x40 };             // NMI: INC $00 / RTI
+    load_prg(code, sizeof(code), 0x8010);
+    if (idle) {
+        static const uint8_t jmp[] = { 0x4C, 0x05, 0x80 };
+        memcpy(&prg[5], jmp, sizeof(jmp));
+    }
+}
+
+struct Result {
+    uint8_t nmis;
+    uint8_t polled;
+    uint16_t PC;
+    uint64_t cycles;
+    uint64_t dots;
+};
+
+Result run_vblank_counter(bool lockstep, uint64_t until) {
+    NES nes;
+    insert(nes);
+    if (lockstep) {
+        while (nes.cpu.cycles < until) {
+            nes.cpu.step();
+            nes.ppu.run(nes.cpu.cycles * 3);
+        }
+    } else {
+        nes.run(until);
+    }
+    Result r = { nes.ram[0], nes.ram[1], nes.cpu.PC, nes.cpu.cycles, nes.ppu.cycles };
+    return r;
+}
+
+void test_sync(void) {
+    // 20 frames, run by instruction or ahead of the PPU
+    uint64_t until = 20 * 89342 / 3;
+    for (int idle = 0; idle < 2; idle++) {
+        load_vblank_counter(idle != 0);
+        Result a = run_vblank_counter(true, until);
+        Result b = run_vblank_counter(false, until);
+        check(a.nmis == 20, "NMI every frame");
+        check(idle || a.polled != 0, "vblank flag polled");
+        check(a.nmis == b.nmis && a.polled == b.polled, "same NMIs and polled flags");
+        check(a.PC == b.PC && a.cycles == b.cycles && a.dots == b.dots, "same end state");
+    }
+}
+
+// Rendering with sprites, NMIs and audio, saved in the middle of a line and
+// loaded into another NES: both continue the same way
+void load_render_loop(void) {
+    static const uint8_t code[] = {
+        0xA9, 0x3F, 0x8D, 0x06, 0x20,   // LDA #$3F / STA $2006
+        0xA9, 0x00, 0x8D, 0x06, 0x20,   // LDA #$00 / STA $2006
+        0xA2, 0x00,                     // LDX #$00
+        0x8E, 0x07, 0x20, 0xE8,         // STX $2007 / INX
+        0xE0, 0x20, 0xD0, 0xF8,         // CPX #$20 / BNE $800C
+        0xA9, 0x1E, 0x8D, 0x01, 0x20,   // LDA #$1E / STA $2001
+        0xA9, 0x0F, 0x8D, 0x15, 0x40,   // LDA #$0F / STA $4015
+        0xA9, 0xBF, 0x8D, 0x00, 0x40,   // LDA #$BF / STA $4000
+        0x8D, 0x03, 0x40,               // STA $4003
+        0xA9, 0x80, 0x8D, 0x00, 0x20,   // LDA #$80 / STA $2000
+        0xE6, 0x01, 0x4C, 0x2B, 0x80,   // INC $01 / JMP $802B
+        0xE6, 0x00,                     // NMI: INC $00
+        0xA9, 0x02, 0x8D, 0x14, 0x40,   // LDA #$02 / STA $4014
+        0xA5, 0x00, 0x8D, 0x06, 0x40,   // LDA $00 / STA $4006
+        0x40 };                         // RTI
+    load_prg(code, sizeof(code), 0x8030);
+}
+
+// Only one NES exists at a time: the first one runs on after saving, then
+// the second one loads the state and runs as far
+void test_save_state(void) {
+    load_render_loop();
+    uint64_t until = 10 * 29781;
+    std::vector<uint8_t> state, after_a, after_b;
+    std::vector<uint16_t> frame_a(240 * 256);
+    std::vector<uint16_t> lines_a(240 * 256);
+    uint64_t saved = 5 * 29781 + 12345;
+    int16_t audio[4096];
+    uint8_t nmis_a;
+    {
+        NES a;
+        insert(a);
+        // Sprites in front of the background on every line, at the right
+        // end where the line is still to be drawn when saved
+        for (int i = 0; i < 64; i++) {
+            a.ram[0x200 + i * 4] = i * 4;
+            a.ram[0x201 + i * 4] = i;
+            a.ram[0x202 + i * 4] = i & 3;
+            a.ram[0x203 + i * 4] = 0xE0 + (i & 7) * 4;
+        }
+        a.run(saved);
+
+        size_t size = a.state_size();
+        state.resize(size);
+        check(a.save(&state[0], size - 1) == 0, "save into a short buffer");
+        check(a.save(&state[0], size) == size, "save");
+        check(size < 4096 + 1024, "state size");
+
+        // Lines output around the save point, the first one in two parts
+        a.run(saved + 1000);
+        memcpy(&lines_a[0], a.ppu.frame, sizeof(a.ppu.frame));
+        a.run(until);
+        after_a.resize(size);
+        a.save(&after_a[0], size);
+        memcpy(&frame_a[0], a.ppu.frame, sizeof(a.ppu.frame));
+        nmis_a = a.ram[0];
+    }
+    {
+        NES b;
+        insert(b);
+        b.run(2 * 29781 + 777);  // Load over a machine in another state
+        check(!b.load(&state[0], 7), "load of a truncated header");
+        std::vector<uint8_t> bad(state);
+        bad[0] = 'X';
+        check(!b.load(&bad[0], bad.size()), "load with a bad magic");
+        check(b.load(&state[0], state.size()), "load");
+
+        uint16_t line = b.ppu.scanline;
+        b.run(saved + 1000);
+        check(line < 240 && b.ppu.scanline > line, "saved while rendering");
+        check(memcmp(&lines_a[line * 256], &b.ppu.frame[line * 256],
+            (b.ppu.scanline - line) * 256 * 2) == 0, "same lines after load");
+        b.run(until);
+        after_b.resize(state.size());
+        b.save(&after_b[0], after_b.size());
+        check(memcmp(&frame_a[0], b.ppu.frame, sizeof(b.ppu.frame)) == 0, "same frame");
+        check(nmis_a >= 9 && b.ram[0] == nmis_a, "same NMIs");
+        check(after_a == after_b, "same state");
+        check(b.audio(audio, 4096) > 4000, "audio after load");
+    }
+}
+
+int main() {
+    test_oam_dma();
+    test_sync();
+    test_save_state();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
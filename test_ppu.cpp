@@ -0,0 +1,455 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include "ppu.h"
+
+// PPU address space: 8 KiB of CHR, 4 KiB of nametables (no mirroring)
+uint8_t vram[0x3000];
+
+uint8_t ppu_read(void *, uint16_t address) {
+    return vram[address % 0x3000];
+}
+void ppu_write(void *, uint16_t address, uint8_t data) {
+    vram[address % 0x3000] = data;
+}
+
+int nmi_edges = 0;
+void ppu_nmi(void *, bool level) {
+    if (level) {
+        nmi_edges++;
+    }
+}
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Dots from the current position to the start of the next frame
+uint64_t frame_length(PPU &ppu) {
+    uint64_t start = ppu.cycles;
+    uint64_t frame = ppu.frame_count;
+    while (ppu.frame_count == frame) {
+        ppu.step();
+    }
+    return ppu.cycles - start;
+}
+
+void test_timing(void) {
+    PPU ppu;
+    ppu.mem_read = ppu_read;
+    ppu.mem_write = ppu_write;
+    ppu.nmi = ppu_nmi;
+    ppu.reset();
+
+    ppu.write(0x2000, 0x80);
+    nmi_edges = 0;
+    check(frame_length(ppu) == 89342, "frame length with rendering disabled");
+    check(frame_length(ppu) == 89342, "odd frame length with rendering disabled");
+    check(nmi_edges == 2, "one NMI per frame");
+
+    // Rendering enabled: the odd frame is one dot shorter
+    ppu.write(0x2001, 0x08);
+    uint64_t a = frame_length(ppu);
+    uint64_t b = frame_length(ppu);
+    check(a + b == 89342 + 89341 && a != b, "odd frame skipped dot");
+
+    // Vblank flag set at dot 1 of line 241 and cleared by reading PPUSTATUS
+    ppu.run(ppu.cycles + 241 * PPU::DOTS + 1);
+    check((ppu.read(0x2002) & 0x80) == 0, "vblank clear before dot 1");
+    ppu.step();
+    check((ppu.read(0x2002) & 0x80) != 0, "vblank set at dot 1");
+    check((ppu.read(0x2002) & 0x80) == 0, "vblank cleared by read");
+
+    // run() skipping over idle dots ends up in the same place as step()
+    PPU ref;
+    ref.mem_read = ppu_read;
+    ref.mem_write = ppu_write;
+    ref.reset();
+    ppu.reset();
+    ppu.cycles = ref.cycles = 0;
+    for (uint64_t until = 0; until < 3 * 89342; until += 997) {
+        ppu.run(until);
+        while (ref.cycles < until) {
+            ref.step();
+        }
+        check(ppu.scanline == ref.scanline && ppu.dot == ref.dot, "run() position");
+    }
+}
+
+void test_background(void) {
+    PPU ppu;
+    ppu.mem_read = ppu_read;
+    ppu.mem_write = ppu_write;
+    ppu.nmi = NULL;
+    ppu.reset();
+
+    // Tile 1: color 1 on the left half, color 2 on the right half, color 3
+    // on the last row
+    memset(vram, 0, sizeof(vram));
+    for (int y = 0; y < 7; y++) {
+        vram[0x10 + y] = 0xF0;
+        vram[0x18 + y] = 0x0F;
+    }
+    vram[0x17] = 0xFF;
+    vram[0x1F] = 0xFF;
+    // Nametable 0 all tile 1, attribute palette 1 for the top-left quadrants
+    memset(&vram[0x2000], 1, 960);
+    memset(&vram[0x23C0], 0x01, 64);
+
+    // Palettes through PPUDATA
+    ppu.write(0x2006, 0x3F);
+    ppu.write(0x2006, 0x00);
+    static const uint8_t pal[8] = { 0x0F, 0x01, 0x02, 0x03, 0x0F, 0x11, 0x12, 0x13 };
+    for (int i = 0; i < 8; i++) {
+        ppu.write(0x2007, pal[i]);
+    }
+    ppu.write(0x2006, 0x00);
+    ppu.write(0x2006, 0x00);
+
+    // Fine X scroll of 2 pixels
+    ppu.write(0x2005, 0x02);
+    ppu.write(0x2005, 0x00);
+    ppu.write(0x2001, 0x0A);
+
+    // Two frames: the first one starts without the pre-render line fetches
+    uint64_t frame = ppu.frame_count;
+    while (ppu.frame_count < frame + 2) {
+        ppu.run(ppu.cycles + 1000);
+    }
+
+    const uint16_t *row = &ppu.frame[0];
+    check(row[0] == 0x11 && row[1] == 0x11, "pixels 0-1, left half after scroll");
+    check(row[2] == 0x12 && row[5] == 0x12, "pixels 2-5, right half");
+    check(row[6] == 0x11, "pixel 6, next tile");
+    check(ppu.frame[7 * 256 + 0] == 0x13, "last tile row");
+    check(ppu.frame[16 * 256 + 6] == 0x01, "bottom-left quadrant palette 0");
+}
+
+void test_sprites(void) {
+    PPU ppu;
+    ppu.mem_read = ppu_read;
+    ppu.mem_write = ppu_write;
+    ppu.nmi = NULL;
+    ppu.reset();
+
+    // Background tile 1 solid color 1 in the top-left 8x8 of the screen only;
+    // sprite tile 2: left column color 3, rest color 1
+    memset(vram, 0, sizeof(vram));
+    memset(&vram[0x10], 0xFF, 8);
+    for (int y = 0; y < 8; y++) {
+        vram[0x20 + y] = 0xFF;
+        vram[0x28 + y] = 0x80;
+    }
+    memset(&vram[0x2000], 0, 960);
+    vram[0x2000 + 2 * 32 + 2] = 1;  // Tile at (16, 16)
+
+    ppu.write(0x2006, 0x3F);
+    ppu.write(0x2006, 0x00);
+    static const uint8_t pal[32] = {
+        0x0F, 0x01, 0x02, 0x03, 0x0F, 0, 0, 0, 0x0F, 0, 0, 0, 0x0F, 0, 0, 0,
+        0x0F, 0x21, 0x22, 0x23, 0x0F, 0x31, 0x32, 0x33, 0x0F, 0, 0, 0, 0x0F, 0, 0, 0 };
+    for (int i = 0; i < 32; i++) {
+        ppu.write(0x2007, pal[i]);
+    }
+    ppu.write(0x2006, 0x00);
+    ppu.write(0x2006, 0x00);
+
+    // OAM: sprite 0 over the background tile, sprite 1 behind it, sprite 2
+    // flipped horizontally with palette 1, the rest off screen
+    static const uint8_t oam[12] = {
+        15, 2, 0x00, 20,
+        15, 2, 0x20, 12,
+        99, 2, 0x41, 40 };
+    ppu.write(0x2003, 0);
+    for (int i = 0; i < 256; i++) {
+        ppu.write(0x2004, i < 12 ? oam[i] : 0xF0);
+    }
+    ppu.write(0x2001, 0x1E);
+
+    uint64_t frame = ppu.frame_count;
+    while (ppu.frame_count < frame + 2) {
+        ppu.run(ppu.cycles + 1000);
+    }
+
+    const uint16_t *row = &ppu.frame[16 * 256];
+    check(row[12] == 0x23 && row[13] == 0x21, "sprite 1 in front of the backdrop");
+    check(row[16] == 0x01, "sprite 1 behind the background");
+    check(row[20] == 0x23 && row[21] == 0x21, "sprite 0 in front of the background");
+    check(row[24] == 0x21, "sprite 0 past the background tile");
+    check(ppu.frame[100 * 256 + 40] == 0x31 && ppu.frame[100 * 256 + 47] == 0x33, "flipped sprite");
+    check(ppu.frame[15 * 256 + 20] == 0x0F, "sprites start one line below their Y");
+
+    // Sprite 0 hit at the first overlapping pixel, (20, 16)
+    while (ppu.scanline != 16 || ppu.dot != 21) {
+        ppu.step();
+        check((ppu.read(0x2002) & 0x40) == 0, "sprite 0 hit not yet");
+    }
+    ppu.step();
+    check((ppu.read(0x2002) & 0x40) != 0, "sprite 0 hit");
+
+    // No hit at X=255, against a background tile at (248, 32)
+    vram[0x2000 + 4 * 32 + 31] = 1;
+    ppu.write(0x2003, 0);
+    ppu.write(0x2004, 31);
+    ppu.write(0x2004, 2);
+    ppu.write(0x2004, 0x00);
+    ppu.write(0x2004, 255);
+    frame = ppu.frame_count;
+    while (ppu.frame_count == frame || ppu.scanline < 240) {
+        ppu.step();
+    }
+    check(ppu.frame[32 * 256 + 255] == 0x23, "sprite 0 at X=255");
+    check((ppu.read(0x2002) & 0x40) == 0, "no sprite 0 hit at X=255");
+}
+
+// Sprite overflow flag at the end of a frame with the given OAM (sprites
+// not listed off screen), read before the pre-render line clears it
+bool overflow(PPU &ppu, const uint8_t *oam, int bytes) {
+    while (ppu.scanline != PPU::VBLANK_LINE) {
+        ppu.step();
+    }
+    ppu.write(0x2003, 0);
+    for (int i = 0; i < 256; i++) {
+        ppu.write(0x2004, i < bytes ? oam[i] : 0xF0);
+    }
+    while (ppu.scanline != 240) {
+        ppu.step();
+    }
+    return (ppu.read(0x2002) & 0x20) != 0;
+}
+
+void test_sprite_evaluation(void) {
+    PPU ppu;
+    ppu.mem_read = ppu_read;
+    ppu.mem_write = ppu_write;
+    ppu.nmi = NULL;
+    ppu.reset();
+
+    // Solid sprite tile 2 over a transparent background
+    memset(vram, 0, sizeof(vram));
+    memset(&vram[0x20], 0xFF, 8);
+    ppu.write(0x2006, 0x3F);
+    ppu.write(0x2006, 0x11);
+    ppu.write(0x2007, 0x21);
+    ppu.write(0x2001, 0x1E);
+
+    // 8 sprites on lines 11-18, then:
+    uint8_t oam[64 * 4];
+    memset(oam, 0xF0, sizeof(oam));
+    for (int i = 0; i < 8; i++) {
+        oam[i * 4] = 10;
+    }
+    check(!overflow(ppu, oam, 8 * 4), "8 sprites on a line");
+    // a 9th one
+    oam[8 * 4] = 10;
+    check(overflow(ppu, oam, 9 * 4), "9 sprites on a line");
+    // a 9th one, skipped as its tile number is read as Y
+    oam[8 * 4] = 0xF0;
+    oam[9 * 4] = 10;
+    check(!overflow(ppu, oam, 10 * 4), "overflow missed");
+    // none, but the tile number of the 10th sprite is read as Y
+    oam[9 * 4] = 0xF0;
+    oam[9 * 4 + 1] = 10;
+    check(overflow(ppu, oam, 10 * 4), "false overflow");
+
+    // Sprite 0 moved from line 50 to line 100 in the middle of the frame
+    uint8_t sprite[4] = { 49, 2, 0x00, 40 };
+    overflow(ppu, sprite, 4);
+    while (ppu.scanline != 20) {
+        ppu.step();
+    }
+    ppu.write(0x2003, 0);
+    ppu.write(0x2004, 99);
+    while (ppu.scanline != 240) {
+        ppu.step();
+    }
+    check(ppu.frame[50 * 256 + 40] == 0x0F, "sprite 0 not at its old line");
+    check(ppu.frame[100 * 256 + 40] == 0x21, "sprite 0 at its new line");
+}
+
+uint32_t seed = 1;
+uint16_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+// Both renderers in lockstep over random patterns, nametables, OAM and
+// register writes at random dots, including mid-line ones
+void test_renderers(void) {
+    PPU dot, span;
+    PPU *ppu[2] = { &dot, &span };
+    dot.renderer = PPU::RENDER_DOT;
+    span.renderer = PPU::RENDER_SCANLINE;
+    for (int i = 0; i < 0x3000; i++) {
+        vram[i] = (i < 0x2000 ? rnd() & rnd() : rnd());
+    }
+    for (int p = 0; p < 2; p++) {
+        ppu[p]->mem_read = ppu_read;
+        ppu[p]->mem_write = ppu_write;
+        ppu[p]->nmi = NULL;
+        ppu[p]->reset();
+    }
+    uint32_t oam_seed = seed;
+    for (int p = 0; p < 2; p++) {
+        seed = oam_seed;
+        ppu[p]->write(0x2006, 0x3F);
+        ppu[p]->write(0x2006, 0x00);
+        for (int i = 0; i < 32; i++) {
+            ppu[p]->write(0x2007, rnd());
+        }
+        ppu[p]->write(0x2003, 0);
+        for (int i = 0; i < 256; i++) {
+            ppu[p]->write(0x2004, rnd());
+        }
+        ppu[p]->write(0x2000, 0x00);
+        ppu[p]->write(0x2001, 0x1E);
+    }
+
+    bool same = true;
+    for (int frame = 0; frame < 16; frame++) {
+        // Sprite 0 somewhere new each frame, for its hit to be polled below
+        uint8_t y = rnd() % 240;
+        uint8_t x = rnd();
+        for (int p = 0; p < 2; p++) {
+            ppu[p]->write(0x2003, 0);
+            ppu[p]->write(0x2004, y);
+            ppu[p]->write(0x2003, 3);
+            ppu[p]->write(0x2004, x);
+        }
+        uint64_t start = dot.frame_count;
+        while (dot.frame_count == start && same) {
+            dot.step();
+            span.step();
+            if (dot.dot % 5 == 0) {
+                same = (dot.read(0x2002) == span.read(0x2002));
+            }
+            if (rnd() >= 0x7FFF - 40) {
+                static const uint16_t regs[6] = { 0x2000, 0x2001, 0x2002, 0x2005, 0x2006, 0x2007 };
+                uint16_t reg = regs[rnd() % 6];
+                uint8_t data = rnd();
+                if (reg == 0x2001) {
+                    // Mostly rendering on, with clipping and emphasis changes
+                    data = (rnd() % 8 == 0 ? data & 0xE7 : data | 0x18);
+                } else if (reg == 0x2006 && (data & 0x3F) == 0x3F) {
+                    data = 0x20;
+                }
+                if (reg == 0x2002) {
+                    same = (dot.read(reg) == span.read(reg));
+                } else {
+                    dot.write(reg, data);
+                    span.write(reg, data);
+                }
+            }
+        }
+        same = same && memcmp(dot.frame, span.frame, sizeof(dot.frame)) == 0;
+    }
+    check(same, "per-dot and scanline renderers match");
+
+    uint32_t out[240 * 256];
+    span.rgba(out);
+    uint8_t first[4];
+    memcpy(first, &out[0], 4);
+    check(first[3] == 0xFF, "RGBA alpha");
+}
+
+// Frame skip: the skipping PPU reads the same status (vblank, sprite 0 hit,
+// overflow) throughout, draws the frames it draws the same, and leaves frame
+// untouched in the others. Both run lazily, in chunks.
+void test_frame_skip(void) {
+    PPU all, skip;
+    PPU *ppu[2] = { &all, &skip };
+    skip.frame_skip = 2;
+    for (int p = 0; p < 2; p++) {
+        ppu[p]->mem_read = ppu_read;
+        ppu[p]->mem_write = ppu_write;
+        ppu[p]->nmi = NULL;
+        ppu[p]->reset();
+    }
+    uint32_t oam_seed = seed;
+    for (int p = 0; p < 2; p++) {
+        seed = oam_seed;
+        ppu[p]->write(0x2006, 0x3F);
+        ppu[p]->write(0x2006, 0x00);
+        for (int i = 0; i < 32; i++) {
+            ppu[p]->write(0x2007, rnd());
+        }
+        ppu[p]->write(0x2003, 0);
+        for (int i = 0; i < 256; i++) {
+            // Sprites mostly on the top lines, for overflows
+            ppu[p]->write(0x2004, (i % 4 == 0 && i % 16 != 0 ? rnd() % 64 : rnd()));
+        }
+        ppu[p]->write(0x2000, 0x00);
+        ppu[p]->write(0x2001, 0x1E);
+    }
+
+    static uint16_t drawn[240 * 256];
+    bool same = true;
+    bool kept = true;
+    uint32_t hits = 0;
+    for (int frame = 0; frame < 12; frame++) {
+        uint8_t y = rnd() % 240;
+        uint8_t x = rnd();
+        for (int p = 0; p < 2; p++) {
+            ppu[p]->write(0x2003, 0);
+            ppu[p]->write(0x2004, y);
+            ppu[p]->write(0x2003, 3);
+            ppu[p]->write(0x2004, x);
+        }
+        uint64_t start = all.frame_count;
+        bool hit = false;
+        while (all.frame_count == start && same) {
+            // Chunks that stay within the frame
+            if (all.scanline < 239) {
+                uint64_t until = all.cycles + rnd() % 200;
+                all.run(until);
+                skip.run(until);
+            } else {
+                all.step();
+                skip.step();
+            }
+            uint8_t status = all.read(0x2002);
+            same = (status == skip.read(0x2002) && all.frame_count == skip.frame_count);
+            hit = hit || (status & 0x40);
+            if (rnd() >= 0x7FFF - 400) {
+                static const uint16_t regs[5] = { 0x2000, 0x2001, 0x2005, 0x2006, 0x2007 };
+                uint16_t reg = regs[rnd() % 5];
+                uint8_t data = rnd();
+                if (reg == 0x2001) {
+                    data = (rnd() % 8 == 0 ? data & 0xE7 : data | 0x18);
+                } else if (reg == 0x2006 && (data & 0x3F) == 0x3F) {
+                    data = 0x20;
+                }
+                all.write(reg, data);
+                skip.write(reg, data);
+            }
+        }
+        hits += hit;
+        if (start % 3 == 0) {
+            same = same && memcmp(all.frame, skip.frame, sizeof(all.frame)) == 0;
+            memcpy(drawn, skip.frame, sizeof(drawn));
+        } else {
+            kept = kept && memcmp(drawn, skip.frame, sizeof(drawn)) == 0;
+        }
+    }
+    check(same, "same status and drawn frames with frame skip");
+    check(kept, "skipped frames not drawn");
+    check(hits > 2, "sprite 0 hits with frame skip");
+}
+
+int main() {
+    test_timing();
+    test_background();
+    test_sprites();
+    test_sprite_evaluation();
+    test_renderers();
+    test_frame_skip();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
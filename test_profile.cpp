@@ -0,0 +1,141 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "cpu6502.h"
+#include "profile.h"
+
+// Built with CPU6502_PROFILE defined
+
+uint8_t image[0x10000];
+uint8_t mem[0x10000];
+
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
+}
+void cpu_write(void *context, uint16_t address, uint8_t data) {
+    ((uint8_t *)context)[address] = data;
+}
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+void setup(CPU6502 &cpu) {
+    memcpy(mem, image, sizeof(mem));
+    cpu.context = mem;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.map(0x00, 0x100, mem, sizeof(mem), true);
+    cpu.reset();
+    cpu.opcode = mem[0x1000];
+    cpu.PC = 0x1000;
+}
+
+// The counters add up to the functional test, block cache or not
+void test_counts(void) {
+    CPU6502 cpu;
+    Profile profile;
+    setup(cpu);
+    cpu.set_block_cache(true);
+    uint64_t start = cpu.cycles;
+    cpu.set_profile(&profile);
+    CPU6502::Stop stop = cpu.run(UINT64_MAX);
+    check(stop == CPU6502::STOP_LOOP && cpu.PC == 0x3B1C, "functional test");
+
+    uint64_t count = 0;
+    uint64_t cycles = 0;
+    for (int i = 0; i < 256; i++) {
+        count += profile.opcodes[i].count;
+        cycles += profile.opcodes[i].cycles;
+    }
+    check(cycles == cpu.cycles - start, "opcode cycles");
+    check(profile.opcodes[0x4C].count > 0 && profile.opcodes[0x02].count == 0, "opcode counts");
+
+    std::vector<Profile::Entry> pcs;
+    profile.entries(pcs);
+    uint64_t pc_count = 0;
+    uint64_t pc_cycles = 0;
+    for (size_t i = 0; i < pcs.size(); i++) {
+        pc_count += pcs[i].counter.count;
+        pc_cycles += pcs[i].counter.cycles;
+        check(i == 0 || pcs[i].counter.cycles <= pcs[i - 1].counter.cycles, "PCs by cycles");
+    }
+    check(pc_count == count && pc_cycles == cycles, "PC counters");
+    bool first = false;
+    for (size_t i = 0; i < pcs.size(); i++) {
+        if (pcs[i].pc == 0x1000) {
+            first = (pcs[i].counter.count == 1 && pcs[i].counter.cycles == 2 && pcs[i].bank == 0);
+        }
+    }
+    check(first, "CLD at $1000");
+
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    check(profile.report(out, "6502_functional_test.lst", 10), "report");
+    fclose(out);
+    check(strstr(text, "Routines by cycles") != NULL && strstr(text, " ckad1\n") != NULL, "routines");
+    check(strstr(text, "adc (adiy2),y") != NULL, "source lines");
+    free(text);
+
+    out = fopen("/dev/null", "w");
+    check(!profile.report(out, "no_such.lst", 10), "missing listing");
+    fclose(out);
+}
+
+// The same PC in two banks
+void test_banks(void) {
+    static uint8_t bank0[0x100];
+    static uint8_t bank1[0x100];
+    memset(bank0, 0xEA, sizeof(bank0));     // NOP
+    memset(bank1, 0xEA, sizeof(bank1));
+    CPU6502 cpu;
+    Profile profile;
+    setup(cpu);
+    cpu.map(0x80, 1, bank0, sizeof(bank0), false);
+    cpu.set_profile(&profile);
+    cpu.PC = 0x8000;
+    cpu.opcode = 0xEA;
+    cpu.step();
+    cpu.step();
+    cpu.map(0x80, 1, bank1, sizeof(bank1), false);
+    cpu.PC = 0x8000;
+    cpu.step();
+    cpu.map(0x80, 1, bank0, sizeof(bank0), false);
+    cpu.PC = 0x8000;
+    cpu.step();
+
+    std::vector<Profile::Entry> pcs;
+    profile.entries(pcs);
+    uint64_t counts[2][2] = { { 0, 0 }, { 0, 0 } };
+    for (size_t i = 0; i < pcs.size(); i++) {
+        if (pcs[i].pc >= 0x8000 && pcs[i].pc <= 0x8001 && pcs[i].bank < 2) {
+            counts[pcs[i].bank][pcs[i].pc & 1] = pcs[i].counter.count;
+        }
+    }
+    check(pcs.size() == 3, "entries");
+    check(counts[0][0] == 2 && counts[0][1] == 1 && counts[1][0] == 1, "banks");
+    check(profile.opcodes[0xEA].count == 4 && profile.opcodes[0xEA].cycles == 8, "NOP cycles");
+
+    profile.clear();
+    profile.entries(pcs);
+    check(pcs.empty() && profile.opcodes[0xEA].count == 0, "clear");
+}
+
+int main() {
+    FILE *prog = fopen("6502_functional_test.bin", "r");
+    fread(image, 1, 0x10000, prog);
+    fclose(prog);
+    test_counts();
+    test_banks();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
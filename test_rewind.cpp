@@ -0,0 +1,132 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "rewind.h"
+#include "test_game.h"
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static const uint64_t FRAME = 29781;
+
+// Rendering with sprites and audio, with the given PPUMASK; each frame the
+// NMI handler moves the sprites and writes the frame count over 64 bytes of
+// RAM
+void setup(NES &nes, uint8_t mask) {
+    static const uint8_t code[] = {
+        0xA9, 0x1E, 0x8D, 0x01, 0x20,   // LDA #$1E / STA $2001
+        0xA9, 0x0F, 0x8D, 0x15, 0x40,   // LDA #$0F / STA $4015
+        0xA9, 0xBF, 0x8D, 0x00, 0x40,   // LDA #$BF / STA $4000
+        0x8D, 0x03, 0x40,               // STA $4003
+        0xA9, 0x80, 0x8D, 0x00, 0x20,   // LDA #$80 / STA $2000
+        0x4C, 0x17, 0x80,               // JMP *
+        0xE6, 0x00,                     // NMI: INC $00
+        0xE6, 0x04, 0xE6, 0x07,         // INC $04 / INC $07
+        0xA2, 0x00,                     // LDX #$00
+        0xA5, 0x00, 0x9D, 0x00, 0x03,   // LDA $00 / STA $0300,X
+        0xE8, 0xE0, 0x40, 0xD0, 0xF6,   // INX / CPX #$40 / BNE $8022
+        0xA9, 0x02, 0x8D, 0x14, 0x40,   // LDA #$02 / STA $4014
+        0xA5, 0x00, 0x8D, 0x06, 0x40,   // LDA $00 / STA $4006
+        0x40 };                         // RTI
+    load_prg(code, sizeof(code), 0x801A);
+    prg[1] = mask;
+    insert(nes);
+    for (int i = 0; i < 256; i++) {
+        nes.ram[0x200 + i] = i * 5;
+    }
+}
+
+std::vector<uint8_t> state(NES &nes) {
+    std::vector<uint8_t> s(nes.state_size());
+    nes.save(&s[0], s.size());
+    return s;
+}
+
+// Step back one frame at a time, and several at once across keyframes
+void test_back(void) {
+    NES nes;
+    setup(nes, 0x1E);
+    Rewind rewind(nes, 600, 1 << 20, 16);
+    std::vector<std::vector<uint8_t> > states;
+    for (int f = 0; f < 200; f++) {
+        nes.run((f + 1) * FRAME);
+        rewind.push();
+        states.push_back(state(nes));
+    }
+    check(rewind.count() == 200, "all states kept");
+
+    bool same = true;
+    for (int f = 199; f >= 150; f--) {
+        same = same && rewind.back(1) == 1 && state(nes) == states[f];
+    }
+    check(same, "back by one");
+    check(rewind.count() == 150, "loaded states dropped");
+
+    // Play on from there, then jump
+    nes.run(nes.cpu.cycles + 3 * FRAME);
+    rewind.push();
+    check(rewind.back(2) == 2 && state(nes) == states[149], "back past a new state");
+    check(rewind.back(37) == 37 && state(nes) == states[112], "back across keyframes");
+    check(rewind.back(5) == 5 && state(nes) == states[107], "back from a keyframe");
+    check(rewind.back(1000) == 107 && state(nes) == states[0], "back to the oldest");
+    check(rewind.count() == 0 && rewind.back(1) == 0, "empty");
+}
+
+// The oldest states are dropped when the storage is full
+void test_bounds(void) {
+    NES nes;
+    setup(nes, 0x1E);
+    Rewind small(nes, 1000, 16384, 8);
+    Rewind few(nes, 50, 1 << 20, 8);
+    std::vector<std::vector<uint8_t> > states;
+    bool bounded = true;
+    for (int f = 0; f < 300; f++) {
+        nes.run((f + 1) * FRAME);
+        small.push();
+        few.push();
+        states.push_back(state(nes));
+        bounded = bounded && small.used() <= 16384;
+    }
+    check(bounded, "storage bounded");
+    check(few.count() == 50, "states bounded");
+    uint32_t n = small.count();
+    check(n > 8 && n < 300, "oldest states dropped");
+    bool same = true;
+    for (uint32_t i = 0; i < n; i++) {
+        same = same && small.back(1) == 1 && state(nes) == states[299 - i];
+    }
+    check(same && small.back(1) == 0, "back to the oldest kept");
+}
+
+// A minute of play at 60 fps in less than 4 MB (not rendered to keep the
+// test short: the states are the same size)
+void test_minute(void) {
+    NES nes;
+    setup(nes, 0x00);
+    Rewind rewind(nes, 3600, 3 << 20, 60);
+    for (int f = 0; f < 3600; f++) {
+        nes.run((f + 1) * FRAME);
+        rewind.push();
+    }
+    check(rewind.count() == 3600, "a minute kept");
+    check(rewind.memory() < 4 << 20, "in less than 4 MB");
+    printf("Rewind: %u states in %u bytes, %u allocated\n", rewind.count(),
+        (unsigned)rewind.used(), (unsigned)rewind.memory());
+}
+
+int main() {
+    test_back();
+    test_bounds();
+    test_minute();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,159 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "rollback.h"
+#include "test_game.h"
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Inputs that change every few frames, as a player's would
+uint8_t input(int player, uint32_t frame) {
+    uint32_t h = (frame / (3 + player * 2) + 1) * 2654435761u + player * 40503u;
+    return (h >> 13) & 0xFF;
+}
+
+// Same state with and without fast-forward, sprite 0 hits included
+void test_fast_forward(void) {
+    std::vector<uint64_t> hashes;
+    uint8_t hits = 0;
+    for (int fast = 0; fast < 2; fast++) {
+        NES nes;
+        setup(nes);
+        nes.set_fast_forward(fast != 0);
+        bool same = true;
+        for (uint32_t f = 0; f < 120; f++) {
+            nes.pad[0] = input(0, f);
+            nes.pad[1] = input(1, f);
+            nes.run_frame();
+            if (fast == 0) {
+                hashes.push_back(nes.hash());
+            } else {
+                same = same && nes.hash() == hashes[f];
+            }
+        }
+        if (fast == 0) {
+            hits = nes.ram[0x05];
+            int16_t audio[1024];
+            check(nes.audio(audio, 1024) > 0, "audio when running normally");
+        } else {
+            int16_t audio[1024];
+            check(same, "same state in fast-forward");
+            check(nes.audio(audio, 1024) == 0, "no audio in fast-forward");
+        }
+    }
+    check(hits > 20, "sprite 0 hits");
+}
+
+// Two peers with 4 frames of latency: every checksum they can give matches
+// a run with all inputs known up front
+void test_loopback(void) {
+    const uint32_t FRAMES = 240;
+    const uint32_t LATENCY = 4;
+    std::vector<uint64_t> reference;
+    uint64_t end = 0;
+    {
+        NES nes;
+        setup(nes);
+        for (uint32_t f = 0; f < FRAMES + LATENCY; f++) {
+            reference.push_back(nes.hash());
+            nes.pad[0] = input(0, f);
+            nes.pad[1] = input(1, f);
+            nes.run_frame();
+            if (f == FRAMES - 1) {
+                end = nes.hash();
+            }
+        }
+    }
+
+    NES a;
+    NES b;
+    setup(a);
+    setup(b);
+    NES *nes[2] = { &a, &b };
+    Rollback *peer[2];
+    for (int p = 0; p < 2; p++) {
+        peer[p] = new Rollback(*nes[p], p, 8);
+    }
+    Loopback link(LATENCY);
+    bool in_window = true;
+    bool same = true;
+    uint32_t checked = 0;
+    for (uint32_t f = 0; f < FRAMES + LATENCY; f++) {
+        for (int p = 0; p < 2; p++) {
+            uint32_t frame;
+            uint8_t data;
+            while (link.receive(p, frame, data)) {
+                in_window = in_window && peer[p]->remote(frame, data);
+            }
+            // The remote peer stops sending at FRAMES
+            if (f < FRAMES) {
+                peer[p]->frame(input(p, f));
+                link.send(1 - p, f, input(p, f));
+            }
+            for (uint32_t g = 0; g < f; g++) {
+                uint64_t hash;
+                if (peer[p]->checksum(g, hash)) {
+                    same = same && hash == reference[g];
+                    checked++;
+                }
+            }
+        }
+        link.tick();
+    }
+    check(in_window, "inputs in the window");
+    check(peer[0]->rollbacks > 0 && peer[1]->rollbacks > 0, "rollbacks");
+    check(checked > FRAMES, "checksums available");
+    check(same, "checksums match");
+    peer[0]->catch_up();
+    peer[1]->catch_up();
+    check(a.hash() == end && b.hash() == end, "peers in the same state");
+    check(peer[0]->confirmed == FRAMES && peer[1]->confirmed == FRAMES, "all inputs confirmed");
+    for (int p = 0; p < 2; p++) {
+        delete peer[p];
+    }
+}
+
+// Late input for the oldest frame of the window: all the window runs again,
+// within the 16.6 ms of one frame at 60 Hz
+void test_budget(void) {
+    const uint32_t WINDOW = 8;
+    NES nes;
+    setup(nes);
+    Rollback session(nes, 0, WINDOW);
+    for (uint32_t f = 0; f < 60; f++) {
+        session.frame(input(0, f));
+        session.remote(f, input(1, f));
+    }
+    for (uint32_t f = 60; f < 60 + WINDOW; f++) {
+        session.frame(input(0, f));
+    }
+    check(session.remote(60, input(1, 60) ^ 0xFF), "late input in the window");
+    check(!session.remote(59 - WINDOW, 0), "input too late");
+    uint32_t replayed = session.replayed;
+    clock_t start = clock();
+    session.frame(input(0, 60 + WINDOW));
+    double ms = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    check(session.replayed - replayed == WINDOW, "window run again");
+    printf("Rollback: %u frames run again and 1 frame in %.2f ms\n", WINDOW, ms);
+    check(ms < 16.6, "rollback within one frame");
+}
+
+int main() {
+    load_game();
+    test_fast_forward();
+    test_loopback();
+    test_budget();
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
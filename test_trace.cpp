@@ -0,0 +1,197 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cpu6502.h"
+#include "trace.h"
+
+const char *path = "test_trace.bin";
+
+uint8_t image[0x10000];
+uint8_t mem[0x10000];
+uint8_t mem2[0x10000];
+
+// Page $02, which the test uses for data, goes through the handlers
+uint8_t cpu_read(void *context, uint16_t address) {
+    return ((uint8_t *)context)[address];
+}
+void cpu_write(void *context, uint16_t address, uint8_t data) {
+    ((uint8_t *)context)[address] = data;
+}
+
+int failures = 0;
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// The functional test in memory, a copy of image
+void setup(CPU6502 &cpu, uint8_t *memory) {
+    memcpy(memory, image, 0x10000);
+    cpu.context = memory;
+    cpu.read = cpu_read;
+    cpu.write = cpu_write;
+    cpu.map(0x00, 0x02, memory, 0x200, true);
+    cpu.map(0x03, 0xFD, memory + 0x300, 0xFD00, true);
+    cpu.reset();
+    cpu.opcode = memory[0x1000];
+    cpu.PC = 0x1000;
+}
+
+// log() lines of the first n instructions
+std::string reference(uint32_t n) {
+    char *text;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    CPU6502 cpu;
+    setup(cpu, mem);
+    for (uint32_t i = 0; i < n; i++) {
+        cpu.log(out);
+        cpu.step();
+    }
+    fclose(out);
+    std::string lines(text, size);
+    free(text);
+    return lines;
+}
+
+std::string decode(bool accesses) {
+    char *text;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    check(Trace::decode(path, out, accesses), "trace file");
+    fclose(out);
+    std::string lines(text, size);
+    free(text);
+    return lines;
+}
+
+// Trace the first n instructions, with step() or run(), into a file keeping
+// the last records
+void record(uint32_t n, uint64_t records, bool step) {
+    Trace trace;
+    CPU6502 cpu;
+    setup(cpu, mem);
+    check(trace.open(path, records, cpu.cycles), "open");
+    cpu.set_trace(&trace);
+    if (step) {
+        for (uint32_t i = 0; i < n; i++) {
+            cpu.step();
+        }
+    } else {
+        // One instruction at a time: the budget is used up by each one
+        for (uint32_t i = 0; i < n; i++) {
+            cpu.run(cpu.cycles + 1);
+        }
+    }
+    cpu.set_trace(NULL);
+    trace.close();
+}
+
+// The decoded trace is what log() prints, the same with step() and run()
+void test_decode(void) {
+    const uint32_t N = 100000;
+    std::string lines = reference(N);
+    record(N, N, true);
+    check(decode(false) == lines, "step() trace decodes to log()");
+    record(N, N, false);
+    check(decode(false) == lines, "run() trace decodes to log()");
+
+    // Accesses to page $02 through the handlers
+    std::string with = decode(true);
+    check(with.size() > lines.size() && with.find(" W $02") != std::string::npos
+        && with.find(" R $02") != std::string::npos, "accesses");
+}
+
+// A file shorter than the run keeps its last records
+void test_wrap(void) {
+    const uint32_t N = 100000;
+    std::string lines = reference(N);
+    record(N, 20000, true);
+    std::string tail = decode(false);
+    size_t count = 0;
+    for (size_t i = 0; i < tail.size(); i++) {
+        count += (tail[i] == '\n');
+    }
+    check(count >= 20000 && count < N, "records kept");
+    check(tail.size() < lines.size() && lines.compare(lines.size() - tail.size(), tail.size(), tail) == 0,
+        "last records");
+}
+
+// CPU time of the calling thread: the emulation thread, which fills the
+// records, while the trace thread writes them out
+double thread_seconds(void) {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// The functional test with and without tracing, in CPU time of the emulation
+// thread. Two CPUs run it side by side, a slice of SLICE cycles at a time,
+// so that both see the same load from other processes, and the fastest of
+// RUNS runs is kept for each slice. The trace thread gets time to write out
+// the records of a traced slice before the next untraced one.
+void test_overhead(void) {
+    const uint64_t SLICE = 1 << 21;
+    const int RUNS = 5;
+    std::vector<double> best[2];
+    for (int run = 0; run < RUNS; run++) {
+        Trace trace;
+        CPU6502 cpu[2];
+        setup(cpu[0], mem);
+        setup(cpu[1], mem2);
+        trace.open(path, 1 << 20, cpu[1].cycles);
+        cpu[1].set_trace(&trace);
+        CPU6502::Stop stop[2] = { CPU6502::STOP_BUDGET, CPU6502::STOP_BUDGET };
+        for (size_t i = 0; stop[0] == CPU6502::STOP_BUDGET || stop[1] == CPU6502::STOP_BUDGET; i++) {
+            for (int traced = 0; traced < 2; traced++) {
+                if (stop[traced] != CPU6502::STOP_BUDGET) {
+                    continue;
+                }
+                double t0 = thread_seconds();
+                stop[traced] = cpu[traced].run(cpu[traced].cycles + SLICE);
+                double t = thread_seconds() - t0;
+                if (i == best[traced].size()) {
+                    best[traced].push_back(t);
+                } else if (t < best[traced][i]) {
+                    best[traced][i] = t;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        for (int traced = 0; traced < 2; traced++) {
+            check(stop[traced] == CPU6502::STOP_LOOP && cpu[traced].PC == 0x3B1C, "functional test");
+        }
+        cpu[1].set_trace(NULL);
+    }
+    double seconds[2] = { 0, 0 };
+    for (int traced = 0; traced < 2; traced++) {
+        for (size_t i = 0; i < best[traced].size(); i++) {
+            seconds[traced] += best[traced][i];
+        }
+    }
+    printf("Trace: functional test in %.3f s, %.3f s traced (%.2fx)\n",
+        seconds[0], seconds[1], seconds[1] / seconds[0]);
+    check(seconds[1] < 2 * seconds[0], "trace overhead under 2x");
+}
+
+int main() {
+    FILE *prog = fopen("6502_functional_test.bin", "r");
+    fread(image, 1, 0x10000, prog);
+    fclose(prog);
+    test_decode();
+    test_wrap();
+    test_overhead();
+    remove(path);
+    if (failures == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,197 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+
+static const char MAGIC[8] = { '6', '5', '0', '2', 'T', 'R', 'C', '1' };
+
+Trace::Trace(void) {
+    ring = NULL;
+    fd = -1;
+    produced = 0;
+    limit = 0;
+    head = 0;
+    tail = 0;
+    stopping = false;
+    start = 0;
+}
+
+Trace::~Trace(void) {
+    close();
+}
+
+bool Trace::open(const char *path, uint64_t records, uint64_t start_cycle) {
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Trace: cannot open %s\n", path);
+        return false;
+    }
+    // One more block than needed, for the one being written
+    blocks = (records + BLOCK - 1) / BLOCK + 1;
+    if (blocks < 2) {
+        blocks = 2;
+    }
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(Record);
+    header.block_records = BLOCK;
+    header.blocks = blocks;
+    // Blocks read as unused until written
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+            || ftruncate(fd, sizeof(header) + blocks * (sizeof(BlockHeader) + BLOCK * sizeof(Record))) != 0) {
+        fprintf(stderr, "Trace: cannot write %s\n", path);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    ring = new Record[RING];
+    produced = 0;
+    limit = RING;
+    head = 0;
+    tail = 0;
+    stopping = false;
+    start = start_cycle;
+    cycle = start_cycle;
+    block.sequence = 1;
+    block.first_cycle = start_cycle;
+    block.count = 0;
+    block.reserved = 0;
+    write_block_header();
+    writer = std::thread(&Trace::write_loop, this);
+    return true;
+}
+
+void Trace::close(void) {
+    if (fd < 0) {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    ::close(fd);
+    fd = -1;
+    delete[] ring;
+    ring = NULL;
+}
+
+// Writer thread: whatever was committed, every millisecond
+void Trace::write_loop(void) {
+    for (;;) {
+        bool stop = stopping.load(std::memory_order_acquire);
+        uint64_t from = tail.load(std::memory_order_relaxed);
+        uint64_t to = head.load(std::memory_order_acquire);
+        if (from == to) {
+            if (stop) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (!write_records(from, to)) {
+            fprintf(stderr, "Trace: write failed, records dropped\n");
+        }
+        tail.store(to, std::memory_order_release);
+    }
+}
+
+uint64_t Trace::block_offset(uint64_t sequence) {
+    return sizeof(FileHeader) + ((sequence - 1) % blocks) * (sizeof(BlockHeader) + BLOCK * sizeof(Record));
+}
+
+bool Trace::write_block_header(void) {
+    return pwrite(fd, &block, sizeof(block), block_offset(block.sequence)) == sizeof(block);
+}
+
+// The records go into the current block before its header counts them, and
+// a new block gets its header before it overwrites an old one
+bool Trace::write_records(uint64_t from, uint64_t to) {
+    bool ok = true;
+    while (from < to) {
+        uint32_t at = from & (RING - 1);
+        uint64_t n = to - from;
+        if (n > RING - at) {
+            n = RING - at;
+        }
+        if (n > BLOCK - block.count) {
+            n = BLOCK - block.count;
+        }
+        const Record *r = &ring[at];
+        for (uint64_t i = 0; i < n; i++) {
+            cycle += r[i].delta;
+        }
+        size_t size = n * sizeof(Record);
+        uint64_t offset = block_offset(block.sequence) + sizeof(BlockHeader) + block.count * sizeof(Record);
+        ok = ok && pwrite(fd, r, size, offset) == (ssize_t)size;
+        block.count += n;
+        from += n;
+        if (block.count == BLOCK) {
+            ok = ok && write_block_header();
+            block.sequence++;
+            block.first_cycle = cycle;
+            block.count = 0;
+            ok = ok && write_block_header();
+        }
+    }
+    return ok && write_block_header();
+}
+
+bool Trace::decode(const char *path, FILE *out, bool accesses) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return false;
+    }
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+            || header.record_size != sizeof(Record) || header.block_records == 0 || header.blocks == 0) {
+        fclose(in);
+        return false;
+    }
+    uint64_t block_size = sizeof(BlockHeader) + header.block_records * sizeof(Record);
+
+    // The blocks in use have consecutive sequence numbers, from the oldest
+    uint64_t oldest = 0;
+    for (uint64_t i = 0; i < header.blocks; i++) {
+        BlockHeader b;
+        fseek(in, sizeof(header) + i * block_size, SEEK_SET);
+        if (fread(&b, sizeof(b), 1, in) == 1 && b.sequence != 0 && (oldest == 0 || b.sequence < oldest)) {
+            oldest = b.sequence;
+        }
+    }
+
+    Record *records = new Record[header.block_records];
+    for (uint64_t sequence = oldest; oldest != 0; sequence++) {
+        BlockHeader b;
+        fseek(in, sizeof(header) + ((sequence - 1) % header.blocks) * block_size, SEEK_SET);
+        if (fread(&b, sizeof(b), 1, in) != 1 || b.sequence != sequence || b.count > header.block_records) {
+            break;
+        }
+        uint32_t count = fread(records, sizeof(Record), b.count, in);
+        uint64_t cycles = b.first_cycle;
+        for (uint32_t i = 0; i < count; i++) {
+            const Record &r = records[i];
+            cycles += r.delta;
+            fprintf(out, "nPC=%04X cyc=%012llu [%02X] %c%c%c%c%c%c A=%02X X=%02X Y=%02X S=%02X",
+                r.pc, (unsigned long long)(cycles % 1000000000), r.opcode,
+                (r.p & 0x01 ? 'C' : '-'),
+                (r.p & 0x80 ? 'N' : '-'),
+                (r.p & 0x02 ? 'Z' : '-'),
+                (r.p & 0x40 ? 'V' : '-'),
+                (r.p & 0x08 ? 'D' : '-'),
+                (r.p & 0x04 ? 'I' : '-'),
+                r.a, r.x, r.y, r.s);
+            if (accesses && r.access != ACCESS_NONE) {
+                fprintf(out, " %c $%04X=%02X", (r.access == ACCESS_READ ? 'R' : 'W'), r.address, r.data);
+            }
+            fputc('\n', out);
+        }
+        if (b.count < header.block_records) {
+            break;
+        }
+    }
+    delete[] records;
+    fclose(in);
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef NES_TRACE_INCLUDED
+#define NES_TRACE_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+// Binary execution trace of a CPU6502, see CPU6502::set_trace(): one record
+// per instruction with the state before it, as printed by CPU6502::log(),
+// and the last access of the previous instruction through the handlers.
+// The CPU writes the records into a lock-free ring with a single producer,
+// and a background thread writes them to a file. The file is a ring too, of
+// a fixed number of blocks, so that it holds the last records if the process
+// dies, but for the last batch; decode() turns it back into log() lines.
+// Only the program using it links trace.cpp: the CPU needs the inline
+// functions below.
+class Trace {
+public:
+    struct Record {
+        uint16_t pc;
+        uint8_t opcode;
+        uint8_t a, x, y, s;
+        uint8_t p;          // As pushed on the stack (B clear)
+        uint32_t delta;     // Cycles since the previous record
+        uint16_t address;   // Access, see access
+        uint8_t data;
+        uint8_t access;     // ACCESS_*
+    };
+    static const uint8_t ACCESS_NONE = 0;
+    static const uint8_t ACCESS_READ = 1;
+    static const uint8_t ACCESS_WRITE = 2;
+
+    Trace(void);
+    ~Trace(void);
+
+    // Trace to path, which keeps at least the last records records. The
+    // first record counts its cycles from start_cycle.
+    bool open(const char *path, uint64_t records, uint64_t start_cycle);
+
+    // Write out all the records and stop the thread
+    void close(void);
+
+    // Producer side: reserve() returns the next free slot and sets end to
+    // the end of its batch of BATCH records, waiting for the thread if the
+    // ring is full. The producer fills the records in place from there, and
+    // commit() hands those before next to the thread.
+    Record *reserve(Record *&end);
+    void commit(Record *next);
+    uint64_t start_cycle(void) { return start; }
+
+    // Records of a trace file as log() lines, oldest first, with accesses
+    // appended if accesses is set. False if it is not a trace file.
+    static bool decode(const char *path, FILE *out, bool accesses);
+
+private:
+    Trace(const Trace &);
+    Trace &operator=(const Trace &);
+
+    static const uint32_t RING = 1 << 16;       // Records in memory
+    static const uint32_t BLOCK = 1 << 14;      // Records per block of the file
+    static const uint32_t BATCH = 1 << 8;       // Records per update of head
+
+    // File layout: a header, then blocks of a header and BLOCK records
+    struct FileHeader {
+        char magic[8];
+        uint32_t record_size;
+        uint32_t block_records;
+        uint64_t blocks;
+    };
+    struct BlockHeader {
+        uint64_t sequence;      // Blocks written before, plus 1; 0 if unused
+        uint64_t first_cycle;   // Cycle before its first record
+        uint32_t count;         // Records in the block
+        uint32_t reserved;
+    };
+
+    uint64_t start;
+    Record *ring;
+    uint64_t produced;              // Records committed
+    uint64_t limit;                 // Producer copy of tail + RING
+    std::atomic<uint64_t> head;     // Records handed to the thread
+    std::atomic<uint64_t> tail;     // Records written to the file
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    // Writer thread state
+    int fd;
+    uint64_t blocks;
+    BlockHeader block;              // Block being written
+    uint64_t cycle;
+
+    void write_loop(void);
+    bool write_records(uint64_t from, uint64_t to);
+    bool write_block_header(void);
+    uint64_t block_offset(uint64_t sequence);
+    void wait_room(uint64_t count);
+};
+
+inline Trace::Record *Trace::reserve(Record *&end) {
+    // Batches end on multiples of BATCH, so that none wraps around the ring:
+    // the one after a partial commit is shorter
+    uint64_t batch_end = (produced | (BATCH - 1)) + 1;
+    if (batch_end > limit) {
+        wait_room(batch_end);
+    }
+    end = &ring[(batch_end - 1) & (RING - 1)] + 1;
+    return &ring[produced & (RING - 1)];
+}
+
+// Sleeps rather than yields: with the thread on the same core, yielding
+// would spin on the CPU until its next wake-up
+inline void Trace::wait_room(uint64_t count) {
+    for (;;) {
+        limit = tail.load(std::memory_order_acquire) + RING;
+        if (count <= limit) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+inline void Trace::commit(Record *next) {
+    produced += next - &ring[produced & (RING - 1)];
+    head.store(produced, std::memory_order_release);
+}
+
+#endif // NES_TRACE_INCLUDED
@@ -0,0 +1,20 @@
+#include <cstdlib>
+#include <cstring>
+#include "trace.h"
+
+// Decode a trace file written through CPU6502::set_trace() into the lines of
+// CPU6502::log(), oldest first. -a appends the access through the handlers
+// of the instruction before each line.
+int main(int argc, char **argv) {
+    bool accesses = (argc == 3 && strcmp(argv[1], "-a") == 0);
+    if (argc != 2 && !accesses) {
+        fprintf(stderr, "Usage: %s [-a] trace\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[argc - 1];
+    if (!Trace::decode(path, stdout, accesses)) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return 1;
+    }
+    return 0;
+}